@@ -0,0 +1,483 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Microbenchmarks of the per-sector kernels, on synthetic PCM */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <libavutil/time.h>
+#include <libavutil/mem.h>
+#include <libavutil/frame.h>
+
+#include "cyanrip_main.h"
+#include "cyanrip_log.h"
+#include "checksums.h"
+#include "accurip.h"
+#include "pregap.h"
+#include "pool.h"
+#include "fifo_frame.h"
+#include "loudness.h"
+#include "deemph.h"
+#include "utils.h"
+
+typedef struct CRBenchResult {
+    const char *name;
+    int64_t units;  /* Number of sectors (or calls, for per-track kernels) */
+    int64_t bytes;  /* Bytes processed */
+    int64_t time;   /* Microseconds */
+    int per_call;
+} CRBenchResult;
+
+#define MAX_RESULTS 32
+
+typedef struct CRBenchCtx {
+    uint8_t *pcm;
+    int nb_sectors;
+    cyanrip_ctx *ctx;
+    CRBenchResult results[MAX_RESULTS];
+    int nb_results;
+} CRBenchCtx;
+
+static void add_result(CRBenchCtx *s, const char *name, int64_t units,
+                       int64_t bytes, int64_t time, int per_call)
+{
+    if (s->nb_results == MAX_RESULTS)
+        return;
+
+    s->results[s->nb_results++] = (CRBenchResult) {
+        .name = name,
+        .units = units,
+        .bytes = bytes,
+        .time = FFMAX(time, 1),
+        .per_call = per_call,
+    };
+}
+
+/* Not silent, not constant, and the same every run */
+static void fill_pcm(uint8_t *dst, size_t bytes)
+{
+    uint32_t state = 0x43524950;
+    for (size_t i = 0; i < bytes; i += 2) {
+        state = state*1664525 + 1013904223;
+        dst[i + 0] = state >> 16;
+        dst[i + 1] = state >> 24;
+    }
+}
+
+static int bench_checksums(CRBenchCtx *s)
+{
+    for (int type = 0; type < CRIP_CHECKSUMS_NB; type++) {
+        cyanrip_checksum_ctx checksum_ctx;
+        cyanrip_track t = { 0 };
+        t.nb_samples = (size_t)s->nb_sectors * (CDIO_CD_FRAMESIZE_RAW >> 2);
+
+        s->ctx->settings.checksums[0] = type;
+        s->ctx->settings.checksums_num = 1;
+
+        int64_t start = av_gettime_relative();
+
+        int ret = crip_init_checksum_ctx(s->ctx, &checksum_ctx, &t);
+        if (ret < 0)
+            return ret;
+
+        for (int i = 0; i < s->nb_sectors; i++)
+            crip_process_checksums(&checksum_ctx, s->pcm + i*CDIO_CD_FRAMESIZE_RAW,
+                                   CDIO_CD_FRAMESIZE_RAW);
+
+        crip_finalize_checksums(&checksum_ctx, &t);
+
+        add_result(s, crip_checksum_providers[type]->name, s->nb_sectors,
+                   (int64_t)s->nb_sectors * CDIO_CD_FRAMESIZE_RAW,
+                   av_gettime_relative() - start, 0);
+
+        av_free(t.tree_leaves);
+        av_dict_free(&t.meta);
+    }
+
+    return 0;
+}
+
+static int bench_sliding_win(CRBenchCtx *s)
+{
+    CRSlidingWinCtx *win = av_mallocz(sizeof(*win));
+    if (!win)
+        return AVERROR(ENOMEM);
+
+    /* Same use as the ETA, one entry per sector read at 8x */
+    int64_t pts = 0, acc = 0;
+    int64_t start = av_gettime_relative();
+
+    for (int i = 0; i < s->nb_sectors; i++) {
+        pts += 1667;
+        acc += cr_sliding_win(win, 1667, pts, av_make_q(1, 1000000),
+                              1000000LL * 1200LL, 1);
+    }
+
+    add_result(s, "sliding_win", s->nb_sectors, 0,
+               av_gettime_relative() - start, 0);
+
+    av_free(win);
+
+    return acc < 0;
+}
+
+static void *fifo_consumer(void *arg)
+{
+    AVBufferRef *fifo = arg;
+
+    while (1) {
+        AVFrame *frame = cr_frame_fifo_pop(fifo);
+        if (!frame)
+            break;
+        av_frame_free(&frame);
+    }
+
+    return NULL;
+}
+
+/* Bounded like the encoder queues */
+static int bench_fifo(CRBenchCtx *s, const char *name, enum CRFrameFIFOFlags flags)
+{
+    int ret = 0;
+    pthread_t thread;
+    AVFrame *frame = av_frame_alloc();
+    AVBufferRef *fifo = cr_frame_fifo_create(384, FRAME_FIFO_BLOCK_NO_INPUT |
+                                                  FRAME_FIFO_BLOCK_MAX_OUTPUT | flags);
+    if (!frame || !fifo) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* One sector per frame, the worst case for the queues */
+    frame->format = AV_SAMPLE_FMT_S16;
+    frame->nb_samples = CDIO_CD_FRAMESIZE_RAW >> 2;
+    frame->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret < 0)
+        goto end;
+
+    int64_t start = av_gettime_relative();
+
+    pthread_create(&thread, NULL, fifo_consumer, fifo);
+
+    for (int i = 0; i < s->nb_sectors; i++) {
+        ret = cr_frame_fifo_push(fifo, frame);
+        if (ret < 0)
+            break;
+    }
+
+    cr_frame_fifo_push(fifo, NULL);
+    pthread_join(thread, NULL);
+
+    add_result(s, name, s->nb_sectors,
+               (int64_t)s->nb_sectors * CDIO_CD_FRAMESIZE_RAW,
+               av_gettime_relative() - start, 0);
+
+end:
+    av_buffer_unref(&fifo);
+    av_frame_free(&frame);
+    return ret;
+}
+
+static int bench_get_path(CRBenchCtx *s)
+{
+    const int calls = 20000;
+    cyanrip_track t = { 0 };
+
+    av_dict_set(&s->ctx->meta, "album", "Ünïcödé: <The> \"Album\"?", 0);
+    av_dict_set(&s->ctx->meta, "totaldiscs", "2", 0);
+    av_dict_set(&t.meta, "title", "A/B \\ C | D * E", 0);
+    av_dict_set(&t.meta, "track", "7", 0);
+    av_dict_set(&t.meta, "disc", "1", 0);
+    av_dict_set(&t.meta, "totaldiscs", "2", 0);
+
+    int64_t start = av_gettime_relative();
+
+    for (int i = 0; i < calls; i++) {
+        char *path = crip_get_path(s->ctx, CRIP_PATH_TRACK, 0,
+                                   &crip_fmt_info[CYANRIP_FORMAT_FLAC], &t);
+        if (!path)
+            return AVERROR(ENOMEM);
+        av_free(path);
+    }
+
+    add_result(s, "get_path", calls, 0, av_gettime_relative() - start, 1);
+
+    av_dict_free(&t.meta);
+
+    return 0;
+}
+
+static int bench_crc_subq(CRBenchCtx *s)
+{
+    unsigned acc = 0;
+    int64_t start = av_gettime_relative();
+
+    /* A Q subchannel per sector, taken from the PCM */
+    for (int i = 0; i < s->nb_sectors; i++)
+        acc ^= crc_subq(s->pcm + i*CDIO_CD_FRAMESIZE_RAW);
+
+    add_result(s, "crc_subq", s->nb_sectors, (int64_t)s->nb_sectors * 12,
+               av_gettime_relative() - start, 0);
+
+    return acc > 0xFFFF;
+}
+
+static int bench_ar_offset(CRBenchCtx *s)
+{
+    int offset, range = FFMIN(s->nb_sectors / 2 - 1, 10);
+    CRIPAccuDBEntry entry = { .confidence = 1, .checksum = 0, .checksum_450 = 0 };
+    cyanrip_track t = {
+        .ar_db_status = CYANRIP_ACCUDB_FOUND,
+        .ar_db_entries = &entry,
+        .ar_db_nb_entries = 1,
+        .ar_db_max_confidence = 1,
+    };
+
+    if (range <= 0)
+        return 0;
+
+    /* Nothing matches, so every offset is tried */
+    int64_t start = av_gettime_relative();
+    crip_search_ar_offset(&t, &offset, s->pcm + range*CDIO_CD_FRAMESIZE_RAW, 1, 0,
+                          range * CDIO_CD_FRAMESIZE_RAW, NULL);
+
+    /* Each sample offset checksums a full sector */
+    int64_t offsets = range * (CDIO_CD_FRAMESIZE_RAW >> 2);
+    add_result(s, "ar_offset", offsets, offsets * CDIO_CD_FRAMESIZE_RAW,
+               av_gettime_relative() - start, 0);
+
+    return 0;
+}
+
+/* Gain of a biquad at w radians per sample */
+static double biquad_gain(const double b[3], const double a[2], double w)
+{
+    double nr = b[0] + b[1]*cos(w) + b[2]*cos(2*w);
+    double ni = -b[1]*sin(w) - b[2]*sin(2*w);
+    double dr = 1.0 + a[0]*cos(w) + a[1]*cos(2*w);
+    double di = -a[0]*sin(w) - a[1]*sin(2*w);
+    return sqrt((nr*nr + ni*ni)/(dr*dr + di*di));
+}
+
+/* Not timed, the kernels have to be right before they're worth timing.
+ * A 1 kHz sine on both channels reads as its level after K-weighting. */
+static int check_loudness(void)
+{
+    const int nb_samples = 44100*20;
+    int16_t *pcm = av_malloc(nb_samples*4*sizeof(*pcm));
+    CRLoudness *l = av_malloc(sizeof(*l));
+    if (!pcm || !l) {
+        av_free(pcm);
+        av_free(l);
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = 0;
+    static const double levels[] = { -20.00, -20.03, -20.06, -20.09, -31.37 };
+    for (int i = 0; i < FF_ARRAY_ELEMS(levels); i++) {
+        int amp = lrint(32767*pow(10.0, levels[i]/20.0));
+        for (int j = 0; j < nb_samples; j++)
+            pcm[2*j] = pcm[2*j + 1] = lrint(amp*sin(2*M_PI*1000*j/44100.0));
+
+        CRLoudnessStats st;
+        cr_loudness_init(l, 44100);
+        cr_loudness_add(l, pcm, nb_samples);
+        cr_loudness_stats(l, &st);
+
+        double w = 2*M_PI*1000/44100.0;
+        double g = biquad_gain(l->pre_b, l->pre_a, w)*biquad_gain(l->rlb_b, l->rlb_a, w);
+        double expected = -0.691 + 20.0*log10(amp/32768.0*g);
+
+        if (fabs(st.integrated - expected) > 0.01) {
+            fprintf(stderr, "Loudness of a %.2f dBFS sine is %.3f LUFS, expected %.3f!\n",
+                    levels[i], st.integrated, expected);
+            ret = AVERROR_BUG;
+        }
+    }
+
+    av_free(pcm);
+    av_free(l);
+
+    return ret;
+}
+
+/* Deemphasis follows the analog 50/15us curve to within a quarter of a dB,
+ * measured on a sine once the filter has settled */
+static int check_deemph(void)
+{
+    const int nb_samples = 44100;
+    int16_t *pcm = av_malloc(nb_samples*2*sizeof(*pcm));
+    double *out = av_malloc(nb_samples*2*sizeof(*out));
+    if (!pcm || !out) {
+        av_free(pcm);
+        av_free(out);
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = 0;
+    static const double freqs[] = { 1000, 10000, 16000 };
+    for (int i = 0; i < FF_ARRAY_ELEMS(freqs); i++) {
+        for (int j = 0; j < nb_samples; j++)
+            pcm[2*j] = pcm[2*j + 1] = lrint(16384*sin(2*M_PI*freqs[i]*j/44100.0));
+
+        CRDeemph d;
+        cr_deemph_init(&d, 44100);
+        cr_deemph_process(&d, (double *const [2]){ out, out + nb_samples },
+                          pcm, nb_samples);
+
+        double pow_in = 0.0, pow_out = 0.0;
+        for (int j = nb_samples/2; j < nb_samples; j++) {
+            pow_in += (pcm[2*j]/32768.0)*(pcm[2*j]/32768.0);
+            pow_out += out[j]*out[j];
+        }
+
+        double w = 2*M_PI*freqs[i];
+        double gain = 10.0*log10(pow_out/pow_in);
+        double expected = 10.0*log10((1.0 + w*w*15e-6*15e-6)/(1.0 + w*w*50e-6*50e-6));
+
+        if (fabs(gain - expected) > 0.25) {
+            fprintf(stderr, "Deemphasis at %.0f Hz is %.2f dB, expected %.2f!\n",
+                    freqs[i], gain, expected);
+            ret = AVERROR_BUG;
+        }
+    }
+
+    av_free(pcm);
+    av_free(out);
+
+    return ret;
+}
+
+static void print_results(CRBenchCtx *s, FILE *json)
+{
+    printf("%-16s %14s %10s\n", "kernel", "ns/sector", "GB/s");
+    for (int i = 0; i < s->nb_results; i++) {
+        CRBenchResult *r = &s->results[i];
+        double ns = r->time * 1000.0 / r->units;
+        double gbs = r->bytes / (r->time * 1000.0);
+        if (r->bytes)
+            printf("%-16s %14.2f %10.3f\n", r->name, ns, gbs);
+        else
+            printf("%-16s %14.2f %10s\n", r->name, ns, r->per_call ? "(per call)" : "-");
+    }
+
+    if (!json)
+        return;
+
+    fprintf(json, "{\n  \"version\": \"%s\",\n  \"sectors\": %i,\n  \"results\": [\n",
+            PROJECT_VERSION_STRING, s->nb_sectors);
+    for (int i = 0; i < s->nb_results; i++) {
+        CRBenchResult *r = &s->results[i];
+        fprintf(json, "    { \"name\": \"%s\", \"units\": %" PRId64 ", \"bytes\": %" PRId64
+                ", \"time_us\": %" PRId64 ", \"ns_per_%s\": %.3f, \"gb_per_s\": %.4f }%s\n",
+                r->name, r->units, r->bytes, r->time, r->per_call ? "call" : "sector",
+                r->time * 1000.0 / r->units, r->bytes / (r->time * 1000.0),
+                i < (s->nb_results - 1) ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0, c;
+    CRBenchCtx s = { .nb_sectors = 75 * 60 * 5 }; /* 5 minutes */
+    const char *json_path = NULL;
+    FILE *json = NULL;
+
+    while ((c = getopt(argc, argv, "hn:j:")) != -1) {
+        switch (c) {
+        case 'n':
+            s.nb_sectors = strtol(optarg, NULL, 10);
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [-n <sectors>] [-j <file.json|->]\n", argv[0]);
+            return c != 'h';
+        }
+    }
+
+    if (s.nb_sectors <= 0) {
+        fprintf(stderr, "Invalid number of sectors!\n");
+        return 1;
+    }
+
+    s.pcm = av_malloc((size_t)s.nb_sectors * CDIO_CD_FRAMESIZE_RAW);
+    s.ctx = av_mallocz(sizeof(*s.ctx));
+    if (!s.pcm || !s.ctx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    fill_pcm(s.pcm, (size_t)s.nb_sectors * CDIO_CD_FRAMESIZE_RAW);
+
+    s.ctx->pool = cr_pool_create(0);
+    s.ctx->nb_tracks = 12;
+    s.ctx->settings.folder_name_scheme = "{album}{if #releasecomment# > #0# (|releasecomment|)} [{format}]";
+    s.ctx->settings.track_name_scheme = "{if #totaldiscs# > #1#|disc|.}{track} - {title}";
+    s.ctx->settings.sanitize_method = CRIP_SANITIZE_UNICODE;
+    if (!s.ctx->pool) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = check_loudness()) ||
+        (ret = check_deemph()) ||
+        (ret = bench_checksums(&s)) ||
+        (ret = bench_sliding_win(&s)) ||
+        (ret = bench_fifo(&s, "frame_fifo", 0)) ||
+        (ret = bench_fifo(&s, "frame_fifo_spsc", FRAME_FIFO_SPSC)) ||
+        (ret = bench_get_path(&s)) ||
+        (ret = bench_crc_subq(&s)) ||
+        (ret = bench_ar_offset(&s)))
+        goto end;
+
+    if (json_path) {
+        json = !strcmp(json_path, "-") ? stdout : fopen(json_path, "w");
+        if (!json) {
+            fprintf(stderr, "Unable to open %s!\n", json_path);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    print_results(&s, json);
+
+end:
+    if (json && json != stdout)
+        fclose(json);
+    if (s.ctx) {
+        cr_pool_free(&s.ctx->pool);
+        av_dict_free(&s.ctx->meta);
+    }
+    av_free(s.ctx);
+    av_free(s.pcm);
+
+    if (ret)
+        fprintf(stderr, "Benchmark failed: %s!\n", av_err2str(ret));
+
+    return !!ret;
+}
@@ -244,3 +244,39 @@ int crip_find_ar(cyanrip_track *t, uint32_t checksum, int is_450)
 
     return -1;
 }
+
+int crip_search_ar_offset(cyanrip_track *t, int *offset_found,
+                          const uint8_t *mem, int dir, int guess, int bytes,
+                          const int *stop)
+{
+    if (guess) {
+        const uint8_t *start_addr = mem + guess*4;
+        uint32_t accurip_v1 = 0x0;
+        for (int j = 0; j < (CDIO_CD_FRAMESIZE_RAW >> 2); j++)
+            accurip_v1 += AV_RL32(&start_addr[j*4]) * (j + 1);
+        if (crip_find_ar(t, accurip_v1, 1) == t->ar_db_max_confidence && accurip_v1) {
+            *offset_found = guess;
+            return 1;
+        }
+    }
+
+    for (int byte_off = ((dir < 0) * 4); byte_off < bytes; byte_off += 4) {
+        if (stop && *stop)
+            return 0;
+
+        int offset = dir * (byte_off >> 2);
+        if (guess == offset)
+            continue;
+
+        const uint8_t *start_addr = mem + dir * byte_off;
+        uint32_t accurip_v1 = 0x0;
+        for (int j = 0; j < (CDIO_CD_FRAMESIZE_RAW >> 2); j++)
+            accurip_v1 += AV_RL32(&start_addr[j*4]) * (j + 1);
+        if (crip_find_ar(t, accurip_v1, 1) == t->ar_db_max_confidence && accurip_v1) {
+            *offset_found = offset;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -22,3 +22,10 @@
 
 int crip_fill_accurip(cyanrip_ctx *ctx);
 int crip_find_ar(cyanrip_track *t, uint32_t checksum, int is_450);
+
+/* Searches mem in the given direction for a frame matching the AccurateRip
+ * entry with the highest confidence, trying the guess first.
+ * Returns 1 and sets offset_found in samples if found. */
+int crip_search_ar_offset(cyanrip_track *t, int *offset_found,
+                          const uint8_t *mem, int dir, int guess, int bytes,
+                          const int *stop);
@@ -0,0 +1,205 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+
+#include "blake3.h"
+
+enum CRBLAKE3Flags {
+    CHUNK_START = 1 << 0,
+    CHUNK_END   = 1 << 1,
+    PARENT      = 1 << 2,
+    ROOT        = 1 << 3,
+};
+
+static const uint32_t blake3_iv[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t blake3_msg_perm[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, mx, my)                        \
+    do {                                             \
+        st[a] = st[a] + st[b] + (mx);                \
+        st[d] = ROTR32(st[d] ^ st[a], 16);           \
+        st[c] = st[c] + st[d];                       \
+        st[b] = ROTR32(st[b] ^ st[c], 12);           \
+        st[a] = st[a] + st[b] + (my);                \
+        st[d] = ROTR32(st[d] ^ st[a], 8);            \
+        st[c] = st[c] + st[d];                       \
+        st[b] = ROTR32(st[b] ^ st[c], 7);            \
+    } while (0)
+
+static void blake3_compress(const uint32_t cv[8], const uint8_t block[CR_BLAKE3_BLOCK_LEN],
+                            uint64_t counter, uint32_t block_len, uint32_t flags,
+                            uint32_t out[16])
+{
+    uint32_t st[16], m[16], tmp[16];
+
+    for (int i = 0; i < 16; i++)
+        m[i] = AV_RL32(&block[i*4]);
+
+    memcpy(&st[0], cv, 8*sizeof(*cv));
+    memcpy(&st[8], blake3_iv, 4*sizeof(*blake3_iv));
+    st[12] = (uint32_t)counter;
+    st[13] = (uint32_t)(counter >> 32);
+    st[14] = block_len;
+    st[15] = flags;
+
+    for (int r = 0; r < 7; r++) {
+        G(0, 4,  8, 12, m[ 0], m[ 1]);
+        G(1, 5,  9, 13, m[ 2], m[ 3]);
+        G(2, 6, 10, 14, m[ 4], m[ 5]);
+        G(3, 7, 11, 15, m[ 6], m[ 7]);
+        G(0, 5, 10, 15, m[ 8], m[ 9]);
+        G(1, 6, 11, 12, m[10], m[11]);
+        G(2, 7,  8, 13, m[12], m[13]);
+        G(3, 4,  9, 14, m[14], m[15]);
+
+        for (int i = 0; i < 16; i++)
+            tmp[i] = m[blake3_msg_perm[i]];
+        memcpy(m, tmp, sizeof(m));
+    }
+
+    for (int i = 0; i < 8; i++) {
+        out[i + 0] = st[i] ^ st[i + 8];
+        out[i + 8] = st[i + 8] ^ cv[i];
+    }
+}
+
+static void blake3_parent_cv(const uint32_t left[8], const uint32_t right[8],
+                             uint32_t flags, uint32_t out_cv[8])
+{
+    uint8_t block[CR_BLAKE3_BLOCK_LEN];
+    uint32_t out[16];
+
+    for (int i = 0; i < 8; i++) {
+        AV_WL32(&block[i*4 +  0], left[i]);
+        AV_WL32(&block[i*4 + 32], right[i]);
+    }
+
+    blake3_compress(blake3_iv, block, 0, CR_BLAKE3_BLOCK_LEN, PARENT | flags, out);
+    memcpy(out_cv, out, 8*sizeof(*out_cv));
+}
+
+static void blake3_chunk_reset(CRBLAKE3Ctx *s, uint64_t chunk_counter)
+{
+    memcpy(s->cv, blake3_iv, sizeof(s->cv));
+    s->chunk_counter = chunk_counter;
+    s->block_len = 0;
+    s->blocks_compressed = 0;
+    memset(s->block, 0, sizeof(s->block));
+}
+
+static inline int blake3_chunk_len(const CRBLAKE3Ctx *s)
+{
+    return CR_BLAKE3_BLOCK_LEN*s->blocks_compressed + s->block_len;
+}
+
+static inline uint32_t blake3_chunk_start_flag(const CRBLAKE3Ctx *s)
+{
+    return s->blocks_compressed ? 0 : CHUNK_START;
+}
+
+static void blake3_push_cv(CRBLAKE3Ctx *s, uint32_t cv[8], uint64_t total_chunks)
+{
+    /* Merge completed subtrees, one per trailing zero bit in the chunk count */
+    while (!(total_chunks & 1)) {
+        blake3_parent_cv(s->cv_stack[--s->cv_stack_len], cv, 0, cv);
+        total_chunks >>= 1;
+    }
+
+    memcpy(s->cv_stack[s->cv_stack_len++], cv, 8*sizeof(*cv));
+}
+
+void cr_blake3_init(CRBLAKE3Ctx *s)
+{
+    blake3_chunk_reset(s, 0);
+    s->cv_stack_len = 0;
+}
+
+void cr_blake3_update(CRBLAKE3Ctx *s, const uint8_t *data, size_t len)
+{
+    uint32_t out[16];
+
+    while (len) {
+        if (blake3_chunk_len(s) == CR_BLAKE3_CHUNK_LEN) {
+            blake3_compress(s->cv, s->block, s->chunk_counter, s->block_len,
+                            blake3_chunk_start_flag(s) | CHUNK_END, out);
+            uint64_t total_chunks = s->chunk_counter + 1;
+            blake3_push_cv(s, out, total_chunks);
+            blake3_chunk_reset(s, total_chunks);
+        }
+
+        if (s->block_len == CR_BLAKE3_BLOCK_LEN) {
+            blake3_compress(s->cv, s->block, s->chunk_counter, CR_BLAKE3_BLOCK_LEN,
+                            blake3_chunk_start_flag(s), out);
+            memcpy(s->cv, out, sizeof(s->cv));
+            s->blocks_compressed++;
+            s->block_len = 0;
+            memset(s->block, 0, sizeof(s->block));
+        }
+
+        size_t take = FFMIN(CR_BLAKE3_BLOCK_LEN - s->block_len, len);
+        memcpy(&s->block[s->block_len], data, take);
+        s->block_len += take;
+        data += take;
+        len  -= take;
+    }
+}
+
+void cr_blake3_final(CRBLAKE3Ctx *s, uint8_t out[CR_BLAKE3_OUT_LEN])
+{
+    uint32_t cv[8], res[16];
+    uint8_t block[CR_BLAKE3_BLOCK_LEN];
+    const uint32_t *in_cv = s->cv;
+    const uint8_t *in_block = s->block;
+    uint32_t block_len = s->block_len;
+    uint32_t flags = blake3_chunk_start_flag(s) | CHUNK_END;
+
+    /* Fold the current chunk into the stack of subtrees, right to left */
+    for (int i = s->cv_stack_len - 1; i >= 0; i--) {
+        blake3_compress(in_cv, in_block, i == (s->cv_stack_len - 1) ? s->chunk_counter : 0,
+                        block_len, flags, res);
+        memcpy(cv, res, sizeof(cv));
+
+        for (int j = 0; j < 8; j++) {
+            AV_WL32(&block[j*4 +  0], s->cv_stack[i][j]);
+            AV_WL32(&block[j*4 + 32], cv[j]);
+        }
+
+        in_cv = blake3_iv;
+        in_block = block;
+        block_len = CR_BLAKE3_BLOCK_LEN;
+        flags = PARENT;
+    }
+
+    blake3_compress(in_cv, in_block, s->cv_stack_len ? 0 : s->chunk_counter,
+                    block_len, flags | ROOT, res);
+
+    for (int i = 0; i < CR_BLAKE3_OUT_LEN/4; i++)
+        AV_WL32(&out[i*4], res[i]);
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CR_BLAKE3_OUT_LEN   32
+#define CR_BLAKE3_BLOCK_LEN 64
+#define CR_BLAKE3_CHUNK_LEN 1024
+
+/* Portable, unkeyed BLAKE3 hasher */
+typedef struct CRBLAKE3Ctx {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[CR_BLAKE3_BLOCK_LEN];
+    int block_len;
+    int blocks_compressed;
+
+    /* Stack of chaining values for completed subtrees */
+    uint32_t cv_stack[54][8];
+    int cv_stack_len;
+} CRBLAKE3Ctx;
+
+void cr_blake3_init(CRBLAKE3Ctx *s);
+void cr_blake3_update(CRBLAKE3Ctx *s, const uint8_t *data, size_t len);
+void cr_blake3_final(CRBLAKE3Ctx *s, uint8_t out[CR_BLAKE3_OUT_LEN]);
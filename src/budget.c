@@ -0,0 +1,50 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdatomic.h>
+
+#include "budget.h"
+
+static atomic_llong budget_limit = 0;
+static atomic_llong budget_used  = 0;
+
+void cr_budget_set_limit(int64_t limit)
+{
+    atomic_store(&budget_limit, limit > 0 ? limit : 0);
+}
+
+void cr_budget_acquire(int64_t bytes)
+{
+    atomic_fetch_add(&budget_used, bytes);
+}
+
+void cr_budget_release(int64_t bytes)
+{
+    atomic_fetch_sub(&budget_used, bytes);
+}
+
+int64_t cr_budget_used(void)
+{
+    return atomic_load(&budget_used);
+}
+
+int cr_budget_exceeded(void)
+{
+    int64_t limit = atomic_load(&budget_limit);
+    return limit && (atomic_load(&budget_used) > limit);
+}
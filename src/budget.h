@@ -0,0 +1,34 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Process-wide budget for the memory held in queues and cover art.
+ * Queues created with the BLOCK_BUDGET flag make producers wait while it's
+ * exceeded, as long as they have something queued already. */
+
+/* 0 means unlimited */
+void cr_budget_set_limit(int64_t limit);
+
+void cr_budget_acquire(int64_t bytes);
+void cr_budget_release(int64_t bytes);
+
+int64_t cr_budget_used(void);
+int cr_budget_exceeded(void);
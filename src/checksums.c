@@ -0,0 +1,460 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <strings.h>
+
+#include <libavutil/crc.h>
+#include <libavutil/sha.h>
+
+#include "checksums.h"
+#include "blake3.h"
+#include "treehash.h"
+#include "cyanrip_log.h"
+
+/* EAC CRC32, over all samples */
+typedef struct CRIPEACCtx {
+    const AVCRC *table;
+    uint32_t crc;
+} CRIPEACCtx;
+
+static int eac_init(void *priv, cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    CRIPEACCtx *s = priv;
+    s->table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    s->crc   = UINT32_MAX;
+    return 0;
+}
+
+static void eac_update(void *priv, const uint8_t *data, int bytes)
+{
+    CRIPEACCtx *s = priv;
+    s->crc = av_crc(s->table, s->crc, data, bytes);
+}
+
+static void eac_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    CRIPEACCtx *s = priv;
+    t->eac_crc = s->crc ^ UINT32_MAX;
+    AV_WB32(digest, t->eac_crc);
+}
+
+/* EAC CRC32 "without null samples", skips all 16-bit samples which are 0 */
+static void eac_nonull_update(void *priv, const uint8_t *data, int bytes)
+{
+    CRIPEACCtx *s = priv;
+    int start = 0;
+
+    /* CRC runs of non-zero samples at once */
+    for (int i = 0; i < bytes; i += 2) {
+        if (AV_RL16(&data[i]))
+            continue;
+        if (i > start)
+            s->crc = av_crc(s->table, s->crc, &data[start], i - start);
+        start = i + 2;
+    }
+
+    if (bytes > start)
+        s->crc = av_crc(s->table, s->crc, &data[start], bytes - start);
+}
+
+static void eac_nonull_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    CRIPEACCtx *s = priv;
+    AV_WB32(digest, s->crc ^ UINT32_MAX);
+}
+
+/* AccurateRip v1, v1 of frame 450 and v2 */
+typedef struct CRIPAccuripCtx {
+    uint32_t acu_start;
+    uint32_t acu_end;
+    uint32_t acu_mult;
+    uint32_t acu_sum_1;
+    uint32_t acu_sum_1_450;
+    uint32_t acu_sum_2;
+} CRIPAccuripCtx;
+
+static int accurip_init(void *priv, cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    CRIPAccuripCtx *s = priv;
+    s->acu_start = 0;
+    s->acu_end   = t->nb_samples;
+    s->acu_mult  = 1;
+    s->acu_sum_1 = 0x0;
+    s->acu_sum_1_450 = 0x0;
+    s->acu_sum_2 = 0x0;
+
+    if (t->acurip_track_is_first)
+        s->acu_start += (CDIO_CD_FRAMESIZE_RAW * 5) >> 2;
+    if (t->acurip_track_is_last)
+        s->acu_end   -= (CDIO_CD_FRAMESIZE_RAW * 5) >> 2;
+
+    return 0;
+}
+
+static void accurip_update(void *priv, const uint8_t *data, int bytes)
+{
+    CRIPAccuripCtx *s = priv;
+
+    /* Loop over samples */
+    for (int j = 0; j < (bytes >> 2); j++) {
+        if (s->acu_mult >= s->acu_start && s->acu_mult <= s->acu_end) {
+            uint32_t val = AV_RL32(&data[j*4]);
+            uint64_t tmp = (uint64_t)val  * (uint64_t)s->acu_mult;
+            uint32_t lo  = (uint32_t)(tmp & (uint64_t)UINT32_MAX);
+            uint32_t hi  = (uint32_t)(tmp / (uint64_t)0x100000000);
+            s->acu_sum_1 += s->acu_mult * val;
+            s->acu_sum_2 += hi;
+            s->acu_sum_2 += lo;
+        }
+        if (((s->acu_mult - 1) >= (450 * (CDIO_CD_FRAMESIZE_RAW >> 2))) &&
+            ((s->acu_mult - 1)  < (451 * (CDIO_CD_FRAMESIZE_RAW >> 2)))) {
+            uint32_t mult = s->acu_mult - (450 * (CDIO_CD_FRAMESIZE_RAW >> 2));
+            s->acu_sum_1_450 += AV_RL32(&data[j*4]) * mult;
+        }
+        s->acu_mult++;
+    }
+}
+
+static void accurip_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    CRIPAccuripCtx *s = priv;
+    t->acurip_checksum_v1 = s->acu_sum_1;
+    t->acurip_checksum_v1_450 = s->acu_sum_1_450;
+    t->acurip_checksum_v2 = s->acu_sum_2;
+    AV_WB32(&digest[0], s->acu_sum_1);
+    AV_WB32(&digest[4], s->acu_sum_2);
+    AV_WB32(&digest[8], s->acu_sum_1_450);
+}
+
+/* CUETools DB CRC32, skips 10 frames at the start and end of the disc */
+typedef struct CRIPCTDBCtx {
+    const AVCRC *table;
+    uint32_t crc;
+    int64_t pos;
+    int64_t start;
+    int64_t end;
+} CRIPCTDBCtx;
+
+static int ctdb_init(void *priv, cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    CRIPCTDBCtx *s = priv;
+    s->table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    s->crc   = UINT32_MAX;
+    s->pos   = 0;
+    s->start = 0;
+    s->end   = t->nb_samples * 4;
+
+    if (t->acurip_track_is_first)
+        s->start += CDIO_CD_FRAMESIZE_RAW * 10;
+    if (t->acurip_track_is_last)
+        s->end   -= CDIO_CD_FRAMESIZE_RAW * 10;
+
+    return 0;
+}
+
+static void ctdb_update(void *priv, const uint8_t *data, int bytes)
+{
+    CRIPCTDBCtx *s = priv;
+    int64_t from = FFMAX(s->pos, s->start);
+    int64_t to = FFMIN(s->pos + bytes, s->end);
+
+    if (to > from)
+        s->crc = av_crc(s->table, s->crc, data + from - s->pos, to - from);
+
+    s->pos += bytes;
+}
+
+static void ctdb_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    CRIPCTDBCtx *s = priv;
+    AV_WB32(digest, s->crc ^ UINT32_MAX);
+}
+
+/* SHA-256 of the PCM */
+typedef struct CRIPSHA256Ctx {
+    struct AVSHA *sha;
+} CRIPSHA256Ctx;
+
+static int sha256_init(void *priv, cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    CRIPSHA256Ctx *s = priv;
+    s->sha = av_sha_alloc();
+    if (!s->sha)
+        return AVERROR(ENOMEM);
+    return av_sha_init(s->sha, 256);
+}
+
+static void sha256_update(void *priv, const uint8_t *data, int bytes)
+{
+    CRIPSHA256Ctx *s = priv;
+    av_sha_update(s->sha, data, bytes);
+}
+
+static void sha256_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    CRIPSHA256Ctx *s = priv;
+    av_sha_final(s->sha, digest);
+}
+
+static void sha256_uninit(void *priv)
+{
+    CRIPSHA256Ctx *s = priv;
+    av_freep(&s->sha);
+}
+
+/* BLAKE3 of the PCM */
+static int blake3_init(void *priv, cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    cr_blake3_init(priv);
+    return 0;
+}
+
+static void blake3_update(void *priv, const uint8_t *data, int bytes)
+{
+    cr_blake3_update(priv, data, bytes);
+}
+
+static void blake3_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    cr_blake3_final(priv, digest);
+}
+
+/* SHA-256 tree of the PCM, with leaves hashed on the pool */
+typedef struct CRIPTreeCtx {
+    CRIPTreeHash *tree;
+    int err;
+} CRIPTreeCtx;
+
+static int tree_init(void *priv, cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    CRIPTreeCtx *s = priv;
+    s->tree = crip_tree_alloc(ctx->pool, t->nb_samples*4);
+    if (!s->tree)
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+static void tree_update(void *priv, const uint8_t *data, int bytes)
+{
+    CRIPTreeCtx *s = priv;
+    if (!s->err)
+        s->err = crip_tree_update(s->tree, data, bytes);
+}
+
+static void tree_final(void *priv, cyanrip_track *t, uint8_t *digest)
+{
+    char str[2*CRIP_TREE_HASH_SIZE + 1];
+    CRIPTreeCtx *s = priv;
+
+    av_freep(&t->tree_leaves);
+    t->nb_tree_leaves = 0;
+
+    int ret = s->err ? s->err : crip_tree_final(s->tree, digest, &t->tree_leaves);
+    if (ret < 0) {
+        cyanrip_log(NULL, 0, "Error computing SHA-256 tree: %s!\n", av_err2str(ret));
+        memset(digest, 0, CRIP_TREE_HASH_SIZE);
+        return;
+    }
+
+    t->nb_tree_leaves = ret;
+
+    for (int i = 0; i < CRIP_TREE_HASH_SIZE; i++)
+        snprintf(&str[i*2], 3, "%02x", digest[i]);
+    av_dict_set(&t->meta, "PCM_SHA256_TREE", str, 0);
+}
+
+static void tree_uninit(void *priv)
+{
+    CRIPTreeCtx *s = priv;
+    crip_tree_free(&s->tree);
+}
+
+static const CRIPChecksumProvider checksum_eac = {
+    .name      = "eac",
+    .label     = "EAC CRC32",
+    .size      = 4,
+    .priv_size = sizeof(CRIPEACCtx),
+    .init      = eac_init,
+    .update    = eac_update,
+    .final     = eac_final,
+};
+
+static const CRIPChecksumProvider checksum_accurip = {
+    .name      = "accurip",
+    .label     = "Accurip",
+    .size      = 12,
+    .priv_size = sizeof(CRIPAccuripCtx),
+    .init      = accurip_init,
+    .update    = accurip_update,
+    .final     = accurip_final,
+};
+
+static const CRIPChecksumProvider checksum_eac_nonull = {
+    .name      = "eac_nonull",
+    .label     = "EAC CRC32 w/o nulls",
+    .size      = 4,
+    .priv_size = sizeof(CRIPEACCtx),
+    .init      = eac_init,
+    .update    = eac_nonull_update,
+    .final     = eac_nonull_final,
+};
+
+static const CRIPChecksumProvider checksum_ctdb = {
+    .name      = "ctdb",
+    .label     = "CTDB CRC32",
+    .size      = 4,
+    .priv_size = sizeof(CRIPCTDBCtx),
+    .init      = ctdb_init,
+    .update    = ctdb_update,
+    .final     = ctdb_final,
+};
+
+static const CRIPChecksumProvider checksum_sha256 = {
+    .name      = "sha256",
+    .label     = "SHA-256",
+    .size      = 32,
+    .priv_size = sizeof(CRIPSHA256Ctx),
+    .init      = sha256_init,
+    .update    = sha256_update,
+    .final     = sha256_final,
+    .uninit    = sha256_uninit,
+};
+
+static const CRIPChecksumProvider checksum_blake3 = {
+    .name      = "blake3",
+    .label     = "BLAKE3",
+    .size      = CR_BLAKE3_OUT_LEN,
+    .priv_size = sizeof(CRBLAKE3Ctx),
+    .init      = blake3_init,
+    .update    = blake3_update,
+    .final     = blake3_final,
+};
+
+static const CRIPChecksumProvider checksum_sha256_tree = {
+    .name      = "sha256_tree",
+    .label     = "SHA-256 tree",
+    .size      = CRIP_TREE_HASH_SIZE,
+    .priv_size = sizeof(CRIPTreeCtx),
+    .init      = tree_init,
+    .update    = tree_update,
+    .final     = tree_final,
+    .uninit    = tree_uninit,
+};
+
+const CRIPChecksumProvider *crip_checksum_providers[CRIP_CHECKSUMS_NB] = {
+    [CRIP_CHECKSUM_EAC]        = &checksum_eac,
+    [CRIP_CHECKSUM_ACCURIP]    = &checksum_accurip,
+    [CRIP_CHECKSUM_EAC_NONULL] = &checksum_eac_nonull,
+    [CRIP_CHECKSUM_CTDB]       = &checksum_ctdb,
+    [CRIP_CHECKSUM_SHA256]     = &checksum_sha256,
+    [CRIP_CHECKSUM_BLAKE3]     = &checksum_blake3,
+    [CRIP_CHECKSUM_SHA256_TREE] = &checksum_sha256_tree,
+};
+
+int crip_checksum_from_name(const char *name)
+{
+    for (int i = 0; i < CRIP_CHECKSUMS_NB; i++)
+        if (!strcasecmp(name, crip_checksum_providers[i]->name))
+            return i;
+    return -1;
+}
+
+void crip_print_checksums(void)
+{
+    for (int i = 0; i < CRIP_CHECKSUMS_NB; i++) {
+        const CRIPChecksumProvider *p = crip_checksum_providers[i];
+        cyanrip_log(NULL, 0, "\t%s\t%s%s\n", p->name, p->label,
+                    i < CRIP_CHECKSUM_EAC_NONULL ? "\t(always enabled)" : "");
+    }
+}
+
+void crip_checksum_to_str(const cyanrip_track *t, enum CRIPChecksumType type,
+                          char *str, int len)
+{
+    const CRIPChecksumProvider *p = crip_checksum_providers[type];
+    const uint8_t *digest = t->checksums[type];
+
+    if (p->size == 4) {
+        snprintf(str, len, "%08X", AV_RB32(digest));
+        return;
+    }
+
+    str[0] = '\0';
+    for (int i = 0; i < p->size && (i*2 + 2) < len; i++)
+        snprintf(&str[i*2], 3, "%02x", digest[i]);
+}
+
+int crip_init_checksum_ctx(cyanrip_ctx *ctx, cyanrip_checksum_ctx *s, cyanrip_track *t)
+{
+    int ret;
+    memset(s, 0, sizeof(*s));
+
+    t->computed_crcs = 0;
+
+    for (int i = 0; i < ctx->settings.checksums_num; i++) {
+        enum CRIPChecksumType type = ctx->settings.checksums[i];
+        const CRIPChecksumProvider *p = crip_checksum_providers[type];
+
+        s->priv[s->nb_active] = av_mallocz(p->priv_size);
+        if (!s->priv[s->nb_active]) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        s->type[s->nb_active++] = type;
+
+        ret = p->init(s->priv[s->nb_active - 1], ctx, t);
+        if (ret < 0)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    cyanrip_log(ctx, 0, "Error initializing checksums: %s!\n", av_err2str(ret));
+    crip_uninit_checksum_ctx(s);
+    return ret;
+}
+
+void crip_process_checksums(cyanrip_checksum_ctx *s, const uint8_t *data, int bytes)
+{
+    if (!bytes)
+        return;
+
+    for (int i = 0; i < s->nb_active; i++)
+        crip_checksum_providers[s->type[i]]->update(s->priv[i], data, bytes);
+}
+
+void crip_finalize_checksums(cyanrip_checksum_ctx *s, cyanrip_track *t)
+{
+    for (int i = 0; i < s->nb_active; i++)
+        crip_checksum_providers[s->type[i]]->final(s->priv[i], t, t->checksums[s->type[i]]);
+
+    t->computed_crcs = 1;
+    crip_uninit_checksum_ctx(s);
+}
+
+void crip_uninit_checksum_ctx(cyanrip_checksum_ctx *s)
+{
+    for (int i = 0; i < s->nb_active; i++) {
+        const CRIPChecksumProvider *p = crip_checksum_providers[s->type[i]];
+        if (p->uninit && s->priv[i])
+            p->uninit(s->priv[i]);
+        av_freep(&s->priv[i]);
+    }
+    s->nb_active = 0;
+}
@@ -19,72 +19,40 @@
 #pragma once
 
 #include <stdint.h>
-#include <libavutil/crc.h>
 
 #include "cyanrip_main.h"
 
-typedef struct cyanrip_checksum_ctx {
-    const AVCRC *eac_ctx;
-    uint32_t eac_crc;
-    uint32_t acu_start;
-    uint32_t acu_end;
-    uint32_t acu_mult;
-    uint32_t acu_sum_1;
-    uint32_t acu_sum_1_450;
-    uint32_t acu_sum_2;
-} cyanrip_checksum_ctx;
-
-static inline void crip_init_checksum_ctx(cyanrip_ctx *ctx, cyanrip_checksum_ctx *s, cyanrip_track *t)
-{
-    s->eac_ctx   = av_crc_get_table(AV_CRC_32_IEEE_LE);
-    s->eac_crc   = UINT32_MAX;
-    s->acu_start = 0;
-    s->acu_end   = t->nb_samples;
-    s->acu_mult  = 1;
-    s->acu_sum_1 = 0x0;
-    s->acu_sum_1_450 = 0x0;
-    s->acu_sum_2 = 0x0;
+typedef struct CRIPChecksumProvider {
+    const char *name;  /* Name used to select it on the command line */
+    const char *label; /* Name used in the log */
+    int size;          /* Size of the digest in bytes */
+    size_t priv_size;
 
-    t->computed_crcs = 0;
+    int  (*init)(void *priv, cyanrip_ctx *ctx, cyanrip_track *t);
+    void (*update)(void *priv, const uint8_t *data, int bytes);
+    void (*final)(void *priv, cyanrip_track *t, uint8_t *digest);
+    void (*uninit)(void *priv); /* May be NULL */
+} CRIPChecksumProvider;
 
-    if (t->acurip_track_is_first)
-        s->acu_start += (CDIO_CD_FRAMESIZE_RAW * 5) >> 2;
-    if (t->acurip_track_is_last)
-        s->acu_end   -= (CDIO_CD_FRAMESIZE_RAW * 5) >> 2;
-}
+extern const CRIPChecksumProvider *crip_checksum_providers[CRIP_CHECKSUMS_NB];
 
-static inline void crip_process_checksums(cyanrip_checksum_ctx *s, const uint8_t *data, int bytes)
-{
-    if (!bytes)
-        return;
+typedef struct cyanrip_checksum_ctx {
+    int nb_active;
+    enum CRIPChecksumType type[CRIP_CHECKSUMS_NB];
+    void *priv[CRIP_CHECKSUMS_NB];
+} cyanrip_checksum_ctx;
 
-    s->eac_crc = av_crc(s->eac_ctx, s->eac_crc, data, bytes);
+/* Returns the type, or -1 if not found */
+int crip_checksum_from_name(const char *name);
+void crip_print_checksums(void);
 
-    /* Loop over samples */
-    for (int j = 0; j < (bytes >> 2); j++) {
-        if (s->acu_mult >= s->acu_start && s->acu_mult <= s->acu_end) {
-            uint32_t val = AV_RL32(&data[j*4]);
-            uint64_t tmp = (uint64_t)val  * (uint64_t)s->acu_mult;
-            uint32_t lo  = (uint32_t)(tmp & (uint64_t)UINT32_MAX);
-            uint32_t hi  = (uint32_t)(tmp / (uint64_t)0x100000000);
-            s->acu_sum_1 += s->acu_mult * val;
-            s->acu_sum_2 += hi;
-            s->acu_sum_2 += lo;
-        }
-        if (((s->acu_mult - 1) >= (450 * (CDIO_CD_FRAMESIZE_RAW >> 2))) &&
-            ((s->acu_mult - 1)  < (451 * (CDIO_CD_FRAMESIZE_RAW >> 2)))) {
-            uint32_t mult = s->acu_mult - (450 * (CDIO_CD_FRAMESIZE_RAW >> 2));
-            s->acu_sum_1_450 += AV_RL32(&data[j*4]) * mult;
-        }
-        s->acu_mult++;
-    }
-}
+/* Writes the digest, either as an uppercase 32-bit value or lowercase hex */
+void crip_checksum_to_str(const cyanrip_track *t, enum CRIPChecksumType type,
+                          char *str, int len);
 
-static inline void crip_finalize_checksums(cyanrip_checksum_ctx *s, cyanrip_track *t)
-{
-    t->computed_crcs = 1;
-    t->eac_crc = s->eac_crc ^ UINT32_MAX;
-    t->acurip_checksum_v1 = s->acu_sum_1;
-    t->acurip_checksum_v1_450 = s->acu_sum_1_450;
-    t->acurip_checksum_v2 = s->acu_sum_2;
-}
+/* Initializes all checksums selected in the settings */
+int  crip_init_checksum_ctx(cyanrip_ctx *ctx, cyanrip_checksum_ctx *s, cyanrip_track *t);
+void crip_process_checksums(cyanrip_checksum_ctx *s, const uint8_t *data, int bytes);
+/* Writes the results to the track, and frees the context */
+void crip_finalize_checksums(cyanrip_checksum_ctx *s, cyanrip_track *t);
+void crip_uninit_checksum_ctx(cyanrip_checksum_ctx *s);
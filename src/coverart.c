@@ -21,8 +21,10 @@
 #include <libavutil/base64.h>
 
 #include "coverart.h"
+#include "budget.h"
 #include "cyanrip_log.h"
 #include "utils.h"
+#include "writer.h"
 
 #define COVERART_DB_URL_BASE "http://coverartarchive.org/release"
 
@@ -45,8 +47,10 @@ int crip_save_art(cyanrip_ctx *ctx, CRIPArt *art, const cyanrip_out_fmt *fmt)
         return 0;
     }
 
+    /* The image2 muxer would open the file itself, the pipe one writes to
+     * whatever it's given */
     AVFormatContext *avf = NULL;
-    ret = avformat_alloc_output_context2(&avf, NULL, NULL, ffpath);
+    ret = avformat_alloc_output_context2(&avf, NULL, "image2pipe", ffpath);
     if (ret < 0) {
         cyanrip_log(ctx, 0, "Unable to init lavf context: %s!\n", av_err2str(ret));
         goto fail;
@@ -65,19 +69,15 @@ int crip_save_art(cyanrip_ctx *ctx, CRIPArt *art, const cyanrip_out_fmt *fmt)
     av_dict_copy(&avf->metadata, art->meta, 0);
 
     /* Open for writing */
-    ret = avio_open(&avf->pb, ffpath, AVIO_FLAG_WRITE);
+    ret = cr_writer_avio_open(&avf->pb, filepath, art->pkt->size,
+                              ctx->settings.writer_flags);
     if (ret < 0) {
         cyanrip_log(ctx, 0, "Couldn't open %s for writing: %s!\n", filepath, av_err2str(ret));
         goto fail;
     }
 
-    /* Silence libavformat warning */
-    AVDictionary *opts = NULL;
-    av_dict_set(&opts, "update", "1", 0);
-
     /* Write header */
-    ret = avformat_write_header(avf, &opts);
-    av_dict_free(&opts);
+    ret = avformat_write_header(avf, NULL);
     if (ret < 0) {
         cyanrip_log(ctx, 0, "Couldn't write header: %s!\n", av_err2str(ret));
         goto fail;
@@ -99,18 +99,25 @@ int crip_save_art(cyanrip_ctx *ctx, CRIPArt *art, const cyanrip_out_fmt *fmt)
     }
 
 fail:
+    if (avf) {
+        int err = cr_writer_avio_close(&avf->pb);
+        if (err < 0 && ret >= 0) {
+            cyanrip_log(ctx, 0, "Error writing %s: %s!\n", filepath, av_err2str(err));
+            ret = err;
+        }
+    }
+    avformat_free_context(avf);
+
     av_free(filepath);
     av_free(ffpath);
 
-    if (avf)
-        avio_closep(&avf->pb);
-    avformat_free_context(avf);
-
     return ret;
 }
 
 void crip_free_art(CRIPArt *art)
 {
+    if (art->pkt)
+        cr_budget_release(art->pkt->size);
     av_packet_free(&art->pkt);
     av_freep(&art->params);
 
@@ -251,6 +258,22 @@ end:
     return ret;
 }
 
+/* Output extension guesswork */
+static const char *guess_extension(enum AVCodecID codec_id)
+{
+    switch (codec_id) {
+    case AV_CODEC_ID_MJPEG: return "jpg";
+    case AV_CODEC_ID_PNG:   return "png";
+    case AV_CODEC_ID_BMP:   return "bmp";
+    case AV_CODEC_ID_TIFF:  return "tiff";
+    case AV_CODEC_ID_AV1:   return "avif";
+    case AV_CODEC_ID_HEVC:  return "heif";
+    case AV_CODEC_ID_WEBP:  return "webp";
+    case AV_CODEC_ID_NONE:  return NULL;
+    default:                return avcodec_get_name(codec_id);
+    }
+}
+
 static int demux_image(cyanrip_ctx *ctx, CRIPArt *art, int info_only)
 {
     int ret = 0;
@@ -276,24 +299,10 @@ static int demux_image(cyanrip_ctx *ctx, CRIPArt *art, int info_only)
 
     memcpy(art->params, avf->streams[0]->codecpar, sizeof(AVCodecParameters));
 
-    /* Output extension guesswork */
     av_freep(&art->extension);
-    if (art->params->codec_id == AV_CODEC_ID_MJPEG) {
-        art->extension = av_strdup("jpg");
-    } else if (art->params->codec_id == AV_CODEC_ID_PNG) {
-        art->extension = av_strdup("png");
-    } else if (art->params->codec_id == AV_CODEC_ID_BMP) {
-        art->extension = av_strdup("bmp");
-    } else if (art->params->codec_id == AV_CODEC_ID_TIFF) {
-        art->extension = av_strdup("tiff");
-    } else if (art->params->codec_id == AV_CODEC_ID_AV1) {
-        art->extension = av_strdup("avif");
-    } else if (art->params->codec_id == AV_CODEC_ID_HEVC) {
-        art->extension = av_strdup("heif");
-    } else if (art->params->codec_id == AV_CODEC_ID_WEBP) {
-        art->extension = av_strdup("webp");
-    } else if (art->params->codec_id != AV_CODEC_ID_NONE) {
-        art->extension = av_strdup(avcodec_get_name(art->params->codec_id));
+    const char *ext = guess_extension(art->params->codec_id);
+    if (ext) {
+        art->extension = av_strdup(ext);
     } else {
         ret = AVERROR(EINVAL);
         cyanrip_log(ctx, 0, "Error demuxing cover image: %s!\n", av_err2str(ret));
@@ -315,6 +324,8 @@ static int demux_image(cyanrip_ctx *ctx, CRIPArt *art, int info_only)
         goto end;
     }
 
+    cr_budget_acquire(art->pkt->size);
+
     avformat_close_input(&avf);
 
     av_freep(&art->data);
@@ -328,6 +339,33 @@ end:
     return ret;
 }
 
+int crip_art_from_stream(cyanrip_ctx *ctx, CRIPArt *art, const AVStream *st)
+{
+    const char *ext = guess_extension(st->codecpar->codec_id);
+    if (!ext || !st->attached_pic.size) {
+        cyanrip_log(ctx, 0, "Error reading attached picture: %s!\n",
+                    av_err2str(AVERROR(EINVAL)));
+        return AVERROR(EINVAL);
+    }
+
+    art->params = av_calloc(1, sizeof(AVCodecParameters));
+    art->extension = av_strdup(ext);
+    art->pkt = av_packet_clone(&st->attached_pic);
+    if (!art->params || !art->extension || !art->pkt) {
+        av_packet_free(&art->pkt);
+        crip_free_art(art);
+        return AVERROR(ENOMEM);
+    }
+
+    memcpy(art->params, st->codecpar, sizeof(AVCodecParameters));
+    art->params->extradata = NULL;
+    art->params->extradata_size = 0;
+
+    cr_budget_acquire(art->pkt->size);
+
+    return 0;
+}
+
 static int string_is_url(const char *src)
 {
     return !strncmp(src, "http://", 4)   ||
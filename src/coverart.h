@@ -16,9 +16,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <libavformat/avformat.h>
+
 #include "cyanrip_main.h"
 
 int crip_fill_coverart(cyanrip_ctx *ctx, int info_only);
 int crip_fill_track_coverart(cyanrip_ctx *ctx, int info_only);
+/* Takes the attached picture of an opened file's stream */
+int crip_art_from_stream(cyanrip_ctx *ctx, CRIPArt *art, const AVStream *st);
 int crip_save_art(cyanrip_ctx *ctx, CRIPArt *art, const cyanrip_out_fmt *fmt);
 void crip_free_art(CRIPArt *art);
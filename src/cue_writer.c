@@ -26,12 +26,12 @@ int cyanrip_cue_init(cyanrip_ctx *ctx)
                                       &crip_fmt_info[ctx->settings.outputs[i]],
                                       NULL);
 
-        ctx->cuefile[i] = fopen(cuefile, "wb+");
-
-        if (!ctx->cuefile[i]) {
+        int ret = cr_writer_open(&ctx->cuefile[i], cuefile, 0,
+                                 ctx->settings.writer_flags);
+        if (ret < 0) {
             cyanrip_log(ctx, 0, "Couldn't open path \"%s\" for writing: %s!\n"
                         "Invalid folder name? Try -D <folder>.\n",
-                        cuefile, av_err2str(AVERROR(errno)));
+                        cuefile, av_err2str(ret));
             av_freep(&cuefile);
             return 1;
         }
@@ -46,7 +46,8 @@ int cyanrip_cue_init(cyanrip_ctx *ctx)
     do {                                                                       \
         if (dict_get(DICT, TAG)) {                                             \
             for (int Z = 0; Z < ctx->settings.outputs_num; Z++)                \
-                fprintf(ctx->cuefile[Z], FORMAT, dict_get(DICT, TAG));         \
+                cr_writer_printf(ctx->cuefile[Z], FORMAT,                      \
+                                 dict_get(DICT, TAG));                         \
         }                                                                      \
     } while (0)
 
@@ -64,7 +65,7 @@ void cyanrip_cue_start(cyanrip_ctx *ctx)
                 char *tmp = av_strdup(d->key);
                 for (int i = 0; tmp[i]; i++)
                     tmp[i] = av_toupper(tmp[i]);
-                fprintf(ctx->cuefile[Z], "REM %s \"%s\"\n", tmp, d->value);
+                cr_writer_printf(ctx->cuefile[Z], "REM %s \"%s\"\n", tmp, d->value);
                 av_free(tmp);
             }
         }
@@ -80,6 +81,10 @@ void cyanrip_cue_track(cyanrip_ctx *ctx, cyanrip_track *t)
     char time_00[16];
     char time_01[16];
 
+    /* Not written when streaming outputs */
+    if (!ctx->cuefile[0])
+        return;
+
     /* Finish over the pregap which has been appended to the last track */
     const int write_appended_pregap = (
         t->pregap_lsn != CDIO_INVALID_LSN && t->pregap_lsn != t->start_lsn && t->pt
@@ -87,14 +92,14 @@ void cyanrip_cue_track(cyanrip_ctx *ctx, cyanrip_track *t)
         && t->merged_pregap_end == CDIO_INVALID_LSN);
     if (write_appended_pregap) {
         for (int Z = 0; Z < ctx->settings.outputs_num; Z++)
-            fprintf(ctx->cuefile[Z], "  TRACK %02d AUDIO\n", t->index);
+            cr_writer_printf(ctx->cuefile[Z], "  TRACK %02d AUDIO\n", t->index);
 
         CLOG("    TITLE \"%s\"\n", t->meta, "title");
         CLOG("    PERFORMER \"%s\"\n", t->meta, "artist");
 
         cyanrip_frames_to_cue(t->pregap_lsn - t->pt->start_lsn_sig, time_00);
         for (int Z = 0; Z < ctx->settings.outputs_num; Z++)
-            fprintf(ctx->cuefile[Z], "    INDEX 00 %s\n", time_00);
+            cr_writer_printf(ctx->cuefile[Z], "    INDEX 00 %s\n", time_00);
     }
 
     for (int Z = 0; Z < ctx->settings.outputs_num; Z++) {
@@ -110,12 +115,12 @@ void cyanrip_cue_track(cyanrip_ctx *ctx, cyanrip_track *t)
             }
         }
 
-        fprintf(ctx->cuefile[Z], "FILE \"%s\" %s\n", name,
+        cr_writer_printf(ctx->cuefile[Z], "FILE \"%s\" %s\n", name,
                 ctx->settings.outputs[Z] == CYANRIP_FORMAT_MP3 ? "MP3" :
                 t->track_is_data ? "BINARY" : "WAVE");
 
         if (!write_appended_pregap)
-            fprintf(ctx->cuefile[Z], "  TRACK %02d %s\n", t->number,
+            cr_writer_printf(ctx->cuefile[Z], "  TRACK %02d %s\n", t->number,
                     t->track_is_data ? "MODE1/2352" : "AUDIO");
 
         av_free(path);
@@ -140,17 +145,17 @@ void cyanrip_cue_track(cyanrip_ctx *ctx, cyanrip_track *t)
     for (int Z = 0; Z < ctx->settings.outputs_num; Z++) {
         if (t->preemphasis && !ctx->settings.deemphasis &&
             !ctx->settings.force_deemphasis)
-            fprintf(ctx->cuefile[Z], "    FLAGS PRE\n");
+            cr_writer_printf(ctx->cuefile[Z], "    FLAGS PRE\n");
 
         if (t->dropped_pregap_start != CDIO_INVALID_LSN &&
             t->dropped_pregap_start != t->start_lsn) {
-            fprintf(ctx->cuefile[Z], "    PREGAP %s\n",   time_00);
-            fprintf(ctx->cuefile[Z], "    INDEX 01 %s\n", time_01);
+            cr_writer_printf(ctx->cuefile[Z], "    PREGAP %s\n",   time_00);
+            cr_writer_printf(ctx->cuefile[Z], "    INDEX 01 %s\n", time_01);
         } else if (t->merged_pregap_end != CDIO_INVALID_LSN) {
-            fprintf(ctx->cuefile[Z], "    INDEX 00 %s\n", time_00);
-            fprintf(ctx->cuefile[Z], "    INDEX 01 %s\n", time_01);
+            cr_writer_printf(ctx->cuefile[Z], "    INDEX 00 %s\n", time_00);
+            cr_writer_printf(ctx->cuefile[Z], "    INDEX 01 %s\n", time_01);
         } else {
-            fprintf(ctx->cuefile[Z], "    INDEX 01 %s\n", time_01);
+            cr_writer_printf(ctx->cuefile[Z], "    INDEX 01 %s\n", time_01);
         }
     }
 }
@@ -161,7 +166,8 @@ void cyanrip_cue_end(cyanrip_ctx *ctx)
         if (!ctx->cuefile[i])
             continue;
 
-        fclose(ctx->cuefile[i]);
-        ctx->cuefile[i] = NULL;
+        int ret = cr_writer_close(&ctx->cuefile[i]);
+        if (ret < 0)
+            cyanrip_log(ctx, 0, "Error writing cue file: %s!\n", av_err2str(ret));
     }
 }
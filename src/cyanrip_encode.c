@@ -27,12 +27,24 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/opt.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/time.h>
 
 #include "fifo_frame.h"
 #include "fifo_packet.h"
 #include "cyanrip_encode.h"
 #include "cyanrip_log.h"
 #include "os_compat.h"
+#include "pool.h"
+#include "flac_stitch.h"
+#include "flac_tags.h"
+#include "deemph.h"
+#include "loudness.h"
+#include "journal.h"
+#include "writer.h"
+#include "verify.h"
+#include "manifest.h"
+#include "sink.h"
 
 #if CONFIG_BIG_ENDIAN
 #define AV_CODEC_ID_PCM_S16 AV_CODEC_ID_PCM_S16BE
@@ -44,39 +56,158 @@
 #define AV_CODEC_ID_PCM_F64 AV_CODEC_ID_PCM_F64LE
 #endif
 
+const cyanrip_out_fmt crip_fmt_info[] = {
+    [CYANRIP_FORMAT_FLAC]     = { "flac",     "FLAC", "flac",  "flac",  1, 11, 1, AV_CODEC_ID_FLAC,      },
+    [CYANRIP_FORMAT_MP3]      = { "mp3",      "MP3",  "mp3",   "mp3",   1,  0, 0, AV_CODEC_ID_MP3,       },
+    [CYANRIP_FORMAT_TTA]      = { "tta",      "TTA",  "tta",   "tta",   0,  0, 1, AV_CODEC_ID_TTA,       },
+    [CYANRIP_FORMAT_OPUS]     = { "opus",     "OPUS", "opus",  "ogg",   0, 10, 0, AV_CODEC_ID_OPUS,      },
+    [CYANRIP_FORMAT_AAC]      = { "aac",      "AAC",  "m4a",   "adts",  0,  0, 0, AV_CODEC_ID_AAC,       },
+    [CYANRIP_FORMAT_AAC_MP4]  = { "aac_mp4",  "AAC",  "mp4",   "mp4",   1,  0, 0, AV_CODEC_ID_AAC,       },
+    [CYANRIP_FORMAT_WAVPACK]  = { "wavpack",  "WV",   "wv",    "wv",    0,  3, 1, AV_CODEC_ID_WAVPACK,   },
+    [CYANRIP_FORMAT_VORBIS]   = { "vorbis",   "OGG",  "ogg",   "ogg",   0,  0, 0, AV_CODEC_ID_VORBIS,    },
+    [CYANRIP_FORMAT_ALAC]     = { "alac",     "ALAC", "m4a",   "ipod",  0,  2, 1, AV_CODEC_ID_ALAC,      },
+    [CYANRIP_FORMAT_ALAC_MP4] = { "alac_mp4", "ALAC", "mp4",   "mp4",   1,  2, 1, AV_CODEC_ID_ALAC,      },
+    [CYANRIP_FORMAT_WAV]      = { "wav",      "WAV",  "wav",   "wav",   0,  0, 1, AV_CODEC_ID_NONE,      },
+    [CYANRIP_FORMAT_OPUS_MP4] = { "opus_mp4", "OPUS", "mp4",   "mp4",   1, 10, 0, AV_CODEC_ID_OPUS,      },
+    [CYANRIP_FORMAT_PCM]      = { "pcm",      "PCM",  "pcm",   "s16le", 0,  0, 1, AV_CODEC_ID_NONE,      },
+};
+
+enum CRIPEncState {
+    CRIP_ENC_DONE = 0,  /* Nothing left to do, or never started */
+    CRIP_ENC_RUNNING,   /* Encoding queued frames */
+    CRIP_ENC_ENCODED,   /* All packets queued, waiting for writeout */
+};
+
+/* Sectors are gathered into frames this big before filtering and encoding */
+#define CRIP_PCM_FRAME_SECTORS 16
+#define CRIP_PCM_FRAME_BYTES (CRIP_PCM_FRAME_SECTORS*CDIO_CD_FRAMESIZE_RAW)
+
+/* Enough for a few seconds of audio */
+#define CRIP_ENC_MAX_QUEUED_FRAMES 24
+
+/* Codec frames per segment, and the most segments encoded at once */
+#define CRIP_ENC_SEGMENT_FRAMES 64
+#define CRIP_ENC_MAX_SEGMENTS 16
+
+/* A run of frames encoded on the pool by its own encoder */
+typedef struct CRIPEncSegment {
+    struct cyanrip_enc_ctx *s;
+    int64_t first_frame; /* Codec frame number of the first frame */
+    AVFrame *frames[CRIP_ENC_SEGMENT_FRAMES];
+    int nb_frames;
+    AVPacket **pkts;
+    int nb_pkts;
+    int done; /* Under the encoder's lock */
+    int ret;
+} CRIPEncSegment;
+
+static void free_segment(CRIPEncSegment **seg)
+{
+    if (!*seg)
+        return;
+
+    for (int i = 0; i < (*seg)->nb_frames; i++)
+        av_frame_free(&(*seg)->frames[i]);
+    for (int i = 0; i < (*seg)->nb_pkts; i++)
+        av_packet_free(&(*seg)->pkts[i]);
+    av_free((*seg)->pkts);
+
+    av_freep(seg);
+}
+
 struct cyanrip_enc_ctx {
     cyanrip_ctx *ctx;
     AVBufferRef *fifo;
-    pthread_t thread;
     AVFormatContext *avf;
-    SwrContext *swr;
+    AVAudioFifo *reframe; /* Converted audio not yet in a frame of the codec's size */
+    int64_t next_pts;
     AVCodecContext *out_avctx;
     atomic_int status;
     atomic_int quit;
     int audio_stream_index;
     cyanrip_track *t;
 
-    int mutex_held;
+    /* Encoding runs as jobs on the pool, one at a time per context */
     pthread_mutex_t lock;
+    pthread_cond_t cond;
+    enum CRIPEncState state;
+    int job_running;
+    int job_pending;
+    int writeout;
+    int flushing;
+    AVPacket *out_pkt;
 
     AVStream *st_aud;
     AVStream *st_img;
     const cyanrip_out_fmt *cfmt;
+    char *filename;
+    char *tmp_filename; /* Renamed to filename once done, unless discarded */
+    int discard;
     int separate_writeout;
-    AVBufferRef *packet_fifo;
+    int raw; /* Sectors are written as they are, there's no encoder */
+    int raw_ended;
+    CRJournal *journal; /* Packets held until writeout, FLAC gets its tags patched instead */
     AVPacket *cover_art_pkt;
+
+    /* Outputs which only differ by container get the packets of a single
+     * encoder. Mirrors have no encoder, frame FIFO or jobs of their own, the
+     * master muxes into them, and is always ended before them. */
+    cyanrip_enc_ctx *master;
+    cyanrip_enc_ctx *mirrors[CYANRIP_FORMATS_NB];
+    int nb_mirrors;
+
+    /* Codecs with independent frames can encode segments of a track in
+     * parallel, the packets are muxed in order once each one is done. */
+    int segmented;
+    int max_segments;
+    CRIPEncSegment *seg_fill; /* Being filled */
+    CRIPEncSegment *segs[CRIP_ENC_MAX_SEGMENTS]; /* Submitted, in order */
+    int nb_segs;
+    int segs_running; /* Under lock */
+    int64_t seg_next_frame;
+
+    /* FLAC frames need renumbering, and STREAMINFO covering all segments */
+    struct AVMD5 *flac_md5;
+    int flac_min_frame, flac_max_frame;
+    int64_t flac_samples;
+    uint8_t *flac_streaminfo;
+
+    /* Lossless packets get decoded back as they're muxed */
+    CRVerify *verify;
 };
 
 typedef struct cyanrip_filt_ctx {
-    /* Deemphasis, and HDCD decoding (not at once) */
     AVFilterGraph *graph;
     AVFilterContext *buffersink_ctx;
     AVFilterContext *buffersrc_ctx;
 } cyanrip_filt_ctx;
 
+/* A sample format conversion, shared by all outputs which need it */
+typedef struct CRIPConvGroup {
+    SwrContext *swr;
+    enum AVSampleFormat sample_fmt;
+    int sample_rate;
+    AVChannelLayout ch_layout;
+} CRIPConvGroup;
+
 struct cyanrip_dec_ctx {
-    cyanrip_filt_ctx filt;
-    cyanrip_filt_ctx peak;
+    /* HDCD decoding runs through a graph kept for the whole disc, deemphasis
+     * is done here (not at once) */
+    int deemphasis;
+    CRDeemph deemph;
+    AVBufferPool *deemph_pool;
+
+    CRLoudness loudness;
+
+    /* Set up on the first frame, as that's when the input format is known */
+    int conv_ready;
+    CRIPConvGroup conv[CYANRIP_FORMATS_NB];
+    int nb_conv;
+    int enc_conv[CYANRIP_FORMATS_NB]; /* 0 if the output takes frames as-is, group + 1 otherwise */
+
+    /* Frame being filled with sectors, its buffer comes from the pool */
+    AVBufferPool *pcm_pool;
+    AVFrame *pcm_frame;
 };
 
 void cyanrip_print_codecs(void)
@@ -249,7 +380,8 @@ static int pick_codec_sample_rate(const AVCodec *codec)
 
 static AVCodecContext *setup_out_avctx(cyanrip_ctx *ctx, AVFormatContext *avf,
                                        const AVCodec *codec, const cyanrip_out_fmt *cfmt,
-                                       int decode_hdcd, int deemphasis)
+                                       int compression_level, int decode_hdcd,
+                                       int deemphasis, int global_header)
 {
     AVCodecContext *avctx = avcodec_alloc_context3(codec);
     if (!avctx)
@@ -259,7 +391,7 @@ static AVCodecContext *setup_out_avctx(cyanrip_ctx *ctx, AVFormatContext *avf,
     avctx->bit_rate              = cfmt->lossless ? 0 : lrintf(ctx->settings.bitrate*1000.0f);
     avctx->sample_fmt            = pick_codec_sample_fmt(codec, decode_hdcd);
     avctx->ch_layout             = pick_codec_channel_layout(codec);
-    avctx->compression_level     = cfmt->compression_level;
+    avctx->compression_level     = compression_level;
     avctx->sample_rate           = pick_codec_sample_rate(codec);
     avctx->time_base             = (AVRational){ 1, avctx->sample_rate };
     avctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
@@ -269,7 +401,7 @@ static AVCodecContext *setup_out_avctx(cyanrip_ctx *ctx, AVFormatContext *avf,
     else if (cfmt->lossless)
         avctx->bits_per_raw_sample = 16;
 
-    if (avf->oformat->flags & AVFMT_GLOBALHEADER)
+    if (global_header || (avf->oformat->flags & AVFMT_GLOBALHEADER))
         avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     return avctx;
@@ -293,14 +425,21 @@ void cyanrip_free_dec_ctx(cyanrip_ctx *ctx, cyanrip_dec_ctx **s)
 
     cyanrip_dec_ctx *dec_ctx = *s;
 
-    cyanrip_free_filt_ctx(ctx, &dec_ctx->filt, 0);
-    cyanrip_free_filt_ctx(ctx, &dec_ctx->peak, 0);
+    av_buffer_pool_uninit(&dec_ctx->deemph_pool);
+
+    for (int i = 0; i < dec_ctx->nb_conv; i++) {
+        swr_free(&dec_ctx->conv[i].swr);
+        av_channel_layout_uninit(&dec_ctx->conv[i].ch_layout);
+    }
+
+    av_frame_free(&dec_ctx->pcm_frame);
+    /* Frames still queued in encoders keep the pool alive */
+    av_buffer_pool_uninit(&dec_ctx->pcm_pool);
 
     av_freep(s);
 }
 
-static int init_filtering(cyanrip_ctx *ctx, cyanrip_filt_ctx *s,
-                          int hdcd, int deemphasis, int peak)
+static int init_filtering(cyanrip_ctx *ctx, cyanrip_filt_ctx *s)
 {
     int ret = 0;
     AVFilterInOut *inputs = NULL;
@@ -325,41 +464,35 @@ static int init_filtering(cyanrip_ctx *ctx, cyanrip_filt_ctx *s,
         goto fail;
     }
 
-    if (!peak) {
-        const AVFilter *abuffersink = avfilter_get_by_name("abuffersink");
-        ret = avfilter_graph_create_filter(&s->buffersink_ctx, abuffersink, "out",
-                                           NULL, NULL, s->graph);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error creating filter sink: %s!\n", av_err2str(ret));
-            goto fail;
-        }
+    const AVFilter *abuffersink = avfilter_get_by_name("abuffersink");
+    ret = avfilter_graph_create_filter(&s->buffersink_ctx, abuffersink, "out",
+                                       NULL, NULL, s->graph);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error creating filter sink: %s!\n", av_err2str(ret));
+        goto fail;
+    }
 
-        static const enum AVSampleFormat out_sample_fmts_hdcd[] = { AV_SAMPLE_FMT_S32, -1 };
-        static const enum AVSampleFormat out_sample_fmts_deemph[] = { AV_SAMPLE_FMT_DBLP, -1 };
+    static const enum AVSampleFormat out_sample_fmts_hdcd[] = { AV_SAMPLE_FMT_S32, -1 };
 
-        ret = av_opt_set_int_list(s->buffersink_ctx, "sample_fmts",
-                                  hdcd ? out_sample_fmts_hdcd :
-                                  deemphasis ? out_sample_fmts_deemph :
-                                  NULL,
-                                  -1, AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error setting filter sample format: %s!\n", av_err2str(ret));
-            goto fail;
-        }
+    ret = av_opt_set_int_list(s->buffersink_ctx, "sample_fmts", out_sample_fmts_hdcd,
+                              -1, AV_OPT_SEARCH_CHILDREN);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error setting filter sample format: %s!\n", av_err2str(ret));
+        goto fail;
+    }
 
-        ret = av_opt_set(s->buffersink_ctx, "ch_layouts", "stereo", AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error setting filter channel layout: %s!\n", av_err2str(ret));
-            goto fail;
-        }
+    ret = av_opt_set(s->buffersink_ctx, "ch_layouts", "stereo", AV_OPT_SEARCH_CHILDREN);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error setting filter channel layout: %s!\n", av_err2str(ret));
+        goto fail;
+    }
 
-        static const int out_sample_rates[] = { 44100, -1 };
-        ret = av_opt_set_int_list(s->buffersink_ctx, "sample_rates", out_sample_rates, -1,
-                                  AV_OPT_SEARCH_CHILDREN);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error setting filter sample rate: %s!\n", av_err2str(ret));
-            goto fail;
-        }
+    static const int out_sample_rates[] = { 44100, -1 };
+    ret = av_opt_set_int_list(s->buffersink_ctx, "sample_rates", out_sample_rates, -1,
+                              AV_OPT_SEARCH_CHILDREN);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error setting filter sample rate: %s!\n", av_err2str(ret));
+        goto fail;
     }
 
     outputs = avfilter_inout_alloc();
@@ -372,24 +505,17 @@ static int init_filtering(cyanrip_ctx *ctx, cyanrip_filt_ctx *s,
     outputs->pad_idx       = 0;
     outputs->next          = NULL;
 
-    if (!peak) {
-        inputs = avfilter_inout_alloc();
-        if (!inputs) {
-            ret = AVERROR(ENOMEM);
-            goto fail;
-        }
-        inputs->name          = av_strdup("out");
-        inputs->filter_ctx    = s->buffersink_ctx;
-        inputs->pad_idx       = 0;
-        inputs->next          = NULL;
+    inputs = avfilter_inout_alloc();
+    if (!inputs) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
     }
+    inputs->name          = av_strdup("out");
+    inputs->filter_ctx    = s->buffersink_ctx;
+    inputs->pad_idx       = 0;
+    inputs->next          = NULL;
 
-    const char *filter_desc = hdcd ? "hdcd" :
-                              deemphasis ? "aemphasis=type=cd" :
-                              peak ? "ebur128=peak=true+sample,anullsink" :
-                              NULL;
-
-    ret = avfilter_graph_parse_ptr(s->graph, filter_desc, &inputs, &outputs, NULL);
+    ret = avfilter_graph_parse_ptr(s->graph, "hdcd", &inputs, &outputs, NULL);
     if (ret < 0) {
         cyanrip_log(ctx, 0, "Error parsing filter graph: %s!\n", av_err2str(ret));
         goto fail;
@@ -419,95 +545,290 @@ int cyanrip_create_dec_ctx(cyanrip_ctx *ctx, cyanrip_dec_ctx **s,
     if (!dec_ctx)
         return AVERROR(ENOMEM);
 
-    if ((ctx->settings.decode_hdcd) ||
-        (ctx->settings.deemphasis && t->preemphasis) ||
-        (ctx->settings.force_deemphasis)) {
+    if (!ctx->settings.decode_hdcd &&
+        ((ctx->settings.deemphasis && t->preemphasis) || ctx->settings.force_deemphasis)) {
+        dec_ctx->deemphasis = 1;
+        cr_deemph_init(&dec_ctx->deemph, 44100);
+    }
 
-        ret = init_filtering(ctx, &dec_ctx->filt,
-                             ctx->settings.decode_hdcd,
-                             (ctx->settings.deemphasis && t->preemphasis) || ctx->settings.force_deemphasis,
-                             0);
-        if (ret < 0)
-            goto fail;
+    cr_loudness_init(&dec_ctx->loudness, 44100);
+
+    *s = dec_ctx;
+
+    return ret;
+}
+
+static int setup_init_swr(cyanrip_ctx *ctx, CRIPConvGroup *g, const AVFrame *in)
+{
+    SwrContext *swr = swr_alloc();
+    if (!swr) {
+        cyanrip_log(ctx, 0, "Could not alloc swr context!\n");
+        return AVERROR(ENOMEM);
     }
 
-    ret = init_filtering(ctx, &dec_ctx->peak, 0, 0, 1);
-    if (ret < 0)
+    av_opt_set_int       (swr, "in_sample_rate",  in->sample_rate, 0);
+    av_opt_set_chlayout  (swr, "in_chlayout",     &in->ch_layout,  0);
+    av_opt_set_sample_fmt(swr, "in_sample_fmt",   in->format,      0);
+
+    av_opt_set_int       (swr, "out_sample_rate", g->sample_rate,  0);
+    av_opt_set_chlayout  (swr, "out_chlayout",    &g->ch_layout,   0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt",  g->sample_fmt,   0);
+
+    int ret = swr_init(swr);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Could not init swr context!\n");
+        swr_free(&swr);
+        return ret;
+    }
+
+    g->swr = swr;
+
+    return 0;
+}
+
+/* Groups outputs by what they need the input converted to */
+static int init_conversion(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                           int num_enc, cyanrip_dec_ctx *dec_ctx,
+                           const AVFrame *in)
+{
+    int ret;
+
+    for (int i = 0; i < num_enc; i++) {
+        if (enc_ctx[i]->master || enc_ctx[i]->raw)
+            continue;
+
+        AVCodecContext *avctx = enc_ctx[i]->out_avctx;
+
+        if (avctx->sample_fmt == in->format &&
+            avctx->sample_rate == in->sample_rate &&
+            !av_channel_layout_compare(&avctx->ch_layout, &in->ch_layout))
+            continue;
+
+        int j;
+        for (j = 0; j < dec_ctx->nb_conv; j++) {
+            CRIPConvGroup *g = &dec_ctx->conv[j];
+            if (avctx->sample_fmt == g->sample_fmt &&
+                avctx->sample_rate == g->sample_rate &&
+                !av_channel_layout_compare(&avctx->ch_layout, &g->ch_layout))
+                break;
+        }
+
+        if (j == dec_ctx->nb_conv) {
+            CRIPConvGroup *g = &dec_ctx->conv[j];
+            g->sample_fmt = avctx->sample_fmt;
+            g->sample_rate = avctx->sample_rate;
+            if ((ret = av_channel_layout_copy(&g->ch_layout, &avctx->ch_layout)) < 0)
+                return ret;
+            dec_ctx->nb_conv++;
+            if ((ret = setup_init_swr(ctx, g, in)) < 0)
+                return ret;
+        }
+
+        dec_ctx->enc_conv[i] = j + 1;
+    }
+
+    dec_ctx->conv_ready = 1;
+
+    return 0;
+}
+
+/* Converts a frame, or drains the converter if in is NULL, *out is left
+ * NULL if nothing came out */
+static int convert_frame(cyanrip_ctx *ctx, CRIPConvGroup *g,
+                         const AVFrame *in, AVFrame **out)
+{
+    int ret;
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        cyanrip_log(ctx, 0, "Error allocating frame!\n");
+        return AVERROR(ENOMEM);
+    }
+
+    frame->format = g->sample_fmt;
+    frame->sample_rate = g->sample_rate;
+    if ((ret = av_channel_layout_copy(&frame->ch_layout, &g->ch_layout)) < 0)
         goto fail;
 
-    *s = dec_ctx;
+    /* Allocates the buffer itself */
+    ret = swr_convert_frame(g->swr, frame, in);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error converting audio: %s!\n", av_err2str(ret));
+        goto fail;
+    }
+
+    if (frame->nb_samples)
+        *out = frame;
+    else
+        av_frame_free(&frame);
 
     return 0;
 
 fail:
-    cyanrip_free_dec_ctx(ctx, &dec_ctx);
+    av_frame_free(&frame);
     return ret;
 }
 
-static int push_frame_to_encs(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
-                              int num_enc, AVFrame *frame)
+static void kick_encoding(cyanrip_enc_ctx *s);
+
+/* Frames are always the gathered sectors here, a NULL one writes the trailer */
+static int write_raw(cyanrip_ctx *ctx, cyanrip_enc_ctx *s, const AVFrame *frame)
 {
     int ret;
 
+    if (s->raw_ended || atomic_load(&s->quit))
+        return 0;
+
+    if (!frame) {
+        s->raw_ended = 1;
+        ret = av_write_trailer(s->avf);
+    } else {
+        avio_write(s->avf->pb, frame->data[0], frame->nb_samples << 2);
+        ret = s->avf->pb->error;
+    }
+
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error writing to file: %s!\n", av_err2str(ret));
+        atomic_store(&s->status, ret);
+    }
+
+    return ret;
+}
+
+static int push_frame_to_enc(cyanrip_ctx *ctx, cyanrip_enc_ctx *s,
+                             AVFrame *frame)
+{
+    int ret = cr_frame_fifo_push(s->fifo, frame);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error pushing frame to FIFO: %s!\n", av_err2str(ret));
+        return ret;
+    }
+
+    kick_encoding(s);
+
+    return 0;
+}
+
+/* Each distinct conversion runs once, outputs get references to its result */
+static int push_frame_to_encs(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                              int num_enc, cyanrip_dec_ctx *dec_ctx,
+                              AVFrame *frame)
+{
+    int ret = 0;
+    AVFrame *conv[CYANRIP_FORMATS_NB] = { NULL };
+
+    if (frame && !dec_ctx->conv_ready &&
+        (ret = init_conversion(ctx, enc_ctx, num_enc, dec_ctx, frame)) < 0)
+        return ret;
+
+    for (int i = 0; i < dec_ctx->nb_conv; i++)
+        if ((ret = convert_frame(ctx, &dec_ctx->conv[i], frame, &conv[i])) < 0)
+            goto end;
+
     for (int i = 0; i < num_enc; i++) {
+        if (enc_ctx[i]->master)
+            continue;
+
         int status = atomic_load(&enc_ctx[i]->status);
-        if (status < 0)
-            return status;
+        if (status < 0) {
+            ret = status;
+            goto end;
+        }
 
-        ret = cr_frame_fifo_push(enc_ctx[i]->fifo, frame);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error pushing frame to FIFO: %s!\n", av_err2str(ret));
-            return ret;
+        if (enc_ctx[i]->raw) {
+            if ((ret = write_raw(ctx, enc_ctx[i], frame)) < 0)
+                goto end;
+            continue;
         }
+
+        int g = dec_ctx->enc_conv[i];
+        AVFrame *out = g ? conv[g - 1] : frame;
+
+        /* Converters may hold on to samples */
+        if (out && (ret = push_frame_to_enc(ctx, enc_ctx[i], out)) < 0)
+            goto end;
+
+        /* EOF, after whatever was drained */
+        if (!frame && (ret = push_frame_to_enc(ctx, enc_ctx[i], NULL)) < 0)
+            goto end;
     }
 
-    return 0;
+end:
+    for (int i = 0; i < dec_ctx->nb_conv; i++)
+        av_frame_free(&conv[i]);
+
+    return ret;
 }
 
-static int filter_frame(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
-                        int num_enc, cyanrip_dec_ctx *dec_ctx, AVFrame *frame,
-                        int calc_global_peak)
+static int deemph_frame(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                        int num_enc, cyanrip_dec_ctx *dec_ctx, const AVFrame *frame)
 {
-    int ret = 0;
-    AVFrame *dec_frame = NULL;
+    int ret;
 
-    ret = av_buffersrc_add_frame_flags(dec_ctx->peak.buffersrc_ctx, frame,
-                                       AV_BUFFERSRC_FLAG_NO_CHECK_FORMAT |
-                                       AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
-    if (ret < 0) {
-        cyanrip_log(ctx, 0, "Error filtering frame: %s!\n", av_err2str(ret));
-        goto fail;
+    if (!frame)
+        return push_frame_to_encs(ctx, enc_ctx, num_enc, dec_ctx, NULL);
+
+    /* Planes are a frame's worth of doubles, buffers get reused like the input's */
+    if (!dec_ctx->deemph_pool) {
+        dec_ctx->deemph_pool = av_buffer_pool_init(CRIP_PCM_FRAME_SECTORS*(CDIO_CD_FRAMESIZE_RAW >> 2)*
+                                                   sizeof(double), NULL);
+        if (!dec_ctx->deemph_pool)
+            return AVERROR(ENOMEM);
     }
 
-    if (frame && calc_global_peak) {
-        ret = av_buffersrc_add_frame_flags(ctx->peak_ctx->peak.buffersrc_ctx, frame,
-                                           AV_BUFFERSRC_FLAG_NO_CHECK_FORMAT |
-                                           AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error filtering frame: %s!\n", av_err2str(ret));
-            goto fail;
+    AVFrame *out = av_frame_alloc();
+    if (!out)
+        return AVERROR(ENOMEM);
+
+    for (int c = 0; c < 2; c++) {
+        out->buf[c] = av_buffer_pool_get(dec_ctx->deemph_pool);
+        if (!out->buf[c]) {
+            av_frame_free(&out);
+            return AVERROR(ENOMEM);
         }
+        out->data[c] = out->buf[c]->data;
     }
 
-    if (!dec_ctx->filt.buffersrc_ctx)
-        return push_frame_to_encs(ctx, enc_ctx, num_enc, frame);
+    out->format = AV_SAMPLE_FMT_DBLP;
+    out->sample_rate = frame->sample_rate;
+    out->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+    out->nb_samples = frame->nb_samples;
+    out->extended_data = out->data;
+    out->linesize[0] = out->buf[0]->size;
+
+    cr_deemph_process(&dec_ctx->deemph, (double *const *)out->data,
+                      (const int16_t *)frame->data[0], frame->nb_samples);
+
+    ret = push_frame_to_encs(ctx, enc_ctx, num_enc, dec_ctx, out);
+    av_frame_free(&out);
+
+    return ret;
+}
+
+static int filter_frame(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                        int num_enc, cyanrip_dec_ctx *dec_ctx, AVFrame *frame)
+{
+    int ret = 0;
+    AVFrame *dec_frame = NULL;
+
+    if (frame)
+        cr_loudness_add(&dec_ctx->loudness, (const int16_t *)frame->data[0],
+                        frame->nb_samples);
+
+    if (dec_ctx->deemphasis)
+        return deemph_frame(ctx, enc_ctx, num_enc, dec_ctx, frame);
+    else if (!ctx->hdcd_filt || !frame)
+        return push_frame_to_encs(ctx, enc_ctx, num_enc, dec_ctx, frame);
 
-    ret = av_buffersrc_add_frame_flags(dec_ctx->filt.buffersrc_ctx, frame,
+    /* The graph outlives the track, so it never sees an EOF. HDCD decoding
+     * has no delay, pushing the frame through gives all of its output. */
+    ret = av_buffersrc_add_frame_flags(ctx->hdcd_filt->buffersrc_ctx, frame,
                                        AV_BUFFERSRC_FLAG_NO_CHECK_FORMAT |
-                                       AV_BUFFERSRC_FLAG_KEEP_REF);
+                                       AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
     if (ret < 0) {
         cyanrip_log(ctx, 0, "Error filtering frame: %s!\n", av_err2str(ret));
         goto fail;
     }
 
-    ret = avfilter_graph_request_oldest(dec_ctx->filt.graph);
-    if (ret == AVERROR_EOF) {
-        return push_frame_to_encs(ctx, enc_ctx, num_enc, NULL);
-    } else if (ret < 0) {
-        cyanrip_log(ctx, 0, "Error filtering frame: %s!\n", av_err2str(ret));
-        goto fail;
-    }
-
     while (1) {
         dec_frame = av_frame_alloc();
         if (!dec_frame) {
@@ -515,22 +836,18 @@ static int filter_frame(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
             goto fail;
         }
 
-        ret = av_buffersink_get_frame_flags(dec_ctx->filt.buffersink_ctx, dec_frame,
+        ret = av_buffersink_get_frame_flags(ctx->hdcd_filt->buffersink_ctx, dec_frame,
                                             AV_BUFFERSINK_FLAG_NO_REQUEST);
         if (ret == AVERROR(EAGAIN)) {
             av_frame_free(&dec_frame);
             ret = 0;
             break;
-        } else if (ret == AVERROR_EOF) {
-            av_frame_free(&dec_frame);
-            ret = 0;
-            return push_frame_to_encs(ctx, enc_ctx, num_enc, NULL);
         } else if (ret < 0) {
             cyanrip_log(ctx, 0, "Error filtering frame: %s!\n", av_err2str(ret));
             goto fail;
         }
 
-        push_frame_to_encs(ctx, enc_ctx, num_enc, dec_frame);
+        push_frame_to_encs(ctx, enc_ctx, num_enc, dec_ctx, dec_frame);
         av_frame_free(&dec_frame);
     }
 
@@ -538,46 +855,87 @@ fail:
     return ret;
 }
 
-int cyanrip_send_pcm_to_encoders(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
-                                 int num_enc, cyanrip_dec_ctx *dec_ctx,
-                                 const uint8_t *data, int bytes,
-                                 int calc_global_peak)
+static int get_pcm_frame(cyanrip_ctx *ctx, cyanrip_dec_ctx *dec_ctx)
 {
-    int ret = 0;
-    AVFrame *frame = NULL;
+    if (!dec_ctx->pcm_pool) {
+        dec_ctx->pcm_pool = av_buffer_pool_init(CRIP_PCM_FRAME_BYTES, NULL);
+        if (!dec_ctx->pcm_pool)
+            goto fail;
+    }
 
-    if (!data && !bytes)
-        goto send;
-    else if (!bytes)
-        return 0;
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        goto fail;
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        cyanrip_log(ctx, 0, "Error allocating frame!\n");
-        ret = AVERROR(ENOMEM);
+    frame->buf[0] = av_buffer_pool_get(dec_ctx->pcm_pool);
+    if (!frame->buf[0]) {
+        av_frame_free(&frame);
         goto fail;
     }
 
     frame->sample_rate = 44100;
-    frame->nb_samples = bytes >> 2;
+    frame->nb_samples = 0;
     frame->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
     frame->format = AV_SAMPLE_FMT_S16;
+    frame->data[0] = frame->buf[0]->data;
+    frame->extended_data = frame->data;
+    frame->linesize[0] = CRIP_PCM_FRAME_BYTES;
 
-    ret = av_frame_get_buffer(frame, 0);
-    if (ret < 0) {
-        cyanrip_log(ctx, 0, "Error allocating frame: %s!\n", av_err2str(ret));
-        goto fail;
-    }
+    dec_ctx->pcm_frame = frame;
 
-    memcpy(frame->data[0], data, bytes);
+    return 0;
 
-send:
-    ret = filter_frame(ctx, enc_ctx, num_enc, dec_ctx, frame, calc_global_peak);
 fail:
+    cyanrip_log(ctx, 0, "Error allocating frame!\n");
+    return AVERROR(ENOMEM);
+}
+
+static int send_pcm_frame(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                          int num_enc, cyanrip_dec_ctx *dec_ctx)
+{
+    AVFrame *frame = dec_ctx->pcm_frame;
+    dec_ctx->pcm_frame = NULL;
+
+    int ret = filter_frame(ctx, enc_ctx, num_enc, dec_ctx, frame);
     av_frame_free(&frame);
+
     return ret;
 }
 
+int cyanrip_send_pcm_to_encoders(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                                 int num_enc, cyanrip_dec_ctx *dec_ctx,
+                                 const uint8_t *data, int bytes)
+{
+    int ret = 0;
+
+    /* Flush, send out whatever was gathered first */
+    if (!data && !bytes) {
+        if (dec_ctx->pcm_frame && (ret = send_pcm_frame(ctx, enc_ctx, num_enc, dec_ctx)) < 0)
+            return ret;
+        return filter_frame(ctx, enc_ctx, num_enc, dec_ctx, NULL);
+    }
+
+    while (bytes > 0) {
+        if (!dec_ctx->pcm_frame && (ret = get_pcm_frame(ctx, dec_ctx)) < 0)
+            return ret;
+
+        AVFrame *frame = dec_ctx->pcm_frame;
+        int offset = frame->nb_samples << 2;
+        int len = FFMIN(bytes, CRIP_PCM_FRAME_BYTES - offset);
+
+        memcpy(frame->data[0] + offset, data, len);
+        frame->nb_samples += len >> 2;
+        data += len;
+        bytes -= len;
+
+        if ((frame->nb_samples << 2) == CRIP_PCM_FRAME_BYTES &&
+            (ret = send_pcm_frame(ctx, enc_ctx, num_enc, dec_ctx)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
 void cyanrip_immediate_stop_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
 {
     for (int i = 0; i < ctx->settings.outputs_num; i++) {
@@ -587,259 +945,285 @@ void cyanrip_immediate_stop_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
     }
 }
 
-int cyanrip_reset_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
+void cyanrip_discard_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **s)
 {
-    cyanrip_immediate_stop_encoding(ctx, t);
-
-    for (int i = 0; i < ctx->settings.outputs_num; i++) {
-        cyanrip_enc_ctx *s = t->enc_ctx[i];
-
-        if (s->mutex_held) {
-            pthread_mutex_unlock(&s->lock);
-            s->mutex_held = 0;
-        }
-    }
+    if (!s || !*s)
+        return;
 
-    for (int i = 0; i < ctx->settings.outputs_num; i++)
-        cyanrip_end_track_encoding(&t->enc_ctx[i]);
+    atomic_store(&(*s)->quit, 1);
+    (*s)->discard = 1;
 
-    for (int i = 0; i < ctx->settings.outputs_num; i++)
-        cyanrip_init_track_encoding(ctx, &t->enc_ctx[i], t,
-                                    ctx->settings.outputs[i]);
+    cyanrip_end_track_encoding(s);
+}
 
-    return 0;
+static void log_loudness(cyanrip_ctx *ctx, const CRLoudnessStats *st)
+{
+    cyanrip_log(ctx, 0, "Summary:\n\n"
+                "  Integrated loudness:\n"
+                "    I:         %5.1f LUFS\n"
+                "    Threshold: %5.1f LUFS\n\n"
+                "  Loudness range:\n"
+                "    LRA:       %5.1f LU\n"
+                "    Threshold: %5.1f LUFS\n"
+                "    LRA low:   %5.1f LUFS\n"
+                "    LRA high:  %5.1f LUFS\n\n"
+                "  Sample peak:\n"
+                "    Peak:      %5.1f dBFS\n\n"
+                "  True peak:\n"
+                "    Peak:      %5.1f dBFS\n",
+                st->integrated, st->integrated_thresh,
+                st->range, st->range_thresh, st->lra_low, st->lra_high,
+                st->sample_peak, st->true_peak);
 }
 
 int cyanrip_finalize_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
 {
-    AVFilterContext *filt_ctx = t->dec_ctx->peak.graph->filters[1];
+    CRLoudnessStats st;
 
-    av_opt_get_double(filt_ctx, "integrated", AV_OPT_SEARCH_CHILDREN, &t->ebu_integrated);
-    av_opt_get_double(filt_ctx, "range", AV_OPT_SEARCH_CHILDREN, &t->ebu_range);
-    av_opt_get_double(filt_ctx, "lra_low", AV_OPT_SEARCH_CHILDREN, &t->ebu_lra_low);
-    av_opt_get_double(filt_ctx, "lra_high", AV_OPT_SEARCH_CHILDREN, &t->ebu_lra_high);
-    av_opt_get_double(filt_ctx, "sample_peak", AV_OPT_SEARCH_CHILDREN, &t->ebu_sample_peak);
-    av_opt_get_double(filt_ctx, "true_peak", AV_OPT_SEARCH_CHILDREN, &t->ebu_true_peak);
+    cr_loudness_stats(&t->dec_ctx->loudness, &st);
+    t->ebu_integrated  = st.integrated;
+    t->ebu_range       = st.range;
+    t->ebu_lra_low     = st.lra_low;
+    t->ebu_lra_high    = st.lra_high;
+    t->ebu_sample_peak = st.sample_peak;
+    t->ebu_true_peak   = st.true_peak;
 
-    cyanrip_free_filt_ctx(ctx, &t->dec_ctx->peak, 1);
-    if (ctx->settings.decode_hdcd)
-        cyanrip_log(ctx, 0, "\n  ");
-    else
-        cyanrip_log(ctx, 0, "\n");
-    cyanrip_free_filt_ctx(ctx, &t->dec_ctx->filt, ctx->settings.decode_hdcd);
+    log_loudness(ctx, &st);
+    cyanrip_log(ctx, 0, "\n");
+
+    /* Only the pass that made it counts towards the album */
+    if (ctx->loudness)
+        cr_loudness_merge(ctx->loudness, &t->dec_ctx->loudness);
 
     return 0;
 }
 
-int cyanrip_initialize_ebur128(cyanrip_ctx *ctx)
+int cyanrip_initialize_filtering(cyanrip_ctx *ctx)
 {
-    int ret = 0;
+    int ret;
 
-    cyanrip_dec_ctx *dec_ctx = av_mallocz(sizeof(*dec_ctx));
-    if (!dec_ctx)
+    if (!ctx->settings.decode_hdcd)
+        return 0;
+
+    ctx->hdcd_filt = av_mallocz(sizeof(*ctx->hdcd_filt));
+    if (!ctx->hdcd_filt)
         return AVERROR(ENOMEM);
-    ctx->peak_ctx = dec_ctx;
 
-    ret = init_filtering(ctx, &dec_ctx->peak, 0, 0, 1);
+    ret = init_filtering(ctx, ctx->hdcd_filt);
     if (ret < 0)
-        goto fail;
-
-    return 0;
+        cyanrip_finalize_filtering(ctx, 0);
 
-fail:
-    cyanrip_finalize_ebur128(ctx, 0);
     return ret;
 }
 
-int cyanrip_finalize_ebur128(cyanrip_ctx *ctx, int log)
+void cyanrip_finalize_filtering(cyanrip_ctx *ctx, int log)
 {
-    cyanrip_dec_ctx *dec_ctx = ctx->peak_ctx;
+    if (!ctx->hdcd_filt)
+        return;
 
-    if (!log)
-        goto end;
-
-    AVFilterContext *filt_ctx = dec_ctx->peak.graph->filters[1];
-
-    int ret = av_buffersrc_add_frame_flags(dec_ctx->peak.buffersrc_ctx, NULL,
-                                           AV_BUFFERSRC_FLAG_NO_CHECK_FORMAT |
-                                           AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
-    if (ret < 0) {
-        cyanrip_log(ctx, 0, "Error filtering frame: %s!\n", av_err2str(ret));
-        cyanrip_free_filt_ctx(ctx, &dec_ctx->peak, 0);
-        av_freep(ctx->peak_ctx);
-        return ret;
-    }
-
-    av_opt_get_double(filt_ctx, "integrated", AV_OPT_SEARCH_CHILDREN, &ctx->ebu_integrated);
-    av_opt_get_double(filt_ctx, "range", AV_OPT_SEARCH_CHILDREN, &ctx->ebu_range);
-    av_opt_get_double(filt_ctx, "lra_low", AV_OPT_SEARCH_CHILDREN, &ctx->ebu_lra_low);
-    av_opt_get_double(filt_ctx, "lra_high", AV_OPT_SEARCH_CHILDREN, &ctx->ebu_lra_high);
-    av_opt_get_double(filt_ctx, "sample_peak", AV_OPT_SEARCH_CHILDREN, &ctx->ebu_sample_peak);
-    av_opt_get_double(filt_ctx, "true_peak", AV_OPT_SEARCH_CHILDREN, &ctx->ebu_true_peak);
+    /* Its stats cover the whole disc */
+    if (log)
+        cyanrip_log(ctx, 0, "HDCD ");
+    cyanrip_free_filt_ctx(ctx, ctx->hdcd_filt, log);
+    if (log)
+        cyanrip_log(ctx, 0, "\n");
 
-    cyanrip_log(ctx, 0, "Album Loudness ");
+    av_freep(&ctx->hdcd_filt);
+}
 
-end:
-    if (ctx->peak_ctx) {
-        cyanrip_free_filt_ctx(ctx, &ctx->peak_ctx->peak, log);
-        if (log)
-            cyanrip_log(ctx, 0, "\n");
-    }
+int cyanrip_initialize_ebur128(cyanrip_ctx *ctx)
+{
+    ctx->loudness = av_malloc(sizeof(*ctx->loudness));
+    if (!ctx->loudness)
+        return AVERROR(ENOMEM);
 
-    av_freep(&ctx->peak_ctx);
+    cr_loudness_init(ctx->loudness, 44100);
 
     return 0;
 }
 
-static SwrContext *setup_init_swr(cyanrip_ctx *ctx, AVCodecContext *out_avctx,
-                                  int hdcd, int deemphasis)
+int cyanrip_finalize_ebur128(cyanrip_ctx *ctx, int log)
 {
-    SwrContext *swr = swr_alloc();
-    if (!swr) {
-        cyanrip_log(ctx, 0, "Could not alloc swr context!\n");
-        return NULL;
+    if (log && ctx->loudness) {
+        CRLoudnessStats st;
+        cr_loudness_stats(ctx->loudness, &st);
+        ctx->ebu_integrated  = st.integrated;
+        ctx->ebu_range       = st.range;
+        ctx->ebu_lra_low     = st.lra_low;
+        ctx->ebu_lra_high    = st.lra_high;
+        ctx->ebu_sample_peak = st.sample_peak;
+        ctx->ebu_true_peak   = st.true_peak;
+
+        cyanrip_log(ctx, 0, "Album Loudness ");
+        log_loudness(ctx, &st);
+        cyanrip_log(ctx, 0, "\n");
     }
 
-    AVChannelLayout ichl = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
-    enum AVSampleFormat in_sample_fmt = hdcd ? AV_SAMPLE_FMT_S32 :
-                                        (deemphasis ? AV_SAMPLE_FMT_DBLP :
-                                                      AV_SAMPLE_FMT_S16);
-
-    av_opt_set_int       (swr, "in_sample_rate",  44100,                  0);
-    av_opt_set_chlayout  (swr, "in_chlayout",     &ichl,                  0);
-    av_opt_set_sample_fmt(swr, "in_sample_fmt",   in_sample_fmt,          0);
-
-    av_opt_set_int       (swr, "out_sample_rate", out_avctx->sample_rate, 0);
-    av_opt_set_chlayout  (swr, "out_chlayout",    &out_avctx->ch_layout,  0);
-    av_opt_set_sample_fmt(swr, "out_sample_fmt",  out_avctx->sample_fmt,  0);
-
-    if (swr_init(swr) < 0) {
-        cyanrip_log(ctx, 0, "Could not init swr context!\n");
-        swr_free(&swr);
-        return NULL;
-    }
+    av_freep(&ctx->loudness);
 
-    return swr;
+    return 0;
 }
 
-static int64_t get_next_audio_pts(cyanrip_enc_ctx *ctx, AVFrame *in)
+/* Checks if the queue has enough for another frame before taking more input */
+static int audio_frame_ready(cyanrip_enc_ctx *ctx)
 {
-    const int64_t m = (int64_t)44100 * ctx->out_avctx->sample_rate;
-    const int64_t b = (int64_t)ctx->out_avctx->time_base.num * m;
-    const int64_t c = ctx->out_avctx->time_base.den;
-    const int64_t in_pts = in ? in->pts : AV_NOPTS_VALUE;
-
-    int64_t npts = in_pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale(in_pts, b, c);
-
-    npts = swr_next_pts(ctx->swr, npts);
-
-    int64_t out_pts = av_rescale(npts, c, b);
-
-    return out_pts;
+    int frame_size = ctx->out_avctx->frame_size;
+    return frame_size && av_audio_fifo_size(ctx->reframe) >= frame_size;
 }
 
+/* Input is already converted, all that's left is to cut it into frames of
+ * the size the codec wants */
 static int audio_process_frame(cyanrip_enc_ctx *ctx, AVFrame **input, int flush)
 {
     int ret;
+    AVFrame *in = *input;
+    AVFrame *out_frame = NULL;
     int frame_size = ctx->out_avctx->frame_size;
+    int queued = av_audio_fifo_size(ctx->reframe);
 
-    int64_t resampled_frame_pts = get_next_audio_pts(ctx, *input);
-
-    /* Resample the frame, can be NULL */
-    ret = swr_convert_frame(ctx->swr, NULL, *input);
-
-    av_frame_free(input);
+    *input = NULL;
 
-    if (ret < 0) {
-        av_log(ctx, AV_LOG_ERROR, "Error pushing audio for resampling: %s!\n", av_err2str(ret));
-        return ret;
+    /* Passthrough if it's the right size already */
+    if (in && !queued && (!frame_size || in->nb_samples == frame_size)) {
+        out_frame = in;
+        goto end;
     }
 
-    /* Not enough output samples to get a frame */
-    if (!flush) {
-        int out_samples = swr_get_out_samples(ctx->swr, 0);
-        if (!frame_size && out_samples)
-            frame_size = out_samples;
-        else if (!out_samples || ((frame_size) && (out_samples < frame_size)))
-            return AVERROR(EAGAIN);
-    } else if (!frame_size && ctx->swr) {
-        frame_size = swr_get_out_samples(ctx->swr, 0);
-        if (!frame_size)
-            return 0;
+    if (in) {
+        ret = av_audio_fifo_write(ctx->reframe, (void **)in->extended_data, in->nb_samples);
+        av_frame_free(&in);
+        if (ret < 0) {
+            cyanrip_log(ctx->ctx, 0, "Error queueing audio: %s!\n", av_err2str(ret));
+            return ret;
+        }
+        queued = av_audio_fifo_size(ctx->reframe);
     }
 
-    if (flush && !ctx->swr)
-        return 0;
+    /* Not enough samples to get a frame, or fully drained once flushing */
+    if (!queued)
+        return flush ? 0 : AVERROR(EAGAIN);
+    else if (!flush && frame_size && queued < frame_size)
+        return AVERROR(EAGAIN);
 
-    AVFrame *out_frame = NULL;
     if (!(out_frame = av_frame_alloc())) {
-        av_log(ctx, AV_LOG_ERROR, "Error allocating frame!\n");
+        cyanrip_log(ctx->ctx, 0, "Error allocating frame!\n");
         return AVERROR(ENOMEM);
     }
 
-    out_frame->format                = ctx->out_avctx->sample_fmt;
-    out_frame->ch_layout             = ctx->out_avctx->ch_layout;
-    out_frame->sample_rate           = ctx->out_avctx->sample_rate;
-    out_frame->pts                   = resampled_frame_pts;
+    out_frame->format      = ctx->out_avctx->sample_fmt;
+    out_frame->sample_rate = ctx->out_avctx->sample_rate;
+    out_frame->nb_samples  = frame_size ? FFMIN(frame_size, queued) : queued;
 
-    /* SWR sets this field to whatever it can output if it can't this much */
-    out_frame->nb_samples            = frame_size;
+    ret = av_channel_layout_copy(&out_frame->ch_layout, &ctx->out_avctx->ch_layout);
+    if (ret < 0)
+        goto fail;
 
     /* Get frame buffer */
     ret = av_frame_get_buffer(out_frame, 0);
     if (ret < 0) {
-        av_log(ctx, AV_LOG_ERROR, "Error allocating frame: %s!\n", av_err2str(ret));
-        av_frame_free(&out_frame);
-        return ret;
+        cyanrip_log(ctx->ctx, 0, "Error allocating frame: %s!\n", av_err2str(ret));
+        goto fail;
     }
 
-    /* Resample */
-    ret = swr_convert_frame(ctx->swr, out_frame, NULL);
+    ret = av_audio_fifo_read(ctx->reframe, (void **)out_frame->extended_data,
+                             out_frame->nb_samples);
     if (ret < 0) {
-        av_log(ctx, AV_LOG_ERROR, "Error pulling resampled audio: %s!\n", av_err2str(ret));
-        av_frame_free(&out_frame);
-        return ret;
+        cyanrip_log(ctx->ctx, 0, "Error dequeueing audio: %s!\n", av_err2str(ret));
+        goto fail;
     }
 
-    /* swr has been drained */
-    if (!out_frame->nb_samples) {
-        av_frame_free(&out_frame);
-        swr_free(&ctx->swr);
-    }
+end:
+    /* Timebase is 1/sample_rate */
+    out_frame->pts = ctx->next_pts;
+    ctx->next_pts += out_frame->nb_samples;
 
     *input = out_frame;
 
     return 0;
+
+fail:
+    av_frame_free(&out_frame);
+    return ret;
 }
 
 int cyanrip_end_track_encoding(cyanrip_enc_ctx **s)
 {
     cyanrip_enc_ctx *ctx;
+    int ret;
     if (!s || !*s)
         return 0;
 
     ctx = *s;
 
-    if (ctx->mutex_held) {
+    pthread_mutex_lock(&ctx->lock);
+    int active = ctx->state != CRIP_ENC_DONE || ctx->job_running || ctx->segs_running;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (active) {
+        /* Send EOF, needed in case we haven't sent it yet and the user cancels. */
+        cr_frame_fifo_push(ctx->fifo, NULL);
+        cyanrip_writeout_track(ctx->ctx, ctx);
+
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->state != CRIP_ENC_DONE || ctx->job_running || ctx->segs_running)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
         pthread_mutex_unlock(&ctx->lock);
-        ctx->mutex_held = 0;
     }
 
-    /* Send EOF, needed in case we haven't sent it yet and the user cancels. */
-    cr_frame_fifo_push(ctx->fifo, NULL);
-    pthread_join(ctx->thread, NULL);
+    free_segment(&ctx->seg_fill);
+    for (int i = 0; i < ctx->nb_segs; i++)
+        free_segment(&ctx->segs[i]);
+    av_freep(&ctx->flac_md5);
+    av_freep(&ctx->flac_streaminfo);
+    cr_verify_free(&ctx->verify);
+
+    /* Mirrors are complete, and have nothing left to forward to */
+    for (int i = 0; i < ctx->nb_mirrors; i++)
+        ctx->mirrors[i]->master = NULL;
+
+    /* Leave a valid file behind if ripping stopped early */
+    if (ctx->raw && !ctx->raw_ended && !ctx->discard) {
+        atomic_store(&ctx->quit, 0);
+        write_raw(ctx->ctx, ctx, NULL);
+    }
+
     pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    av_packet_free(&ctx->out_pkt);
 
-    swr_free(&ctx->swr);
+    av_audio_fifo_free(ctx->reframe);
 
     avcodec_free_context(&ctx->out_avctx);
 
-    if (ctx->avf)
-        avio_closep(&ctx->avf->pb);
+    if (ctx->avf && ctx->ctx->sink) {
+        /* Readers drop streams which end with an error */
+        int status = ctx->discard || atomic_load(&ctx->quit) ? AVERROR_EXIT :
+                     atomic_load(&ctx->status);
+        if ((ret = cr_sink_avio_close(&ctx->avf->pb, status)) < 0)
+            cyanrip_log(ctx->ctx, 0, "Error closing stream of %s: %s!\n", ctx->filename, av_err2str(ret));
+    } else if (ctx->avf && (ret = cr_writer_avio_close(&ctx->avf->pb)) < 0 && !ctx->discard) {
+        cyanrip_log(ctx->ctx, 0, "Error closing %s: %s!\n", ctx->filename, av_err2str(ret));
+    }
     avformat_free_context(ctx->avf);
 
+    /* Streamed outputs have no files */
+    if (ctx->discard && ctx->filename && !ctx->ctx->sink) {
+        remove(ctx->tmp_filename ? ctx->tmp_filename : ctx->filename);
+        cr_manifest_remove(ctx->tmp_filename ? ctx->tmp_filename : ctx->filename);
+    } else if (ctx->tmp_filename && !ctx->ctx->sink) {
+        remove(ctx->filename);
+        if (rename(ctx->tmp_filename, ctx->filename))
+            cyanrip_log(ctx->ctx, 0, "Couldn't rename %s to %s: %s!\n", ctx->tmp_filename,
+                        ctx->filename, av_err2str(AVERROR(errno)));
+        else
+            cr_manifest_rename(ctx->tmp_filename, ctx->filename);
+    }
+
+    av_free(ctx->filename);
+    av_free(ctx->tmp_filename);
+
     av_buffer_unref(&ctx->fifo);
-    av_buffer_unref(&ctx->packet_fifo);
+    cr_journal_close(&ctx->journal);
     av_packet_free(&ctx->cover_art_pkt);
 
     atomic_store(&ctx->quit, 0);
@@ -878,192 +1262,725 @@ fail:
     return ret;
 }
 
-static void *cyanrip_track_encoding(void *ctx)
+static void set_state(cyanrip_enc_ctx *s, enum CRIPEncState state, int ret)
 {
-    cyanrip_enc_ctx *s = ctx;
-    int ret = 0, flushing = 0;
+    if (ret < 0)
+        atomic_store(&s->status, ret);
 
-    /* Allocate output packet */
-    AVPacket *out_pkt = av_packet_alloc();
-    if (!out_pkt) {
-        ret = AVERROR(ENOMEM);
-        cyanrip_log(s->ctx, 0, "Error while encoding: %s!\n", av_err2str(ret));
-        goto fail;
-    }
+    /* Nothing will read frames anymore, don't let the producer block */
+    if (state == CRIP_ENC_DONE)
+        cr_frame_fifo_set_max_queued(s->fifo, 0);
 
-    while (!atomic_load(&s->quit)) {
-        AVFrame *out_frame = NULL;
+    pthread_mutex_lock(&s->lock);
+    s->state = state;
+    pthread_mutex_unlock(&s->lock);
+}
 
-        if (!flushing) {
-            out_frame = cr_frame_fifo_pop(s->fifo);
-            flushing = !out_frame;
-        }
+/* Writes all journalled packets and the trailer */
+static int write_packets(cyanrip_enc_ctx *s)
+{
+    int ret;
 
-        ret = audio_process_frame(ctx, &out_frame, flushing);
-        if (ret == AVERROR(EAGAIN))
-            continue;
-        else if (ret)
-            goto fail;
+    if (atomic_load(&s->quit))
+        return 0;
 
-        /* Give frame */
-        ret = avcodec_send_frame(s->out_avctx, out_frame);
-        av_frame_free(&out_frame);
-        if (ret < 0) {
-            cyanrip_log(s->ctx, 0, "Error encoding: %s!\n", av_err2str(ret));
-            goto fail;
-        }
+    if ((ret = open_output(s->ctx, s)) < 0) {
+        cyanrip_log(s->ctx, 0, "Error writing to file: %s!\n", av_err2str(ret));
+        return ret;
+    }
 
-        /* Return loop */
-        while (!atomic_load(&s->quit)) {
-            ret = avcodec_receive_packet(s->out_avctx, out_pkt);
-            if (ret == AVERROR_EOF) {
-                ret = 0;
-                goto write_trailer;
-            } else if (ret == AVERROR(EAGAIN)) {
-                ret = 0;
-                break;
-            } else if (ret < 0) {
-                cyanrip_log(s->ctx, 0, "Error while encoding: %s!\n", av_err2str(ret));
-                goto fail;
-            }
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
 
-            int sid = s->audio_stream_index;
-            out_pkt->stream_index = sid;
+    if ((ret = cr_journal_rewind(s->journal)) < 0)
+        goto end;
 
-            AVRational src_tb = s->out_avctx->time_base;
-            AVRational dst_tb = s->avf->streams[sid]->time_base;
+    while (!atomic_load(&s->quit) && !(ret = cr_journal_read(s->journal, pkt))) {
+        /* Send frames to lavf */
+        ret = av_interleaved_write_frame(s->avf, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            goto end;
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
 
-            /* Rescale timestamps to container */
-            av_packet_rescale_ts(out_pkt, src_tb, dst_tb);
+end:
+    av_packet_free(&pkt);
+    if (ret < 0) {
+        cyanrip_log(s->ctx, 0, "Error writing packet: %s!\n", av_err2str(ret));
+        return ret;
+    }
 
-            if (s->separate_writeout) {
-                /* Put encoded frame in FIFO */
-                ret = cr_packet_fifo_push(s->packet_fifo, out_pkt);
-                if (ret < 0) {
-                    cyanrip_log(ctx, 0, "Error pushing packet to FIFO: %s!\n", av_err2str(ret));
-                    goto fail;
-                }
-            } else {
-                /* Send frame to lavf */
-                ret = av_interleaved_write_frame(s->avf, out_pkt);
-                if (ret < 0) {
-                    cyanrip_log(s->ctx, 0, "Error writing packet: %s!\n", av_err2str(ret));
-                    goto fail;
-                }
-             }
+    if ((ret = av_write_trailer(s->avf)) < 0)
+        cyanrip_log(s->ctx, 0, "Error writing trailer: %s!\n", av_err2str(ret));
 
-            /* Reset the packet */
-            av_packet_unref(out_pkt);
-        }
+    return ret;
+}
+
+/* Adds the tags set since the header was written to a finished FLAC file */
+static int patch_tags(cyanrip_enc_ctx *s)
+{
+    int ret;
+    AVDictionary *tags = NULL;
+    const AVDictionaryEntry *e = NULL;
+
+    if (atomic_load(&s->quit))
+        return 0;
+
+    while ((e = av_dict_get(s->t->meta, "", e, AV_DICT_IGNORE_SUFFIX))) {
+        const AVDictionaryEntry *old = av_dict_get(s->avf->metadata, e->key, NULL, 0);
+        if (!old || strcmp(old->value, e->value))
+            av_dict_set(&tags, e->key, e->value, 0);
     }
 
-write_trailer:
-    av_packet_free(&out_pkt);
+    const char *path = s->tmp_filename ? s->tmp_filename : s->filename;
+    ret = cr_flac_append_tags(path, tags);
+    if (ret < 0)
+        cyanrip_log(s->ctx, 0, "Error adding tags to %s: %s!\n", s->filename, av_err2str(ret));
+    else
+        cr_manifest_patched(s->ctx->pool, path);
+
+    av_dict_free(&tags);
+    return ret;
+}
+
+/* Muxes or queues a packet from the encoder, which may be a master's */
+static int output_packet(cyanrip_enc_ctx *s, AVPacket *pkt, AVRational src_tb)
+{
+    int ret;
+    int sid = s->audio_stream_index;
+    pkt->stream_index = sid;
 
-    if (s->separate_writeout) {
-        ret = cr_packet_fifo_push(s->packet_fifo, NULL);
+    /* Rescale timestamps to container */
+    av_packet_rescale_ts(pkt, src_tb, s->avf->streams[sid]->time_base);
+
+    if (s->journal) {
+        /* Park it on disk until the tags are known */
+        ret = cr_journal_write(s->journal, pkt);
         if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error pushing packet to FIFO: %s!\n", av_err2str(ret));
-            goto fail;
+            cyanrip_log(s->ctx, 0, "Error writing packet to journal: %s!\n", av_err2str(ret));
+            return ret;
+        }
+    } else {
+        /* Send frame to lavf */
+        ret = av_interleaved_write_frame(s->avf, pkt);
+        if (ret < 0) {
+            cyanrip_log(s->ctx, 0, "Error writing packet: %s!\n", av_err2str(ret));
+            return ret;
         }
+    }
 
-        if (atomic_load(&s->quit))
-            goto fail;
+    return 0;
+}
 
-        pthread_mutex_lock(&s->lock);
-        pthread_mutex_unlock(&s->lock);
+/* Sends an encoded packet to the mirrors, then muxes it */
+static int emit_packet(cyanrip_enc_ctx *s, AVPacket *pkt)
+{
+    int ret;
+    AVRational src_tb = s->out_avctx->time_base;
 
-        if (atomic_load(&s->quit))
-            goto fail;
+    if (s->verify)
+        cr_verify_packet(s->verify, pkt);
 
-        if ((ret = open_output(s->ctx, s)) < 0) {
-            cyanrip_log(s->ctx, 0, "Error writing to file: %s!\n", av_err2str(ret));
-            goto fail;
-        }
+    for (int i = 0; i < s->nb_mirrors; i++) {
+        AVPacket *clone = av_packet_clone(pkt);
+        if (!clone)
+            return AVERROR(ENOMEM);
+        ret = output_packet(s->mirrors[i], clone, src_tb);
+        av_packet_free(&clone);
+        if (ret < 0)
+            return ret;
+    }
+
+    return output_packet(s, pkt, src_tb);
+}
+
+static int encode_segment(cyanrip_enc_ctx *s, CRIPEncSegment *seg)
+{
+    int ret;
+    const AVCodecContext *ref = s->out_avctx;
+    AVCodecContext *avctx = avcodec_alloc_context3(ref->codec);
+    if (!avctx)
+        return AVERROR(ENOMEM);
+
+    /* Same as the main encoder */
+    avctx->opaque                = ref->opaque;
+    avctx->bit_rate              = ref->bit_rate;
+    avctx->sample_fmt            = ref->sample_fmt;
+    avctx->compression_level     = ref->compression_level;
+    avctx->sample_rate           = ref->sample_rate;
+    avctx->time_base             = ref->time_base;
+    avctx->strict_std_compliance = ref->strict_std_compliance;
+    avctx->bits_per_raw_sample   = ref->bits_per_raw_sample;
+    avctx->flags                 = ref->flags;
+    if ((ret = av_channel_layout_copy(&avctx->ch_layout, &ref->ch_layout)) < 0)
+        goto end;
 
-        while (!atomic_load(&s->quit) && (out_pkt = cr_packet_fifo_pop(s->packet_fifo))) {
-            /* Send frames to lavf */
-            ret = av_interleaved_write_frame(s->avf, out_pkt);
-            av_packet_free(&out_pkt);
+    ret = avcodec_open2(avctx, ref->codec, NULL);
+    if (ret < 0)
+        goto end;
+
+    for (int i = 0; i <= seg->nb_frames && !atomic_load(&s->quit); i++) {
+        ret = avcodec_send_frame(avctx, i < seg->nb_frames ? seg->frames[i] : NULL);
+        if (ret < 0)
+            goto end;
+
+        while (1) {
+            AVPacket *pkt = av_packet_alloc();
+            if (!pkt) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+
+            ret = avcodec_receive_packet(avctx, pkt);
+            if (ret < 0) {
+                av_packet_free(&pkt);
+                break;
+            }
+
+            ret = av_dynarray_add_nofree(&seg->pkts, &seg->nb_pkts, pkt);
             if (ret < 0) {
-                cyanrip_log(s->ctx, 0, "Error writing packet: %s!\n", av_err2str(ret));
-                goto fail;
+                av_packet_free(&pkt);
+                goto end;
             }
         }
-    }
 
-    if ((ret = av_write_trailer(s->avf)) < 0) {
-        cyanrip_log(s->ctx, 0, "Error writing trailer: %s!\n", av_err2str(ret));
-        goto fail;
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
     }
 
-fail:
-    av_packet_free(&out_pkt);
+    ret = 0;
+
+end:
+    avcodec_free_context(&avctx);
+    return ret;
+}
+
+static void segment_job(void *arg)
+{
+    CRIPEncSegment *seg = arg;
+    cyanrip_enc_ctx *s = seg->s;
+
+    int ret = atomic_load(&s->quit) ? 0 : encode_segment(s, seg);
+
+    /* Frames are no longer needed */
+    for (int i = 0; i < seg->nb_frames; i++)
+        av_frame_free(&seg->frames[i]);
+
+    pthread_mutex_lock(&s->lock);
+    seg->ret = ret;
+    seg->done = 1;
+    pthread_mutex_unlock(&s->lock);
 
-    atomic_store(&s->status, ret);
+    /* Let the encoder mux it */
+    kick_encoding(s);
 
-    return NULL;
+    /* Nothing may touch the context after this */
+    pthread_mutex_lock(&s->lock);
+    s->segs_running--;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
 }
 
-int cyanrip_writeout_track(cyanrip_ctx *ctx, cyanrip_enc_ctx *s)
+static int submit_segment(cyanrip_enc_ctx *s)
 {
-    if (s->mutex_held) {
-        pthread_mutex_unlock(&s->lock);
-        s->mutex_held = 0;
-    }
+    CRIPEncSegment *seg = s->seg_fill;
+    s->seg_fill = NULL;
+    s->segs[s->nb_segs++] = seg;
+
+    pthread_mutex_lock(&s->lock);
+    s->segs_running++;
+    pthread_mutex_unlock(&s->lock);
+
+    if (cr_pool_submit(s->ctx->pool, segment_job, seg) < 0)
+        segment_job(seg);
 
     return 0;
 }
 
-int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
-                                cyanrip_track *t, enum cyanrip_output_formats format)
+static int mux_segment_packet(cyanrip_enc_ctx *s, CRIPEncSegment *seg, AVPacket *pkt)
+{
+    int ret;
+
+    if (s->out_avctx->codec_id == AV_CODEC_ID_FLAC) {
+        /* Each encoder signals its own STREAMINFO once flushed */
+        size_t si_size;
+        uint8_t *si = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &si_size);
+        if (si && si_size >= 34 && !s->flac_streaminfo &&
+            !(s->flac_streaminfo = av_memdup(si, si_size)))
+            return AVERROR(ENOMEM);
+
+        if (!pkt->size)
+            return 0;
+
+        if ((ret = cr_flac_renumber_frame(pkt, seg->first_frame)) < 0) {
+            cyanrip_log(s->ctx, 0, "Error stitching FLAC frame: %s!\n", av_err2str(ret));
+            return ret;
+        }
+
+        s->flac_min_frame = s->flac_min_frame ? FFMIN(s->flac_min_frame, pkt->size) : pkt->size;
+        s->flac_max_frame = FFMAX(s->flac_max_frame, pkt->size);
+    }
+
+    return emit_packet(s, pkt);
+}
+
+/* Muxes the packets of all leading segments which are done */
+static int drain_segments(cyanrip_enc_ctx *s)
 {
     int ret = 0;
-    const cyanrip_out_fmt *cfmt = &crip_fmt_info[format];
-    cyanrip_enc_ctx *s = av_mallocz(sizeof(*s));
-    int deemphasis = (ctx->settings.deemphasis && t->preemphasis) || ctx->settings.force_deemphasis;
 
-    const AVCodec *out_codec = NULL;
+    while (s->nb_segs) {
+        CRIPEncSegment *seg = s->segs[0];
 
-    s->mutex_held = 1;
-    s->t = t;
-    s->ctx = ctx;
-    s->cfmt = cfmt;
-    s->separate_writeout = ctx->settings.enable_replaygain;
-    atomic_init(&s->status, 0);
-    atomic_init(&s->quit, 0);
+        pthread_mutex_lock(&s->lock);
+        int done = seg->done;
+        pthread_mutex_unlock(&s->lock);
+        if (!done)
+            break;
 
-    char *filename = crip_get_path(ctx, CRIP_PATH_TRACK, 1, cfmt, t);
+        memmove(&s->segs[0], &s->segs[1], (--s->nb_segs)*sizeof(*s->segs));
 
-    /* Filename with protocol override */
-    char *ffpath = cr_ffmpeg_file_path(filename);
+        ret = seg->ret;
+        if (ret < 0)
+            cyanrip_log(s->ctx, 0, "Error encoding: %s!\n", av_err2str(ret));
 
-    /* lavf init */
-    ret = avformat_alloc_output_context2(&s->avf, NULL, cfmt->lavf_name, ffpath);
-    if (ret < 0) {
-        cyanrip_log(ctx, 0, "Unable to init lavf context: %s!\n", av_err2str(ret));
-        goto fail;
-    }
+        for (int i = 0; i < seg->nb_pkts && ret >= 0; i++)
+            ret = mux_segment_packet(s, seg, seg->pkts[i]);
 
-    s->st_aud = avformat_new_stream(s->avf, NULL);
-    if (!s->st_aud) {
-        cyanrip_log(ctx, 0, "Unable to alloc stream!\n");
-        ret = AVERROR(ENOMEM);
-        goto fail;
+        free_segment(&seg);
+        if (ret < 0)
+            return ret;
     }
 
-    /* Cover image init */
-    CRIPArt *art = &t->art;
-    if (!art->pkt) {
-        int i;
-        for (i = 0; i < ctx->nb_cover_arts; i++)
-            if (!strcmp(dict_get(ctx->cover_arts[i].meta, "title"), "Front"))
-                break;
-        art = &ctx->cover_arts[i == ctx->nb_cover_arts ? 0 : i];
+    return 0;
+}
+
+/* Last packet, carries the STREAMINFO of the whole stream */
+static int finish_flac_stream(cyanrip_enc_ctx *s)
+{
+    uint8_t md5[16];
+
+    if (!s->flac_streaminfo)
+        return 0;
+
+    av_md5_final(s->flac_md5, md5);
+    cr_flac_patch_streaminfo(s->flac_streaminfo, s->flac_min_frame, s->flac_max_frame,
+                             s->flac_samples, md5);
+
+    AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    int ret = av_packet_add_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                      s->flac_streaminfo, 34);
+    if (ret < 0) {
+        av_packet_free(&pkt);
+        return ret;
     }
+    s->flac_streaminfo = NULL; /* Owned by the packet */
 
-    if (art->pkt && cfmt->coverart_supported &&
-        !ctx->settings.disable_coverart_embedding) {
+    pkt->pts = pkt->dts = s->flac_samples;
+    ret = emit_packet(s, pkt);
+    av_packet_free(&pkt);
+
+    return ret;
+}
+
+/* Same as encode_frames(), but hands runs of frames to segment jobs */
+static int encode_segments(cyanrip_enc_ctx *s)
+{
+    int ret;
+
+    if ((ret = drain_segments(s)) < 0)
+        return ret;
+
+    while (!atomic_load(&s->quit)) {
+        AVFrame *out_frame = NULL;
+
+        /* Segment jobs kick us once they're done */
+        if (s->nb_segs == s->max_segments)
+            return 0;
+
+        if (!s->flushing && !audio_frame_ready(s)) {
+            /* Never wait for input, the next push will kick us again */
+            if (!cr_frame_fifo_get_size(s->fifo))
+                return 0;
+            out_frame = cr_frame_fifo_pop(s->fifo);
+            s->flushing = !out_frame;
+        }
+
+        ret = audio_process_frame(s, &out_frame, s->flushing);
+        if (ret == AVERROR(EAGAIN))
+            continue;
+        else if (ret)
+            return ret;
+
+        if (!out_frame) {
+            if (s->seg_fill && (ret = submit_segment(s)) < 0)
+                return ret;
+            if (s->nb_segs)
+                return 0;
+            if ((ret = finish_flac_stream(s)) < 0)
+                return ret;
+            return 1;
+        }
+
+        if (s->flac_md5) {
+            cr_flac_md5_update(s->flac_md5, out_frame, s->out_avctx->bits_per_raw_sample);
+            s->flac_samples += out_frame->nb_samples;
+        }
+
+        if (s->verify)
+            cr_verify_input(s->verify, out_frame);
+
+        if (!s->seg_fill) {
+            s->seg_fill = av_mallocz(sizeof(*s->seg_fill));
+            if (!s->seg_fill) {
+                av_frame_free(&out_frame);
+                return AVERROR(ENOMEM);
+            }
+            s->seg_fill->s = s;
+            s->seg_fill->first_frame = s->seg_next_frame;
+        }
+
+        s->seg_fill->frames[s->seg_fill->nb_frames++] = out_frame;
+        s->seg_next_frame++;
+
+        if (s->seg_fill->nb_frames == CRIP_ENC_SEGMENT_FRAMES &&
+            (ret = submit_segment(s)) < 0)
+            return ret;
+    }
+
+    return 1;
+}
+
+/* Encodes all frames queued so far, returns 1 once all packets are out */
+static int encode_frames(cyanrip_enc_ctx *s)
+{
+    int ret;
+
+    if (s->segmented)
+        return encode_segments(s);
+
+    while (!atomic_load(&s->quit)) {
+        AVFrame *out_frame = NULL;
+
+        if (!s->flushing && !audio_frame_ready(s)) {
+            /* Never wait for input, the next push will kick us again */
+            if (!cr_frame_fifo_get_size(s->fifo))
+                return 0;
+            out_frame = cr_frame_fifo_pop(s->fifo);
+            s->flushing = !out_frame;
+        }
+
+        ret = audio_process_frame(s, &out_frame, s->flushing);
+        if (ret == AVERROR(EAGAIN))
+            continue;
+        else if (ret)
+            return ret;
+
+        if (s->verify && out_frame)
+            cr_verify_input(s->verify, out_frame);
+
+        /* Give frame */
+        ret = avcodec_send_frame(s->out_avctx, out_frame);
+        av_frame_free(&out_frame);
+        if (ret < 0) {
+            cyanrip_log(s->ctx, 0, "Error encoding: %s!\n", av_err2str(ret));
+            return ret;
+        }
+
+        /* Return loop */
+        while (!atomic_load(&s->quit)) {
+            ret = avcodec_receive_packet(s->out_avctx, s->out_pkt);
+            if (ret == AVERROR_EOF) {
+                return 1;
+            } else if (ret == AVERROR(EAGAIN)) {
+                break;
+            } else if (ret < 0) {
+                cyanrip_log(s->ctx, 0, "Error while encoding: %s!\n", av_err2str(ret));
+                return ret;
+            }
+
+            ret = emit_packet(s, s->out_pkt);
+            if (ret < 0)
+                return ret;
+
+            /* Reset the packet */
+            av_packet_unref(s->out_pkt);
+        }
+    }
+
+    return 1;
+}
+
+/* Mismatches don't stop anything, they're counted and reported */
+static void finish_verify(cyanrip_enc_ctx *s)
+{
+    if (!s->verify || atomic_load(&s->quit))
+        return;
+
+    int ret = cr_verify_finish(s->verify);
+    if (ret == AVERROR_INVALIDDATA)
+        cyanrip_log(s->ctx, 0, "\nTrack %i: %s output does not decode back to the ripped audio!\n",
+                    s->t->number, s->cfmt->name);
+    else if (ret < 0)
+        cyanrip_log(s->ctx, 0, "\nTrack %i: unable to decode %s output to verify it: %s!\n",
+                    s->t->number, s->cfmt->name, av_err2str(ret));
+
+    if (ret < 0)
+        atomic_fetch_add(&s->ctx->verify_failures, 1);
+}
+
+/* Closed by the job which finished them, so any file which has to be hashed
+ * again is read back while still cached, and in parallel with other tracks */
+static int close_outputs(cyanrip_enc_ctx *s)
+{
+    int ret = 0, err;
+
+    if (s->ctx->sink)
+        return 0;
+
+    for (int i = 0; i <= s->nb_mirrors; i++) {
+        cyanrip_enc_ctx *o = i ? s->mirrors[i - 1] : s;
+        if (!o->avf || atomic_load(&o->quit) ||
+            (err = cr_writer_avio_close(&o->avf->pb)) >= 0)
+            continue;
+        cyanrip_log(s->ctx, 0, "Error closing %s: %s!\n", o->filename, av_err2str(err));
+        ret = ret < 0 ? ret : err;
+    }
+
+    return ret;
+}
+
+static void run_encoding(cyanrip_enc_ctx *s)
+{
+    int ret, writeout;
+
+    pthread_mutex_lock(&s->lock);
+    enum CRIPEncState state = s->state;
+    writeout = s->writeout;
+    pthread_mutex_unlock(&s->lock);
+
+    switch (state) {
+    case CRIP_ENC_RUNNING:
+        ret = encode_frames(s);
+        if (!ret)
+            return;
+        if (ret < 0) {
+            set_state(s, CRIP_ENC_DONE, ret);
+            return;
+        }
+
+        finish_verify(s);
+
+        /* Journalled outputs get their header and trailer at writeout */
+        for (int i = 0; i <= s->nb_mirrors; i++) {
+            cyanrip_enc_ctx *o = i ? s->mirrors[i - 1] : s;
+            if (!o->journal && (ret = av_write_trailer(o->avf)) < 0) {
+                cyanrip_log(s->ctx, 0, "Error writing trailer: %s!\n", av_err2str(ret));
+                set_state(s, CRIP_ENC_DONE, ret);
+                return;
+            }
+        }
+
+        if (!s->separate_writeout) {
+            set_state(s, CRIP_ENC_DONE, close_outputs(s));
+            return;
+        }
+
+        set_state(s, CRIP_ENC_ENCODED, 0);
+        if (!writeout)
+            return;
+        /* Fallthrough */
+    case CRIP_ENC_ENCODED:
+        if (!writeout)
+            return;
+        ret = 0;
+        for (int i = 0; i <= s->nb_mirrors && ret >= 0; i++) {
+            cyanrip_enc_ctx *o = i ? s->mirrors[i - 1] : s;
+            if (o->journal)
+                ret = write_packets(o);
+        }
+        /* Tags are added to the finished files */
+        if (ret >= 0)
+            ret = close_outputs(s);
+        for (int i = 0; i <= s->nb_mirrors && ret >= 0; i++) {
+            cyanrip_enc_ctx *o = i ? s->mirrors[i - 1] : s;
+            if (!o->journal)
+                ret = patch_tags(o);
+        }
+        set_state(s, CRIP_ENC_DONE, ret);
+        return;
+    case CRIP_ENC_DONE:
+        /* Drop anything pushed after the end */
+        while (cr_frame_fifo_get_size(s->fifo)) {
+            AVFrame *frame = cr_frame_fifo_pop(s->fifo);
+            av_frame_free(&frame);
+        }
+        return;
+    }
+}
+
+static void encoding_job(void *arg)
+{
+    cyanrip_enc_ctx *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->job_pending) {
+        s->job_pending = 0;
+        pthread_mutex_unlock(&s->lock);
+
+        run_encoding(s);
+
+        pthread_mutex_lock(&s->lock);
+    }
+    s->job_running = 0;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void kick_encoding(cyanrip_enc_ctx *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->job_pending = 1;
+    if (s->job_running) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    s->job_running = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    /* Run it here if the pool can't take it */
+    if (cr_pool_submit(s->ctx->pool, encoding_job, s) < 0)
+        encoding_job(s);
+}
+
+int cyanrip_writeout_track(cyanrip_ctx *ctx, cyanrip_enc_ctx *s)
+{
+    /* The master writes out all of its mirrors at once */
+    if (!s) /* Deferred */
+        return 0;
+    else if (s->master)
+        return cyanrip_writeout_track(ctx, s->master);
+    else if (!s->fifo) /* Written as it was ripped, or a mirror of an already ended master */
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    s->writeout = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    kick_encoding(s);
+
+    return 0;
+}
+
+/* Roughly how large the file ends up, so it can be allocated upfront.
+ * Lossless codecs are taken to keep 3/4 of the PCM, which errs on the large
+ * side, and whatever isn't written to gets cut off once done. */
+static int64_t estimate_output_size(cyanrip_ctx *ctx, cyanrip_enc_ctx *s)
+{
+    int64_t pcm_size = s->t->nb_samples * 4 * (ctx->settings.decode_hdcd ? 2 : 1);
+    int64_t size;
+
+    if (s->cfmt->codec == AV_CODEC_ID_NONE)
+        size = pcm_size;
+    else if (s->cfmt->lossless)
+        size = pcm_size * 3 / 4;
+    else
+        size = llrintf(ctx->settings.bitrate * 125.0f) * s->t->nb_samples / 44100;
+
+    /* Headers and tags */
+    return size + (64 << 10);
+}
+
+/* WAV and PCM take the sectors as they come from the drive, if nothing
+ * needs changing */
+static int is_raw_output(cyanrip_ctx *ctx, cyanrip_track *t,
+                         enum cyanrip_output_formats format)
+{
+    int deemphasis = (ctx->settings.deemphasis && t->preemphasis) || ctx->settings.force_deemphasis;
+    return !CONFIG_BIG_ENDIAN && crip_fmt_info[format].codec == AV_CODEC_ID_NONE &&
+           !ctx->settings.decode_hdcd && !deemphasis;
+}
+
+/* Mirrors get the master's packets, global_header is set if any of them
+ * needs the codec's headers out of band */
+static int init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                               cyanrip_track *t, enum cyanrip_output_formats format,
+                               int compression_level, int candidate,
+                               cyanrip_enc_ctx *master, int global_header)
+{
+    int ret = 0;
+    const cyanrip_out_fmt *cfmt = &crip_fmt_info[format];
+    cyanrip_enc_ctx *s = av_mallocz(sizeof(*s));
+    int deemphasis = (ctx->settings.deemphasis && t->preemphasis) || ctx->settings.force_deemphasis;
+    char *ffpath = NULL;
+
+    const AVCodec *out_codec = NULL;
+
+    s->t = t;
+    s->ctx = ctx;
+    s->cfmt = cfmt;
+    s->raw = is_raw_output(ctx, t, format);
+    /* Neither WAV nor PCM can carry ReplayGain tags, and deferred outputs
+     * are encoded once they're known */
+    s->separate_writeout = ctx->settings.enable_replaygain && !s->raw &&
+                           !av_dict_get(t->meta, "REPLAYGAIN_ALBUM_GAIN", NULL, 0);
+    atomic_init(&s->status, 0);
+    atomic_init(&s->quit, 0);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    s->filename = crip_get_path(ctx, CRIP_PATH_TRACK, !ctx->sink, cfmt, t);
+    if (!s->filename) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* Speculatively encoded rips go into a temporary file */
+    if (candidate) {
+        s->tmp_filename = av_asprintf("%s.%i.part", s->filename, candidate);
+        if (!s->tmp_filename) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+
+    const char *filename = s->tmp_filename ? s->tmp_filename : s->filename;
+
+    /* Filename with protocol override */
+    ffpath = cr_ffmpeg_file_path(filename);
+
+    /* lavf init */
+    ret = avformat_alloc_output_context2(&s->avf, NULL, cfmt->lavf_name, ffpath);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Unable to init lavf context: %s!\n", av_err2str(ret));
+        goto fail;
+    }
+
+    s->st_aud = avformat_new_stream(s->avf, NULL);
+    if (!s->st_aud) {
+        cyanrip_log(ctx, 0, "Unable to alloc stream!\n");
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* Cover image init */
+    CRIPArt *art = &t->art;
+    if (!art->pkt) {
+        int i;
+        for (i = 0; i < ctx->nb_cover_arts; i++)
+            if (!strcmp(dict_get(ctx->cover_arts[i].meta, "title"), "Front"))
+                break;
+        art = &ctx->cover_arts[i == ctx->nb_cover_arts ? 0 : i];
+    }
+
+    if (art->pkt && cfmt->coverart_supported &&
+        !ctx->settings.disable_coverart_embedding) {
         s->st_img = avformat_new_stream(s->avf, NULL);
         if (!s->st_img) {
             cyanrip_log(ctx, 0, "Unable to alloc stream!\n");
@@ -1077,6 +1994,38 @@ int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
         s->cover_art_pkt = av_packet_clone(art->pkt);
     }
 
+    if (master) {
+        s->master = master;
+
+        s->st_aud->time_base = (AVRational){ 1, master->out_avctx->sample_rate };
+        s->audio_stream_index = s->st_aud->index;
+
+        ret = avcodec_parameters_from_context(s->st_aud->codecpar, master->out_avctx);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Couldn't copy codec params!\n");
+            goto fail;
+        }
+
+        goto open;
+    }
+
+    if (s->raw) {
+        AVCodecParameters *par = s->st_aud->codecpar;
+        par->codec_type            = AVMEDIA_TYPE_AUDIO;
+        par->codec_id              = AV_CODEC_ID_PCM_S16LE;
+        par->format                = AV_SAMPLE_FMT_S16;
+        par->sample_rate           = 44100;
+        par->ch_layout             = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+        par->bits_per_coded_sample = 16;
+        par->block_align           = 4;
+        par->bit_rate              = 44100*4*8;
+
+        s->st_aud->time_base = (AVRational){ 1, 44100 };
+        s->audio_stream_index = s->st_aud->index;
+
+        goto open;
+    }
+
     /* Find encoder */
     if (cfmt->codec == AV_CODEC_ID_NONE)
         out_codec = avcodec_find_encoder(ctx->settings.decode_hdcd ?
@@ -1092,8 +2041,9 @@ int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
     }
 
     /* Output avctx */
-    s->out_avctx = setup_out_avctx(ctx, s->avf, out_codec, cfmt,
-                                   ctx->settings.decode_hdcd, deemphasis);
+    s->out_avctx = setup_out_avctx(ctx, s->avf, out_codec, cfmt, compression_level,
+                                   ctx->settings.decode_hdcd, deemphasis,
+                                   global_header);
     if (!s->out_avctx) {
         cyanrip_log(ctx, 0, "Unable to init output avctx!\n");
         goto fail;
@@ -1117,38 +2067,80 @@ int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
         goto fail;
     }
 
-    /* Open for writing */
-    ret = avio_open(&s->avf->pb, ffpath, AVIO_FLAG_WRITE);
-    if (ret < 0) {
-        cyanrip_log(ctx, 0, "Couldn't open %s: %s! Invalid folder name? Try -D <folder>.\n", filename, av_err2str(ret));
+    /* Conversion happens before the FIFO, this just re-frames */
+    s->reframe = av_audio_fifo_alloc(s->out_avctx->sample_fmt,
+                                     s->out_avctx->ch_layout.nb_channels,
+                                     FFMAX(s->out_avctx->frame_size, 1));
+    if (!s->reframe) {
+        ret = AVERROR(ENOMEM);
         goto fail;
     }
 
-    /* SWR */
-    s->swr = setup_init_swr(ctx, s->out_avctx,
-                            ctx->settings.decode_hdcd, deemphasis);
-    if (!s->swr)
-        goto fail;
-
     /* FIFO */
-    s->fifo = cr_frame_fifo_create(-1, FRAME_FIFO_BLOCK_NO_INPUT);
+    s->fifo = cr_frame_fifo_create(CRIP_ENC_MAX_QUEUED_FRAMES,
+                                   FRAME_FIFO_BLOCK_MAX_OUTPUT | FRAME_FIFO_BLOCK_BUDGET |
+                                   FRAME_FIFO_SPSC);
     if (!s->fifo)
         goto fail;
 
-    /* File write lock */
-    ret = pthread_mutex_init(&s->lock, NULL);
-    if (ret != 0) {
-        ret = AVERROR(ret);
+    s->out_pkt = av_packet_alloc();
+    if (!s->out_pkt) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* Segments need a fixed frame size, and to be worth splitting up */
+    s->max_segments = FFMIN(cr_pool_threads(ctx->pool), CRIP_ENC_MAX_SEGMENTS);
+    if (s->max_segments > 1 && s->out_avctx->frame_size &&
+        (s->out_avctx->codec_id == AV_CODEC_ID_ALAC ||
+         (s->out_avctx->codec_id == AV_CODEC_ID_FLAC &&
+          !av_sample_fmt_is_planar(s->out_avctx->sample_fmt)))) {
+        s->segmented = 1;
+        if (s->out_avctx->codec_id == AV_CODEC_ID_FLAC &&
+            !(s->flac_md5 = av_md5_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        if (s->flac_md5)
+            av_md5_init(s->flac_md5);
+    }
+
+    if (ctx->settings.verify_outputs && cfmt->lossless &&
+        (ret = cr_verify_create(&s->verify, s->out_avctx)) < 0) {
+        if (ret == AVERROR(ENOMEM))
+            goto fail;
+        cyanrip_log(ctx, 0, "Unable to verify %s output: %s, continuing without!\n",
+                    cfmt->name, av_err2str(ret));
+    }
+
+open:
+    /* Open for writing */
+    if (ctx->sink) {
+        /* MP4 can only be streamed fragmented, other muxers don't have the option.
+         * Audio has no keyframes to cut at, so cut a fragment every second. */
+        av_opt_set(s->avf, "movflags", "+empty_moov+default_base_moof", AV_OPT_SEARCH_CHILDREN);
+        av_opt_set_int(s->avf, "frag_duration", 1000000, AV_OPT_SEARCH_CHILDREN);
+        ret = cr_sink_avio_open(ctx->sink, &s->avf->pb, t->number, cfmt->name, s->filename);
+    } else {
+        ret = cr_writer_avio_open(&s->avf->pb, filename, estimate_output_size(ctx, s),
+                                  ctx->settings.writer_flags);
+    }
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s! Invalid folder name? Try -D <folder>.\n", filename, av_err2str(ret));
         goto fail;
     }
-    pthread_mutex_lock(&s->lock);
-    s->mutex_held = 1;
 
-    /* Packet fifo */
-    if (s->separate_writeout) {
-        s->packet_fifo = cr_packet_fifo_create(-1, 0);
-        if (!s->packet_fifo)
+    /* FLAC keeps room in its header to add tags to later, anything
+     * else gets muxed at writeout from a journal of its packets */
+    if (s->separate_writeout && strcmp(cfmt->lavf_name, "flac")) {
+        char *jpath = av_asprintf("%s.journal", filename);
+        s->journal = jpath ? cr_journal_open(jpath) : NULL;
+        av_free(jpath);
+        if (!s->journal) {
+            cyanrip_log(ctx, 0, "Couldn't create journal for %s!\n", filename);
+            ret = AVERROR(EIO);
             goto fail;
+        }
     } else {
         ret = open_output(ctx, s);
         if (ret < 0)
@@ -1156,9 +2148,12 @@ int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
     }
 
     av_free(ffpath);
-    av_free(filename);
 
-    pthread_create(&s->thread, NULL, cyanrip_track_encoding, s);
+    /* Jobs are started once frames get pushed */
+    if (master)
+        master->mirrors[master->nb_mirrors++] = s;
+    else if (!s->raw)
+        s->state = CRIP_ENC_RUNNING;
 
     *enc_ctx = s;
 
@@ -1166,8 +2161,553 @@ int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
 
 fail:
     av_free(ffpath);
-    av_free(filename);
+    s->discard = !!s->tmp_filename || ctx->sink;
     cyanrip_end_track_encoding(&s);
 
     return ret;
 }
+
+/* Compression levels which trade encoding speed for size */
+static const struct {
+    enum AVCodecID codec;
+    int min, max;
+} tune_ranges[] = {
+    { AV_CODEC_ID_FLAC,    0, 12 },
+    { AV_CODEC_ID_WAVPACK, 0,  8 },
+    { AV_CODEC_ID_ALAC,    0,  2 },
+};
+
+/* Seconds of audio each level is timed on */
+#define CRIP_TUNE_SECONDS 3
+/* How much faster than the drive encoders need to be, as reads come in bursts */
+#define CRIP_TUNE_HEADROOM 1.5
+#define CRIP_TUNE_CACHE_ENTRIES 256
+
+static int find_tune_range(enum AVCodecID codec)
+{
+    for (int i = 0; i < FF_ARRAY_ELEMS(tune_ranges); i++)
+        if (tune_ranges[i].codec == codec)
+            return i;
+    return -1;
+}
+
+static int pick_compression_level(cyanrip_ctx *ctx, enum cyanrip_output_formats format,
+                                  int read_rate)
+{
+    const cyanrip_out_fmt *cfmt = &crip_fmt_info[format];
+    int r = find_tune_range(cfmt->codec);
+    int level = ctx->settings.compression_level;
+
+    if (r < 0 || level == -1)
+        return cfmt->compression_level;
+    else if (level != CRIP_COMPRESSION_AUTO)
+        return av_clip(level, tune_ranges[r].min, tune_ranges[r].max);
+
+    /* Until the drive's speed is known */
+    if (!read_rate || !ctx->enc_speed[format][tune_ranges[r].min])
+        return cfmt->compression_level;
+
+    /* All outputs encode at once, spread over the pool */
+    double needed = (double)read_rate*(CDIO_CD_FRAMESIZE_RAW >> 2)*
+                    ctx->settings.outputs_num*CRIP_TUNE_HEADROOM;
+    double threads = cr_pool_threads(ctx->pool);
+
+    for (level = tune_ranges[r].max; level > tune_ranges[r].min; level--)
+        if (ctx->enc_speed[format][level]*threads >= needed)
+            break;
+
+    return level;
+}
+
+/* Something like music, tones with some noise, different on each channel */
+static void fill_tune_frame(AVFrame *frame)
+{
+    uint32_t seed = 0x1234567;
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int bps = av_get_bytes_per_sample(frame->format);
+    int channels = frame->ch_layout.nb_channels;
+
+    for (int i = 0; i < frame->nb_samples; i++) {
+        for (int c = 0; c < channels; c++) {
+            seed = seed*1664525 + 1013904223;
+            double v = 6000.0*sin(2.0*M_PI*(220.0 + 110.0*c)*i/44100.0) +
+                       3000.0*sin(2.0*M_PI*1320.0*i/44100.0) +
+                       (int16_t)(seed >> 16)/64.0;
+
+            int idx = planar ? i : i*channels + c;
+            uint8_t *dst = frame->extended_data[planar ? c : 0];
+            if (bps == 2)
+                ((int16_t *)dst)[idx] = lrint(v);
+            else if (bps == 4)
+                ((int32_t *)dst)[idx] = lrint(v)*65536;
+        }
+    }
+}
+
+/* Returns how many samples per second an encoder manages on one thread */
+static int bench_level(cyanrip_ctx *ctx, const AVCodec *codec, int level, double *speed)
+{
+    int ret;
+    AVFrame *frame = NULL;
+    AVPacket *pkt = NULL;
+    AVCodecContext *avctx = avcodec_alloc_context3(codec);
+    if (!avctx)
+        return AVERROR(ENOMEM);
+
+    avctx->sample_fmt            = pick_codec_sample_fmt(codec, ctx->settings.decode_hdcd);
+    avctx->ch_layout             = pick_codec_channel_layout(codec);
+    avctx->compression_level     = level;
+    avctx->sample_rate           = 44100;
+    avctx->time_base             = (AVRational){ 1, 44100 };
+    avctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    avctx->bits_per_raw_sample   = ctx->settings.decode_hdcd ?
+                                   FFMIN(24, av_get_bytes_per_sample(avctx->sample_fmt)*8) : 16;
+
+    ret = avcodec_open2(avctx, codec, NULL);
+    if (ret < 0)
+        goto end;
+
+    frame = av_frame_alloc();
+    pkt = av_packet_alloc();
+    if (!frame || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    frame->format = avctx->sample_fmt;
+    frame->nb_samples = avctx->frame_size ? avctx->frame_size : 4096;
+    frame->sample_rate = avctx->sample_rate;
+    if ((ret = av_channel_layout_copy(&frame->ch_layout, &avctx->ch_layout)) < 0 ||
+        (ret = av_frame_get_buffer(frame, 0)) < 0)
+        goto end;
+
+    fill_tune_frame(frame);
+
+    int64_t nb_samples = 0;
+    int64_t start = av_gettime_relative();
+
+    /* The same frame every time, encoders don't look across frames */
+    for (int eof = 0; !eof;) {
+        eof = nb_samples >= CRIP_TUNE_SECONDS*44100;
+        frame->pts = nb_samples;
+        ret = avcodec_send_frame(avctx, eof ? NULL : frame);
+        if (ret < 0)
+            goto end;
+        nb_samples += frame->nb_samples;
+
+        while ((ret = avcodec_receive_packet(avctx, pkt)) >= 0)
+            av_packet_unref(pkt);
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+
+    int64_t elapsed = av_gettime_relative() - start;
+    *speed = (double)nb_samples*1000000/FFMAX(elapsed, 1);
+    ret = 0;
+
+end:
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&avctx);
+    return ret;
+}
+
+static FILE *open_tune_cache(const char *mode)
+{
+    char path[4096];
+    const char *dir = getenv("XDG_CACHE_HOME");
+
+    if (dir)
+        snprintf(path, sizeof(path), "%s/cyanrip_autotune", dir);
+    else if ((dir = getenv("HOME")))
+        snprintf(path, sizeof(path), "%s/.cache/cyanrip_autotune", dir);
+    else
+        return NULL;
+
+    return fopen(path, mode);
+}
+
+typedef struct CRIPTuneEntry {
+    char codec[32];
+    unsigned version;
+    int bits;
+    int level;
+    double speed;
+} CRIPTuneEntry;
+
+int cyanrip_autotune_encoders(cyanrip_ctx *ctx)
+{
+    int ret = 0;
+    CRIPTuneEntry *cache = av_calloc(CRIP_TUNE_CACHE_ENTRIES, sizeof(*cache));
+    int nb_cache = 0;
+    if (!cache)
+        return AVERROR(ENOMEM);
+
+    /* Results depend on the machine and the version of the encoders */
+    FILE *f = open_tune_cache("r");
+    if (f) {
+        CRIPTuneEntry *e = &cache[nb_cache];
+        while (nb_cache < CRIP_TUNE_CACHE_ENTRIES &&
+               fscanf(f, "%31s %u %i %i %lf", e->codec, &e->version,
+                      &e->bits, &e->level, &e->speed) == 5)
+            e = &cache[++nb_cache];
+        fclose(f);
+    }
+
+    FILE *out = NULL;
+    const unsigned version = avcodec_version();
+    const int bits = ctx->settings.decode_hdcd ? 32 : 16;
+
+    for (int i = 0; i < ctx->settings.outputs_num; i++) {
+        enum cyanrip_output_formats format = ctx->settings.outputs[i];
+        const cyanrip_out_fmt *cfmt = &crip_fmt_info[format];
+        int r = find_tune_range(cfmt->codec);
+        if (r < 0)
+            continue;
+
+        /* Formats with the same codec share the results */
+        int j = 0;
+        for (; j < i; j++)
+            if (crip_fmt_info[ctx->settings.outputs[j]].codec == cfmt->codec)
+                break;
+        if (j < i) {
+            memcpy(ctx->enc_speed[format], ctx->enc_speed[ctx->settings.outputs[j]],
+                   sizeof(ctx->enc_speed[format]));
+            continue;
+        }
+
+        const AVCodec *codec = avcodec_find_encoder(cfmt->codec);
+        if (!codec)
+            continue;
+
+        for (int level = tune_ranges[r].min; level <= tune_ranges[r].max; level++) {
+            double *speed = &ctx->enc_speed[format][level];
+
+            for (int k = 0; k < nb_cache && !*speed; k++)
+                if (!strcmp(cache[k].codec, codec->name) && cache[k].version == version &&
+                    cache[k].bits == bits && cache[k].level == level)
+                    *speed = cache[k].speed;
+            if (*speed)
+                continue;
+
+            ret = bench_level(ctx, codec, level, speed);
+            if (ret < 0) {
+                cyanrip_log(ctx, 0, "Error benchmarking %s at level %i: %s!\n",
+                            codec->name, level, av_err2str(ret));
+                goto end;
+            }
+
+            if (!out)
+                out = open_tune_cache("a");
+            if (out)
+                fprintf(out, "%s %u %i %i %f\n", codec->name, version, bits, level, *speed);
+        }
+
+        cyanrip_log(ctx, 0, "Autotuned %s: level %i at %.0fx to level %i at %.0fx realtime per thread\n",
+                    cfmt->folder_suffix,
+                    tune_ranges[r].min, ctx->enc_speed[format][tune_ranges[r].min]/44100,
+                    tune_ranges[r].max, ctx->enc_speed[format][tune_ranges[r].max]/44100);
+    }
+
+end:
+    if (out)
+        fclose(out);
+    av_free(cache);
+    return ret;
+}
+
+/* Formats which only differ by container can share an encoder */
+static int shares_encoder(enum cyanrip_output_formats a, int level_a,
+                          enum cyanrip_output_formats b, int level_b)
+{
+    const cyanrip_out_fmt *fa = &crip_fmt_info[a];
+    const cyanrip_out_fmt *fb = &crip_fmt_info[b];
+    return fa->codec == fb->codec &&
+           level_a == level_b &&
+           fa->lossless == fb->lossless;
+}
+
+static int needs_global_header(enum cyanrip_output_formats format)
+{
+    const AVOutputFormat *ofmt = av_guess_format(crip_fmt_info[format].lavf_name, NULL, NULL);
+    return ofmt && (ofmt->flags & AVFMT_GLOBALHEADER);
+}
+
+/* Outputs in [first, last) */
+static int init_encoders(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                         cyanrip_track *t, int candidate, int first, int last)
+{
+    const enum cyanrip_output_formats *outputs = ctx->settings.outputs;
+    const int read_rate = atomic_load(&ctx->read_rate);
+    int levels[CYANRIP_FORMATS_NB];
+
+    for (int i = first; i < last; i++)
+        levels[i] = pick_compression_level(ctx, outputs[i], read_rate);
+
+    for (int i = first; i < last; i++) {
+        cyanrip_enc_ctx *master = NULL;
+        int global_header = 0;
+
+        if (is_raw_output(ctx, t, outputs[i])) {
+            int ret = init_track_encoding(ctx, &enc_ctx[i], t, outputs[i], levels[i],
+                                          candidate, NULL, 0);
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+
+        /* Masters always come first, so they're also ended first */
+        for (int j = first; j < i; j++) {
+            if (!enc_ctx[j]->master && !enc_ctx[j]->raw &&
+                shares_encoder(outputs[j], levels[j], outputs[i], levels[i])) {
+                master = enc_ctx[j];
+                break;
+            }
+        }
+
+        for (int j = i + 1; !master && j < last; j++)
+            if (shares_encoder(outputs[i], levels[i], outputs[j], levels[j]))
+                global_header |= needs_global_header(outputs[j]);
+
+        int ret = init_track_encoding(ctx, &enc_ctx[i], t, outputs[i], levels[i],
+                                      candidate, master, global_header);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int cyanrip_init_track_encoders(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                                cyanrip_track *t, int candidate)
+{
+    return init_encoders(ctx, enc_ctx, t, candidate, 0, ctx->nb_live_outputs);
+}
+
+static int push_decoded(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx, int num_enc,
+                        cyanrip_dec_ctx *dec_ctx, AVCodecContext *dec, AVFrame *frame)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+        ret = push_frame_to_encs(ctx, enc_ctx, num_enc, dec_ctx, frame);
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+    }
+
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+/* Decodes a file into the outputs from first onwards, src only names it */
+static int transcode_file(cyanrip_ctx *ctx, cyanrip_track *t, const char *path,
+                          int first, const char *src)
+{
+    int ret = 0;
+    const int num_enc = ctx->settings.outputs_num - first;
+    cyanrip_dec_ctx *dec_ctx = NULL;
+    AVFormatContext *avf = NULL;
+    AVCodecContext *dec = NULL;
+    const AVCodec *codec = NULL;
+
+    char *ffpath = cr_ffmpeg_file_path(path);
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (!ffpath || !pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    ret = avformat_open_input(&avf, ffpath, NULL, NULL);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", path, av_err2str(ret));
+        goto end;
+    }
+
+    if ((ret = avformat_find_stream_info(avf, NULL)) < 0)
+        goto end;
+
+    int idx = av_find_best_stream(avf, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (idx < 0) {
+        ret = idx;
+        goto end;
+    }
+
+    dec = avcodec_alloc_context3(codec);
+    if (!dec) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = avcodec_parameters_to_context(dec, avf->streams[idx]->codecpar)) < 0 ||
+        (ret = avcodec_open2(dec, codec, NULL)) < 0)
+        goto end;
+
+    /* Only for its converters, deemphasis and HDCD are in the source already */
+    if ((ret = cyanrip_create_dec_ctx(ctx, &dec_ctx, t)) < 0)
+        goto end;
+
+    if ((ret = init_encoders(ctx, t->enc_ctx, t, 0, first, ctx->settings.outputs_num)) < 0)
+        goto end;
+
+    cyanrip_log(ctx, 0, "Encoding track %i from %s...\n", t->number, src);
+
+    while ((ret = av_read_frame(avf, pkt)) >= 0) {
+        if (pkt->stream_index == idx)
+            ret = avcodec_send_packet(dec, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0 ||
+            (ret = push_decoded(ctx, t->enc_ctx + first, num_enc, dec_ctx, dec, frame)) < 0)
+            goto end;
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+
+    if ((ret = avcodec_send_packet(dec, NULL)) < 0 ||
+        (ret = push_decoded(ctx, t->enc_ctx + first, num_enc, dec_ctx, dec, frame)) < 0)
+        goto end;
+
+    ret = push_frame_to_encs(ctx, t->enc_ctx + first, num_enc, dec_ctx, NULL);
+
+end:
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error encoding track %i from %s: %s!\n",
+                    t->number, src, av_err2str(ret));
+        for (int i = first; i < ctx->settings.outputs_num; i++)
+            cyanrip_discard_encoding(ctx, &t->enc_ctx[i]);
+    }
+
+    cyanrip_free_dec_ctx(ctx, &dec_ctx);
+    avcodec_free_context(&dec);
+    avformat_close_input(&avf);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    av_free(ffpath);
+
+    return ret;
+}
+
+int cyanrip_transcode_track(cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    int ret = 0;
+    const cyanrip_out_fmt *src_fmt = &crip_fmt_info[ctx->settings.outputs[0]];
+
+    /* The source has to be complete, with its tags */
+    for (int i = 0; i < ctx->nb_live_outputs; i++) {
+        int err = cyanrip_end_track_encoding(&t->enc_ctx[i]);
+        ret = ret < 0 ? ret : err;
+    }
+    if (ret < 0)
+        return ret;
+
+    char *path = crip_get_path(ctx, CRIP_PATH_TRACK, 0, src_fmt, t);
+    if (!path)
+        return AVERROR(ENOMEM);
+
+    ret = transcode_file(ctx, t, path, ctx->nb_live_outputs, src_fmt->name);
+
+    av_free(path);
+
+    return ret;
+}
+
+int cyanrip_transcode_file(cyanrip_ctx *ctx, cyanrip_track *t, const char *path)
+{
+    return transcode_file(ctx, t, path, 0, path);
+}
+
+struct cyanrip_prewarm {
+    cyanrip_ctx *ctx;
+    cyanrip_track *t;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int ret;
+};
+
+static int setup_track_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    int ret = cyanrip_create_dec_ctx(ctx, &t->dec_ctx, t);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error initializing decoder: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    ret = cyanrip_init_track_encoders(ctx, t->enc_ctx, t, 0);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error initializing encoder: %s\n", av_err2str(ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+static void prewarm_job(void *arg)
+{
+    struct cyanrip_prewarm *p = arg;
+
+    int ret = setup_track_encoding(p->ctx, p->t);
+
+    pthread_mutex_lock(&p->lock);
+    p->ret = ret;
+    p->done = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void cyanrip_prewarm_track_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    if (t->prewarm || t->dec_ctx)
+        return;
+
+    struct cyanrip_prewarm *p = av_mallocz(sizeof(*p));
+    if (!p)
+        return;
+
+    p->ctx = ctx;
+    p->t = t;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    /* Not fatal, the track will be set up when it's ripped */
+    if (cr_pool_submit(ctx->pool, prewarm_job, p) < 0) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        av_free(p);
+        return;
+    }
+
+    t->prewarm = p;
+}
+
+void cyanrip_cancel_prewarm(cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    if (!t->prewarm)
+        return;
+
+    /* Outputs were already opened, and their headers may be written */
+    cyanrip_setup_track_encoding(ctx, t);
+    for (int i = 0; i < ctx->settings.outputs_num; i++)
+        cyanrip_discard_encoding(ctx, &t->enc_ctx[i]);
+    cyanrip_free_dec_ctx(ctx, &t->dec_ctx);
+}
+
+int cyanrip_setup_track_encoding(cyanrip_ctx *ctx, cyanrip_track *t)
+{
+    struct cyanrip_prewarm *p = t->prewarm;
+    if (!p)
+        return setup_track_encoding(ctx, t);
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->done)
+        pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    int ret = p->ret;
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    av_freep(&t->prewarm);
+
+    return ret;
+}
@@ -30,21 +30,45 @@ const char *cyanrip_fmt_folder(enum cyanrip_output_formats format);
 
 int cyanrip_create_dec_ctx(cyanrip_ctx *ctx, cyanrip_dec_ctx **s,
                            cyanrip_track *t);
-int cyanrip_init_track_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
-                                cyanrip_track *t, enum cyanrip_output_formats format);
+/* Initializes an encoder for each output, outputs which only differ by
+ * container share one. A non-zero candidate encodes into temporary files,
+ * which replace the outputs once done. */
+int cyanrip_init_track_encoders(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                                cyanrip_track *t, int candidate);
+/* Initializes the decoder and all encoders of a track, or waits for the
+ * prewarm to finish if one was started */
+int cyanrip_setup_track_encoding(cyanrip_ctx *ctx, cyanrip_track *t);
+/* Starts the above on the pool, so it's ready once the track is ripped */
+void cyanrip_prewarm_track_encoding(cyanrip_ctx *ctx, cyanrip_track *t);
+/* Waits for a prewarm of a track which never got ripped, and removes its outputs */
+void cyanrip_cancel_prewarm(cyanrip_ctx *ctx, cyanrip_track *t);
 int cyanrip_send_pcm_to_encoders(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
                                  int num_enc, cyanrip_dec_ctx *dec_ctx,
-                                 const uint8_t *data, int bytes,
-                                 int calc_global_peak);
+                                 const uint8_t *data, int bytes);
 
 void cyanrip_immediate_stop_encoding(cyanrip_ctx *ctx, cyanrip_track *t);
-int cyanrip_reset_encoding(cyanrip_ctx *ctx, cyanrip_track *t);
+/* Stops encoding, and removes the output */
+void cyanrip_discard_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **s);
 int cyanrip_finalize_encoding(cyanrip_ctx *ctx, cyanrip_track *t);
 
+/* Sets up the HDCD decoding graph, which is kept for the whole disc */
+int cyanrip_initialize_filtering(cyanrip_ctx *ctx);
+void cyanrip_finalize_filtering(cyanrip_ctx *ctx, int log);
+
 int cyanrip_initialize_ebur128(cyanrip_ctx *ctx);
 int cyanrip_finalize_ebur128(cyanrip_ctx *ctx, int log);
 
+/* Times each compression level of the lossless outputs, or takes it from
+ * the cache, for levels to be picked based on the drive's speed */
+int cyanrip_autotune_encoders(cyanrip_ctx *ctx);
+
 int cyanrip_writeout_track(cyanrip_ctx *ctx, cyanrip_enc_ctx *enc_ctx);
 
+/* Ends the live outputs of a track, and encodes its deferred outputs from
+ * the file of the first one */
+int cyanrip_transcode_track(cyanrip_ctx *ctx, cyanrip_track *t);
+/* Encodes all outputs of a track from an existing file, without ending them */
+int cyanrip_transcode_file(cyanrip_ctx *ctx, cyanrip_track *t, const char *path);
+
 int cyanrip_end_track_encoding(cyanrip_enc_ctx **s);
 void cyanrip_free_dec_ctx(cyanrip_ctx *ctx, cyanrip_dec_ctx **s);
@@ -27,6 +27,17 @@
 #include "cyanrip_encode.h"
 #include "cyanrip_log.h"
 #include "accurip.h"
+#include "checksums.h"
+
+const paranoia_mode_t paranoia_level_map[] = {
+    [0] = PARANOIA_MODE_DISABLE, /* Disable everything */
+    [1] = PARANOIA_MODE_OVERLAP, /* Perform overlapped reads */
+    [2] = PARANOIA_MODE_OVERLAP | PARANOIA_MODE_VERIFY, /* Perform and verify overlapped reads */
+    [3] = PARANOIA_MODE_FULL ^ PARANOIA_MODE_NEVERSKIP, /* Maximum, but do allow skipping sectors */
+};
+const int crip_max_paranoia_level = (sizeof(paranoia_level_map) / sizeof(paranoia_level_map[0])) - 1;
+
+uint64_t paranoia_status[PARANOIA_CB_FINISHED + 1] = { 0 };
 
 #define CLOG(FORMAT, DICT, TAG)                                                \
     if (dict_get(DICT, TAG))                                                   \
@@ -118,6 +129,16 @@ void cyanrip_log_track_end(cyanrip_ctx *ctx, cyanrip_track *t)
             cyanrip_log(ctx, 0, " (after %i rips)\n", t->total_repeats);
         else
             cyanrip_log(ctx, 0, "\n");
+
+        for (int i = 0; i < ctx->settings.checksums_num; i++) {
+            char str[2*CRIP_CHECKSUM_MAX_SIZE + 1];
+            enum CRIPChecksumType type = ctx->settings.checksums[i];
+            if (type < CRIP_CHECKSUM_EAC_NONULL)
+                continue;
+            crip_checksum_to_str(t, type, str, sizeof(str));
+            cyanrip_log(ctx, 0, "  %s:%*s%s\n", crip_checksum_providers[type]->label,
+                        FFMAX(14 - (int)strlen(crip_checksum_providers[type]->label), 1), "", str);
+        }
     }
 
     cyanrip_log(ctx, 0, "  Accurip:       %s",
@@ -224,15 +245,19 @@ void cyanrip_log_track_end(cyanrip_ctx *ctx, cyanrip_track *t)
 void cyanrip_log_start_report(cyanrip_ctx *ctx)
 {
     cyanrip_log(ctx, 0, "cyanrip %s (%s)\n", PROJECT_VERSION_STRING, vcstag);
-    cdio_hwinfo_t hwinfo;
-    const int hwinfo_success = cdio_get_hwinfo(ctx->cdio, &hwinfo);
-    if (!hwinfo_success)
-        cyanrip_log(ctx, 0, "Drive used:     error retrieving drive info\n");
-    else
-        cyanrip_log(ctx, 0, "Drive used:     %s %s (revision %s)\n", hwinfo.psz_vendor, hwinfo.psz_model, hwinfo.psz_revision);
-    cyanrip_log(ctx, 0, "System device:  %s\n", ctx->settings.dev_path);
-    if (ctx->drive->drive_model)
-        cyanrip_log(ctx, 0, "Device model:   %s\n", ctx->drive->drive_model);
+    if (ctx->settings.resplit) {
+        cyanrip_log(ctx, 0, "Disc master:    %s\n", ctx->settings.resplit);
+    } else {
+        cdio_hwinfo_t hwinfo;
+        const int hwinfo_success = cdio_get_hwinfo(ctx->cdio, &hwinfo);
+        if (!hwinfo_success)
+            cyanrip_log(ctx, 0, "Drive used:     error retrieving drive info\n");
+        else
+            cyanrip_log(ctx, 0, "Drive used:     %s %s (revision %s)\n", hwinfo.psz_vendor, hwinfo.psz_model, hwinfo.psz_revision);
+        cyanrip_log(ctx, 0, "System device:  %s\n", ctx->settings.dev_path);
+        if (ctx->drive->drive_model)
+            cyanrip_log(ctx, 0, "Device model:   %s\n", ctx->drive->drive_model);
+    }
     cyanrip_log(ctx, 0, "Offset:         %c%i %s\n", ctx->settings.offset >= 0 ? '+' : '-', abs(ctx->settings.offset),
                 abs(ctx->settings.offset) == 1 ? "sample" : "samples");
     cyanrip_log(ctx, 0, "%s%c%i %s\n",
@@ -334,6 +359,14 @@ void cyanrip_log_finish_report(cyanrip_ctx *ctx)
         cyanrip_log(ctx, 0, "\n");
     }
 
+    if (ctx->settings.verify_outputs) {
+        int failures = atomic_load(&ctx->verify_failures);
+        if (failures)
+            cyanrip_log(ctx, 0, "Outputs failing verification: %i\n\n", failures);
+        else
+            cyanrip_log(ctx, 0, "Outputs verified: all decode back to the ripped audio\n\n");
+    }
+
     int has_status = 0;
     cyanrip_log(ctx, 0, "Paranoia status counts:\n");
 
@@ -368,6 +401,13 @@ void cyanrip_log_finish_report(cyanrip_ctx *ctx)
 
 #undef PCHECK
 
+    if (ctx->tree_root_computed) {
+        cyanrip_log(ctx, 0, "Disc SHA-256 tree: ");
+        for (int i = 0; i < sizeof(ctx->tree_root); i++)
+            cyanrip_log(ctx, 0, "%02x", ctx->tree_root[i]);
+        cyanrip_log(ctx, 0, "\n\n");
+    }
+
     cyanrip_log(ctx, 0, "Ripping errors: %i\n", ctx->total_error_count);
     cyanrip_log(ctx, 0, "Ripping finished at %s\n", t_s);
 }
@@ -379,12 +419,12 @@ int cyanrip_log_init(cyanrip_ctx *ctx)
                                       &crip_fmt_info[ctx->settings.outputs[i]],
                                       NULL);
 
-        ctx->logfile[i] = fopen(logfile, "wb+");
-
-        if (!ctx->logfile[i]) {
+        int ret = cr_writer_open(&ctx->logfile[i], logfile, 0,
+                                 ctx->settings.writer_flags);
+        if (ret < 0) {
             cyanrip_log(ctx, 0, "Couldn't open path \"%s\" for writing: %s!\n"
                         "Invalid folder name? Try -D <folder>.\n",
-                        logfile, av_err2str(AVERROR(errno)));
+                        logfile, av_err2str(ret));
             av_freep(&logfile);
             return 1;
         }
@@ -412,15 +452,15 @@ void cyanrip_log_end(cyanrip_ctx *ctx)
 
         av_sha512_init(shactx, 512);
 
-        long int pos = ftell(ctx->logfile[i]);
+        int64_t pos = cr_writer_size(ctx->logfile[i]);
         uint8_t *str_data_new = av_realloc(str_data, pos);
         if (!str_data_new)
             goto fail;
         str_data = str_data_new;
 
-        rewind(ctx->logfile[i]);
-        long int read_bytes = fread(str_data, 1, pos, ctx->logfile[i]);
-        fseek(ctx->logfile[i], 0, SEEK_END);
+        int read_bytes = cr_writer_read(ctx->logfile[i], str_data, pos, 0);
+        if (read_bytes < 0)
+            goto fail;
 
         av_sha512_update(shactx, str_data, read_bytes);
         av_sha512_final(shactx, digest);
@@ -444,10 +484,9 @@ void cyanrip_log_end(cyanrip_ctx *ctx)
             if (digest_str[j] == '+') digest_str[j] = '.';
         }
 
-        fprintf(ctx->logfile[i], "Log FUN512: %s\n", digest_str);
+        cr_writer_printf(ctx->logfile[i], "Log FUN512: %s\n", digest_str);
 fail:
-        fclose(ctx->logfile[i]);
-        ctx->logfile[i] = NULL;
+        cr_writer_close(&ctx->logfile[i]);
     }
 
     av_free(str_data);
@@ -457,6 +496,14 @@ fail:
 static cyanrip_ctx *av_global_ctx = NULL;
 static int av_max_log_level = AV_LOG_QUIET;
 static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_to_stderr = 0;
+
+void cyanrip_log_to_stderr(void)
+{
+    pthread_mutex_lock(&log_lock);
+    log_to_stderr = 1;
+    pthread_mutex_unlock(&log_lock);
+}
 
 static void av_log_capture(void *ptr, int lvl, const char *format,
                            va_list args)
@@ -473,12 +520,12 @@ static void av_log_capture(void *ptr, int lvl, const char *format,
 
             va_list args2;
             va_copy(args2, args);
-            vfprintf(av_global_ctx->logfile[i], format, args2);
+            cr_writer_vprintf(av_global_ctx->logfile[i], format, args2);
             va_end(args2);
         }
     }
 
-    vprintf(format, args);
+    vfprintf(log_to_stderr ? stderr : stdout, format, args);
 
 end:
     pthread_mutex_unlock(&log_lock);
@@ -516,12 +563,12 @@ void cyanrip_log(cyanrip_ctx *ctx, int verbose, const char *format, ...)
 
             va_list args2;
             va_copy(args2, args);
-            vfprintf(ctx->logfile[i], format, args2);
+            cr_writer_vprintf(ctx->logfile[i], format, args2);
             va_end(args2);
         }
     }
 
-    vprintf(format, args);
+    vfprintf(log_to_stderr ? stderr : stdout, format, args);
 
     va_end(args);
 
@@ -31,3 +31,6 @@ void cyanrip_set_av_log_capture(cyanrip_ctx *ctx, int enable,
                                 int max_av_lvl);
 
 void cyanrip_log(cyanrip_ctx *ctx, int verbose, const char *format, ...);
+
+/* For when stdout carries the outputs */
+void cyanrip_log_to_stderr(void);
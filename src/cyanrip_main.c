@@ -39,32 +39,27 @@
 #include "os_compat.h"
 #include "cyanrip_encode.h"
 #include "pregap.h"
+#include "pool.h"
+#include "treehash.h"
+#include "budget.h"
+#include "from_master.h"
+#include "disc_master.h"
+#include "manifest.h"
+#include "sink.h"
 
 int quit_now = 0;
 
-const cyanrip_out_fmt crip_fmt_info[] = {
-    [CYANRIP_FORMAT_FLAC]     = { "flac",     "FLAC", "flac",  "flac",  1, 11, 1, AV_CODEC_ID_FLAC,      },
-    [CYANRIP_FORMAT_MP3]      = { "mp3",      "MP3",  "mp3",   "mp3",   1,  0, 0, AV_CODEC_ID_MP3,       },
-    [CYANRIP_FORMAT_TTA]      = { "tta",      "TTA",  "tta",   "tta",   0,  0, 1, AV_CODEC_ID_TTA,       },
-    [CYANRIP_FORMAT_OPUS]     = { "opus",     "OPUS", "opus",  "ogg",   0, 10, 0, AV_CODEC_ID_OPUS,      },
-    [CYANRIP_FORMAT_AAC]      = { "aac",      "AAC",  "m4a",   "adts",  0,  0, 0, AV_CODEC_ID_AAC,       },
-    [CYANRIP_FORMAT_AAC_MP4]  = { "aac_mp4",  "AAC",  "mp4",   "mp4",   1,  0, 0, AV_CODEC_ID_AAC,       },
-    [CYANRIP_FORMAT_WAVPACK]  = { "wavpack",  "WV",   "wv",    "wv",    0,  3, 1, AV_CODEC_ID_WAVPACK,   },
-    [CYANRIP_FORMAT_VORBIS]   = { "vorbis",   "OGG",  "ogg",   "ogg",   0,  0, 0, AV_CODEC_ID_VORBIS,    },
-    [CYANRIP_FORMAT_ALAC]     = { "alac",     "ALAC", "m4a",   "ipod",  0,  2, 1, AV_CODEC_ID_ALAC,      },
-    [CYANRIP_FORMAT_ALAC_MP4] = { "alac_mp4", "ALAC", "mp4",   "mp4",   1,  2, 1, AV_CODEC_ID_ALAC,      },
-    [CYANRIP_FORMAT_WAV]      = { "wav",      "WAV",  "wav",   "wav",   0,  0, 1, AV_CODEC_ID_NONE,      },
-    [CYANRIP_FORMAT_OPUS_MP4] = { "opus_mp4", "OPUS", "mp4",   "mp4",   1, 10, 0, AV_CODEC_ID_OPUS,      },
-    [CYANRIP_FORMAT_PCM]      = { "pcm",      "PCM",  "pcm",   "s16le", 0,  0, 1, AV_CODEC_ID_NONE,      },
-};
-
 static int get_media_changed(CdIo_t *cdio) {
+    if (!cdio)
+        return 0;
     const int ret = cdio_get_media_changed(cdio);
     return ret != 0 && ret != DRIVER_OP_UNSUPPORTED;
 }
 
 static void free_track(cyanrip_ctx *ctx, cyanrip_track *t)
 {
+    cyanrip_cancel_prewarm(ctx, t);
+
     if (quit_now)
         cyanrip_immediate_stop_encoding(ctx, t);
 
@@ -76,6 +71,36 @@ static void free_track(cyanrip_ctx *ctx, cyanrip_track *t)
     crip_free_art(&t->art);
     av_dict_free(&t->meta);
     av_free(t->ar_db_entries);
+    av_free(t->tree_leaves);
+}
+
+static void cyanrip_release_drive(cyanrip_ctx *ctx)
+{
+    if (ctx->paranoia)
+        cdio_paranoia_free(ctx->paranoia);
+    if (ctx->drive)
+        cdio_cddap_close_no_free_cdio(ctx->drive);
+    if (ctx->settings.eject_on_success_rip && !ctx->total_error_count &&
+        (ctx->mcap & CDIO_DRIVE_CAP_MISC_EJECT) && ctx->cdio && !quit_now)
+        cdio_eject_media(&ctx->cdio);
+    else if (ctx->cdio)
+        cdio_destroy(ctx->cdio);
+
+    ctx->paranoia = NULL;
+    ctx->drive = NULL;
+    ctx->cdio = NULL;
+
+    crip_master_close(&ctx->master);
+}
+
+/* Waits for all outputs to be written and closed */
+static void end_track_outputs(cyanrip_ctx *ctx)
+{
+    for (int i = 0; i < ctx->nb_tracks; i++) {
+        cyanrip_cancel_prewarm(ctx, &ctx->tracks[i]);
+        for (int j = 0; j < ctx->settings.outputs_num; j++)
+            cyanrip_end_track_encoding(&ctx->tracks[i].enc_ctx[j]);
+    }
 }
 
 static void cyanrip_ctx_end(cyanrip_ctx **s)
@@ -88,21 +113,20 @@ static void cyanrip_ctx_end(cyanrip_ctx **s)
     for (int i = 0; i < ctx->nb_tracks; i++)
         free_track(ctx, &ctx->tracks[i]);
 
+    cr_sink_close(&ctx->sink);
+
     for (int i = 0; i < ctx->nb_cover_arts; i++)
         crip_free_art(&ctx->cover_arts[i]);
 
     cyanrip_finalize_ebur128(ctx, 0);
+    cyanrip_finalize_filtering(ctx, 0);
+    cr_pool_free(&ctx->pool);
     av_free(ctx->mb_submission_url);
 
-    if (ctx->paranoia)
-        cdio_paranoia_free(ctx->paranoia);
-    if (ctx->drive)
-        cdio_cddap_close_no_free_cdio(ctx->drive);
-    if (ctx->settings.eject_on_success_rip && !ctx->total_error_count &&
-        (ctx->mcap & CDIO_DRIVE_CAP_MISC_EJECT) && ctx->cdio && !quit_now)
-        cdio_eject_media(&ctx->cdio);
-    else if (ctx->cdio)
-        cdio_destroy(ctx->cdio);
+    cyanrip_release_drive(ctx);
+
+    /* Whatever got closed since, or on an early exit */
+    cr_writer_sync();
 
     free(ctx->settings.dev_path);
     av_dict_free(&ctx->meta);
@@ -111,14 +135,6 @@ static void cyanrip_ctx_end(cyanrip_ctx **s)
     *s = NULL;
 }
 
-static const paranoia_mode_t paranoia_level_map[] = {
-    [0] = PARANOIA_MODE_DISABLE, /* Disable everything */
-    [1] = PARANOIA_MODE_OVERLAP, /* Perform overlapped reads */
-    [2] = PARANOIA_MODE_OVERLAP | PARANOIA_MODE_VERIFY, /* Perform and verify overlapped reads */
-    [3] = PARANOIA_MODE_FULL ^ PARANOIA_MODE_NEVERSKIP, /* Maximum, but do allow skipping sectors */
-};
-const int crip_max_paranoia_level = (sizeof(paranoia_level_map) / sizeof(paranoia_level_map[0])) - 1;
-
 /*
 * Whether the string ends with suffix
 */
@@ -150,22 +166,15 @@ static CdIo_t *cyanrip_open_dev(const char *dev_path)
     return cdio_open(dev_path, DRIVER_UNKNOWN);
 }
 
-static int cyanrip_ctx_init(cyanrip_ctx **s, cyanrip_settings *settings)
+/* Opens the drive, and reads the disc's TOC */
+static int cyanrip_open_drive(cyanrip_ctx *ctx)
 {
-    cyanrip_ctx *ctx = av_mallocz(sizeof(cyanrip_ctx));
-
-    memcpy(&ctx->settings, settings, sizeof(cyanrip_settings));
-
-    if (ctx->settings.print_info_only)
-        ctx->settings.eject_on_success_rip = 0;
-
     cdio_init();
 
     if (!ctx->settings.dev_path) {
         ctx->settings.dev_path = cdio_get_default_device(NULL);
         if (!ctx->settings.dev_path) {
             cyanrip_log(ctx, 0, "No device specified and unable to get default device!\n");
-            cyanrip_ctx_end(&ctx);
             return AVERROR(EINVAL);
         }
     }
@@ -173,7 +182,6 @@ static int cyanrip_ctx_init(cyanrip_ctx **s, cyanrip_settings *settings)
     ctx->cdio = cyanrip_open_dev(ctx->settings.dev_path);
     if (!ctx->cdio) {
         cyanrip_log(ctx, 0, "Unable to open device: %s\n", ctx->settings.dev_path);
-        cyanrip_ctx_end(&ctx);
         return AVERROR(EINVAL);
     }
 
@@ -198,20 +206,18 @@ static int cyanrip_ctx_init(cyanrip_ctx **s, cyanrip_settings *settings)
     int ret = cdio_cddap_open(ctx->drive);
     if (ret < 0) {
         cyanrip_log(ctx, 0, "Unable to open device!\n");
-        cyanrip_ctx_end(&ctx);
         return AVERROR(EINVAL);
     }
 
     cdio_cddap_verbose_set(ctx->drive, CDDA_MESSAGE_LOGIT, CDDA_MESSAGE_FORGETIT);
 
-    if (settings->speed) {
+    if (ctx->settings.speed) {
         if (!(ctx->mcap & CDIO_DRIVE_CAP_MISC_SELECT_SPEED)) {
             cyanrip_log(ctx, 0, "Device does not support changing speeds!\n");
-            cyanrip_ctx_end(&ctx);
             return AVERROR(EINVAL);
         }
 
-        ret = cdio_cddap_speed_set(ctx->drive, settings->speed);
+        ret = cdio_cddap_speed_set(ctx->drive, ctx->settings.speed);
         msg = cdio_cddap_errors(ctx->drive);
         if (msg) {
             cyanrip_log(ctx, 0, "cdio error: %s\n", msg);
@@ -224,44 +230,64 @@ static int cyanrip_ctx_init(cyanrip_ctx **s, cyanrip_settings *settings)
     ctx->paranoia = cdio_paranoia_init(ctx->drive);
     if (!ctx->paranoia) {
         cyanrip_log(ctx, 0, "Unable to init paranoia!\n");
-        cyanrip_ctx_end(&ctx);
         return AVERROR(EINVAL);
     }
 
-    cdio_paranoia_modeset(ctx->paranoia, paranoia_level_map[settings->paranoia_level]);
+    cdio_paranoia_modeset(ctx->paranoia, paranoia_level_map[ctx->settings.paranoia_level]);
 
     ctx->start_lsn = 0;
 
     ctx->end_lsn = cdio_get_track_lsn(ctx->cdio, CDIO_CDROM_LEADOUT_TRACK) - 1;
     ctx->duration_frames = ctx->end_lsn - ctx->start_lsn + 1;
 
-    ctx->nb_tracks = ctx->nb_cd_tracks = cdio_cddap_tracks(ctx->drive);
-    if ((ctx->nb_tracks < 1) || (ctx->nb_tracks > CDIO_CD_MAX_TRACKS)) {
-        cyanrip_log(ctx, 0, "Invalid number of tracks: %i!\n", ctx->nb_tracks);
-        ctx->nb_tracks = 0;
-        cyanrip_ctx_end(&ctx);
+    ctx->nb_cd_tracks = cdio_cddap_tracks(ctx->drive);
+    if ((ctx->nb_cd_tracks < 1) || (ctx->nb_cd_tracks > CDIO_CD_MAX_TRACKS)) {
+        cyanrip_log(ctx, 0, "Invalid number of tracks: %i!\n", ctx->nb_cd_tracks);
+        ctx->nb_cd_tracks = 0;
         return AVERROR(EINVAL);
     }
 
     int first_track_nb = cdio_get_first_track_num(ctx->cdio);
+    for (int i = 0; i < ctx->nb_cd_tracks; i++) {
+        CRIPTocEntry *e = &ctx->toc[i];
+
+        e->number = i + first_track_nb;
+        e->is_data = !cdio_cddap_track_audiop(ctx->drive, e->number);
+        e->pregap_lsn = cyanrip_get_track_pregap_lsn(ctx->cdio, e->number);
+        e->start_lsn = cdio_get_track_lsn(ctx->cdio, e->number);
+        e->end_lsn = cdio_get_track_last_lsn(ctx->cdio, e->number);
+
+        if ((i == (ctx->nb_cd_tracks - 1)) && (e->end_lsn == CDIO_INVALID_LSN)) {
+            e->end_lsn = ctx->end_lsn;
+        } else if (e->end_lsn == CDIO_INVALID_LSN) {
+            cyanrip_log(ctx, 0, "CDIO returned invalid track %i end LSN\n", i + 1);
+            return AVERROR(EINVAL);
+        }
+    }
+
+    /* For hot removal detection - init this so we can detect changes */
+    get_media_changed(ctx->cdio);
+
+    return 0;
+}
+
+/* Sets up the tracks from the TOC, wherever it came from */
+static void setup_tracks(cyanrip_ctx *ctx)
+{
+    ctx->nb_tracks = ctx->nb_cd_tracks;
+
     for (int i = 0; i < ctx->nb_cd_tracks; i++) {
         cyanrip_track *t = &ctx->tracks[i];
+        const CRIPTocEntry *e = &ctx->toc[i];
 
         t->index = i + 1;
-        t->number = t->cd_track_number = i + first_track_nb;
-        t->track_is_data = !cdio_cddap_track_audiop(ctx->drive, t->number);
-        t->pregap_lsn = cyanrip_get_track_pregap_lsn(ctx->cdio, t->number);
+        t->number = t->cd_track_number = e->number;
+        t->track_is_data = e->is_data;
+        t->pregap_lsn = e->pregap_lsn;
         t->dropped_pregap_start = CDIO_INVALID_LSN;
         t->merged_pregap_end = CDIO_INVALID_LSN;
-        t->start_lsn = cdio_get_track_lsn(ctx->cdio, t->number);
-        t->end_lsn = cdio_get_track_last_lsn(ctx->cdio, t->number);
-
-        if ((i == (ctx->nb_cd_tracks - 1)) && (t->end_lsn == CDIO_INVALID_LSN)) {
-            t->end_lsn = ctx->end_lsn;
-        } else if (t->end_lsn == CDIO_INVALID_LSN) {
-            cyanrip_log(ctx, 0, "CDIO returned invalid track %i end LSN\n", t->index);
-            return AVERROR(EINVAL);
-        }
+        t->start_lsn = e->start_lsn;
+        t->end_lsn = e->end_lsn;
 
         t->start_lsn_sig = t->start_lsn;
         t->end_lsn_sig = t->end_lsn;
@@ -293,9 +319,45 @@ static int cyanrip_ctx_init(cyanrip_ctx **s, cyanrip_settings *settings)
         t->acurip_track_is_last = 1;
         break;
     }
+}
 
-    /* For hot removal detection - init this so we can detect changes */
-    get_media_changed(ctx->cdio);
+static int cyanrip_ctx_init(cyanrip_ctx **s, cyanrip_settings *settings)
+{
+    cyanrip_ctx *ctx = av_mallocz(sizeof(cyanrip_ctx));
+
+    memcpy(&ctx->settings, settings, sizeof(cyanrip_settings));
+
+    ctx->nb_live_outputs = ctx->settings.outputs_num - ctx->settings.defer_lossy;
+
+    cr_budget_set_limit((int64_t)ctx->settings.memory_budget << 20);
+
+    ctx->pool = cr_pool_create(0);
+    if (!ctx->pool) {
+        cyanrip_log(ctx, 0, "Unable to create worker threads!\n");
+        cyanrip_ctx_end(&ctx);
+        return AVERROR(ENOMEM);
+    }
+
+    /* No drive */
+    if (ctx->settings.from_master) {
+        *s = ctx;
+        return 0;
+    }
+
+    if (ctx->settings.print_info_only)
+        ctx->settings.eject_on_success_rip = 0;
+
+    int ret;
+    if (ctx->settings.resplit)
+        ret = crip_master_load(ctx, ctx->settings.resplit);
+    else
+        ret = cyanrip_open_drive(ctx);
+    if (ret < 0) {
+        cyanrip_ctx_end(&ctx);
+        return ret;
+    }
+
+    setup_tracks(ctx);
 
     *s = ctx;
     return 0;
@@ -382,79 +444,59 @@ static void copy_album_to_track_meta(cyanrip_ctx *ctx)
 
 static const uint8_t silent_frame[CDIO_CD_FRAMESIZE_RAW] = { 0 };
 
-uint64_t paranoia_status[PARANOIA_CB_FINISHED + 1] = { 0 };
-
 static void status_cb(long int n, paranoia_cb_mode_t status)
 {
     if (status >= PARANOIA_CB_READ && status <= PARANOIA_CB_FINISHED)
         paranoia_status[status]++;
 }
 
+static void cyanrip_seek(cyanrip_ctx *ctx, lsn_t lsn)
+{
+    ctx->read_lsn = lsn;
+    if (!ctx->settings.resplit)
+        cdio_paranoia_seek(ctx->paranoia, lsn, SEEK_SET);
+}
+
 static const uint8_t *cyanrip_read_frame(cyanrip_ctx *ctx)
 {
     int err = 0;
     char *msg = NULL;
 
     const uint8_t *data;
-    data = (void *)cdio_paranoia_read_limited(ctx->paranoia, &status_cb,
-                                              ctx->settings.max_retries);
+    if (ctx->settings.resplit) {
+        data = crip_master_read(ctx->master, ctx->read_lsn);
+        if (!data) {
+            cyanrip_log(ctx, 0, "\nSector %i is not in the disc master!\n", ctx->read_lsn);
+            err = 1;
+        }
+    } else {
+        data = (void *)cdio_paranoia_read_limited(ctx->paranoia, &status_cb,
+                                                  ctx->settings.max_retries);
 
-    msg = cdio_cddap_errors(ctx->drive);
-    if (msg) {
-        cyanrip_log(ctx, 0, "\ncdio error: %s\n", msg);
-        cdio_cddap_free_messages(msg);
-        err = 1;
+        msg = cdio_cddap_errors(ctx->drive);
+        if (msg) {
+            cyanrip_log(ctx, 0, "\ncdio error: %s\n", msg);
+            cdio_cddap_free_messages(msg);
+            err = 1;
+        }
     }
 
     if (!data) {
-        if (!msg) {
+        if (!msg && !err) {
             cyanrip_log(ctx, 0, "\nFrame read failed!\n");
             err = 1;
         }
         data = silent_frame;
+    } else if (ctx->master && !ctx->settings.resplit) {
+        crip_master_write(ctx->master, ctx->read_lsn, data);
     }
 
     ctx->total_error_count += err;
+    ctx->read_lsn++;
 
     return data;
 }
 
-static int search_for_offset(cyanrip_track *t, int *offset_found,
-                             const uint8_t *mem, int dir,
-                             int guess, int bytes)
-{
-    if (guess) {
-        const uint8_t *start_addr = mem + guess*4;
-        uint32_t accurip_v1 = 0x0;
-        for (int j = 0; j < (CDIO_CD_FRAMESIZE_RAW >> 2); j++)
-            accurip_v1 += AV_RL32(&start_addr[j*4]) * (j + 1);
-        if (crip_find_ar(t, accurip_v1, 1) == t->ar_db_max_confidence && accurip_v1) {
-            *offset_found = guess;
-            return 1;
-        }
-    }
-
-    for (int byte_off = ((dir < 0) * 4); byte_off < bytes; byte_off += 4) {
-        if (quit_now)
-            return 0;
-
-        int offset = dir * (byte_off >> 2);
-        if (guess == offset)
-            continue;
-
-        const uint8_t *start_addr = mem + dir * byte_off;
-        uint32_t accurip_v1 = 0x0;
-        for (int j = 0; j < (CDIO_CD_FRAMESIZE_RAW >> 2); j++)
-            accurip_v1 += AV_RL32(&start_addr[j*4]) * (j + 1);
-        if (crip_find_ar(t, accurip_v1, 1) == t->ar_db_max_confidence && accurip_v1) {
-            *offset_found = offset;
-            return 1;
-        }
-    }
-
-    return 0;
-}
-
 static void search_for_drive_offset(cyanrip_ctx *ctx, int range)
 {
     int had_ar = 0, did_check = 0;
@@ -486,7 +528,7 @@ static void search_for_drive_offset(cyanrip_ctx *ctx, int range)
         size_t bytes = 0;
 
         cyanrip_log(ctx, 0, "Loading data for track %i...\n", t_idx + 1);
-        cdio_paranoia_seek(ctx->paranoia, start, SEEK_SET);
+        cyanrip_seek(ctx, start);
         for (int i = 0; i < 2*range; i++) {
             const uint8_t *data = cyanrip_read_frame(ctx);
             memcpy(mem + bytes, data, CDIO_CD_FRAMESIZE_RAW);
@@ -502,11 +544,11 @@ static void search_for_drive_offset(cyanrip_ctx *ctx, int range)
 
         cyanrip_log(ctx, 0, "Data loaded, searching for offsets...\n");
 
-        found = search_for_offset(t, &offset, mem + (bytes >> 1), dir, offset_found_samples,
-                                  range * CDIO_CD_FRAMESIZE_RAW);
+        found = crip_search_ar_offset(t, &offset, mem + (bytes >> 1), dir, offset_found_samples,
+                                      range * CDIO_CD_FRAMESIZE_RAW, &quit_now);
         if (!found)
-            found = search_for_offset(t, &offset, mem + (bytes >> 1), -dir, 0,
-                                      range * CDIO_CD_FRAMESIZE_RAW);
+            found = crip_search_ar_offset(t, &offset, mem + (bytes >> 1), -dir, 0,
+                                          range * CDIO_CD_FRAMESIZE_RAW, &quit_now);
 
         if (!found) {
             cyanrip_log(ctx, 0, "Nothing found for track %i%s\n", t_idx + 1,
@@ -554,14 +596,26 @@ end:
 
 static void track_read_extra(cyanrip_ctx *ctx, cyanrip_track *t)
 {
+    CRIPTocEntry *e = &ctx->toc[t->cd_track_number - ctx->toc[0].number];
+
+    /* The master has what the drive said */
+    if (ctx->settings.resplit) {
+        t->preemphasis = e->preemphasis;
+        t->preemphasis_in_subcode = e->preemphasis_in_subcode;
+        if (e->isrc[0] && !dict_get(t->meta, "isrc"))
+            av_dict_set(&t->meta, "isrc", e->isrc, 0);
+        return;
+    }
+
     if (!t->track_is_data) {
         /* ISRC code */
         if (!ctx->disregard_cd_isrc && (ctx->rcap & CDIO_DRIVE_CAP_READ_ISRC) && !dict_get(t->meta, "isrc")) {
             const char *isrc_str = cdio_get_track_isrc(ctx->cdio, t->cd_track_number);
             if (isrc_str) {
-                if (strlen(isrc_str))
+                if (strlen(isrc_str)) {
                     av_dict_set(&t->meta, "isrc", isrc_str, 0);
-                else
+                    av_strlcpy(e->isrc, isrc_str, sizeof(e->isrc));
+                } else
                     ctx->disregard_cd_isrc = 1;
                 cdio_free((void *)isrc_str);
             } else {
@@ -582,7 +636,36 @@ static void track_read_extra(cyanrip_ctx *ctx, cyanrip_track *t)
                 t->preemphasis = t->preemphasis_in_subcode = subchannel_data.control & 0x01;
             }
         }
+
+        e->preemphasis = t->preemphasis;
+        e->preemphasis_in_subcode = t->preemphasis_in_subcode;
+        e->extra_read = 1;
+    }
+}
+
+/* Reads whatever the disc master is still missing, and closes it */
+static int cyanrip_finish_master(cyanrip_ctx *ctx)
+{
+    lsn_t start;
+    int frames;
+
+    /* Tracks may not start at 1, or not all be ripped */
+    for (int i = 0; i < ctx->nb_tracks; i++) {
+        cyanrip_track *t = &ctx->tracks[i];
+        if (!t->track_is_data &&
+            !ctx->toc[t->cd_track_number - ctx->toc[0].number].extra_read)
+            track_read_extra(ctx, t);
+    }
+
+    while (!quit_now && crip_master_next_gap(ctx->master, &start, &frames)) {
+        cyanrip_log(ctx, 0, "Reading %i frames from LSN %i into the disc master...\n",
+                    frames, start);
+        cyanrip_seek(ctx, start);
+        for (int i = 0; i < frames && !quit_now; i++)
+            cyanrip_read_frame(ctx);
     }
+
+    return crip_master_close(&ctx->master);
 }
 
 static double sample_peak_rel_amp(const uint8_t *data, const int bytes) {
@@ -601,6 +684,21 @@ static double sample_peak_rel_amp(const uint8_t *data, const int bytes) {
     return (double)sample_peak/sample_peak_max;
 }
 
+typedef struct CRIPRepeatCandidate {
+    uint32_t eac_crc;
+    int nb_rips;
+    cyanrip_dec_ctx *dec_ctx;
+    cyanrip_enc_ctx *enc_ctx[CYANRIP_FORMATS_NB];
+} CRIPRepeatCandidate;
+
+static void discard_candidate_encoding(cyanrip_ctx *ctx, cyanrip_enc_ctx **enc_ctx,
+                                       cyanrip_dec_ctx **dec_ctx)
+{
+    for (int i = 0; i < ctx->settings.outputs_num; i++)
+        cyanrip_discard_encoding(ctx, &enc_ctx[i]);
+    cyanrip_free_dec_ctx(ctx, dec_ctx);
+}
+
 static int cyanrip_rip_track(cyanrip_ctx *ctx, cyanrip_track *t)
 {
     int ret = 0;
@@ -622,12 +720,11 @@ static int cyanrip_rip_track(cyanrip_ctx *ctx, cyanrip_track *t)
     track_set_creation_time(ctx, t);
 
     uint32_t start_frames_read;
-    uint32_t *last_checksums = NULL;
-    uint32_t nb_last_checksums = 0;
-    uint32_t repeat_mode_encode = 0;
+    cyanrip_checksum_ctx checksum_ctx = { 0 };
+    CRIPRepeatCandidate *candidates = NULL;
+    int nb_candidates = 0;
     uint32_t total_repeats = 0;
-    int calc_global_peak_set = 0;
-    int calc_global_peak = !ctx->settings.ripping_retries;
+    int flushed = 0, promoted = 0;
 repeat_ripping:;
     const int frames_before_disc_start = t->frames_before_disc_start;
     const int frames = t->frames;
@@ -635,13 +732,14 @@ repeat_ripping:;
     const ptrdiff_t offs = t->partial_frame_byte_offs;
     start_frames_read = ctx->frames_read;
 
-    cdio_paranoia_seek(ctx->paranoia, t->start_lsn, SEEK_SET);
+    cyanrip_seek(ctx, t->start_lsn);
 
     int start_err = ctx->total_error_count;
 
     /* Checksum */
-    cyanrip_checksum_ctx checksum_ctx;
-    crip_init_checksum_ctx(ctx, &checksum_ctx, t);
+    ret = crip_init_checksum_ctx(ctx, &checksum_ctx, t);
+    if (ret < 0)
+        goto end;
 
     /* Fill with silence to maintain track length */
     for (int i = 0; i < frames_before_disc_start; i++) {
@@ -655,17 +753,16 @@ repeat_ripping:;
 
         crip_process_checksums(&checksum_ctx, data, bytes);
 
-        if (!ctx->settings.ripping_retries || repeat_mode_encode) {
-            ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->settings.outputs_num,
-                                               t->dec_ctx, data, bytes, calc_global_peak);
-            if (ret) {
-                cyanrip_log(ctx, 0, "Error in decoding/sending frame: %s\n", av_err2str(ret));
-                goto fail;
-            }
+        ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->nb_live_outputs,
+                                           t->dec_ctx, data, bytes);
+        if (ret) {
+            cyanrip_log(ctx, 0, "Error in decoding/sending frame: %s\n", av_err2str(ret));
+            goto fail;
         }
     }
 
     int64_t frame_last_read = av_gettime_relative();
+    int64_t read_time = 0;
     double track_sample_peak_rel_amp_precise = 0.0;
 
     /* Read the actual CD data */
@@ -679,10 +776,16 @@ repeat_ripping:;
 
         /* Flush paranoia cache if overreading into lead-out - no idea why */
         if ((t->start_lsn + i) > ctx->end_lsn)
-            cdio_paranoia_seek(ctx->paranoia, t->start_lsn + i, SEEK_SET);
+            cyanrip_seek(ctx, t->start_lsn + i);
 
         int bytes = CDIO_CD_FRAMESIZE_RAW;
+        int64_t read_start = av_gettime_relative();
         const uint8_t *data = cyanrip_read_frame(ctx);
+        read_time += av_gettime_relative() - read_start;
+
+        /* Only the time spent reading, waiting on encoders doesn't count */
+        if (!((i + 1) % 75) && read_time)
+            atomic_store(&ctx->read_rate, (int)((i + 1)*1000000LL/read_time));
 
         /* Account for partial frames caused by the offset */
         if (offs > 0) {
@@ -716,13 +819,11 @@ repeat_ripping:;
             FFMAX(frame_sample_peak_rel_amp_precise, track_sample_peak_rel_amp_precise);
 
         /* Decode and encode */
-        if (!ctx->settings.ripping_retries || repeat_mode_encode) {
-            ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->settings.outputs_num,
-                                               t->dec_ctx, data, bytes, calc_global_peak);
-            if (ret < 0) {
-                cyanrip_log(ctx, 0, "\nError in decoding/sending frame: %s\n", av_err2str(ret));
-                goto fail;
-            }
+        ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->nb_live_outputs,
+                                           t->dec_ctx, data, bytes);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "\nError in decoding/sending frame: %s\n", av_err2str(ret));
+            goto fail;
         }
 
         if (line_len > 0) {
@@ -732,8 +833,7 @@ repeat_ripping:;
 
         /* Report progress */
         line_len += snprintf(line, sizeof(line),
-                             "Ripping%strack %i, progress - %0.2f%%",
-                             (!ctx->settings.ripping_retries || repeat_mode_encode) ? " and encoding " : " ",
+                             "Ripping and encoding track %i, progress - %0.2f%%",
                              t->number, ((double)(i + 1)/frames)*100.0f);
 
         ctx->frames_read++;
@@ -805,80 +905,119 @@ repeat_ripping:;
 
         crip_process_checksums(&checksum_ctx, data, bytes);
 
-        if (!ctx->settings.ripping_retries || repeat_mode_encode) {
-            ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->settings.outputs_num,
-                                               t->dec_ctx, data, bytes, calc_global_peak);
-            if (ret < 0) {
-                cyanrip_log(ctx, 0, "Error in decoding/sending frame: %s\n", av_err2str(ret));
-                goto fail;
-            }
+        ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->nb_live_outputs,
+                                           t->dec_ctx, data, bytes);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Error in decoding/sending frame: %s\n", av_err2str(ret));
+            goto fail;
         }
     }
 
-    calc_global_peak = 0;
-
     crip_finalize_checksums(&checksum_ctx, t);
 
-    if (ctx->settings.ripping_retries) {
-        int matches = 0;
-        for (int i = 0; i < nb_last_checksums; i++)
-            matches += last_checksums[i] == checksum_ctx.eac_crc;
+    /* Every pass is encoded, and kept until its checksum wins or loses */
+    if (ctx->settings.ripping_retries && !quit_now) {
+        CRIPRepeatCandidate *cand = NULL;
+
+        ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->nb_live_outputs,
+                                           t->dec_ctx, NULL, 0);
+        if (ret) {
+            cyanrip_log(ctx, 0, "\nError sending flush signal to encoders: %s\n", av_err2str(ret));
+            goto end;
+        }
+        flushed = 1;
 
         total_repeats++;
+
+        for (int i = 0; i < nb_candidates; i++) {
+            if (candidates[i].eac_crc == t->eac_crc) {
+                cand = &candidates[i];
+                break;
+            }
+        }
+
+        if (cand) {
+            /* An earlier pass already holds the same audio */
+            cand->nb_rips++;
+            discard_candidate_encoding(ctx, t->enc_ctx, &t->dec_ctx);
+        } else {
+            cand = av_realloc_array(candidates, nb_candidates + 1, sizeof(*candidates));
+            if (!cand) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            candidates = cand;
+
+            cand = &candidates[nb_candidates++];
+            cand->eac_crc = t->eac_crc;
+            cand->nb_rips = 1;
+            cand->dec_ctx = t->dec_ctx;
+            memcpy(cand->enc_ctx, t->enc_ctx, sizeof(cand->enc_ctx));
+            t->dec_ctx = NULL;
+            memset(t->enc_ctx, 0, sizeof(t->enc_ctx));
+        }
+
+        int matches = cand->nb_rips - 1;
+
+        if (ctx->settings.ar_accept_confidence && t->ar_db_status == CYANRIP_ACCUDB_FOUND) {
+            int confidence = FFMAX(crip_find_ar(t, t->acurip_checksum_v1, 0),
+                                   crip_find_ar(t, t->acurip_checksum_v2, 0));
+            if (confidence >= ctx->settings.ar_accept_confidence) {
+                cyanrip_log(ctx, 0, "\nDone; (checksum %08X matches AccurateRip, confidence %i)\n",
+                            t->eac_crc, confidence);
+                goto promote_candidate;
+            }
+        }
         if (matches >= ctx->settings.ripping_retries) {
             cyanrip_log(ctx, 0, "\nDone; (%i out of %i matches for current checksum %08X)\n",
-                        matches, ctx->settings.ripping_retries, checksum_ctx.eac_crc);
-            goto finalize_ripping;
+                        matches, ctx->settings.ripping_retries, t->eac_crc);
+            goto promote_candidate;
         }
         if (total_repeats >= ctx->settings.max_retries) {
             cyanrip_log(ctx, 0, "\nDone; (no matches found, but hit repeat limit of %i)\n",
                         ctx->settings.max_retries);
-            goto finalize_ripping;
-        }
-
-        /* If the next match may be the last one, start encoding */
-        if ((matches + 1) >= ctx->settings.ripping_retries ||
-            (total_repeats + 1) >= ctx->settings.max_retries) {
-            repeat_mode_encode = 1;
-            if (!calc_global_peak_set) {
-                calc_global_peak_set = 1;
-                calc_global_peak = 1;
-            }
+            goto promote_candidate;
         }
 
         cyanrip_log(ctx, 0, "\nRepeating ripping (%i out of %i matches for current checksum %08X)\n",
-                    matches, ctx->settings.ripping_retries, checksum_ctx.eac_crc);
+                    matches, ctx->settings.ripping_retries, t->eac_crc);
 
-        last_checksums = av_realloc(last_checksums,
-                                    (nb_last_checksums + 1)*sizeof(*last_checksums));
-        if (!last_checksums) {
-            ret = AVERROR(ENOMEM);
+        /* Encode the next pass into temporary files */
+        ret = cyanrip_create_dec_ctx(ctx, &t->dec_ctx, t);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Error initializing decoder: %s\n", av_err2str(ret));
             goto end;
         }
 
-        last_checksums[nb_last_checksums] = checksum_ctx.eac_crc;
-        nb_last_checksums++;
-
-        int err = cyanrip_reset_encoding(ctx, t);
-        if (err < 0) {
-            cyanrip_log(ctx, 0, "Error in encoding: %s\n", av_err2str(err));
-            ret = err;
+        ret = cyanrip_init_track_encoders(ctx, t->enc_ctx, t, total_repeats);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Error in encoding: %s\n", av_err2str(ret));
             goto end;
         }
 
+        flushed = 0;
         ctx->frames_read = start_frames_read;
         goto repeat_ripping;
+
+promote_candidate:
+        /* The track's checksums are those of the current pass, which is the winner */
+        t->dec_ctx = cand->dec_ctx;
+        memcpy(t->enc_ctx, cand->enc_ctx, sizeof(t->enc_ctx));
+        cand->dec_ctx = NULL;
+        memset(cand->enc_ctx, 0, sizeof(cand->enc_ctx));
+        promoted = 1;
     }
 
-finalize_ripping:
-    cyanrip_log(NULL, 0, "\nFlushing encoders...\n");
+    if (!flushed) {
+        cyanrip_log(NULL, 0, "\nFlushing encoders...\n");
 
-    /* Flush encoders */
-    ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->settings.outputs_num,
-                                       t->dec_ctx, NULL, 0, 0);
-    if (ret) {
-        cyanrip_log(ctx, 0, "Error sending flush signal to encoders: %s\n", av_err2str(ret));
-        return ret;
+        /* Flush encoders */
+        ret = cyanrip_send_pcm_to_encoders(ctx, t->enc_ctx, ctx->nb_live_outputs,
+                                           t->dec_ctx, NULL, 0);
+        if (ret) {
+            cyanrip_log(ctx, 0, "Error sending flush signal to encoders: %s\n", av_err2str(ret));
+            goto end;
+        }
     }
 
 fail:
@@ -890,10 +1029,31 @@ fail:
     }
 
 end:
-    av_free(last_checksums);
+    crip_uninit_checksum_ctx(&checksum_ctx);
+
+    /* An unfinished pass must never replace a complete one, keep the one
+     * which matched the most instead */
+    if (nb_candidates && !promoted && (quit_now || ret < 0)) {
+        CRIPRepeatCandidate *best = &candidates[0];
+        for (int i = 1; i < nb_candidates; i++)
+            if (candidates[i].nb_rips > best->nb_rips)
+                best = &candidates[i];
+
+        discard_candidate_encoding(ctx, t->enc_ctx, &t->dec_ctx);
+        t->dec_ctx = best->dec_ctx;
+        memcpy(t->enc_ctx, best->enc_ctx, sizeof(t->enc_ctx));
+        best->dec_ctx = NULL;
+        memset(best->enc_ctx, 0, sizeof(best->enc_ctx));
+    }
+
+    /* Drop the losing passes, and remove their outputs */
+    for (int i = 0; i < nb_candidates; i++)
+        discard_candidate_encoding(ctx, candidates[i].enc_ctx, &candidates[i].dec_ctx);
+    av_free(candidates);
 
     t->total_repeats = total_repeats;
     if (!quit_now && !ret) {
+        t->encoded = 1;
         cyanrip_finalize_encoding(ctx, t);
         const double track_true_peak_rel_amp_ebu = pow(10, t->ebu_true_peak/20);
         const double track_sample_peak_rel_amp_ebu = pow(10, t->ebu_sample_peak/20);
@@ -1155,327 +1315,6 @@ static char *append_missing_keys(char *src, const char *key1, const char *key2)
     return copy;
 }
 
-static inline int crip_is_integer(const char *src)
-{
-    for (int i = 0; i < strlen(src); i++)
-        if (!av_isdigit(src[i]))
-            return 0;
-    return 1;
-}
-
-static int add_to_dir_list(char ***dir_list, int *dir_list_nb, const char *src)
-{
-    int nb = *dir_list_nb;
-    char **new_ptr = av_realloc(*dir_list, (nb + 1) * sizeof(*new_ptr));
-    if (!new_ptr)
-        return AVERROR(ENOMEM);
-
-    new_ptr[nb] = av_strdup(src);
-    nb++;
-
-    *dir_list = new_ptr;
-    *dir_list_nb = nb;
-
-    return 0;
-}
-
-struct CRIPCharReplacement {
-    const char from;
-    const char to;
-    const char to_u[5];
-    int is_avail_locally;
-} crip_char_replacement[] = {
-    { '<', '_', "‹", HAS_CH_LESS },
-    { '>', '_', "›", HAS_CH_MORE },
-    { ':', '_', "∶", HAS_CH_COLUMN },
-    { '|', '_', "│", HAS_CH_OR },
-    { '?', '_', "？", HAS_CH_Q },
-    { '*', '_', "∗", HAS_CH_ANY },
-    { '/', '_', "∕", HAS_CH_FWDSLASH },
-    { '\\', '_', "⧹", HAS_CH_BWDSLASH },
-    { '"', '\'', "“", HAS_CH_QUOTES },
-    { '"', '\'', "”", HAS_CH_QUOTES },
-    { 0 },
-};
-
-static int crip_bprint_sanitize(cyanrip_ctx *ctx, AVBPrint *buf, const char *str,
-                                char ***dir_list, int *dir_list_nb,
-                                int sanitize_fwdslash)
-{
-    int32_t cp, ret, quote_match = 0;
-    const char *pos = str, *end = str + strlen(str);
-
-    int os_sanitize = (ctx->settings.sanitize_method == CRIP_SANITIZE_OS_SIMPLE) ||
-                      (ctx->settings.sanitize_method == CRIP_SANITIZE_OS_UNICODE);
-
-    while (str < end) {
-        ret = av_utf8_decode(&cp, (const uint8_t **)&str, end, AV_UTF8_FLAG_ACCEPT_ALL);
-        if (ret < 0) {
-            cyanrip_log(ctx, 0, "Error parsing string: %s!\n", av_err2str(ret));
-            return ret;
-        }
-
-        struct CRIPCharReplacement *rep = NULL;
-        for (int i = 0; crip_char_replacement[i].from; i++) {
-            if (cp == crip_char_replacement[i].from) {
-                int is_quote = crip_char_replacement[i].from == '"';
-                rep = &crip_char_replacement[i + (is_quote && quote_match)];
-                quote_match = (quote_match + 1) & 1;
-                break;
-            }
-        }
-
-        int skip = !rep;
-        int skip_sanitation = rep && (os_sanitize && rep->is_avail_locally);
-        int passthrough_slash = rep && !skip_sanitation && (rep->from == OS_DIR_CHAR && !sanitize_fwdslash);
-
-        if (skip || skip_sanitation || passthrough_slash) {
-            if (passthrough_slash)
-                add_to_dir_list(dir_list, dir_list_nb, buf->str);
-            av_bprint_append_data(buf, pos, str - pos);
-            pos = str;
-            continue;
-        } else if (ctx->settings.sanitize_method == CRIP_SANITIZE_SIMPLE ||
-                   ctx->settings.sanitize_method == CRIP_SANITIZE_OS_SIMPLE) {
-            av_bprint_chars(buf, rep->to, 1);
-        } else if (ctx->settings.sanitize_method == CRIP_SANITIZE_UNICODE ||
-                   ctx->settings.sanitize_method == CRIP_SANITIZE_OS_UNICODE) {
-            av_bprint_append_data(buf, rep->to_u, strlen(rep->to_u));
-        }
-
-        pos = str;
-    }
-
-    return 0;
-}
-
-static char *get_dir_tag_val(cyanrip_ctx *ctx, AVDictionary *meta,
-                             const char *ofmt, const char *key)
-{
-    char *val = NULL;
-    if (!strcmp(key, "year")) {
-        const char *date = dict_get(meta, "date");
-        if (date) {
-            char *save_year, *date_dup = av_strdup(date);
-            val = av_strdup(av_strtok(date_dup, ":-", &save_year));
-            av_free(date_dup);
-        }
-    } else if (!strcmp(key, "format")) {
-        val = av_strdup(ofmt);
-    } else if (!strcmp(key, "track")) {
-        const char *track = dict_get(meta, "track");
-        if (crip_is_integer(track)) {
-            int pad = 0, digits = strlen(track);
-            if (((digits + pad) < 2) && ctx->nb_tracks >  9) pad++;
-            if (((digits + pad) < 3) && ctx->nb_tracks > 99) pad++;
-            val = av_mallocz(pad + digits + 1);
-            for (int i = 0; i < pad; i++)
-                val[i] = '0';
-            memcpy(&val[pad], track, digits);
-        } else {
-            val = av_strdup(track);
-        }
-    } else {
-        val = av_strdup(dict_get(meta, key));
-    }
-
-    return val;
-}
-
-static int process_cond(cyanrip_ctx *ctx, AVBPrint *buf, AVDictionary *meta,
-                        const char *ofmt, char ***dir_list, int *dir_list_nb,
-                        const char *scheme)
-{
-    char *scheme_copy = av_strdup(scheme);
-
-    char *save, *tok = av_strtok(scheme_copy, "{}", &save);
-    while (tok) {
-        if (!strncmp(tok, "if", strlen("if"))) {
-            char *cond = av_strdup(tok);
-            char *cond_save, *cond_tok = av_strtok(cond, "#", &cond_save);
-
-            cond_tok = av_strtok(NULL, "#", &cond_save);
-            if (!cond_tok) {
-                cyanrip_log(ctx, 0, "Invalid scheme syntax, no \"#\"!\n");
-                av_free(cond);
-                goto fail;
-            }
-
-            int val1_origin_is_tag = 1;
-            char *val1 = get_dir_tag_val(ctx, meta, ofmt, cond_tok);
-            if (!val1) {
-                val1 = av_strdup(tok);
-                val1_origin_is_tag = 0;
-            }
-
-            cond_tok = av_strtok(NULL, "#", &cond_save);
-            if (!cond_tok) {
-                cyanrip_log(ctx, 0, "Invalid scheme syntax, no terminating \"#\"!\n");
-                av_free(cond);
-                av_free(val1);
-                goto fail;
-            }
-
-            int cond_is_eq = 0, cond_is_not_eq = 0, cond_is_more = 0, cond_is_less = 0;
-            if (strstr(cond_tok, "==")) {
-                cond_is_eq = 1;
-            } else if (strstr(cond_tok, "!=")) {
-                cond_is_not_eq = 1;
-            } else if (strstr(cond_tok, ">")) {
-                cond_is_more = 1;
-            } else if (strstr(cond_tok, "<")) {
-                cond_is_less = 1;
-            } else {
-                cyanrip_log(ctx, 0, "Invalid condition syntax!\n");
-                av_free(cond);
-                av_free(val1);
-                goto fail;
-            }
-
-            cond_tok = av_strtok(NULL, "#", &cond_save);
-            if (!cond_tok) {
-                cyanrip_log(ctx, 0, "Invalid scheme syntax, no terminating \"#\"!\n");
-                goto fail;
-            }
-
-            int val2_origin_is_tag = 1;
-            char *val2 = get_dir_tag_val(ctx, meta, ofmt, cond_tok);
-            if (!val2) {
-                val2 = av_strdup(cond_tok);
-                val2_origin_is_tag = 0;
-            }
-
-            cond_tok = av_strtok(NULL, "#", &cond_save);
-            if (!cond_tok) {
-                cyanrip_log(ctx, 0, "Invalid scheme syntax, no terminating \"#\"!\n");
-                goto fail;
-            }
-
-            int cond_true = 0;
-            cond_true |= cond_is_eq && !strcmp(val1, val2);
-            cond_true |= cond_is_not_eq && strcmp(val1, val2);
-
-            if (cond_is_less || cond_is_more) {
-                int val1_is_int = crip_is_integer(val1), val2_is_int = crip_is_integer(val2);
-                if (!val1_is_int && (val1_is_int == val2_is_int)) { /* None are int */
-                    cond_true = cond_is_less ? (strcmp(val1, val2) < 0) : (cond_is_more ? strcmp(val1, val2) > 0 : 0);
-                } else if (val1_is_int && (val1_is_int == val2_is_int)) { /* Both are int */
-                    int64_t val1_dec = strtol(val1, NULL, 10);
-                    int64_t val2_dec = strtol(val2, NULL, 10);
-                    cond_true |= cond_is_less && val1_dec < val2_dec;
-                    cond_true |= cond_is_more && val1_dec > val2_dec;
-                } else {
-                    ptrdiff_t val1_dec = val1_is_int ? strtol(val1, NULL, 10) : (!val1_origin_is_tag ? 0 : (ptrdiff_t)val1);
-                    ptrdiff_t val2_dec = val2_is_int ? strtol(val2, NULL, 10) : (!val2_origin_is_tag ? 0 : (ptrdiff_t)val2);
-                    cond_true |= cond_is_less && val1_dec < val2_dec;
-                    cond_true |= cond_is_more && val1_dec > val2_dec;
-                }
-            }
-
-            if (cond_true) {
-                char *true_save, *true_tok = av_strtok(cond_tok, "|", &true_save);
-                while (true_tok) {
-                    int origin_is_tag = 1;
-                    char *true_val = get_dir_tag_val(ctx, meta, ofmt, true_tok);
-                    if (!true_val) {
-                        true_val = av_strdup(true_tok);
-                        origin_is_tag = 0;
-                    }
-
-                    crip_bprint_sanitize(ctx, buf, true_val, dir_list, dir_list_nb, origin_is_tag);
-                    av_free(true_val);
-
-                    true_tok = av_strtok(NULL, "|", &true_save);
-                }
-            }
-
-            av_free(val2);
-            av_free(val1);
-            av_free(cond);
-
-            tok = av_strtok(NULL, "{}", &save);
-            continue;
-        }
-
-        int origin_is_tag = 1;
-        char *val = get_dir_tag_val(ctx, meta, ofmt, tok);
-        if (!val) {
-            val = av_strdup(tok);
-            origin_is_tag = 0;
-        }
-
-        crip_bprint_sanitize(ctx, buf, val, dir_list, dir_list_nb, origin_is_tag);
-        av_free(val);
-
-        tok = av_strtok(NULL, "{}", &save);
-    }
-
-    av_free(scheme_copy);
-    return 0;
-
-fail:
-    av_free(scheme_copy);
-    return AVERROR(EINVAL);
-}
-
-char *crip_get_path(cyanrip_ctx *ctx, enum CRIPPathType type, int create_dirs,
-                    const cyanrip_out_fmt *fmt, void *arg)
-{
-    char *ret = NULL;
-    AVBPrint buf;
-    char **dir_list = NULL;
-    int dir_list_nb = 0;
-    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
-
-    if (process_cond(ctx, &buf, ctx->meta, fmt->folder_suffix, &dir_list, &dir_list_nb,
-                     ctx->settings.folder_name_scheme))
-        goto end;
-
-    add_to_dir_list(&dir_list, &dir_list_nb, buf.str);
-    av_bprint_chars(&buf, OS_DIR_CHAR, 1);
-
-    char *ext = NULL;
-    if (type == CRIP_PATH_COVERART) {
-        CRIPArt *art = arg;
-        crip_bprint_sanitize(ctx, &buf, dict_get(art->meta, "title"), &dir_list, &dir_list_nb, 0);
-        ext = art->extension ? av_strdup(art->extension) : av_strdup("<extension>");
-    } else if (type == CRIP_PATH_LOG) {
-        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
-                         ctx->settings.log_name_scheme))
-            goto end;
-        ext = av_strdup("log");
-    } else if (type == CRIP_PATH_CUE) {
-        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
-                         ctx->settings.cue_name_scheme))
-            goto end;
-        ext = av_strdup("cue");
-    } else {
-        cyanrip_track *t = arg;
-        if (process_cond(ctx, &buf, t->meta, fmt->name, &dir_list, &dir_list_nb,
-                         ctx->settings.track_name_scheme))
-            goto end;
-        ext = av_strdup(t->track_is_data ? "bin" : fmt->ext);
-    }
-
-    if (ext)
-        av_bprintf(&buf, ".%s", ext);
-    av_free(ext);
-
-end:
-    for (int i = 0; i < dir_list_nb; i++) {
-        if (create_dirs) {
-            cyanrip_stat_t st_req = { 0 };
-            if (cyanrip_stat(dir_list[i], &st_req) == -1)
-                mkdir(dir_list[i], 0700);
-        }
-        av_free(dir_list[i]);
-    }
-    av_free(dir_list);
-
-    av_bprint_finalize(&buf, &ret);
-    return ret;
-}
-
 int main(int argc, char **argv)
 {
     cyanrip_ctx *ctx = NULL;
@@ -1490,6 +1329,11 @@ int main(int argc, char **argv)
     if (signal(SIGINT, on_quit_signal) == SIG_ERR)
         cyanrip_log(ctx, 0, "Can't init signal handler!\n");
 
+#ifdef SIGPIPE
+    /* A sink's reader going away is a write error, not a crash */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
     /* Default settings */
     settings.dev_path = NULL;
     settings.folder_name_scheme = "{album}{if #releasecomment# > #0# (|releasecomment|)} [{format}]";
@@ -1502,6 +1346,17 @@ int main(int argc, char **argv)
     settings.over_under_read_frames = 0;
     settings.offset = 0;
     settings.ripping_retries = 0;
+    settings.ar_accept_confidence = 0;
+    settings.memory_budget = 512;
+    settings.compression_level = -1;
+    settings.writer_flags = 0;
+    settings.defer_lossy = 0;
+    settings.from_master = NULL;
+    settings.write_master = 0;
+    settings.resplit = NULL;
+    settings.verify_outputs = 0;
+    settings.write_manifest = 0;
+    settings.sink = NULL;
     settings.print_info_only = 0;
     settings.disable_mb = 0;
     settings.disable_coverart_db = 0;
@@ -1516,9 +1371,12 @@ int main(int argc, char **argv)
     settings.eject_on_success_rip = 0;
     settings.outputs[0] = CYANRIP_FORMAT_FLAC;
     settings.outputs_num = 1;
+    settings.checksums[0] = CRIP_CHECKSUM_EAC;
+    settings.checksums[1] = CRIP_CHECKSUM_ACCURIP;
+    settings.checksums_num = 2;
     settings.disable_coverart_embedding = 0;
     settings.enable_replaygain = 1;
-    settings.paranoia_level = FF_ARRAY_ELEMS(paranoia_level_map) - 1;
+    settings.paranoia_level = crip_max_paranoia_level;
 
     memset(settings.pregap_action, CYANRIP_PREGAP_DEFAULT, 198*sizeof(*settings.pregap_action));
 
@@ -1541,7 +1399,18 @@ int main(int argc, char **argv)
     int track_cover_arts_map[198] = { 0 };
     int nb_track_cover_arts = 0;
 
-    while ((c = getopt(argc, argv, "hNAUfHIVQEGWKOl:a:t:b:c:r:d:o:s:S:D:p:C:R:P:F:L:T:M:Z:m:")) != -1) {
+    enum { OPT_FROM_MASTER = 256, OPT_MASTER, OPT_RESPLIT, OPT_MANIFEST, OPT_SINK };
+    static const struct option long_options[] = {
+        { "from-master", required_argument, NULL, OPT_FROM_MASTER },
+        { "master",      no_argument,       NULL, OPT_MASTER      },
+        { "resplit",     required_argument, NULL, OPT_RESPLIT     },
+        { "manifest",    no_argument,       NULL, OPT_MANIFEST    },
+        { "sink",        required_argument, NULL, OPT_SINK        },
+        { NULL },
+    };
+
+    while ((c = getopt_long(argc, argv, "hNAUfHIVQEGWKOJuevl:a:t:b:c:r:d:o:k:s:S:D:p:C:R:P:F:L:T:M:Z:z:m:B:X:",
+                            long_options, NULL)) != -1) {
         switch (c) {
         case 'h':
             cyanrip_log(ctx, 0, "cyanrip %s (%s) help:\n", PROJECT_VERSION_STRING, vcstag);
@@ -1550,6 +1419,7 @@ int main(int argc, char **argv)
             cyanrip_log(ctx, 0, "    -s <int>              CD Drive offset in samples (default: 0)\n");
             cyanrip_log(ctx, 0, "    -r <int>              Maximum number of retries for frames and repeated rips (default: 10)\n");
             cyanrip_log(ctx, 0, "    -Z <int>              Rips tracks until their checksums match <int> number of times. For very damaged CDs.\n");
+            cyanrip_log(ctx, 0, "    -z <int>              With -Z, accept a track at once if it matches AccurateRip with at least <int> confidence\n");
             cyanrip_log(ctx, 0, "    -S <int>              Set drive speed (default: unset)\n");
             cyanrip_log(ctx, 0, "    -p <number>=<string>  Track pregap handling (default: default)\n");
             cyanrip_log(ctx, 0, "    -P <int>              Paranoia level, %i to 0 inclusive, default: %i\n", crip_max_paranoia_level, settings.paranoia_level);
@@ -1558,9 +1428,12 @@ int main(int argc, char **argv)
             cyanrip_log(ctx, 0, "    -E                    Force CD deemphasis\n");
             cyanrip_log(ctx, 0, "    -W                    Disable automatic CD deemphasis\n");
             cyanrip_log(ctx, 0, "    -K                    Disable ReplayGain tagging\n");
+            cyanrip_log(ctx, 0, "    -k <list>             Comma separated list of extra checksums to compute\n");
+            cyanrip_log(ctx, 0, "    -v                    Verify lossless outputs by decoding them back while encoding\n");
             cyanrip_log(ctx, 0, "\n  Output options:\n");
             cyanrip_log(ctx, 0, "    -o <string>           Comma separated list of outputs\n");
             cyanrip_log(ctx, 0, "    -b <kbps>             Bitrate of lossy files in kbps\n");
+            cyanrip_log(ctx, 0, "    -X <int>              Compression level of lossless files, \"auto\" to match the drive's speed\n");
             cyanrip_log(ctx, 0, "    -D <string>           Directory naming scheme, by default its \"%s\"\n", settings.folder_name_scheme);
             cyanrip_log(ctx, 0, "    -F <string>           Track naming scheme, by default its \"%s\"\n", settings.track_name_scheme);
             cyanrip_log(ctx, 0, "    -L <string>           Log file name scheme, by default its \"%s\"\n", settings.log_name_scheme);
@@ -1581,6 +1454,15 @@ int main(int argc, char **argv)
             cyanrip_log(ctx, 0, "    -G                    Disables embedding of cover art images\n");
             cyanrip_log(ctx, 0, "\n  Misc. options:\n");
             cyanrip_log(ctx, 0, "    -Q                    Eject tray once successfully done\n");
+            cyanrip_log(ctx, 0, "    -B <MiB>              Memory budget for queued audio and cover art (default: %i, 0 for unlimited)\n", settings.memory_budget);
+            cyanrip_log(ctx, 0, "    -J                    Write output files around the page cache, where supported\n");
+            cyanrip_log(ctx, 0, "    -u                    Write output files asynchronously with io_uring (Linux only)\n");
+            cyanrip_log(ctx, 0, "    -e                    Encode lossy outputs from a lossless one once the disc's been ripped\n");
+            cyanrip_log(ctx, 0, "    --manifest            Write the SHA-256 of every file into a manifest in each output folder\n");
+            cyanrip_log(ctx, 0, "    --sink <path>         Stream all outputs into a pipe or file instead, \"-\" for stdout\n");
+            cyanrip_log(ctx, 0, "    --from-master <dir>   Encode the outputs from a folder of FLAC files ripped before, without a disc\n");
+            cyanrip_log(ctx, 0, "    --master              Also write the whole disc into a single lossless master\n");
+            cyanrip_log(ctx, 0, "    --resplit <path>      Rip from a disc master instead of a disc, e.g. with different pregap handling\n");
             cyanrip_log(ctx, 0, "    -V                    Print program version\n");
             cyanrip_log(ctx, 0, "    -h                    Print options help\n");
             cyanrip_log(ctx, 0, "    -f                    Find drive offset (requires a disc with an AccuRip DB entry)\n");
@@ -1708,6 +1590,31 @@ int main(int argc, char **argv)
                 p = av_strtok(NULL, ",", &p_save);
             }
             break;
+        case 'k':
+            settings.checksums_num = 2;
+            if (!strncmp("help", optarg, strlen("help"))) {
+                cyanrip_log(ctx, 0, "Supported checksums:\n");
+                crip_print_checksums();
+                return 0;
+            }
+            p = av_strtok(optarg, ",", &p_save);
+            while (p) {
+                int res = crip_checksum_from_name(p);
+                if (res == -1) {
+                    cyanrip_log(ctx, 0, "Invalid checksum \"%s\"\n", p);
+                    return 1;
+                }
+                for (int i = 2; i < settings.checksums_num; i++) {
+                    if (settings.checksums[i] == res) {
+                        cyanrip_log(ctx, 0, "Duplicated checksum \"%s\"\n", p);
+                        return 1;
+                    }
+                }
+                if (res >= CRIP_CHECKSUM_EAC_NONULL)
+                    settings.checksums[settings.checksums_num++] = res;
+                p = av_strtok(NULL, ",", &p_save);
+            }
+            break;
         case 'I':
             settings.print_info_only = 1;
             break;
@@ -1727,6 +1634,65 @@ int main(int argc, char **argv)
                 return 1;
             }
             break;
+        case 'z':
+            settings.ar_accept_confidence = strtol(optarg, NULL, 10);
+            if (settings.ar_accept_confidence < 0) {
+                cyanrip_log(ctx, 0, "Invalid AccurateRip confidence!\n");
+                return 1;
+            }
+            break;
+        case 'X':
+            if (!strcmp(optarg, "auto")) {
+                settings.compression_level = CRIP_COMPRESSION_AUTO;
+                break;
+            }
+            settings.compression_level = strtol(optarg, NULL, 10);
+            if (!crip_is_integer(optarg) || settings.compression_level < 0) {
+                cyanrip_log(ctx, 0, "Invalid compression level!\n");
+                return 1;
+            }
+            break;
+        case 'B':
+            settings.memory_budget = strtol(optarg, NULL, 10);
+            if (settings.memory_budget < 0) {
+                cyanrip_log(ctx, 0, "Invalid memory budget!\n");
+                return 1;
+            }
+            break;
+        case 'J':
+            settings.writer_flags |= CR_WRITER_DIRECT;
+            break;
+        case 'u':
+#if HAVE_LIBURING
+            settings.writer_flags |= CR_WRITER_ASYNC;
+#else
+            cyanrip_log(ctx, 0, "Built without io_uring support, writing synchronously!\n");
+#endif
+            break;
+        case 'e':
+            settings.defer_lossy = 1;
+            break;
+        case OPT_FROM_MASTER:
+            settings.from_master = optarg;
+            break;
+        case 'v':
+            settings.verify_outputs = 1;
+            break;
+        case OPT_MASTER:
+            settings.write_master = 1;
+            break;
+        case OPT_RESPLIT:
+            settings.resplit = optarg;
+            break;
+        case OPT_MANIFEST:
+            settings.write_manifest = 1;
+            settings.writer_flags |= CR_WRITER_HASH;
+            break;
+        case OPT_SINK:
+            settings.sink = optarg;
+            if (!strcmp(optarg, "-"))
+                cyanrip_log_to_stderr();
+            break;
         case 'f':
             find_drive_offset_range = 6;
             break;
@@ -1897,6 +1863,81 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    /* Everything gets encoded from the master */
+    if (settings.from_master)
+        settings.defer_lossy = 0;
+
+    if (settings.resplit && find_drive_offset_range) {
+        cyanrip_log(ctx, 0, "Drive offset can't be searched for in a disc master!\n");
+        return 1;
+    }
+
+    if (settings.resplit)
+        settings.write_master = 0;
+
+    /* Nothing gets written into the output folders */
+    if (settings.sink && (settings.write_manifest || settings.write_master)) {
+        cyanrip_log(ctx, 0, "%s can't be written when streaming outputs!\n",
+                    settings.write_manifest ? "Manifests" : "Disc masters");
+        return 1;
+    }
+
+    /* Streams can't be rewritten once they're out */
+    if (settings.sink) {
+        if (settings.enable_replaygain) {
+            cyanrip_log(ctx, 0, "ReplayGain tags can't be added to streamed outputs, disabling ReplayGain.\n");
+            settings.enable_replaygain = 0;
+        }
+        if (settings.defer_lossy) {
+            cyanrip_log(ctx, 0, "Deferred outputs are encoded from files, encoding all of them while ripping.\n");
+            settings.defer_lossy = 0;
+        }
+    }
+
+    /* Only repeated rips can be accepted early, by their AccurateRip entry */
+    if (settings.ar_accept_confidence && !settings.ripping_retries) {
+        cyanrip_log(ctx, 0, "-z only applies to rips repeated with -Z, ignoring it.\n");
+        settings.ar_accept_confidence = 0;
+    } else if (settings.ar_accept_confidence && settings.disable_accurip) {
+        cyanrip_log(ctx, 0, "-z needs AccurateRip, which is disabled with -A, ignoring it.\n");
+        settings.ar_accept_confidence = 0;
+    }
+
+    /* Repeated rips would mix passes in the master */
+    if (settings.write_master && settings.ripping_retries) {
+        cyanrip_log(ctx, 0, "Disc masters can't be written when ripping repeatedly, not writing one.\n");
+        settings.write_master = 0;
+    }
+
+    /* Lossless outputs go first, lossy ones get encoded from the first, which
+     * has to be something lavf can read back */
+    if (settings.defer_lossy) {
+        enum cyanrip_output_formats lossy[CYANRIP_FORMATS_NB], pcm[CYANRIP_FORMATS_NB];
+        int nb_lossless = 0, nb_pcm = 0, nb_lossy = 0;
+
+        for (int i = 0; i < settings.outputs_num; i++) {
+            enum cyanrip_output_formats f = settings.outputs[i];
+            if (f == CYANRIP_FORMAT_PCM)
+                pcm[nb_pcm++] = f;
+            else if (crip_fmt_info[f].lossless)
+                settings.outputs[nb_lossless++] = f;
+            else
+                lossy[nb_lossy++] = f;
+        }
+
+        memcpy(&settings.outputs[nb_lossless], pcm, nb_pcm*sizeof(*pcm));
+        memcpy(&settings.outputs[nb_lossless + nb_pcm], lossy, nb_lossy*sizeof(*lossy));
+
+        if (!nb_lossless || !nb_lossy) {
+            cyanrip_log(ctx, 0, "Deferring lossy outputs needs a lossless output besides PCM, "
+                        "encoding all of them while ripping.\n");
+            nb_lossy = 0;
+        }
+
+        /* How many outputs are deferred */
+        settings.defer_lossy = nb_lossy;
+    }
+
     if (find_drive_offset_range) {
         settings.disable_accurip = 0;
         settings.disable_mb = 1;
@@ -1909,6 +1950,34 @@ int main(int argc, char **argv)
     if (cyanrip_ctx_init(&ctx, &settings))
         return 1;
 
+    /* Named pipes wait for a reader here */
+    if (settings.sink && !settings.print_info_only) {
+        int ret = cr_sink_open(&ctx->sink, settings.sink);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Couldn't open sink %s: %s!\n", settings.sink, av_err2str(ret));
+            cyanrip_ctx_end(&ctx);
+            return 1;
+        }
+    }
+
+    if (settings.from_master) {
+        ctx->nb_cover_arts = nb_cover_arts;
+        for (int i = 0; i < nb_cover_arts; i++) {
+            ctx->cover_arts[i].source_url = av_strdup(cover_arts[i].source_url);
+            av_dict_set(&ctx->cover_arts[i].meta, "title", cover_arts[i].title, 0);
+        }
+
+        if (crip_from_master(ctx, settings.from_master, &quit_now) < 0)
+            ctx->total_error_count++;
+        goto end;
+    }
+
+    if (settings.compression_level == CRIP_COMPRESSION_AUTO && !settings.print_info_only &&
+        cyanrip_autotune_encoders(ctx) < 0) {
+        ctx->total_error_count++;
+        goto end;
+    }
+
     if (!settings.offset && !offset_set && !settings.print_info_only &&
         !find_drive_offset_range && (ctx->rcap & CDIO_DRIVE_CAP_READ_ISRC)) {
         cyanrip_log(ctx, 0, "Offset is unset! To continue with an offset of 0, run with -s 0!\n");
@@ -2046,13 +2115,13 @@ int main(int argc, char **argv)
             av_dict_set(&ctx->meta, "album_artist", artist, 0);
     }
 
-    /* Create log file */
-    if (!ctx->settings.print_info_only) {
+    /* Create log file, streamed rips only print it */
+    if (!ctx->settings.print_info_only && !ctx->sink) {
         if (cyanrip_log_init(ctx))
             return 1;
         if (cyanrip_cue_init(ctx))
             return 1;
-    } else {
+    } else if (ctx->settings.print_info_only) {
         cyanrip_log(ctx, 0, "Log(s) will be written to:\n");
         for (int f = 0; f < ctx->settings.outputs_num; f++) {
             char *logfile = crip_get_path(ctx, CRIP_PATH_LOG, 0,
@@ -2072,7 +2141,7 @@ int main(int argc, char **argv)
     }
 
     cyanrip_log_start_report(ctx);
-    if (!ctx->settings.print_info_only)
+    if (!ctx->settings.print_info_only && !ctx->sink)
         cyanrip_cue_start(ctx);
     setup_track_offsets_and_report(ctx);
 
@@ -2140,8 +2209,8 @@ int main(int argc, char **argv)
         goto end;
     }
 
-    /* Write non-track cover arts */
-    if (ctx->nb_cover_arts) {
+    /* Write non-track cover arts, streamed outputs only embed them */
+    if (ctx->nb_cover_arts && !ctx->sink) {
         cyanrip_log(ctx, 0, "Cover art destination(s):\n");
         for (int f = 0; f < ctx->settings.outputs_num; f++) {
             for (int i = 0; i < ctx->nb_cover_arts; i++) {
@@ -2164,12 +2233,21 @@ int main(int argc, char **argv)
         cyanrip_log(ctx, 0, "\n");
     }
 
+    if (ctx->settings.write_master && !ctx->settings.print_info_only &&
+        crip_master_open(ctx) < 0) {
+        ctx->total_error_count++;
+        goto end;
+    }
+
     cyanrip_log(ctx, 0, "Tracks:\n");
     if (ctx->settings.rip_indices_count == -1) {
         ctx->frames_to_read = ctx->duration_frames;
 
-        if (!ctx->settings.print_info_only)
+        if (!ctx->settings.print_info_only) {
             cyanrip_initialize_ebur128(ctx);
+            if (cyanrip_initialize_filtering(ctx) < 0)
+                goto end;
+        }
 
         for (int i = 0; i < ctx->nb_tracks; i++) {
             cyanrip_track *t = &ctx->tracks[i];
@@ -2184,20 +2262,12 @@ int main(int argc, char **argv)
                 }
             } else {
                 /* Initialize */
-                int ret = cyanrip_create_dec_ctx(ctx, &t->dec_ctx, t);
-                if (ret < 0) {
-                    cyanrip_log(ctx, 0, "Error initializing decoder: %s\n", av_err2str(ret));
+                if (cyanrip_setup_track_encoding(ctx, t) < 0)
                     goto end;
-                }
 
-                for (int j = 0; j < ctx->settings.outputs_num; j++) {
-                    ret = cyanrip_init_track_encoding(ctx, &t->enc_ctx[j], t,
-                                                      ctx->settings.outputs[j]);
-                    if (ret < 0) {
-                        cyanrip_log(ctx, 0, "Error initializing encoder: %s\n", av_err2str(ret));
-                        goto end;
-                    }
-                }
+                /* Get the next track ready while this one is ripped */
+                if ((i + 1) < ctx->nb_tracks)
+                    cyanrip_prewarm_track_encoding(ctx, &ctx->tracks[i + 1]);
 
                 if (cyanrip_rip_track(ctx, t))
                     break;
@@ -2207,8 +2277,16 @@ int main(int argc, char **argv)
                 break;
         }
 
-        if (!ctx->settings.print_info_only)
+        if (!ctx->settings.print_info_only) {
             cyanrip_finalize_ebur128(ctx, 1);
+            cyanrip_finalize_filtering(ctx, 1);
+        }
+
+        if (!ctx->settings.print_info_only &&
+            crip_tree_disc_meta(ctx) < 0) {
+            ctx->total_error_count++;
+            goto end;
+        }
 
         if (ctx->settings.enable_replaygain &&
             !ctx->settings.print_info_only) {
@@ -2281,6 +2359,8 @@ int main(int argc, char **argv)
         }
 
         cyanrip_initialize_ebur128(ctx);
+        if (cyanrip_initialize_filtering(ctx) < 0)
+            goto end;
 
         /**
          * Rip tracks.
@@ -2297,18 +2377,17 @@ int main(int argc, char **argv)
             cyanrip_track *t = &ctx->tracks[j];
 
             /* Initialize */
-            int ret = cyanrip_create_dec_ctx(ctx, &t->dec_ctx, t);
-            if (ret < 0) {
-                cyanrip_log(ctx, 0, "Error initializing decoder: %s\n", av_err2str(ret));
+            int ret = cyanrip_setup_track_encoding(ctx, t);
+            if (ret < 0)
                 goto end;
-            }
 
-            for (j = 0; j < ctx->settings.outputs_num; j++) {
-                ret = cyanrip_init_track_encoding(ctx, &t->enc_ctx[j], t,
-                                                  ctx->settings.outputs[j]);
-                if (ret < 0) {
-                    cyanrip_log(ctx, 0, "Error initializing encoder: %s\n", av_err2str(ret));
-                    goto end;
+            /* Get the next track ready while this one is ripped */
+            if ((i + 1) < ctx->settings.rip_indices_count) {
+                for (j = 0; j < ctx->nb_tracks; j++) {
+                    if (ctx->tracks[j].number == ctx->settings.rip_indices[i + 1]) {
+                        cyanrip_prewarm_track_encoding(ctx, &ctx->tracks[j]);
+                        break;
+                    }
                 }
             }
 
@@ -2324,6 +2403,12 @@ int main(int argc, char **argv)
         }
 
         cyanrip_finalize_ebur128(ctx, 1);
+        cyanrip_finalize_filtering(ctx, 1);
+
+        if (crip_tree_disc_meta(ctx) < 0) {
+            ctx->total_error_count++;
+            goto end;
+        }
 
         if (ctx->settings.enable_replaygain) {
             crip_replaygain_meta_album(ctx);
@@ -2356,12 +2441,71 @@ int main(int argc, char **argv)
         }
     }
 
-    if (!ctx->settings.print_info_only)
+    /* When resplitting, the master is what's being read from */
+    if (ctx->master && !ctx->settings.resplit && !quit_now &&
+        cyanrip_finish_master(ctx) < 0)
+        ctx->total_error_count++;
+
+    /* Lets the disc go before encoding the deferred outputs */
+    if (!ctx->settings.print_info_only && ctx->settings.defer_lossy && !quit_now) {
+        cyanrip_release_drive(ctx);
+
+        for (int i = 0; i < ctx->nb_tracks; i++) {
+            if (!ctx->tracks[i].encoded)
+                continue;
+
+            if (cyanrip_transcode_track(ctx, &ctx->tracks[i]) < 0)
+                ctx->total_error_count++;
+
+            if (quit_now)
+                break;
+        }
+    }
+
+    if (!ctx->settings.print_info_only) {
+        if (!ctx->sink && crip_tree_write(ctx) < 0)
+            ctx->total_error_count++;
+        if (!ctx->settings.enable_replaygain && !quit_now) {
+            end_track_outputs(ctx);
+            if (crip_tree_append_tags(ctx) < 0)
+                ctx->total_error_count++;
+        }
+        /* Outputs are verified as they finish encoding */
+        if (ctx->settings.verify_outputs && !quit_now)
+            end_track_outputs(ctx);
+        ctx->total_error_count += atomic_load(&ctx->verify_failures);
         cyanrip_log_finish_report(ctx);
+    }
 end:
     cyanrip_log_end(ctx);
     cyanrip_cue_end(ctx);
 
+    /* Everything's hashed once closed */
+    if (ctx->settings.write_manifest && !ctx->settings.print_info_only && !quit_now) {
+        end_track_outputs(ctx);
+        if (crip_manifest_write(ctx) < 0)
+            ctx->total_error_count++;
+    }
+
+    if (ctx->sink) {
+        end_track_outputs(ctx);
+        int ret = cr_sink_close(&ctx->sink);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Error closing sink %s: %s!\n", ctx->settings.sink, av_err2str(ret));
+            ctx->total_error_count++;
+        }
+    }
+
+    /* Closed outputs are all synced at once */
+    if (ctx->settings.writer_flags & CR_WRITER_ASYNC) {
+        end_track_outputs(ctx);
+        int ret = cr_writer_sync();
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Error syncing outputs: %s!\n", av_err2str(ret));
+            ctx->total_error_count++;
+        }
+    }
+
     int err_cnt = ctx->total_error_count;
 
     cyanrip_ctx_end(&ctx);
@@ -23,10 +23,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
 #include "../config.h"
 #include "version.h"
 
 #include "utils.h"
+#include "writer.h"
 
 #include <cdio/paranoia/paranoia.h>
 #include <cdio/audio.h>
@@ -54,6 +56,10 @@ enum cyanrip_output_formats {
     CYANRIP_FORMATS_NB,
 };
 
+/* Picks the compression level of lossless encoders to keep up with the drive */
+#define CRIP_COMPRESSION_AUTO (-2)
+#define CRIP_MAX_COMPRESSION_LEVELS 16
+
 enum cyanrip_pregap_action {
     CYANRIP_PREGAP_DEFAULT = 0,
     CYANRIP_PREGAP_DROP,
@@ -69,12 +75,29 @@ enum CRIPAccuDBStatus {
     CYANRIP_ACCUDB_FOUND,
 };
 
+enum CRIPChecksumType {
+    CRIP_CHECKSUM_EAC = 0, /* Always computed */
+    CRIP_CHECKSUM_ACCURIP, /* Always computed */
+    CRIP_CHECKSUM_EAC_NONULL,
+    CRIP_CHECKSUM_CTDB,
+    CRIP_CHECKSUM_SHA256,
+    CRIP_CHECKSUM_BLAKE3,
+    CRIP_CHECKSUM_SHA256_TREE,
+
+    CRIP_CHECKSUMS_NB,
+};
+
+#define CRIP_CHECKSUM_MAX_SIZE 32
+
 enum CRIPPathType {
     CRIP_PATH_COVERART, /* arg must be a CRIPArt * */
     CRIP_PATH_TRACK, /* arg must be a cyanrip_track * */
     CRIP_PATH_DATA, /* arg must be a cyanrip_track * */
     CRIP_PATH_LOG, /* arg must be NULL */
     CRIP_PATH_CUE, /* arg must be NULL */
+    CRIP_PATH_TREE, /* arg must be NULL */
+    CRIP_PATH_MASTER, /* arg must be NULL */
+    CRIP_PATH_MANIFEST, /* arg must be NULL */
 };
 
 enum CRIPSanitize {
@@ -117,14 +140,43 @@ typedef struct cyanrip_settings {
     int deemphasis;
     int force_deemphasis;
     int ripping_retries;
+    int ar_accept_confidence;
     int disable_coverart_embedding;
     enum coverart_lookup_sizes coverart_lookup_size;
     int enable_replaygain;
+    int memory_budget; /* MiB, 0 for unlimited */
+    int compression_level; /* Of lossless encoders, -1 for each format's own */
+    int writer_flags; /* CR_WRITER_* flags of output files */
+    int defer_lossy; /* Lossy outputs to encode from a lossless one once ripped */
+    char *from_master; /* Folder of earlier rips to encode from, instead of a disc */
+    int write_master; /* Also write the whole disc into a single lossless master */
+    char *resplit; /* Disc master to read from, instead of a disc */
+    int verify_outputs; /* Decode lossless outputs back while encoding */
+    int write_manifest; /* SHA-256 of every file written, in each output folder */
+    char *sink; /* Pipe, file or "-" to stream all outputs into, instead of their files */
 
     enum cyanrip_output_formats outputs[CYANRIP_FORMATS_NB];
     int outputs_num;
+
+    enum CRIPChecksumType checksums[CRIP_CHECKSUMS_NB];
+    int checksums_num;
 } cyanrip_settings;
 
+/* A track as the disc's TOC signals it, before any pregap handling */
+typedef struct CRIPTocEntry {
+    int number;
+    int is_data;
+    lsn_t pregap_lsn;
+    lsn_t start_lsn;
+    lsn_t end_lsn;
+
+    /* Known once read from the disc */
+    int extra_read;
+    int preemphasis;
+    int preemphasis_in_subcode;
+    char isrc[13];
+} CRIPTocEntry;
+
 typedef struct CRIPAccuDBEntry {
     int confidence;
     uint32_t checksum; /* We don't know which version it is */
@@ -180,6 +232,9 @@ typedef struct cyanrip_track {
     uint32_t acurip_checksum_v1;
     uint32_t acurip_checksum_v1_450;
     uint32_t acurip_checksum_v2;
+    uint8_t checksums[CRIP_CHECKSUMS_NB][CRIP_CHECKSUM_MAX_SIZE]; /* Raw digests */
+    uint8_t (*tree_leaves)[32]; /* SHA-256 tree leaves, if enabled */
+    int nb_tree_leaves;
     int acurip_track_is_first;
     int acurip_track_is_last;
 
@@ -199,21 +254,29 @@ typedef struct cyanrip_track {
     struct cyanrip_track *pt;
     struct cyanrip_track *nt;
 
+    int encoded; /* Ripped in full, with all live outputs encoded */
+
     struct cyanrip_dec_ctx *dec_ctx;
     struct cyanrip_enc_ctx *enc_ctx[CYANRIP_FORMATS_NB];
+    struct cyanrip_prewarm *prewarm;
 } cyanrip_track;
 
 typedef struct cyanrip_ctx {
     cdrom_drive_t     *drive;
     cdrom_paranoia_t  *paranoia;
     CdIo_t            *cdio;
-    FILE              *logfile[CYANRIP_FORMATS_NB];
-    FILE              *cuefile[CYANRIP_FORMATS_NB];
+    CRWriter          *logfile[CYANRIP_FORMATS_NB];
+    CRWriter          *cuefile[CYANRIP_FORMATS_NB];
     cyanrip_settings   settings;
+    struct CRPool     *pool;
+    struct CRIPMaster *master; /* Written while ripping, or read from instead of the drive */
+    struct CRSink     *sink; /* Outputs go here if set, rather than into files */
+    lsn_t              read_lsn; /* Of the next frame to read */
 
     cyanrip_track tracks[198];
     int nb_tracks; /* Total number of output tracks */
     int nb_cd_tracks; /* Total tracks the CD signals */
+    CRIPTocEntry toc[CDIO_CD_MAX_TRACKS];
     int disregard_cd_isrc; /* If one track doesn't have ISRC, universally the rest won't */
 
     char *mb_submission_url;
@@ -243,8 +306,21 @@ typedef struct cyanrip_ctx {
     lsn_t frames_read;
     lsn_t frames_to_read;
 
+    /* Autotuning */
+    atomic_int read_rate; /* Sectors per second the drive reads at, 0 until known */
+    atomic_int verify_failures; /* Outputs which didn't decode back to their input */
+    int nb_live_outputs; /* Encoded while ripping, the rest are deferred */
+    double enc_speed[CYANRIP_FORMATS_NB][CRIP_MAX_COMPRESSION_LEVELS]; /* Samples per second on one thread */
+
+    /* Disc SHA-256 tree root */
+    uint8_t tree_root[32];
+    int tree_root_computed;
+
+    /* HDCD decoding, shared by all tracks */
+    struct cyanrip_filt_ctx *hdcd_filt;
+
     /* Album EBUR128 values */
-    struct cyanrip_dec_ctx *peak_ctx;
+    struct CRLoudness *loudness; /* Tracks get merged in once done */
     double ebu_integrated;
     double ebu_range;
     double ebu_lra_low;
@@ -270,4 +346,5 @@ char *crip_get_path(cyanrip_ctx *ctx, enum CRIPPathType type, int create_dirs,
                     const cyanrip_out_fmt *fmt, void *arg);
 
 extern uint64_t paranoia_status[PARANOIA_CB_FINISHED + 1];
+extern const paranoia_mode_t paranoia_level_map[];
 extern const int crip_max_paranoia_level;
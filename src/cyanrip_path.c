@@ -0,0 +1,354 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <sys/stat.h>
+
+#include <libavutil/bprint.h>
+#include <libavutil/avstring.h>
+
+#include "cyanrip_main.h"
+#include "cyanrip_log.h"
+#include "os_compat.h"
+
+static int add_to_dir_list(char ***dir_list, int *dir_list_nb, const char *src)
+{
+    int nb = *dir_list_nb;
+    char **new_ptr = av_realloc(*dir_list, (nb + 1) * sizeof(*new_ptr));
+    if (!new_ptr)
+        return AVERROR(ENOMEM);
+
+    new_ptr[nb] = av_strdup(src);
+    nb++;
+
+    *dir_list = new_ptr;
+    *dir_list_nb = nb;
+
+    return 0;
+}
+
+struct CRIPCharReplacement {
+    const char from;
+    const char to;
+    const char to_u[5];
+    int is_avail_locally;
+} crip_char_replacement[] = {
+    { '<', '_', "‹", HAS_CH_LESS },
+    { '>', '_', "›", HAS_CH_MORE },
+    { ':', '_', "∶", HAS_CH_COLUMN },
+    { '|', '_', "│", HAS_CH_OR },
+    { '?', '_', "？", HAS_CH_Q },
+    { '*', '_', "∗", HAS_CH_ANY },
+    { '/', '_', "∕", HAS_CH_FWDSLASH },
+    { '\\', '_', "⧹", HAS_CH_BWDSLASH },
+    { '"', '\'', "“", HAS_CH_QUOTES },
+    { '"', '\'', "”", HAS_CH_QUOTES },
+    { 0 },
+};
+
+static int crip_bprint_sanitize(cyanrip_ctx *ctx, AVBPrint *buf, const char *str,
+                                char ***dir_list, int *dir_list_nb,
+                                int sanitize_fwdslash)
+{
+    int32_t cp, ret, quote_match = 0;
+    const char *pos = str, *end = str + strlen(str);
+
+    int os_sanitize = (ctx->settings.sanitize_method == CRIP_SANITIZE_OS_SIMPLE) ||
+                      (ctx->settings.sanitize_method == CRIP_SANITIZE_OS_UNICODE);
+
+    while (str < end) {
+        ret = av_utf8_decode(&cp, (const uint8_t **)&str, end, AV_UTF8_FLAG_ACCEPT_ALL);
+        if (ret < 0) {
+            cyanrip_log(ctx, 0, "Error parsing string: %s!\n", av_err2str(ret));
+            return ret;
+        }
+
+        struct CRIPCharReplacement *rep = NULL;
+        for (int i = 0; crip_char_replacement[i].from; i++) {
+            if (cp == crip_char_replacement[i].from) {
+                int is_quote = crip_char_replacement[i].from == '"';
+                rep = &crip_char_replacement[i + (is_quote && quote_match)];
+                quote_match = (quote_match + 1) & 1;
+                break;
+            }
+        }
+
+        int skip = !rep;
+        int skip_sanitation = rep && (os_sanitize && rep->is_avail_locally);
+        int passthrough_slash = rep && !skip_sanitation && (rep->from == OS_DIR_CHAR && !sanitize_fwdslash);
+
+        if (skip || skip_sanitation || passthrough_slash) {
+            if (passthrough_slash)
+                add_to_dir_list(dir_list, dir_list_nb, buf->str);
+            av_bprint_append_data(buf, pos, str - pos);
+            pos = str;
+            continue;
+        } else if (ctx->settings.sanitize_method == CRIP_SANITIZE_SIMPLE ||
+                   ctx->settings.sanitize_method == CRIP_SANITIZE_OS_SIMPLE) {
+            av_bprint_chars(buf, rep->to, 1);
+        } else if (ctx->settings.sanitize_method == CRIP_SANITIZE_UNICODE ||
+                   ctx->settings.sanitize_method == CRIP_SANITIZE_OS_UNICODE) {
+            av_bprint_append_data(buf, rep->to_u, strlen(rep->to_u));
+        }
+
+        pos = str;
+    }
+
+    return 0;
+}
+
+static char *get_dir_tag_val(cyanrip_ctx *ctx, AVDictionary *meta,
+                             const char *ofmt, const char *key)
+{
+    char *val = NULL;
+    if (!strcmp(key, "year")) {
+        const char *date = dict_get(meta, "date");
+        if (date) {
+            char *save_year, *date_dup = av_strdup(date);
+            val = av_strdup(av_strtok(date_dup, ":-", &save_year));
+            av_free(date_dup);
+        }
+    } else if (!strcmp(key, "format")) {
+        val = av_strdup(ofmt);
+    } else if (!strcmp(key, "track")) {
+        const char *track = dict_get(meta, "track");
+        if (crip_is_integer(track)) {
+            int pad = 0, digits = strlen(track);
+            if (((digits + pad) < 2) && ctx->nb_tracks >  9) pad++;
+            if (((digits + pad) < 3) && ctx->nb_tracks > 99) pad++;
+            val = av_mallocz(pad + digits + 1);
+            for (int i = 0; i < pad; i++)
+                val[i] = '0';
+            memcpy(&val[pad], track, digits);
+        } else {
+            val = av_strdup(track);
+        }
+    } else {
+        val = av_strdup(dict_get(meta, key));
+    }
+
+    return val;
+}
+
+static int process_cond(cyanrip_ctx *ctx, AVBPrint *buf, AVDictionary *meta,
+                        const char *ofmt, char ***dir_list, int *dir_list_nb,
+                        const char *scheme)
+{
+    char *scheme_copy = av_strdup(scheme);
+
+    char *save, *tok = av_strtok(scheme_copy, "{}", &save);
+    while (tok) {
+        if (!strncmp(tok, "if", strlen("if"))) {
+            char *cond = av_strdup(tok);
+            char *cond_save, *cond_tok = av_strtok(cond, "#", &cond_save);
+
+            cond_tok = av_strtok(NULL, "#", &cond_save);
+            if (!cond_tok) {
+                cyanrip_log(ctx, 0, "Invalid scheme syntax, no \"#\"!\n");
+                av_free(cond);
+                goto fail;
+            }
+
+            int val1_origin_is_tag = 1;
+            char *val1 = get_dir_tag_val(ctx, meta, ofmt, cond_tok);
+            if (!val1) {
+                val1 = av_strdup(tok);
+                val1_origin_is_tag = 0;
+            }
+
+            cond_tok = av_strtok(NULL, "#", &cond_save);
+            if (!cond_tok) {
+                cyanrip_log(ctx, 0, "Invalid scheme syntax, no terminating \"#\"!\n");
+                av_free(cond);
+                av_free(val1);
+                goto fail;
+            }
+
+            int cond_is_eq = 0, cond_is_not_eq = 0, cond_is_more = 0, cond_is_less = 0;
+            if (strstr(cond_tok, "==")) {
+                cond_is_eq = 1;
+            } else if (strstr(cond_tok, "!=")) {
+                cond_is_not_eq = 1;
+            } else if (strstr(cond_tok, ">")) {
+                cond_is_more = 1;
+            } else if (strstr(cond_tok, "<")) {
+                cond_is_less = 1;
+            } else {
+                cyanrip_log(ctx, 0, "Invalid condition syntax!\n");
+                av_free(cond);
+                av_free(val1);
+                goto fail;
+            }
+
+            cond_tok = av_strtok(NULL, "#", &cond_save);
+            if (!cond_tok) {
+                cyanrip_log(ctx, 0, "Invalid scheme syntax, no terminating \"#\"!\n");
+                goto fail;
+            }
+
+            int val2_origin_is_tag = 1;
+            char *val2 = get_dir_tag_val(ctx, meta, ofmt, cond_tok);
+            if (!val2) {
+                val2 = av_strdup(cond_tok);
+                val2_origin_is_tag = 0;
+            }
+
+            cond_tok = av_strtok(NULL, "#", &cond_save);
+            if (!cond_tok) {
+                cyanrip_log(ctx, 0, "Invalid scheme syntax, no terminating \"#\"!\n");
+                goto fail;
+            }
+
+            int cond_true = 0;
+            cond_true |= cond_is_eq && !strcmp(val1, val2);
+            cond_true |= cond_is_not_eq && strcmp(val1, val2);
+
+            if (cond_is_less || cond_is_more) {
+                int val1_is_int = crip_is_integer(val1), val2_is_int = crip_is_integer(val2);
+                if (!val1_is_int && (val1_is_int == val2_is_int)) { /* None are int */
+                    cond_true = cond_is_less ? (strcmp(val1, val2) < 0) : (cond_is_more ? strcmp(val1, val2) > 0 : 0);
+                } else if (val1_is_int && (val1_is_int == val2_is_int)) { /* Both are int */
+                    int64_t val1_dec = strtol(val1, NULL, 10);
+                    int64_t val2_dec = strtol(val2, NULL, 10);
+                    cond_true |= cond_is_less && val1_dec < val2_dec;
+                    cond_true |= cond_is_more && val1_dec > val2_dec;
+                } else {
+                    ptrdiff_t val1_dec = val1_is_int ? strtol(val1, NULL, 10) : (!val1_origin_is_tag ? 0 : (ptrdiff_t)val1);
+                    ptrdiff_t val2_dec = val2_is_int ? strtol(val2, NULL, 10) : (!val2_origin_is_tag ? 0 : (ptrdiff_t)val2);
+                    cond_true |= cond_is_less && val1_dec < val2_dec;
+                    cond_true |= cond_is_more && val1_dec > val2_dec;
+                }
+            }
+
+            if (cond_true) {
+                char *true_save, *true_tok = av_strtok(cond_tok, "|", &true_save);
+                while (true_tok) {
+                    int origin_is_tag = 1;
+                    char *true_val = get_dir_tag_val(ctx, meta, ofmt, true_tok);
+                    if (!true_val) {
+                        true_val = av_strdup(true_tok);
+                        origin_is_tag = 0;
+                    }
+
+                    crip_bprint_sanitize(ctx, buf, true_val, dir_list, dir_list_nb, origin_is_tag);
+                    av_free(true_val);
+
+                    true_tok = av_strtok(NULL, "|", &true_save);
+                }
+            }
+
+            av_free(val2);
+            av_free(val1);
+            av_free(cond);
+
+            tok = av_strtok(NULL, "{}", &save);
+            continue;
+        }
+
+        int origin_is_tag = 1;
+        char *val = get_dir_tag_val(ctx, meta, ofmt, tok);
+        if (!val) {
+            val = av_strdup(tok);
+            origin_is_tag = 0;
+        }
+
+        crip_bprint_sanitize(ctx, buf, val, dir_list, dir_list_nb, origin_is_tag);
+        av_free(val);
+
+        tok = av_strtok(NULL, "{}", &save);
+    }
+
+    av_free(scheme_copy);
+    return 0;
+
+fail:
+    av_free(scheme_copy);
+    return AVERROR(EINVAL);
+}
+
+char *crip_get_path(cyanrip_ctx *ctx, enum CRIPPathType type, int create_dirs,
+                    const cyanrip_out_fmt *fmt, void *arg)
+{
+    char *ret = NULL;
+    AVBPrint buf;
+    char **dir_list = NULL;
+    int dir_list_nb = 0;
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
+
+    if (process_cond(ctx, &buf, ctx->meta, fmt->folder_suffix, &dir_list, &dir_list_nb,
+                     ctx->settings.folder_name_scheme))
+        goto end;
+
+    add_to_dir_list(&dir_list, &dir_list_nb, buf.str);
+    av_bprint_chars(&buf, OS_DIR_CHAR, 1);
+
+    char *ext = NULL;
+    if (type == CRIP_PATH_COVERART) {
+        CRIPArt *art = arg;
+        crip_bprint_sanitize(ctx, &buf, dict_get(art->meta, "title"), &dir_list, &dir_list_nb, 0);
+        ext = art->extension ? av_strdup(art->extension) : av_strdup("<extension>");
+    } else if (type == CRIP_PATH_LOG) {
+        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
+                         ctx->settings.log_name_scheme))
+            goto end;
+        ext = av_strdup("log");
+    } else if (type == CRIP_PATH_CUE) {
+        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
+                         ctx->settings.cue_name_scheme))
+            goto end;
+        ext = av_strdup("cue");
+    } else if (type == CRIP_PATH_TREE) {
+        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
+                         ctx->settings.log_name_scheme))
+            goto end;
+        ext = av_strdup("sha256tree");
+    } else if (type == CRIP_PATH_MASTER) {
+        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
+                         ctx->settings.log_name_scheme))
+            goto end;
+        ext = av_strdup("master.flac");
+    } else if (type == CRIP_PATH_MANIFEST) {
+        if (process_cond(ctx, &buf, ctx->meta, fmt->name, &dir_list, &dir_list_nb,
+                         ctx->settings.log_name_scheme))
+            goto end;
+        ext = av_strdup("sha256");
+    } else {
+        cyanrip_track *t = arg;
+        if (process_cond(ctx, &buf, t->meta, fmt->name, &dir_list, &dir_list_nb,
+                         ctx->settings.track_name_scheme))
+            goto end;
+        ext = av_strdup(t->track_is_data ? "bin" : fmt->ext);
+    }
+
+    if (ext)
+        av_bprintf(&buf, ".%s", ext);
+    av_free(ext);
+
+end:
+    for (int i = 0; i < dir_list_nb; i++) {
+        if (create_dirs) {
+            cyanrip_stat_t st_req = { 0 };
+            if (cyanrip_stat(dir_list[i], &st_req) == -1)
+                mkdir(dir_list[i], 0700);
+        }
+        av_free(dir_list[i]);
+    }
+    av_free(dir_list);
+
+    av_bprint_finalize(&buf, &ret);
+    return ret;
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "deemph.h"
+
+#define DEEMPH_TAU_POLE 50e-6
+#define DEEMPH_TAU_ZERO 15e-6
+
+/* Squared magnitude of H(s) = (1 + s*t_zero)/(1 + s*t_pole) at w rad/s */
+static double analog_power(double w)
+{
+    return (1.0 + w*w*DEEMPH_TAU_ZERO*DEEMPH_TAU_ZERO)/
+           (1.0 + w*w*DEEMPH_TAU_POLE*DEEMPH_TAU_POLE);
+}
+
+/* Root of x/(1 + x^2) = r inside the unit circle */
+static double half_root(double r)
+{
+    return r ? (1.0 - sqrt(1.0 - 4.0*r*r))/(2.0*r) : 0.0;
+}
+
+void cr_deemph_init(CRDeemph *d, int sample_rate)
+{
+    /* The bilinear transform squeezes the whole shelf below Nyquist, ending
+     * up about 1dB too low at the top of the band, and prewarping the pole
+     * and zero only moves the error around. Instead, fit the magnitude of
+     * g*(1 + b/z)/(1 + a/z) to the analog one at DC, the pole and Nyquist.
+     * With c = cos(w), |H|^2 = (p + q*c)/(1 + s*c), which is linear in p, q
+     * and s at each of those. */
+    const double wp = 1.0/DEEMPH_TAU_POLE;
+    const double cm = cos(wp/sample_rate);
+    const double hm = analog_power(wp);
+    const double hn = analog_power(M_PI*sample_rate);
+
+    const double s = (2.0*hm - (1.0 + hn) - cm*(1.0 - hn))/
+                     ((1.0 - hn) + cm*(1.0 + hn) - 2.0*hm*cm);
+    const double p = (1.0 + hn - (hn - 1.0)*s)/2.0;
+    const double q = (1.0 - hn + (1.0 + hn)*s)/2.0;
+
+    /* s = 2a/(1 + a^2), q/p = 2b/(1 + b^2) */
+    const double a = half_root(s/2.0);
+    const double b = half_root(q/(2.0*p));
+    const double g = sqrt(p*(1.0 + a*a)/(1.0 + b*b));
+
+    d->b0 = g;
+    d->b1 = g*b;
+    d->a1 = a;
+
+    memset(d->x1, 0, sizeof(d->x1));
+    memset(d->y1, 0, sizeof(d->y1));
+}
+
+void cr_deemph_process(CRDeemph *d, double *const dst[2],
+                       const int16_t *src, int nb_samples)
+{
+    for (int c = 0; c < 2; c++) {
+        double x1 = d->x1[c], y1 = d->y1[c];
+        double *out = dst[c];
+
+        for (int i = 0; i < nb_samples; i++) {
+            double x = src[2*i + c]*(1.0/32768.0);
+            y1 = d->b0*x + d->b1*x1 - d->a1*y1;
+            x1 = x;
+            out[i] = y1;
+        }
+
+        d->x1[c] = x1;
+        d->y1[c] = y1;
+    }
+}
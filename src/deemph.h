@@ -0,0 +1,33 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* CD deemphasis (50/15us), as a first order shelf per channel */
+typedef struct CRDeemph {
+    double b0, b1, a1;
+    double x1[2], y1[2];
+} CRDeemph;
+
+void cr_deemph_init(CRDeemph *d, int sample_rate);
+
+/* Filters interleaved stereo s16 into planar doubles */
+void cr_deemph_process(CRDeemph *d, double *const dst[2],
+                       const int16_t *src, int nb_samples);
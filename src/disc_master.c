@@ -0,0 +1,663 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+
+#include "disc_master.h"
+#include "cyanrip_log.h"
+#include "writer.h"
+
+#define SECTOR_SAMPLES (CDIO_CD_FRAMESIZE_RAW >> 2)
+
+/* Forward decoding beats seeking up to this many samples */
+#define MAX_DECODE_AHEAD (10*44100)
+
+typedef struct CRIPMasterRun {
+    lsn_t lsn;
+    int frames;
+    int64_t pos; /* In samples, into the FLAC file */
+} CRIPMasterRun;
+
+struct CRIPMaster {
+    cyanrip_ctx *ctx;
+    int writing;
+    char *path;
+    int status;
+
+    AVFormatContext *avf;
+    AVCodecContext *avctx; /* Encoder when writing, decoder when reading */
+    AVFrame *frame;
+    AVPacket *pkt;
+    int stream_index;
+
+    CRIPMasterRun *runs;
+    int nb_runs;
+    int64_t nb_samples;
+
+    /* Writing */
+    int filled; /* Samples in frame */
+    lsn_t lo, hi; /* Audio sectors the master should have */
+
+    /* Reading */
+    int64_t frame_pos; /* Of the decoded frame, in samples */
+    uint8_t sector[CDIO_CD_FRAMESIZE_RAW];
+};
+
+static char *toc_path(const char *path)
+{
+    size_t len = strlen(path);
+    if (len < 5 || av_strcasecmp(path + len - 5, ".flac"))
+        return NULL;
+
+    return av_asprintf("%.*s.toc", (int)(len - 5), path);
+}
+
+static const CRIPMasterRun *find_run(CRIPMaster *m, lsn_t lsn)
+{
+    for (int i = 0; i < m->nb_runs; i++)
+        if (lsn >= m->runs[i].lsn && lsn < m->runs[i].lsn + m->runs[i].frames)
+            return &m->runs[i];
+
+    return NULL;
+}
+
+static int add_run(CRIPMaster *m, lsn_t lsn, int frames)
+{
+    CRIPMasterRun *runs = av_realloc_array(m->runs, m->nb_runs + 1, sizeof(*runs));
+    if (!runs)
+        return AVERROR(ENOMEM);
+
+    m->runs = runs;
+    m->runs[m->nb_runs++] = (CRIPMasterRun){ lsn, frames, m->nb_samples };
+    m->nb_samples += (int64_t)frames*SECTOR_SAMPLES;
+
+    return 0;
+}
+
+static int encode_frame(CRIPMaster *m, AVFrame *frame)
+{
+    int ret = avcodec_send_frame(m->avctx, frame);
+
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(m->avctx, m->pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        else if (ret < 0)
+            break;
+
+        m->pkt->stream_index = m->stream_index;
+        av_packet_rescale_ts(m->pkt, m->avctx->time_base,
+                             m->avf->streams[m->stream_index]->time_base);
+        ret = av_interleaved_write_frame(m->avf, m->pkt);
+    }
+
+    return ret;
+}
+
+int crip_master_open(cyanrip_ctx *ctx)
+{
+    int ret;
+    char *ffpath = NULL;
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_FLAC);
+
+    CRIPMaster *m = av_mallocz(sizeof(*m));
+    if (!m)
+        return AVERROR(ENOMEM);
+
+    m->ctx = ctx;
+    m->writing = 1;
+    ctx->master = m;
+
+    if (!codec) {
+        cyanrip_log(ctx, 0, "FLAC encoder not found (not compiled in lavc?)!\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    /* Dropped pregaps and tracks which aren't ripped are read in the end */
+    m->lo = ctx->end_lsn;
+    m->hi = ctx->start_lsn;
+    for (int i = 0; i < ctx->nb_tracks; i++) {
+        cyanrip_track *t = &ctx->tracks[i];
+        if (t->track_is_data)
+            continue;
+        m->lo = FFMIN(m->lo, t->start_lsn);
+        if (t->dropped_pregap_start != CDIO_INVALID_LSN)
+            m->lo = FFMIN(m->lo, t->dropped_pregap_start);
+        m->hi = FFMAX(m->hi, t->end_lsn);
+    }
+
+    m->path = crip_get_path(ctx, CRIP_PATH_MASTER, 1,
+                            &crip_fmt_info[ctx->settings.outputs[0]], NULL);
+    ffpath = m->path ? cr_ffmpeg_file_path(m->path) : NULL;
+    m->frame = av_frame_alloc();
+    m->pkt = av_packet_alloc();
+    m->avctx = avcodec_alloc_context3(codec);
+    if (!ffpath || !m->frame || !m->pkt || !m->avctx) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    ret = avformat_alloc_output_context2(&m->avf, NULL, "flac", ffpath);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Unable to init lavf context: %s!\n", av_err2str(ret));
+        goto fail;
+    }
+
+    AVStream *st = avformat_new_stream(m->avf, NULL);
+    if (!st) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    m->stream_index = st->index;
+
+    m->avctx->sample_fmt          = AV_SAMPLE_FMT_S16;
+    m->avctx->ch_layout           = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+    m->avctx->sample_rate         = 44100;
+    m->avctx->time_base           = (AVRational){ 1, 44100 };
+    m->avctx->bits_per_raw_sample = 16;
+    if (ctx->settings.compression_level >= 0)
+        m->avctx->compression_level = ctx->settings.compression_level;
+
+    if ((ret = avcodec_open2(m->avctx, codec, NULL)) < 0 ||
+        (ret = avcodec_parameters_from_context(st->codecpar, m->avctx)) < 0) {
+        cyanrip_log(ctx, 0, "Could not open master encoder: %s!\n", av_err2str(ret));
+        goto fail;
+    }
+    st->time_base = m->avctx->time_base;
+
+    m->frame->format      = m->avctx->sample_fmt;
+    m->frame->nb_samples  = m->avctx->frame_size;
+    m->frame->sample_rate = m->avctx->sample_rate;
+    if ((ret = av_channel_layout_copy(&m->frame->ch_layout, &m->avctx->ch_layout)) < 0 ||
+        (ret = av_frame_get_buffer(m->frame, 0)) < 0)
+        goto fail;
+
+    av_dict_copy(&m->avf->metadata, ctx->meta, 0);
+
+    ret = cr_writer_avio_open(&m->avf->pb, m->path,
+                              (int64_t)ctx->duration_frames*CDIO_CD_FRAMESIZE_RAW*3/4,
+                              ctx->settings.writer_flags);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", m->path, av_err2str(ret));
+        goto fail;
+    }
+
+    if ((ret = avformat_write_header(m->avf, NULL)) < 0) {
+        cyanrip_log(ctx, 0, "Couldn't write header: %s!\n", av_err2str(ret));
+        goto fail;
+    }
+
+    cyanrip_log(ctx, 0, "Disc master destination:\n    %s\n\n", m->path);
+
+    av_free(ffpath);
+
+    return 0;
+
+fail:
+    av_free(ffpath);
+    m->status = ret;
+
+    return ret;
+}
+
+void crip_master_write(CRIPMaster *m, lsn_t lsn, const uint8_t *data)
+{
+    int ret;
+
+    if (m->status < 0 || find_run(m, lsn))
+        return;
+
+    CRIPMasterRun *last = m->nb_runs ? &m->runs[m->nb_runs - 1] : NULL;
+    if (last && lsn == last->lsn + last->frames) {
+        last->frames++;
+        m->nb_samples += SECTOR_SAMPLES;
+    } else if ((ret = add_run(m, lsn, 1)) < 0) {
+        goto fail;
+    }
+
+    for (int left = SECTOR_SAMPLES; left;) {
+        if (!m->filled && (ret = av_frame_make_writable(m->frame)) < 0)
+            goto fail;
+
+        int nb = FFMIN(left, m->avctx->frame_size - m->filled);
+        memcpy(m->frame->data[0] + m->filled*4, data, nb*4);
+        m->filled += nb;
+        data += nb*4;
+        left -= nb;
+
+        if (m->filled == m->avctx->frame_size) {
+            m->frame->pts = m->nb_samples - left - m->filled;
+            m->filled = 0;
+            if ((ret = encode_frame(m, m->frame)) < 0)
+                goto fail;
+        }
+    }
+
+    return;
+
+fail:
+    cyanrip_log(m->ctx, 0, "\nError writing disc master: %s!\n", av_err2str(ret));
+    m->status = ret;
+}
+
+int crip_master_next_gap(CRIPMaster *m, lsn_t *start, int *frames)
+{
+    cyanrip_ctx *ctx = m->ctx;
+
+    /* Gaps can only be filled in while writing */
+    if (!m->writing || m->status < 0)
+        return 0;
+
+    for (lsn_t lsn = m->lo; lsn <= m->hi;) {
+        lsn_t end = m->hi + 1;
+
+        /* Skip what's in the master already, and data tracks */
+        const CRIPMasterRun *r = find_run(m, lsn);
+        if (r) {
+            lsn = r->lsn + r->frames;
+            continue;
+        }
+
+        int in_data = 0;
+        for (int i = 0; i < ctx->nb_cd_tracks && !in_data; i++) {
+            const CRIPTocEntry *e = &ctx->toc[i];
+            if (!e->is_data)
+                continue;
+            if (lsn >= e->start_lsn && lsn <= e->end_lsn) {
+                lsn = e->end_lsn + 1;
+                in_data = 1;
+            } else if (e->start_lsn > lsn) {
+                end = FFMIN(end, e->start_lsn);
+            }
+        }
+        if (in_data)
+            continue;
+
+        for (int i = 0; i < m->nb_runs; i++)
+            if (m->runs[i].lsn > lsn)
+                end = FFMIN(end, m->runs[i].lsn);
+
+        *start = lsn;
+        *frames = end - lsn;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int write_toc(CRIPMaster *m)
+{
+    cyanrip_ctx *ctx = m->ctx;
+    CRWriter *w = NULL;
+
+    char *path = toc_path(m->path);
+    if (!path)
+        return AVERROR(ENOMEM);
+
+    int ret = cr_writer_open(&w, path, 0, ctx->settings.writer_flags);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", path, av_err2str(ret));
+        av_free(path);
+        return ret;
+    }
+
+    cr_writer_printf(w, "CYANRIP MASTER 1\n");
+    cr_writer_printf(w, "OFFSET %i\n", ctx->settings.offset);
+    cr_writer_printf(w, "OVERREAD %i\n", ctx->settings.overread_leadinout);
+    cr_writer_printf(w, "LEADOUT %i\n", ctx->end_lsn + 1);
+    if (dict_get(ctx->meta, "disc_mcn"))
+        cr_writer_printf(w, "MCN %s\n", dict_get(ctx->meta, "disc_mcn"));
+
+    for (int i = 0; i < ctx->nb_cd_tracks; i++) {
+        const CRIPTocEntry *e = &ctx->toc[i];
+        cr_writer_printf(w, "TRACK %i %s %i %i %i\n", e->number,
+                         e->is_data ? "DATA" : "AUDIO",
+                         e->pregap_lsn, e->start_lsn, e->end_lsn);
+        if (!e->extra_read)
+            continue;
+        cr_writer_printf(w, "PREEMPHASIS %i %i %i\n", e->number,
+                         e->preemphasis, e->preemphasis_in_subcode);
+        if (e->isrc[0])
+            cr_writer_printf(w, "ISRC %i %s\n", e->number, e->isrc);
+    }
+
+    for (int i = 0; i < m->nb_runs; i++)
+        cr_writer_printf(w, "RUN %i %i\n", m->runs[i].lsn, m->runs[i].frames);
+
+    ret = cr_writer_close(&w);
+    if (ret < 0)
+        cyanrip_log(ctx, 0, "Error writing %s: %s!\n", path, av_err2str(ret));
+
+    av_free(path);
+
+    return ret;
+}
+
+static CRIPTocEntry *find_toc_entry(cyanrip_ctx *ctx, int number)
+{
+    for (int i = 0; i < ctx->nb_cd_tracks; i++)
+        if (ctx->toc[i].number == number)
+            return &ctx->toc[i];
+
+    return NULL;
+}
+
+static int read_toc(CRIPMaster *m, const char *path)
+{
+    cyanrip_ctx *ctx = m->ctx;
+    char line[256], str[32];
+    int a, b, c, d, offset = 0, overread = 0;
+    lsn_t leadout = 0;
+    CRIPTocEntry *e;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        int ret = AVERROR(errno);
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", path, av_err2str(ret));
+        return ret;
+    }
+
+    int ret = !fgets(line, sizeof(line), f) || strcmp(line, "CYANRIP MASTER 1\n") ?
+              AVERROR_INVALIDDATA : 0;
+
+    while (!ret && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (sscanf(line, "OFFSET %i", &offset) == 1) {
+            continue;
+        } else if (sscanf(line, "OVERREAD %i", &overread) == 1) {
+            continue;
+        } else if (sscanf(line, "LEADOUT %i", &leadout) == 1) {
+            continue;
+        } else if (sscanf(line, "MCN %31s", str) == 1) {
+            av_dict_set(&ctx->meta, "disc_mcn", str, 0);
+        } else if (sscanf(line, "TRACK %i %31s %i %i %i", &a, str, &b, &c, &d) == 5) {
+            if (ctx->nb_cd_tracks >= CDIO_CD_MAX_TRACKS) {
+                ret = AVERROR_INVALIDDATA;
+                break;
+            }
+            e = &ctx->toc[ctx->nb_cd_tracks++];
+            e->number = a;
+            e->is_data = !strcmp(str, "DATA");
+            e->pregap_lsn = b;
+            e->start_lsn = c;
+            e->end_lsn = d;
+        } else if (sscanf(line, "PREEMPHASIS %i %i %i", &a, &b, &c) == 3) {
+            if (!(e = find_toc_entry(ctx, a))) {
+                ret = AVERROR_INVALIDDATA;
+                break;
+            }
+            e->extra_read = 1;
+            e->preemphasis = b;
+            e->preemphasis_in_subcode = c;
+        } else if (sscanf(line, "ISRC %i %12s", &a, str) == 2) {
+            if (!(e = find_toc_entry(ctx, a))) {
+                ret = AVERROR_INVALIDDATA;
+                break;
+            }
+            av_strlcpy(e->isrc, str, sizeof(e->isrc));
+        } else if (sscanf(line, "RUN %i %i", &a, &b) == 2) {
+            if (b <= 0) {
+                ret = AVERROR_INVALIDDATA;
+                break;
+            }
+            ret = add_run(m, a, b);
+        } else if (line[0]) {
+            ret = AVERROR_INVALIDDATA;
+        }
+    }
+
+    fclose(f);
+
+    if (!ret && (!ctx->nb_cd_tracks || !m->nb_runs))
+        ret = AVERROR_INVALIDDATA;
+
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Error reading %s: %s!\n", path, av_err2str(ret));
+        return ret;
+    }
+
+    /* Same as -s */
+    ctx->settings.offset = offset;
+    ctx->settings.over_under_read_frames = (offset < 0 ? -1 : +1) *
+        (int)ceilf(abs(offset)/(float)(CDIO_CD_FRAMESIZE_RAW >> 2));
+    ctx->settings.overread_leadinout = overread;
+    ctx->start_lsn = 0;
+    ctx->end_lsn = leadout - 1;
+    ctx->duration_frames = ctx->end_lsn - ctx->start_lsn + 1;
+
+    return 0;
+}
+
+int crip_master_load(cyanrip_ctx *ctx, const char *path)
+{
+    int ret;
+    const AVCodec *codec = NULL;
+    char *ffpath = NULL;
+
+    CRIPMaster *m = av_mallocz(sizeof(*m));
+    if (!m)
+        return AVERROR(ENOMEM);
+
+    m->ctx = ctx;
+    ctx->master = m;
+
+    char *tpath = toc_path(path);
+    if (!tpath) {
+        cyanrip_log(ctx, 0, "Disc master %s is not a FLAC file!\n", path);
+        return AVERROR(EINVAL);
+    }
+
+    ret = read_toc(m, tpath);
+    av_free(tpath);
+    if (ret < 0)
+        return ret;
+
+    m->path = av_strdup(path);
+    ffpath = cr_ffmpeg_file_path(path);
+    m->frame = av_frame_alloc();
+    m->pkt = av_packet_alloc();
+    if (!m->path || !ffpath || !m->frame || !m->pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    ret = avformat_open_input(&m->avf, ffpath, NULL, NULL);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", path, av_err2str(ret));
+        goto end;
+    }
+
+    if ((ret = avformat_find_stream_info(m->avf, NULL)) < 0)
+        goto end;
+
+    m->stream_index = av_find_best_stream(m->avf, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (m->stream_index < 0) {
+        ret = m->stream_index;
+        goto end;
+    }
+
+    AVCodecParameters *par = m->avf->streams[m->stream_index]->codecpar;
+    if (par->codec_id != AV_CODEC_ID_FLAC || par->sample_rate != 44100 ||
+        par->ch_layout.nb_channels != 2 || par->bits_per_raw_sample != 16) {
+        cyanrip_log(ctx, 0, "%s is not a disc master!\n", path);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    m->avctx = avcodec_alloc_context3(codec);
+    if (!m->avctx) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if ((ret = avcodec_parameters_to_context(m->avctx, par)) < 0 ||
+        (ret = avcodec_open2(m->avctx, codec, NULL)) < 0)
+        goto end;
+
+    cyanrip_log(ctx, 0, "Reading from disc master %s\n", path);
+
+end:
+    if (ret < 0)
+        cyanrip_log(ctx, 0, "Error loading disc master: %s!\n", av_err2str(ret));
+    av_free(ffpath);
+
+    return ret;
+}
+
+static int decode_frame(CRIPMaster *m)
+{
+    int ret;
+    AVStream *st = m->avf->streams[m->stream_index];
+    int64_t next = m->frame_pos + m->frame->nb_samples;
+
+    while ((ret = avcodec_receive_frame(m->avctx, m->frame)) == AVERROR(EAGAIN)) {
+        ret = av_read_frame(m->avf, m->pkt);
+        if (ret == AVERROR_EOF) {
+            ret = avcodec_send_packet(m->avctx, NULL);
+        } else if (ret >= 0) {
+            if (m->pkt->stream_index == m->stream_index)
+                ret = avcodec_send_packet(m->avctx, m->pkt);
+            av_packet_unref(m->pkt);
+        }
+        if (ret < 0)
+            return ret;
+    }
+    if (ret < 0)
+        return ret;
+
+    if (m->frame->format != AV_SAMPLE_FMT_S16)
+        return AVERROR_INVALIDDATA;
+
+    if (m->frame->pts != AV_NOPTS_VALUE)
+        m->frame_pos = av_rescale_q(m->frame->pts, st->time_base, (AVRational){ 1, 44100 });
+    else if (next < 0)
+        return AVERROR_INVALIDDATA;
+    else
+        m->frame_pos = next;
+
+    return 0;
+}
+
+static int seek_master(CRIPMaster *m, int64_t pos)
+{
+    AVStream *st = m->avf->streams[m->stream_index];
+    int64_t ts = av_rescale_q(pos, (AVRational){ 1, 44100 }, st->time_base);
+
+    int ret = avformat_seek_file(m->avf, m->stream_index, INT64_MIN, ts, ts, 0);
+    if (ret < 0)
+        return ret;
+
+    avcodec_flush_buffers(m->avctx);
+    av_frame_unref(m->frame);
+
+    /* Only timestamps are known now */
+    m->frame_pos = INT64_MIN;
+
+    return 0;
+}
+
+const uint8_t *crip_master_read(CRIPMaster *m, lsn_t lsn)
+{
+    int ret = 0, seeked = 0;
+
+    const CRIPMasterRun *r = find_run(m, lsn);
+    if (!r || m->status < 0)
+        return NULL;
+
+    int64_t pos = r->pos + (int64_t)(lsn - r->lsn)*SECTOR_SAMPLES;
+    for (int done = 0; done < SECTOR_SAMPLES;) {
+        int64_t end = m->frame_pos + m->frame->nb_samples;
+
+        if (m->frame->nb_samples && pos >= m->frame_pos && pos < end) {
+            int nb = FFMIN(end - pos, SECTOR_SAMPLES - done);
+            memcpy(m->sector + done*4, m->frame->data[0] + (pos - m->frame_pos)*4, nb*4);
+            done += nb;
+            pos += nb;
+            continue;
+        }
+
+        if (!seeked && (pos < m->frame_pos || pos > end + MAX_DECODE_AHEAD)) {
+            if ((ret = seek_master(m, pos)) < 0)
+                break;
+            seeked = 1;
+        } else if (pos < m->frame_pos) {
+            ret = AVERROR_INVALIDDATA;
+            break;
+        }
+
+        if ((ret = decode_frame(m)) < 0)
+            break;
+    }
+
+    if (ret < 0) {
+        cyanrip_log(m->ctx, 0, "\nError reading disc master: %s!\n", av_err2str(ret));
+        m->status = ret;
+        return NULL;
+    }
+
+    return m->sector;
+}
+
+int crip_master_close(CRIPMaster **s)
+{
+    int ret = 0;
+    CRIPMaster *m = *s;
+    if (!m)
+        return 0;
+
+    if (m->writing && m->avf && m->avf->pb) {
+        ret = m->status;
+
+        if (ret >= 0 && m->filled) {
+            m->frame->nb_samples = m->filled;
+            m->frame->pts = m->nb_samples - m->filled;
+            ret = encode_frame(m, m->frame);
+        }
+        if (ret >= 0)
+            ret = encode_frame(m, NULL);
+        if (ret >= 0)
+            ret = av_write_trailer(m->avf);
+
+        int err = cr_writer_avio_close(&m->avf->pb);
+        ret = ret < 0 ? ret : err;
+
+        if (ret < 0)
+            cyanrip_log(m->ctx, 0, "Error writing disc master: %s!\n", av_err2str(ret));
+        else
+            ret = write_toc(m);
+    }
+
+    if (m->writing)
+        avformat_free_context(m->avf);
+    else
+        avformat_close_input(&m->avf);
+
+    avcodec_free_context(&m->avctx);
+    av_frame_free(&m->frame);
+    av_packet_free(&m->pkt);
+    av_free(m->runs);
+    av_free(m->path);
+    av_freep(s);
+
+    return ret;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include "cyanrip_main.h"
+
+/* The disc's audio sectors as the drive returned them, before the offset is
+ * applied, in a single FLAC file. A TOC file next to it holds the disc's TOC,
+ * the offset, and which sectors are where in the FLAC file, so the disc can
+ * be split again without being read. */
+typedef struct CRIPMaster CRIPMaster;
+
+/* Sets up ctx->master for writing, once the tracks are set up */
+int crip_master_open(cyanrip_ctx *ctx);
+/* Sectors which are already in the master are skipped */
+void crip_master_write(CRIPMaster *m, lsn_t lsn, const uint8_t *data);
+/* The next range of audio sectors the master is missing, 0 once complete */
+int crip_master_next_gap(CRIPMaster *m, lsn_t *start, int *frames);
+
+/* Sets up ctx->master for reading, and fills in the TOC and offset */
+int crip_master_load(cyanrip_ctx *ctx, const char *path);
+/* NULL if the sector is not in the master, valid until the next call */
+const uint8_t *crip_master_read(CRIPMaster *m, lsn_t lsn);
+
+/* Finishes the file and writes out the TOC, if writing */
+int crip_master_close(CRIPMaster **m);
@@ -1,5 +1,15 @@
 #include "fifo_frame.h"
 
+static int64_t frame_size(const AVFrame *f)
+{
+    int64_t size = 0;
+    for (int i = 0; i < FF_ARRAY_ELEMS(f->buf) && f->buf[i]; i++)
+        size += f->buf[i]->size;
+    for (int i = 0; i < f->nb_extended_buf; i++)
+        size += f->extended_buf[i]->size;
+    return size;
+}
+
 #define FRENAME(x)     FRAME_FIFO_ ## x
 #define RENAME(x)      cr_frame_ ##x
 #define PRIV_RENAME(x) frame_ ##x
@@ -7,11 +17,13 @@
 #define SNAME          CRFrameFIFO
 #define FREE_FN        av_frame_free
 #define CLONE_FN(x)    ((x) ? av_frame_clone((x)) : NULL)
+#define SIZE_FN(x)     frame_size((x))
 #define TYPE           AVFrame
 
 #include "fifo_template.c"
 
 #undef TYPE
+#undef SIZE_FN
 #undef CLONE_FN
 #undef FREE_FN
 #undef SNAME
@@ -7,6 +7,8 @@
 enum CRFrameFIFOFlags {
     FRAME_FIFO_BLOCK_MAX_OUTPUT = (1 << 0),
     FRAME_FIFO_BLOCK_NO_INPUT   = (1 << 1),
+    FRAME_FIFO_BLOCK_BUDGET     = (1 << 2),
+    FRAME_FIFO_SPSC             = (1 << 3), /* Lock-free ring, needs a limit and a single pusher and popper */
 };
 
 #define FRENAME(x) FRAME_FIFO_ ## x
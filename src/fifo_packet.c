@@ -7,11 +7,13 @@
 #define SNAME          CRPacketFIFO
 #define FREE_FN        av_packet_free
 #define CLONE_FN(x)    ((x) ? av_packet_clone((x)) : NULL)
+#define SIZE_FN(x)     ((x)->buf ? (x)->buf->size : (x)->size)
 #define TYPE           AVPacket
 
 #include "fifo_template.c"
 
 #undef TYPE
+#undef SIZE_FN
 #undef CLONE_FN
 #undef FREE_FN
 #undef SNAME
@@ -1,14 +1,38 @@
+#include <stdatomic.h>
 #include <libavutil/frame.h>
 
+#include "budget.h"
+
+#define FIFO_CACHELINE 64
+
+/* Which side of a ring is (about to go) asleep on the lock */
+#define RING_CONSUMER (1 << 0)
+#define RING_PRODUCER (1 << 1)
+
 typedef struct SNAME {
     TYPE **queued;
     int num_queued;
-    int max_queued;
-    FNAME block_flags;
+    atomic_int max_queued;
+    int64_t bytes; /* Charged to the budget */
+    atomic_int block_flags;
     unsigned int queued_alloc_size;
     pthread_mutex_t lock;
     pthread_cond_t cond_in;
     pthread_cond_t cond_out;
+
+    /* SPSC ring, replaces the above queue when created with the SPSC flag.
+     * The lock and conditions are only touched by a side that has to sleep,
+     * or to wake up a side which said it's sleeping. */
+    TYPE **ring;
+    unsigned int ring_mask;
+    atomic_int ring_sleeping;
+    atomic_llong ring_bytes;
+
+    char pad0[FIFO_CACHELINE];
+    atomic_uint ring_head; /* Only written by the consumer */
+    char pad1[FIFO_CACHELINE - sizeof(atomic_uint)];
+    atomic_uint ring_tail; /* Only written by the producer */
+    char pad2[FIFO_CACHELINE - sizeof(atomic_uint)];
 } SNAME;
 
 static void PRIV_RENAME(fifo_destroy)(void *opaque, uint8_t *data)
@@ -21,6 +45,15 @@ static void PRIV_RENAME(fifo_destroy)(void *opaque, uint8_t *data)
         FREE_FN(&ctx->queued[i]);
     av_freep(&ctx->queued);
 
+    if (ctx->ring) {
+        for (unsigned int i = 0; i <= ctx->ring_mask; i++)
+            FREE_FN(&ctx->ring[i]);
+        av_freep(&ctx->ring);
+        ctx->bytes += atomic_load(&ctx->ring_bytes);
+    }
+
+    cr_budget_release(ctx->bytes);
+
     pthread_mutex_unlock(&ctx->lock);
 
     pthread_cond_destroy(&ctx->cond_in);
@@ -47,18 +80,149 @@ AVBufferRef *RENAME(fifo_create)(int max_queued, FNAME block_flags)
     pthread_cond_init(&ctx->cond_in, NULL);
     pthread_cond_init(&ctx->cond_out, NULL);
 
+    /* The ring has a fixed size, it needs a limit */
+    if ((block_flags & FRENAME(SPSC)) && max_queued > 0) {
+        /* Up to max_queued + 2 entries, plus the final NULL */
+        unsigned int size = 1;
+        while (size < max_queued + 3)
+            size <<= 1;
+
+        ctx->ring = av_mallocz(size*sizeof(*ctx->ring));
+        if (!ctx->ring) {
+            av_buffer_unref(&ctx_ref);
+            return NULL;
+        }
+        ctx->ring_mask = size - 1;
+    }
+
     ctx->block_flags = block_flags;
     ctx->max_queued = max_queued;
 
     return ctx_ref;
 }
 
+static unsigned int PRIV_RENAME(ring_size)(SNAME *ctx)
+{
+    return atomic_load(&ctx->ring_tail) - atomic_load(&ctx->ring_head);
+}
+
+/* Has to be called by the other side after publishing a change */
+static void PRIV_RENAME(ring_wake)(SNAME *ctx, int side, pthread_cond_t *cond)
+{
+    if (!(atomic_load(&ctx->ring_sleeping) & side))
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+enum { RING_PUSH, RING_DROP, RING_WAIT, RING_FULL };
+
+static int PRIV_RENAME(ring_push_state)(SNAME *ctx, int eof)
+{
+    int max_queued = atomic_load(&ctx->max_queued);
+    unsigned int queued = PRIV_RENAME(ring_size)(ctx);
+
+    if (!max_queued)
+        return RING_DROP;
+    else if (queued > ctx->ring_mask)
+        return RING_WAIT;
+    else if (eof)
+        return RING_PUSH;
+
+    int full = queued > (max_queued + 1);
+    int over = (ctx->block_flags & FRENAME(BLOCK_BUDGET)) &&
+               queued && cr_budget_exceeded();
+
+    if (full && !(ctx->block_flags & FRENAME(BLOCK_MAX_OUTPUT)))
+        return RING_FULL;
+
+    return (full || over) ? RING_WAIT : RING_PUSH;
+}
+
+static int PRIV_RENAME(ring_push)(SNAME *ctx, TYPE *in_clone, int eof)
+{
+    int state = PRIV_RENAME(ring_push_state)(ctx, eof);
+    if (state == RING_WAIT) {
+        pthread_mutex_lock(&ctx->lock);
+        atomic_fetch_or(&ctx->ring_sleeping, RING_PRODUCER);
+        while ((state = PRIV_RENAME(ring_push_state)(ctx, eof)) == RING_WAIT)
+            pthread_cond_wait(&ctx->cond_out, &ctx->lock);
+        atomic_fetch_and(&ctx->ring_sleeping, ~RING_PRODUCER);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    if (state != RING_PUSH) {
+        FREE_FN(&in_clone);
+        return state == RING_FULL ? AVERROR(ENOBUFS) : 0;
+    }
+
+    if (in_clone) {
+        int64_t size = SIZE_FN(in_clone);
+        atomic_fetch_add(&ctx->ring_bytes, size);
+        cr_budget_acquire(size);
+    }
+
+    unsigned int tail = atomic_load_explicit(&ctx->ring_tail, memory_order_relaxed);
+    ctx->ring[tail & ctx->ring_mask] = in_clone;
+    atomic_store(&ctx->ring_tail, tail + 1);
+
+    PRIV_RENAME(ring_wake)(ctx, RING_CONSUMER, &ctx->cond_in);
+
+    return 0;
+}
+
+/* Returns 0 once there's something to read */
+static int PRIV_RENAME(ring_wait_input)(SNAME *ctx)
+{
+    if (PRIV_RENAME(ring_size)(ctx))
+        return 0;
+    else if (!(ctx->block_flags & FRENAME(BLOCK_NO_INPUT)))
+        return AVERROR(EAGAIN);
+
+    pthread_mutex_lock(&ctx->lock);
+    atomic_fetch_or(&ctx->ring_sleeping, RING_CONSUMER);
+    while (!PRIV_RENAME(ring_size)(ctx))
+        pthread_cond_wait(&ctx->cond_in, &ctx->lock);
+    atomic_fetch_and(&ctx->ring_sleeping, ~RING_CONSUMER);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return 0;
+}
+
+static TYPE *PRIV_RENAME(ring_pop)(SNAME *ctx)
+{
+    if (PRIV_RENAME(ring_wait_input)(ctx))
+        return NULL;
+
+    unsigned int head = atomic_load_explicit(&ctx->ring_head, memory_order_relaxed);
+    TYPE *out = ctx->ring[head & ctx->ring_mask];
+    ctx->ring[head & ctx->ring_mask] = NULL;
+    atomic_store(&ctx->ring_head, head + 1);
+
+    if (out) {
+        int64_t size = SIZE_FN(out);
+        atomic_fetch_sub(&ctx->ring_bytes, size);
+        cr_budget_release(size);
+    }
+
+    PRIV_RENAME(ring_wake)(ctx, RING_PRODUCER, &ctx->cond_out);
+
+    return out;
+}
+
 int RENAME(fifo_is_full)(AVBufferRef *src)
 {
     if (!src)
         return 0;
 
     SNAME *ctx = (SNAME *)src->data;
+    if (ctx->ring) {
+        int max_queued = atomic_load(&ctx->max_queued);
+        return !max_queued || PRIV_RENAME(ring_size)(ctx) > (max_queued + 1);
+    }
+
     pthread_mutex_lock(&ctx->lock);
     int ret = 0; /* max_queued == -1 -> unlimited */
     if (!ctx->max_queued)
@@ -75,6 +239,9 @@ int RENAME(fifo_get_size)(AVBufferRef *src)
         return 0;
 
     SNAME *ctx = (SNAME *)src->data;
+    if (ctx->ring)
+        return PRIV_RENAME(ring_size)(ctx);
+
     pthread_mutex_lock(&ctx->lock);
     int ret = ctx->num_queued;
     pthread_mutex_unlock(&ctx->lock);
@@ -96,8 +263,15 @@ int RENAME(fifo_get_max_size)(AVBufferRef *src)
 void RENAME(fifo_set_max_queued)(AVBufferRef *dst, int max_queued)
 {
     SNAME *ctx = (SNAME *)dst->data;
+
+    /* The ring can't grow */
+    if (ctx->ring && (max_queued < 0 || max_queued > ctx->ring_mask - 2))
+        max_queued = ctx->ring_mask - 2;
+
     pthread_mutex_lock(&ctx->lock);
     ctx->max_queued = max_queued;
+    /* Blocked producers need to check again */
+    pthread_cond_broadcast(&ctx->cond_out);
     pthread_mutex_unlock(&ctx->lock);
 }
 
@@ -105,7 +279,9 @@ void RENAME(fifo_set_block_flags)(AVBufferRef *dst, FNAME block_flags)
 {
     SNAME *ctx = (SNAME *)dst->data;
     pthread_mutex_lock(&ctx->lock);
-    ctx->block_flags = block_flags;
+    /* The backend is fixed at creation */
+    ctx->block_flags = (block_flags & ~FRENAME(SPSC)) |
+                       (ctx->block_flags & FRENAME(SPSC));
     pthread_mutex_unlock(&ctx->lock);
 }
 
@@ -116,17 +292,25 @@ int RENAME(fifo_push)(AVBufferRef *dst, TYPE *in)
 
     int err = 0;
     TYPE *in_clone = CLONE_FN(in);
-
     SNAME *ctx = (SNAME *)dst->data;
-    pthread_mutex_lock(&ctx->lock);
+    if (ctx->ring)
+        return PRIV_RENAME(ring_push)(ctx, in_clone, !in);
 
-    if (ctx->max_queued == 0)
-        goto unlock;
+    int64_t size = in_clone ? SIZE_FN(in_clone) : 0;
+
+    pthread_mutex_lock(&ctx->lock);
 
     /* Block or error, but only for non-NULL pushes */
-    if (in && (ctx->max_queued != -1) &&
-        (ctx->num_queued > (ctx->max_queued + 1))) {
-        if (!(ctx->block_flags & FRENAME(BLOCK_MAX_OUTPUT))) {
+    while (in && ctx->max_queued) {
+        int full = (ctx->max_queued != -1) &&
+                   (ctx->num_queued > (ctx->max_queued + 1));
+        /* Only wait for the budget if our consumer has something to free */
+        int over = (ctx->block_flags & FRENAME(BLOCK_BUDGET)) &&
+                   ctx->num_queued && cr_budget_exceeded();
+        if (!full && !over)
+            break;
+
+        if (full && !(ctx->block_flags & FRENAME(BLOCK_MAX_OUTPUT))) {
             err = AVERROR(ENOBUFS);
             FREE_FN(&in_clone);
             goto unlock;
@@ -135,6 +319,11 @@ int RENAME(fifo_push)(AVBufferRef *dst, TYPE *in)
         pthread_cond_wait(&ctx->cond_out, &ctx->lock);
     }
 
+    if (ctx->max_queued == 0) {
+        FREE_FN(&in_clone);
+        goto unlock;
+    }
+
     unsigned int oalloc = ctx->queued_alloc_size;
     TYPE **fq = av_fast_realloc(ctx->queued, &ctx->queued_alloc_size,
                                 sizeof(TYPE *)*(ctx->num_queued + 1));
@@ -148,6 +337,9 @@ int RENAME(fifo_push)(AVBufferRef *dst, TYPE *in)
     ctx->queued = fq;
     ctx->queued[ctx->num_queued++] = in_clone;
 
+    ctx->bytes += size;
+    cr_budget_acquire(size);
+
     pthread_cond_signal(&ctx->cond_in);
 
 unlock:
@@ -163,6 +355,9 @@ TYPE *RENAME(fifo_pop)(AVBufferRef *src)
 
     TYPE *out = NULL;
     SNAME *ctx = (SNAME *)src->data;
+    if (ctx->ring)
+        return PRIV_RENAME(ring_pop)(ctx);
+
     pthread_mutex_lock(&ctx->lock);
 
     if (!ctx->num_queued) {
@@ -178,8 +373,13 @@ TYPE *RENAME(fifo_pop)(AVBufferRef *src)
 
     memmove(&ctx->queued[0], &ctx->queued[1], ctx->num_queued*sizeof(TYPE *));
 
-    if (ctx->max_queued > 0)
-        pthread_cond_signal(&ctx->cond_out);
+    if (out) {
+        int64_t size = SIZE_FN(out);
+        ctx->bytes -= size;
+        cr_budget_release(size);
+    }
+
+    pthread_cond_signal(&ctx->cond_out);
 
 unlock:
     pthread_mutex_unlock(&ctx->lock);
@@ -194,6 +394,13 @@ TYPE *RENAME(fifo_peek)(AVBufferRef *src)
 
     TYPE *out = NULL;
     SNAME *ctx = (SNAME *)src->data;
+    if (ctx->ring) {
+        if (PRIV_RENAME(ring_wait_input)(ctx))
+            return NULL;
+        unsigned int head = atomic_load_explicit(&ctx->ring_head, memory_order_relaxed);
+        return CLONE_FN(ctx->ring[head & ctx->ring_mask]);
+    }
+
     pthread_mutex_lock(&ctx->lock);
 
     if (!ctx->num_queued) {
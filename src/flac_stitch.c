@@ -0,0 +1,157 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <libavutil/crc.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "flac_stitch.h"
+#include "../config.h"
+
+/* Frame and sample numbers use an extended UTF-8 coding, up to 36 bits */
+static int get_utf8(const uint8_t *src, int size, int64_t *val)
+{
+    int len = 0;
+    while (len < 8 && (src[0] & (0x80 >> len)))
+        len++;
+
+    if (!len) {
+        *val = src[0];
+        return 1;
+    } else if (len == 1 || len > 7 || len > size) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    *val = src[0] & (0x7F >> len);
+    for (int i = 1; i < len; i++)
+        *val = (*val << 6) | (src[i] & 0x3F);
+
+    return len;
+}
+
+static int put_utf8(uint8_t *dst, int64_t val)
+{
+    if (val < 0x80) {
+        dst[0] = val;
+        return 1;
+    }
+
+    int len = 2;
+    while (len < 7 && val >= (1LL << (5*len + 1)))
+        len++;
+
+    dst[0] = ((0xFF00 >> len) & 0xFF) | (val >> (6*(len - 1)));
+    for (int i = 1; i < len; i++)
+        dst[i] = 0x80 | ((val >> (6*(len - 1 - i))) & 0x3F);
+
+    return len;
+}
+
+int cr_flac_renumber_frame(AVPacket *pkt, int64_t offset)
+{
+    const uint8_t *src = pkt->data;
+    int64_t num;
+
+    /* Sync code and fixed blocksize, variable ones carry sample numbers */
+    if (pkt->size < 8 || AV_RB16(src) != 0xFFF8)
+        return AVERROR_INVALIDDATA;
+
+    int num_len = get_utf8(src + 4, pkt->size - 4, &num);
+    if (num_len < 0)
+        return num_len;
+
+    /* Blocksize and sample rate which didn't fit the codes */
+    int bs_code = src[2] >> 4;
+    int sr_code = src[2] & 0xF;
+    int extra = (bs_code == 6) + 2*(bs_code == 7) +
+                (sr_code == 12) + 2*(sr_code == 13 || sr_code == 14);
+
+    int old_hdr = 4 + num_len + extra;
+    if (old_hdr + 1 + 2 > pkt->size)
+        return AVERROR_INVALIDDATA;
+
+    uint8_t hdr[4 + 7 + 4 + 1];
+    memcpy(hdr, src, 4);
+    int hdr_len = 4 + put_utf8(hdr + 4, num + offset);
+    memcpy(hdr + hdr_len, src + 4 + num_len, extra);
+    hdr_len += extra;
+    hdr[hdr_len] = av_crc(av_crc_get_table(AV_CRC_8_ATM), 0, hdr, hdr_len);
+    hdr_len++;
+
+    /* Payload without the old header and the footer */
+    int body_len = pkt->size - (old_hdr + 1) - 2;
+    int new_size = hdr_len + body_len + 2;
+
+    AVBufferRef *buf = av_buffer_alloc(new_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    uint8_t *dst = buf->data;
+    memcpy(dst, hdr, hdr_len);
+    memcpy(dst + hdr_len, src + old_hdr + 1, body_len);
+    AV_WL16(dst + new_size - 2, av_crc(av_crc_get_table(AV_CRC_16_ANSI), 0,
+                                       dst, new_size - 2));
+    memset(dst + new_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = dst;
+    pkt->size = new_size;
+
+    return 0;
+}
+
+void cr_flac_md5_update(struct AVMD5 *md5, const AVFrame *frame, int bits_per_raw_sample)
+{
+    const int nb = frame->nb_samples * frame->ch_layout.nb_channels;
+    uint8_t tmp[3*1024];
+
+    /* Little-endian samples, packed to 24 bits above 16 */
+    if (bits_per_raw_sample <= 16 && !CONFIG_BIG_ENDIAN) {
+        av_md5_update(md5, frame->data[0], nb*2);
+    } else if (bits_per_raw_sample <= 16) {
+        const int16_t *src = (const int16_t *)frame->data[0];
+        for (int i = 0; i < nb; i += 1536) {
+            int len = FFMIN(nb - i, 1536);
+            for (int j = 0; j < len; j++)
+                AV_WL16(&tmp[2*j], src[i + j]);
+            av_md5_update(md5, tmp, len*2);
+        }
+    } else {
+        const int32_t *src = (const int32_t *)frame->data[0];
+        for (int i = 0; i < nb; i += 1024) {
+            int len = FFMIN(nb - i, 1024);
+            for (int j = 0; j < len; j++)
+                AV_WL24(&tmp[3*j], src[i + j] >> 8);
+            av_md5_update(md5, tmp, len*3);
+        }
+    }
+}
+
+void cr_flac_patch_streaminfo(uint8_t *streaminfo, int min_frame_size, int max_frame_size,
+                              int64_t nb_samples, const uint8_t md5[16])
+{
+    AV_WB24(streaminfo +  4, min_frame_size);
+    AV_WB24(streaminfo +  7, max_frame_size);
+
+    /* Total samples are the low 36 bits after the rate, channels and depth */
+    streaminfo[13] = (streaminfo[13] & 0xF0) | ((nb_samples >> 32) & 0xF);
+    AV_WB32(streaminfo + 14, nb_samples);
+
+    memcpy(streaminfo + 18, md5, 16);
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <libavcodec/packet.h>
+#include <libavutil/frame.h>
+#include <libavutil/md5.h>
+
+/* Helpers to stitch FLAC streams encoded in independent segments */
+
+/* Adds offset to the frame number in a fixed blocksize frame's header,
+ * recomputing both CRCs. The packet's size may change. */
+int cr_flac_renumber_frame(AVPacket *pkt, int64_t offset);
+
+/* Updates the MD5 of the samples like the encoder does */
+void cr_flac_md5_update(struct AVMD5 *md5, const AVFrame *frame, int bits_per_raw_sample);
+
+/* Fixes up a 34 byte STREAMINFO block for the whole stream */
+void cr_flac_patch_streaminfo(uint8_t *streaminfo, int min_frame_size, int max_frame_size,
+                              int64_t nb_samples, const uint8_t md5[16]);
@@ -0,0 +1,156 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <libavutil/error.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "flac_tags.h"
+
+#define FLAC_BLOCK_PADDING        1
+#define FLAC_BLOCK_VORBIS_COMMENT 4
+
+/* Size of a comment block's payload with the tags added */
+static int64_t comment_size(int64_t old_size, const AVDictionary *tags)
+{
+    const AVDictionaryEntry *e = NULL;
+    while ((e = av_dict_get(tags, "", e, AV_DICT_IGNORE_SUFFIX)))
+        old_size += 4 + strlen(e->key) + 1 + strlen(e->value);
+    return old_size;
+}
+
+static void write_comment(uint8_t *dst, const uint8_t *src, int src_size,
+                          const AVDictionary *tags)
+{
+    const AVDictionaryEntry *e = NULL;
+    uint32_t vendor_len = AV_RL32(src);
+    uint32_t count = AV_RL32(src + 4 + vendor_len);
+
+    memcpy(dst, src, src_size);
+    AV_WL32(dst + 4 + vendor_len, count + av_dict_count(tags));
+    dst += src_size;
+
+    while ((e = av_dict_get(tags, "", e, AV_DICT_IGNORE_SUFFIX))) {
+        size_t klen = strlen(e->key), vlen = strlen(e->value);
+        AV_WL32(dst, klen + 1 + vlen);
+        memcpy(dst + 4, e->key, klen);
+        dst[4 + klen] = '=';
+        memcpy(dst + 4 + klen + 1, e->value, vlen);
+        dst += 4 + klen + 1 + vlen;
+    }
+}
+
+int cr_flac_append_tags(const char *path, const AVDictionary *tags)
+{
+    int ret = 0;
+    uint8_t hdr[4];
+    uint8_t *meta = NULL, *out = NULL;
+    int64_t meta_size = 0;
+
+    if (!av_dict_count(tags))
+        return 0;
+
+    FILE *f = fopen(path, "rb+");
+    if (!f)
+        return AVERROR(errno);
+
+    if (fread(hdr, 1, 4, f) != 4 || memcmp(hdr, "fLaC", 4)) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    /* Find where the metadata blocks end */
+    do {
+        if (fread(hdr, 1, 4, f) != 4) {
+            ret = AVERROR_INVALIDDATA;
+            goto end;
+        }
+        meta_size += 4 + AV_RB24(hdr + 1);
+        if (fseek(f, AV_RB24(hdr + 1), SEEK_CUR)) {
+            ret = AVERROR(errno);
+            goto end;
+        }
+    } while (!(hdr[0] & 0x80));
+
+    meta = av_malloc(meta_size);
+    out = av_malloc(meta_size);
+    if (!meta || !out) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    if (fseek(f, 4, SEEK_SET) || fread(meta, 1, meta_size, f) != meta_size) {
+        ret = AVERROR(errno ? errno : EIO);
+        goto end;
+    }
+
+    /* The comment grows by as much as the padding shrinks */
+    int64_t grow = -1, pad_size = -1, new_size = 0;
+    for (int64_t pos = 0; pos < meta_size; pos += 4 + AV_RB24(meta + pos + 1)) {
+        int type = meta[pos] & 0x7F;
+        int64_t size = AV_RB24(meta + pos + 1);
+        if (type == FLAC_BLOCK_VORBIS_COMMENT && grow < 0) {
+            new_size = comment_size(size, tags);
+            grow = new_size - size;
+        }
+        else if (type == FLAC_BLOCK_PADDING && pad_size < 0)
+            pad_size = size;
+    }
+
+    if (grow < 0 || pad_size < grow || new_size >= (1 << 24)) {
+        ret = AVERROR(ENOSPC);
+        goto end;
+    }
+
+    /* Rebuild the blocks in the same order, with the same total size */
+    int64_t opos = 0;
+    int done_comment = 0, done_padding = 0;
+    for (int64_t pos = 0; pos < meta_size; pos += 4 + AV_RB24(meta + pos + 1)) {
+        int type = meta[pos] & 0x7F;
+        int size = AV_RB24(meta + pos + 1);
+
+        out[opos] = meta[pos];
+        if (type == FLAC_BLOCK_VORBIS_COMMENT && !done_comment) {
+            AV_WB24(out + opos + 1, size + grow);
+            write_comment(out + opos + 4, meta + pos + 4, size, tags);
+            opos += 4 + size + grow;
+            done_comment = 1;
+        } else if (type == FLAC_BLOCK_PADDING && !done_padding) {
+            AV_WB24(out + opos + 1, size - grow);
+            memset(out + opos + 4, 0, size - grow);
+            opos += 4 + size - grow;
+            done_padding = 1;
+        } else {
+            memcpy(out + opos, meta + pos, 4 + size);
+            opos += 4 + size;
+        }
+    }
+
+    if (fseek(f, 4, SEEK_SET) || fwrite(out, 1, meta_size, f) != meta_size)
+        ret = AVERROR(errno ? errno : EIO);
+
+end:
+    if (fclose(f) && !ret)
+        ret = AVERROR(errno);
+    av_free(meta);
+    av_free(out);
+    return ret;
+}
@@ -0,0 +1,342 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+
+#include "from_master.h"
+#include "coverart.h"
+#include "cyanrip_encode.h"
+#include "cyanrip_log.h"
+#include "os_compat.h"
+#include "pool.h"
+
+static const char *art_extensions[] = {
+    "jpg", "jpeg", "png", "bmp", "tiff", "webp", "avif", "heif",
+};
+
+typedef struct CRIPMasterJobs {
+    cyanrip_ctx *ctx;
+    char **paths;
+    const int *quit;
+    atomic_int next;
+    atomic_int errors;
+} CRIPMasterJobs;
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Extension without the dot if name has one, NULL otherwise */
+static const char *name_extension(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return (dot && dot != name) ? dot + 1 : NULL;
+}
+
+static int add_album_art(cyanrip_ctx *ctx, const char *path, const char *name)
+{
+    char *title = av_strndup(name, name_extension(name) - name - 1);
+    if (!title)
+        return AVERROR(ENOMEM);
+
+    /* Arts given with -C take precedence */
+    for (int i = 0; i < ctx->nb_cover_arts; i++) {
+        if (!strcmp(dict_get(ctx->cover_arts[i].meta, "title"), title)) {
+            av_free(title);
+            return 0;
+        }
+    }
+
+    if (ctx->nb_cover_arts >= FF_ARRAY_ELEMS(ctx->cover_arts) - 2) {
+        cyanrip_log(ctx, 0, "Too many cover arts, skipping %s\n", path);
+        av_free(title);
+        return 0;
+    }
+
+    CRIPArt *art = &ctx->cover_arts[ctx->nb_cover_arts++];
+    art->source_url = av_strdup(path);
+    av_dict_set(&art->meta, "title", title, AV_DICT_DONT_STRDUP_VAL);
+
+    return art->source_url ? 0 : AVERROR(ENOMEM);
+}
+
+static int probe_track(cyanrip_ctx *ctx, cyanrip_track *t, const char *path)
+{
+    AVFormatContext *avf = NULL;
+    char *ffpath = cr_ffmpeg_file_path(path);
+    if (!ffpath)
+        return AVERROR(ENOMEM);
+
+    int ret = avformat_open_input(&avf, ffpath, NULL, NULL);
+    av_free(ffpath);
+    if (ret < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", path, av_err2str(ret));
+        return ret;
+    }
+
+    int idx = av_find_best_stream(avf, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (idx < 0) {
+        cyanrip_log(ctx, 0, "No audio in %s!\n", path);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    AVStream *st = avf->streams[idx];
+    if (st->codecpar->sample_rate != 44100 || st->codecpar->ch_layout.nb_channels != 2) {
+        cyanrip_log(ctx, 0, "%s is not CD audio!\n", path);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    av_dict_copy(&t->meta, avf->metadata, 0);
+
+    const char *num = dict_get(t->meta, "track");
+    t->number = num ? strtol(num, NULL, 10) : t->index;
+
+    if (st->duration != AV_NOPTS_VALUE)
+        t->nb_samples = av_rescale_q(st->duration, st->time_base,
+                                     (AVRational){ 1, 44100 });
+
+    /* Masters of HDCD discs keep the decoded bits */
+    if (st->codecpar->bits_per_raw_sample > 16)
+        ctx->settings.decode_hdcd = 1;
+
+    for (int i = 0; i < avf->nb_streams; i++) {
+        if (!(avf->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC))
+            continue;
+        if ((ret = crip_art_from_stream(ctx, &t->art, avf->streams[i])) < 0)
+            goto end;
+        av_dict_set(&t->art.meta, "title", "Front", 0);
+        break;
+    }
+
+end:
+    avformat_close_input(&avf);
+
+    return ret;
+}
+
+/* Whether any output would replace the file it's encoded from */
+static int overwrites_master(cyanrip_ctx *ctx, cyanrip_track *t, const char *path)
+{
+    cyanrip_stat_t src = { 0 };
+    if (cyanrip_stat(path, &src) == -1 || !src.st_ino)
+        return 0;
+
+    for (int i = 0; i < ctx->settings.outputs_num; i++) {
+        cyanrip_stat_t dst = { 0 };
+        char *out = crip_get_path(ctx, CRIP_PATH_TRACK, 0,
+                                  &crip_fmt_info[ctx->settings.outputs[i]], t);
+        int same = out && cyanrip_stat(out, &dst) != -1 &&
+                   dst.st_dev == src.st_dev && dst.st_ino == src.st_ino;
+        av_free(out);
+        if (same)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int save_album_arts(cyanrip_ctx *ctx)
+{
+    if (!ctx->nb_cover_arts)
+        return 0;
+
+    cyanrip_log(ctx, 0, "Cover art destination(s):\n");
+    for (int f = 0; f < ctx->settings.outputs_num; f++) {
+        const cyanrip_out_fmt *fmt = &crip_fmt_info[ctx->settings.outputs[f]];
+        for (int i = 0; i < ctx->nb_cover_arts; i++) {
+            char *file = crip_get_path(ctx, CRIP_PATH_COVERART, 0, fmt,
+                                       &ctx->cover_arts[i]);
+            cyanrip_log(ctx, 0, "    %s\n", file);
+            av_free(file);
+
+            int ret = crip_save_art(ctx, &ctx->cover_arts[i], fmt);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    cyanrip_log(ctx, 0, "\n");
+
+    return 0;
+}
+
+static void *master_thread(void *arg)
+{
+    CRIPMasterJobs *j = arg;
+    cyanrip_ctx *ctx = j->ctx;
+
+    while (!*j->quit) {
+        int i = atomic_fetch_add(&j->next, 1);
+        if (i >= ctx->nb_tracks)
+            break;
+
+        cyanrip_track *t = &ctx->tracks[i];
+        int ret = cyanrip_transcode_file(ctx, t, j->paths[i]);
+
+        /* Waits for the encoders, so only as many tracks are in flight as
+         * there are threads */
+        for (int k = 0; k < ctx->settings.outputs_num; k++) {
+            int err = cyanrip_end_track_encoding(&t->enc_ctx[k]);
+            ret = ret < 0 ? ret : err;
+        }
+
+        if (ret < 0)
+            atomic_fetch_add(&j->errors, 1);
+        else
+            cyanrip_log(ctx, 0, "Track %i done\n", t->number);
+    }
+
+    return NULL;
+}
+
+int crip_from_master(cyanrip_ctx *ctx, const char *dir, const int *quit)
+{
+    int ret = 0, nb_files = 0, nb_threads = 0;
+    char *names[198];
+    char *paths[198] = { NULL };
+    pthread_t threads[64];
+    CRIPMasterJobs jobs = { 0 };
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        ret = AVERROR(errno);
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", dir, av_err2str(ret));
+        return ret;
+    }
+
+    /* Metadata and cover art are all taken from the files */
+    ctx->settings.disable_coverart_db = 1;
+    ctx->settings.enable_replaygain = 0;
+    ctx->settings.deemphasis = 0;
+    ctx->settings.force_deemphasis = 0;
+    ctx->settings.decode_hdcd = 0;
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        const char *ext = name_extension(e->d_name);
+        if (!ext)
+            continue;
+
+        if (!av_strcasecmp(ext, "flac")) {
+            if (nb_files >= FF_ARRAY_ELEMS(names)) {
+                cyanrip_log(ctx, 0, "Too many tracks in %s!\n", dir);
+                ret = AVERROR(EINVAL);
+                goto end;
+            }
+            if (!(names[nb_files] = av_strdup(e->d_name))) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            nb_files++;
+            continue;
+        }
+
+        for (int i = 0; i < FF_ARRAY_ELEMS(art_extensions); i++) {
+            if (av_strcasecmp(ext, art_extensions[i]))
+                continue;
+            char *path = av_asprintf("%s%c%s", dir, OS_DIR_CHAR, e->d_name);
+            ret = path ? add_album_art(ctx, path, e->d_name) : AVERROR(ENOMEM);
+            av_free(path);
+            if (ret < 0)
+                goto end;
+            break;
+        }
+    }
+
+    if (!nb_files) {
+        cyanrip_log(ctx, 0, "No FLAC files found in %s!\n", dir);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    /* Named after the track numbers */
+    qsort(names, nb_files, sizeof(*names), cmp_names);
+
+    for (int i = 0; i < nb_files; i++) {
+        cyanrip_track *t = &ctx->tracks[i];
+        t->index = i + 1;
+        ctx->nb_tracks = i + 1;
+
+        paths[i] = av_asprintf("%s%c%s", dir, OS_DIR_CHAR, names[i]);
+        if (!paths[i]) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+
+        if ((ret = probe_track(ctx, t, paths[i])) < 0)
+            goto end;
+
+        if (!i)
+            av_dict_copy(&ctx->meta, t->meta, 0);
+    }
+
+    for (int i = 0; i < ctx->nb_tracks; i++) {
+        if (overwrites_master(ctx, &ctx->tracks[i], paths[i])) {
+            cyanrip_log(ctx, 0, "Outputs would overwrite %s, set a different "
+                        "directory with -D <folder>!\n", paths[i]);
+            ret = AVERROR(EINVAL);
+            goto end;
+        }
+    }
+
+    if ((ret = crip_fill_coverart(ctx, 0)) < 0 ||
+        (ret = save_album_arts(ctx)) < 0)
+        goto end;
+
+    cyanrip_log(ctx, 0, "Encoding %i tracks from %s\n\n", ctx->nb_tracks, dir);
+
+    jobs.ctx = ctx;
+    jobs.paths = paths;
+    jobs.quit = quit;
+    atomic_init(&jobs.next, 0);
+    atomic_init(&jobs.errors, 0);
+
+    int max_threads = FFMIN(cr_pool_threads(ctx->pool), ctx->nb_tracks);
+    max_threads = FFMIN(max_threads, FF_ARRAY_ELEMS(threads));
+    for (; nb_threads < max_threads; nb_threads++)
+        if (pthread_create(&threads[nb_threads], NULL, master_thread, &jobs))
+            break;
+
+    /* Do it here if no thread could be started */
+    if (!nb_threads)
+        master_thread(&jobs);
+
+    for (int i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    ctx->total_error_count += atomic_load(&jobs.errors);
+
+    cyanrip_log(ctx, 0, "\nEncoded %i tracks, %i failed\n", ctx->nb_tracks,
+                atomic_load(&jobs.errors));
+
+end:
+    closedir(d);
+    for (int i = 0; i < nb_files; i++) {
+        av_free(names[i]);
+        av_free(paths[i]);
+    }
+
+    return ret;
+}
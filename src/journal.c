@@ -0,0 +1,177 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+
+#include "journal.h"
+
+struct CRJournal {
+    FILE *file;
+    char *path;
+    int writing;
+};
+
+/* Only ever read back by the same process, so native layout is fine */
+typedef struct CRJournalRecord {
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int32_t size;
+    int32_t flags;
+    int32_t nb_side_data;
+} CRJournalRecord;
+
+typedef struct CRJournalSideData {
+    int32_t type;
+    int32_t size;
+} CRJournalSideData;
+
+CRJournal *cr_journal_open(const char *path)
+{
+    CRJournal *j = av_mallocz(sizeof(*j));
+    if (!j)
+        return NULL;
+
+    j->path = av_strdup(path);
+    if (!j->path)
+        goto fail;
+
+    j->file = fopen(path, "wb+");
+    if (!j->file)
+        goto fail;
+
+    j->writing = 1;
+
+    return j;
+
+fail:
+    av_free(j->path);
+    av_free(j);
+    return NULL;
+}
+
+static int journal_io(CRJournal *j, void *data, size_t size, int write)
+{
+    size_t ret = write ? fwrite(data, 1, size, j->file) :
+                         fread(data, 1, size, j->file);
+    if (ret == size)
+        return 0;
+    else if (!write && feof(j->file))
+        return AVERROR_EOF;
+    return AVERROR(errno ? errno : EIO);
+}
+
+int cr_journal_write(CRJournal *j, const AVPacket *pkt)
+{
+    int ret;
+
+    if (!j->writing)
+        return AVERROR(EINVAL);
+
+    CRJournalRecord rec = {
+        .pts = pkt->pts,
+        .dts = pkt->dts,
+        .duration = pkt->duration,
+        .size = pkt->size,
+        .flags = pkt->flags,
+        .nb_side_data = pkt->side_data_elems,
+    };
+
+    if ((ret = journal_io(j, &rec, sizeof(rec), 1)) < 0 ||
+        (ret = journal_io(j, pkt->data, pkt->size, 1)) < 0)
+        return ret;
+
+    for (int i = 0; i < pkt->side_data_elems; i++) {
+        CRJournalSideData sd = {
+            .type = pkt->side_data[i].type,
+            .size = pkt->side_data[i].size,
+        };
+        if ((ret = journal_io(j, &sd, sizeof(sd), 1)) < 0 ||
+            (ret = journal_io(j, pkt->side_data[i].data, sd.size, 1)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int cr_journal_rewind(CRJournal *j)
+{
+    j->writing = 0;
+    if (fflush(j->file) || fseek(j->file, 0, SEEK_SET))
+        return AVERROR(errno);
+    return 0;
+}
+
+int cr_journal_read(CRJournal *j, AVPacket *pkt)
+{
+    int ret;
+    CRJournalRecord rec;
+
+    if (j->writing)
+        return AVERROR(EINVAL);
+
+    if ((ret = journal_io(j, &rec, sizeof(rec), 0)) < 0)
+        return ret;
+
+    if ((ret = av_new_packet(pkt, rec.size)) < 0)
+        return ret;
+
+    pkt->pts = rec.pts;
+    pkt->dts = rec.dts;
+    pkt->duration = rec.duration;
+    pkt->flags = rec.flags;
+
+    if ((ret = journal_io(j, pkt->data, rec.size, 0)) < 0)
+        goto fail;
+
+    for (int i = 0; i < rec.nb_side_data; i++) {
+        CRJournalSideData sd;
+        if ((ret = journal_io(j, &sd, sizeof(sd), 0)) < 0)
+            goto fail;
+
+        uint8_t *data = av_packet_new_side_data(pkt, sd.type, sd.size);
+        if (!data) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        if ((ret = journal_io(j, data, sd.size, 0)) < 0)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    av_packet_unref(pkt);
+    /* A truncated record means the journal is broken */
+    return ret == AVERROR_EOF ? AVERROR_INVALIDDATA : ret;
+}
+
+void cr_journal_close(CRJournal **j)
+{
+    if (!*j)
+        return;
+
+    fclose((*j)->file);
+    remove((*j)->path);
+    av_free((*j)->path);
+    av_freep(j);
+}
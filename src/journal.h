@@ -0,0 +1,35 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavcodec/packet.h>
+
+/* Packets parked in a file on disk until they can be muxed */
+typedef struct CRJournal CRJournal;
+
+/* The file is created at path, and removed once closed */
+CRJournal *cr_journal_open(const char *path);
+int cr_journal_write(CRJournal *j, const AVPacket *pkt);
+
+/* Starts reading from the first packet */
+int cr_journal_rewind(CRJournal *j);
+/* Returns AVERROR_EOF once all packets have been read */
+int cr_journal_read(CRJournal *j, AVPacket *pkt);
+
+void cr_journal_close(CRJournal **j);
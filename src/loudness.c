@@ -0,0 +1,270 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <libavutil/attributes.h>
+
+#include "loudness.h"
+
+#define ABS_THRESH (-70.0)
+#define HIST_GRAIN 100
+
+#define ENERGY(loudness) (pow(10.0, ((loudness) + 0.691)/10.0))
+#define LOUDNESS(energy) (-0.691 + 10.0*log10(energy))
+
+/* ITU-R BS.1770-4 Annex 2, tap by tap, with the 4 phases side by side so
+ * they can be computed as one vector */
+static const float tp_coeffs[CR_LOUDNESS_TP_TAPS][4] = {
+    {  0.0017089843750f, -0.0291748046875f, -0.0189208984375f, -0.0083007812500f },
+    {  0.0109863281250f,  0.0292968750000f,  0.0330810546875f,  0.0148925781250f },
+    { -0.0196533203125f, -0.0517578125000f, -0.0582275390625f, -0.0266113281250f },
+    {  0.0332031250000f,  0.0891113281250f,  0.1015625000000f,  0.0476074218750f },
+    { -0.0594482421875f, -0.1665039062500f, -0.2003173828125f, -0.1022949218750f },
+    {  0.1373291015625f,  0.4650878906250f,  0.7797851562500f,  0.9721679687500f },
+    {  0.9721679687500f,  0.7797851562500f,  0.4650878906250f,  0.1373291015625f },
+    { -0.1022949218750f, -0.2003173828125f, -0.1665039062500f, -0.0594482421875f },
+    {  0.0476074218750f,  0.1015625000000f,  0.0891113281250f,  0.0332031250000f },
+    { -0.0266113281250f, -0.0582275390625f, -0.0517578125000f, -0.0196533203125f },
+    {  0.0148925781250f,  0.0330810546875f,  0.0292968750000f,  0.0109863281250f },
+    { -0.0083007812500f, -0.0189208984375f, -0.0291748046875f,  0.0017089843750f },
+};
+
+void cr_loudness_init(CRLoudness *l, int sample_rate)
+{
+    memset(l, 0, sizeof(*l));
+
+    /* High shelf, modelling the acoustic effect of the head */
+    double f0 = 1681.974450955533;
+    double g  = 3.999843853973347;
+    double q  = 0.7071752369554196;
+    double k  = tan(M_PI*f0/sample_rate);
+    double vh = pow(10.0, g/20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k/q + k*k;
+
+    l->pre_b[0] = (vh + vb*k/q + k*k)/a0;
+    l->pre_b[1] = 2.0*(k*k - vh)/a0;
+    l->pre_b[2] = (vh - vb*k/q + k*k)/a0;
+    l->pre_a[0] = 2.0*(k*k - 1.0)/a0;
+    l->pre_a[1] = (1.0 - k/q + k*k)/a0;
+
+    /* RLB highpass */
+    f0 = 38.13547087602444;
+    q  = 0.5003270373238773;
+    k  = tan(M_PI*f0/sample_rate);
+    a0 = 1.0 + k/q + k*k;
+
+    l->rlb_b[0] =  1.0;
+    l->rlb_b[1] = -2.0;
+    l->rlb_b[2] =  1.0;
+    l->rlb_a[0] = 2.0*(k*k - 1.0)/a0;
+    l->rlb_a[1] = (1.0 - k/q + k*k)/a0;
+
+    l->sub_len = sample_rate/10;
+}
+
+static inline double biquad(double x, const double b[3], const double a[2], double z[2])
+{
+    double y = b[0]*x + z[0];
+    z[0] = b[1]*x - a[0]*y + z[1];
+    z[1] = b[2]*x - a[1]*y;
+    return y;
+}
+
+/* Each tap adds to all 4 phases at once, which keeps the sums in order and
+ * so vectorizes without fast-math. Kept out of line, as once inlined into
+ * the per-sample loop GCC stops vectorizing it at -O3. */
+static av_noinline float true_peak(const float (*win)[4], float peak)
+{
+    float acc[4] = { 0.0f };
+    for (int t = 0; t < CR_LOUDNESS_TP_TAPS; t++)
+        for (int p = 0; p < 4; p++)
+            acc[p] += tp_coeffs[t][p]*win[CR_LOUDNESS_TP_TAPS - 1 - t][p];
+
+    for (int p = 0; p < 4; p++) {
+        float a = fabsf(acc[p]);
+        peak = a > peak ? a : peak;
+    }
+
+    return peak;
+}
+
+static inline void hist_add(uint32_t *hist, double energy)
+{
+    double loudness = LOUDNESS(energy);
+    if (loudness < ABS_THRESH)
+        return;
+
+    int idx = (loudness - ABS_THRESH)*HIST_GRAIN;
+    hist[idx < CR_LOUDNESS_HIST_SIZE ? idx : CR_LOUDNESS_HIST_SIZE - 1]++;
+}
+
+/* Called once every 100ms, momentary blocks are 400ms, short-term 3s */
+static void end_subblock(CRLoudness *l)
+{
+    l->sub_energy[l->sub_pos] = l->sub_energy_cur;
+    l->sub_pos = (l->sub_pos + 1) % 30;
+    if (l->nb_subs < 30)
+        l->nb_subs++;
+
+    l->sub_energy_cur = 0.0;
+    l->sub_samples = 0;
+
+    double sum = 0.0;
+    for (int i = 1; i <= l->nb_subs; i++) {
+        sum += l->sub_energy[(l->sub_pos - i + 30) % 30];
+        if (i == 4)
+            hist_add(l->block_hist, sum/(4.0*l->sub_len));
+    }
+    if (l->nb_subs == 30)
+        hist_add(l->short_hist, sum/(30.0*l->sub_len));
+}
+
+void cr_loudness_add(CRLoudness *l, const int16_t *src, int nb_samples)
+{
+    while (nb_samples) {
+        int len = l->sub_len - l->sub_samples;
+        len = len < nb_samples ? len : nb_samples;
+
+        double energy = 0.0;
+        double speak = l->sample_peak;
+        double tpeak = l->true_peak;
+        int pos = l->tp_pos;
+
+        for (int i = 0; i < len; i++) {
+            for (int c = 0; c < 2; c++) {
+                double x = src[2*i + c]*(1.0/32768.0);
+                double ax = fabs(x);
+                speak = ax > speak ? ax : speak;
+
+                double y = biquad(x, l->pre_b, l->pre_a, l->pre_z[c]);
+                y = biquad(y, l->rlb_b, l->rlb_a, l->rlb_z[c]);
+                energy += y*y;
+
+                /* Newest sample last, the oldest drops out at the front */
+                float (*h)[4] = l->tp_hist[c];
+                for (int p = 0; p < 4; p++)
+                    h[pos][p] = h[pos + CR_LOUDNESS_TP_TAPS][p] = x;
+                tpeak = true_peak(&h[pos + 1], tpeak);
+            }
+            pos = (pos + 1) % CR_LOUDNESS_TP_TAPS;
+        }
+
+        l->tp_pos = pos;
+        l->sample_peak = speak;
+        l->true_peak = tpeak > speak ? tpeak : speak;
+        l->sub_energy_cur += energy;
+        l->sub_samples += len;
+        src += 2*len;
+        nb_samples -= len;
+
+        if (l->sub_samples == l->sub_len)
+            end_subblock(l);
+    }
+}
+
+void cr_loudness_merge(CRLoudness *dst, const CRLoudness *src)
+{
+    for (int i = 0; i < CR_LOUDNESS_HIST_SIZE; i++) {
+        dst->block_hist[i] += src->block_hist[i];
+        dst->short_hist[i] += src->short_hist[i];
+    }
+
+    if (src->sample_peak > dst->sample_peak)
+        dst->sample_peak = src->sample_peak;
+    if (src->true_peak > dst->true_peak)
+        dst->true_peak = src->true_peak;
+}
+
+/* Blocks are counted in the bin below their loudness, so on average they're
+ * halfway through it */
+static inline double bin_energy(int i)
+{
+    return ENERGY(ABS_THRESH + (i + 0.5)/HIST_GRAIN);
+}
+
+/* Returns the relative threshold, and the mean loudness of everything above it */
+static double gated_loudness(const uint32_t *hist, double offset, double *thresh)
+{
+    double sum = 0.0;
+    uint64_t nb = 0;
+
+    for (int i = 0; i < CR_LOUDNESS_HIST_SIZE; i++) {
+        sum += hist[i]*bin_energy(i);
+        nb += hist[i];
+    }
+    if (!nb) {
+        *thresh = ABS_THRESH;
+        return ABS_THRESH;
+    }
+
+    *thresh = LOUDNESS(sum/nb) + offset;
+
+    int start = (*thresh - ABS_THRESH)*HIST_GRAIN;
+    start = start < 0 ? 0 : start;
+
+    sum = 0.0;
+    nb = 0;
+    for (int i = start; i < CR_LOUDNESS_HIST_SIZE; i++) {
+        sum += hist[i]*bin_energy(i);
+        nb += hist[i];
+    }
+
+    return nb ? LOUDNESS(sum/nb) : ABS_THRESH;
+}
+
+void cr_loudness_stats(const CRLoudness *l, CRLoudnessStats *stats)
+{
+    stats->integrated = gated_loudness(l->block_hist, -10.0, &stats->integrated_thresh);
+
+    /* Range is between the 10th and 95th percentile of gated short-term loudness */
+    gated_loudness(l->short_hist, -20.0, &stats->range_thresh);
+
+    int start = (stats->range_thresh - ABS_THRESH)*HIST_GRAIN;
+    start = start < 0 ? 0 : start;
+
+    uint64_t nb = 0;
+    for (int i = start; i < CR_LOUDNESS_HIST_SIZE; i++)
+        nb += l->short_hist[i];
+
+    stats->lra_low = stats->lra_high = ABS_THRESH;
+    if (nb) {
+        uint64_t n = 0, low = 0.10*nb + 0.5, high = 0.95*nb + 0.5;
+        for (int i = start; i < CR_LOUDNESS_HIST_SIZE; i++) {
+            n += l->short_hist[i];
+            if (n >= low) {
+                stats->lra_low = ABS_THRESH + (double)i/HIST_GRAIN;
+                break;
+            }
+        }
+        n = nb;
+        for (int i = CR_LOUDNESS_HIST_SIZE - 1; i >= start; i--) {
+            n -= l->short_hist[i];
+            if (n < high) {
+                stats->lra_high = ABS_THRESH + (double)i/HIST_GRAIN;
+                break;
+            }
+        }
+    }
+    stats->range = stats->lra_high - stats->lra_low;
+
+    stats->sample_peak = 20.0*log10(l->sample_peak);
+    stats->true_peak = 20.0*log10(l->true_peak);
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* EBU R128 loudness and peak measurement of stereo s16 audio. Loudness is
+ * kept as histograms of gating blocks, so measurements of several tracks
+ * can be merged into one of the album. */
+
+#define CR_LOUDNESS_HIST_SIZE 10000 /* -70 to +30 LUFS, in steps of 0.01 LU */
+#define CR_LOUDNESS_TP_TAPS 12     /* Per phase of the 4x oversampler */
+
+typedef struct CRLoudness {
+    /* K-weighting, a shelf then a highpass per channel */
+    double pre_b[3], pre_a[2];
+    double rlb_b[3], rlb_a[2];
+    double pre_z[2][2], rlb_z[2][2];
+
+    /* Input history of the true peak oversampler, stored twice to avoid
+     * wrapping around, and each sample once per phase */
+    float tp_hist[2][2*CR_LOUDNESS_TP_TAPS][4];
+    int tp_pos;
+
+    /* Energy of the last 30 100ms subblocks */
+    int sub_len;
+    int sub_samples;
+    double sub_energy_cur;
+    double sub_energy[30];
+    int sub_pos;
+    int nb_subs;
+
+    uint32_t block_hist[CR_LOUDNESS_HIST_SIZE]; /* Momentary, for integrated */
+    uint32_t short_hist[CR_LOUDNESS_HIST_SIZE]; /* Short-term, for range */
+
+    double sample_peak;
+    double true_peak;
+} CRLoudness;
+
+typedef struct CRLoudnessStats {
+    double integrated; /* LUFS */
+    double integrated_thresh;
+    double range; /* LU */
+    double range_thresh;
+    double lra_low;
+    double lra_high;
+    double sample_peak; /* dBFS */
+    double true_peak;
+} CRLoudnessStats;
+
+void cr_loudness_init(CRLoudness *l, int sample_rate);
+void cr_loudness_add(CRLoudness *l, const int16_t *src, int nb_samples);
+
+/* Adds the gating blocks and peaks of src to dst */
+void cr_loudness_merge(CRLoudness *dst, const CRLoudness *src);
+
+void cr_loudness_stats(const CRLoudness *l, CRLoudnessStats *stats);
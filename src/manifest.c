@@ -0,0 +1,440 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libavutil/sha.h>
+
+#include "os_compat.h"
+#include "manifest.h"
+#include "cyanrip_main.h"
+#include "cyanrip_log.h"
+#include "writer.h"
+#include "pool.h"
+
+#define HASH_READ_SIZE  (1 << 20)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct CRFileHash {
+    struct AVSHA *sha;
+    int64_t hashed; /* Bytes hashed so far, in order */
+    int dirty; /* Something was written out of order, so the file's read back */
+};
+
+typedef struct CRManifestEntry {
+    char *path;
+    CRFileHash *h;
+    uint8_t hash[CR_MANIFEST_HASH_SIZE];
+    unsigned patch; /* Last patch, to tell which rehash is the latest */
+} CRManifestEntry;
+
+typedef struct CRRehashJob {
+    char *path;
+    unsigned patch;
+} CRRehashJob;
+
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t manifest_cond = PTHREAD_COND_INITIALIZER;
+static CRManifestEntry *manifest_entries;
+static int manifest_nb_entries;
+static unsigned manifest_patches;
+static int manifest_rehashing;
+
+CRFileHash *cr_file_hash_alloc(void)
+{
+    CRFileHash *h = av_mallocz(sizeof(*h));
+    if (!h)
+        return NULL;
+
+    h->sha = av_sha_alloc();
+    if (!h->sha) {
+        av_free(h);
+        return NULL;
+    }
+
+    av_sha_init(h->sha, 256);
+
+    return h;
+}
+
+void cr_file_hash_update(CRFileHash *h, int64_t offset, const uint8_t *data, int size)
+{
+    /* Overwrites, or gaps, get hashed again from the file */
+    if (offset != h->hashed || h->dirty) {
+        h->dirty = 1;
+        return;
+    }
+
+    av_sha_update(h->sha, data, size);
+    h->hashed += size;
+}
+
+void cr_file_hash_free(CRFileHash **h)
+{
+    if (!*h)
+        return;
+
+    av_free((*h)->sha);
+    av_freep(h);
+}
+
+/* SHA-256 can't take back what it's hashed, so any file changed after the
+ * fact is hashed again from its start */
+static int hash_fd(CRFileHash *h, int fd)
+{
+    int ret = 0;
+
+    av_sha_init(h->sha, 256);
+    h->hashed = 0;
+    h->dirty = 0;
+
+    uint8_t *buf = av_malloc(HASH_READ_SIZE);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+
+    while (1) {
+        ssize_t len = read(fd, buf, HASH_READ_SIZE);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = AVERROR(errno);
+            break;
+        } else if (!len) {
+            break;
+        }
+        cr_file_hash_update(h, h->hashed, buf, len);
+    }
+
+end:
+    av_free(buf);
+
+    return ret;
+}
+
+int cr_file_hash_finish(CRFileHash *h, int fd)
+{
+    return h->dirty ? hash_fd(h, fd) : 0;
+}
+
+static int rehash(CRFileHash *h, const char *path)
+{
+    int fd = cyanrip_open(path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    int ret = hash_fd(h, fd);
+    close(fd);
+
+    return ret;
+}
+
+static CRManifestEntry *find_entry(const char *path)
+{
+    for (int i = 0; i < manifest_nb_entries; i++)
+        if (!strcmp(manifest_entries[i].path, path))
+            return &manifest_entries[i];
+
+    return NULL;
+}
+
+static void remove_entry(CRManifestEntry *e)
+{
+    av_free(e->path);
+    cr_file_hash_free(&e->h);
+    *e = manifest_entries[--manifest_nb_entries];
+}
+
+int cr_manifest_add(const char *path, CRFileHash **h)
+{
+    int ret = 0;
+    char *p = av_strdup(path);
+    if (!p)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&manifest_lock);
+
+    /* Written again */
+    CRManifestEntry *e = find_entry(path);
+    if (e)
+        remove_entry(e);
+
+    e = av_realloc_array(manifest_entries, manifest_nb_entries + 1, sizeof(*e));
+    if (!e) {
+        av_free(p);
+        ret = AVERROR(ENOMEM);
+    } else {
+        manifest_entries = e;
+        manifest_entries[manifest_nb_entries++] = (CRManifestEntry){ .path = p, .h = *h };
+        *h = NULL;
+    }
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    return ret;
+}
+
+static CRManifestEntry *find_patch(unsigned patch)
+{
+    for (int i = 0; i < manifest_nb_entries; i++)
+        if (manifest_entries[i].patch == patch)
+            return &manifest_entries[i];
+
+    return NULL;
+}
+
+/* Hashed into a new context, which replaces the entry's unless it was
+ * patched again meanwhile. Found by patch, as it may have been renamed. */
+static void rehash_job(void *arg)
+{
+    CRRehashJob *job = arg;
+    CRFileHash *h = cr_file_hash_alloc();
+    int ret = h ? rehash(h, job->path) : AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&manifest_lock);
+    CRManifestEntry *e = find_patch(job->patch);
+    if (e && ret >= 0) {
+        cr_file_hash_free(&e->h);
+        e->h = h;
+        h = NULL;
+    }
+    manifest_rehashing--;
+    pthread_cond_broadcast(&manifest_cond);
+    pthread_mutex_unlock(&manifest_lock);
+
+    cr_file_hash_free(&h);
+    av_free(job->path);
+    av_free(job);
+}
+
+void cr_manifest_patched(CRPool *pool, const char *path)
+{
+    pthread_mutex_lock(&manifest_lock);
+    CRManifestEntry *e = find_entry(path);
+    if (!e) {
+        pthread_mutex_unlock(&manifest_lock);
+        return;
+    }
+    e->h->dirty = 1;
+    e->patch = ++manifest_patches;
+
+    /* If it can't be queued, it's still hashed once the manifest is written */
+    CRRehashJob *job = av_mallocz(sizeof(*job));
+    if (job && (job->path = av_strdup(path))) {
+        job->patch = e->patch;
+        manifest_rehashing++;
+    } else if (job) {
+        av_freep(&job);
+    }
+    pthread_mutex_unlock(&manifest_lock);
+
+    if (job && cr_pool_submit(pool, rehash_job, job) < 0) {
+        pthread_mutex_lock(&manifest_lock);
+        manifest_rehashing--;
+        pthread_mutex_unlock(&manifest_lock);
+        av_free(job->path);
+        av_free(job);
+    }
+}
+
+void cr_manifest_rename(const char *from, const char *to)
+{
+    pthread_mutex_lock(&manifest_lock);
+    CRManifestEntry *e = find_entry(to);
+    if (e)
+        remove_entry(e);
+    e = find_entry(from);
+    if (e) {
+        char *p = av_strdup(to);
+        if (p) {
+            av_free(e->path);
+            e->path = p;
+        } else {
+            remove_entry(e);
+        }
+    }
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+void cr_manifest_remove(const char *path)
+{
+    pthread_mutex_lock(&manifest_lock);
+    CRManifestEntry *e = find_entry(path);
+    if (e)
+        remove_entry(e);
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+    return strcmp(((const CRManifestEntry *)a)->path, ((const CRManifestEntry *)b)->path);
+}
+
+static void json_string(CRWriter *w, const char *str)
+{
+    cr_writer_printf(w, "\"");
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            cr_writer_printf(w, "\\%c", *str);
+        else if ((uint8_t)*str < 0x20)
+            cr_writer_printf(w, "\\u%04x", *str);
+        else
+            cr_writer_write(w, (const uint8_t *)str, 1);
+    }
+    cr_writer_printf(w, "\"");
+}
+
+/* Same escaping as sha256sum */
+static void sum_line(CRWriter *w, const char *hex, const char *name)
+{
+    int escape = !!strpbrk(name, "\\\n");
+
+    cr_writer_printf(w, "%s%s  ", escape ? "\\" : "", hex);
+    for (; *name; name++) {
+        if (escape && *name == '\\')
+            cr_writer_printf(w, "\\\\");
+        else if (escape && *name == '\n')
+            cr_writer_printf(w, "\\n");
+        else
+            cr_writer_write(w, (const uint8_t *)name, 1);
+    }
+    cr_writer_printf(w, "\n");
+}
+
+static int write_folder(cyanrip_ctx *ctx, const cyanrip_out_fmt *cfmt)
+{
+    int ret, err;
+    CRWriter *sum = NULL, *json = NULL;
+    char hex[2*CR_MANIFEST_HASH_SIZE + 1];
+    const int flags = ctx->settings.writer_flags & ~CR_WRITER_HASH;
+
+    char *path = crip_get_path(ctx, CRIP_PATH_MANIFEST, 1, cfmt, NULL);
+    char *json_path = path ? av_asprintf("%s.json", path) : NULL;
+    const char *sep = path ? strrchr(path, '/') : NULL;
+    if (!json_path) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    size_t dir_len = sep ? sep - path + 1 : 0;
+
+    if ((ret = cr_writer_open(&sum, path, 0, flags)) < 0 ||
+        (ret = cr_writer_open(&json, json_path, 0, flags)) < 0) {
+        cyanrip_log(ctx, 0, "Couldn't open %s: %s!\n", sum ? json_path : path,
+                    av_err2str(ret));
+        goto end;
+    }
+
+    cr_writer_printf(json, "{\n  \"generator\": \"cyanrip %s\",\n  \"files\": [",
+                     PROJECT_VERSION_STRING);
+
+    int nb = 0;
+    for (int i = 0; i < manifest_nb_entries; i++) {
+        CRManifestEntry *e = &manifest_entries[i];
+        if (strncmp(e->path, path, dir_len))
+            continue;
+
+        const char *name = e->path + dir_len;
+        for (int j = 0; j < CR_MANIFEST_HASH_SIZE; j++)
+            snprintf(&hex[j*2], 3, "%02x", e->hash[j]);
+
+        sum_line(sum, hex, name);
+
+        cr_writer_printf(json, "%s\n    { \"path\": ", nb++ ? "," : "");
+        json_string(json, name);
+        cr_writer_printf(json, ", \"size\": %"PRId64", \"sha256\": \"%s\" }",
+                         e->h->hashed, hex);
+    }
+
+    cr_writer_printf(json, "\n  ]\n}\n");
+
+    cyanrip_log(ctx, 0, "    %s\n", path);
+
+end:
+    if (sum && (err = cr_writer_close(&sum)) < 0) {
+        cyanrip_log(ctx, 0, "Error writing %s: %s!\n", path, av_err2str(err));
+        ret = err;
+    }
+    if (json && (err = cr_writer_close(&json)) < 0) {
+        cyanrip_log(ctx, 0, "Error writing %s: %s!\n", json_path, av_err2str(err));
+        ret = err;
+    }
+    av_free(json_path);
+    av_free(path);
+
+    return ret;
+}
+
+int crip_manifest_write(cyanrip_ctx *ctx)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&manifest_lock);
+
+    while (manifest_rehashing)
+        pthread_cond_wait(&manifest_cond, &manifest_lock);
+
+    if (!manifest_nb_entries) {
+        pthread_mutex_unlock(&manifest_lock);
+        return 0;
+    }
+
+    /* Anything which couldn't be hashed again earlier */
+    for (int i = 0; i < manifest_nb_entries; i++) {
+        CRManifestEntry *e = &manifest_entries[i];
+        int err = e->h->dirty ? rehash(e->h, e->path) : 0;
+        if (err < 0) {
+            cyanrip_log(ctx, 0, "Couldn't hash %s: %s!\n", e->path, av_err2str(err));
+            remove_entry(e);
+            ret = err;
+            i--;
+            continue;
+        }
+        av_sha_final(e->h->sha, e->hash);
+    }
+
+    qsort(manifest_entries, manifest_nb_entries, sizeof(*manifest_entries), cmp_entries);
+
+    cyanrip_log(ctx, 0, "Manifest destination(s):\n");
+    for (int f = 0; f < ctx->settings.outputs_num; f++) {
+        int err = write_folder(ctx, &crip_fmt_info[ctx->settings.outputs[f]]);
+        ret = err < 0 ? err : ret;
+    }
+    cyanrip_log(ctx, 0, "\n");
+
+    while (manifest_nb_entries)
+        remove_entry(&manifest_entries[0]);
+    av_freep(&manifest_entries);
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    return ret;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct cyanrip_ctx;
+struct CRPool;
+
+#define CR_MANIFEST_HASH_SIZE 32
+
+/* SHA-256 of a file, updated as it's written. A file with anything written
+ * out of order, like a header patched once done, is read back and hashed
+ * again as a whole. */
+typedef struct CRFileHash CRFileHash;
+
+CRFileHash *cr_file_hash_alloc(void);
+void cr_file_hash_update(CRFileHash *h, int64_t offset, const uint8_t *data, int size);
+/* Reads the file back from fd if anything was out of order, done on close */
+int cr_file_hash_finish(CRFileHash *h, int fd);
+void cr_file_hash_free(CRFileHash **h);
+
+/* Process-wide list of the files written, takes the hash */
+int cr_manifest_add(const char *path, CRFileHash **h);
+
+/* For files changed after being closed, hashed again on the pool */
+void cr_manifest_patched(struct CRPool *pool, const char *path);
+void cr_manifest_rename(const char *from, const char *to);
+void cr_manifest_remove(const char *path);
+
+/* Writes a sha256sum file and a JSON one into each output folder, covering
+ * all files in it, and empties the list */
+int crip_manifest_write(struct cyanrip_ctx *ctx);
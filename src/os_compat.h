@@ -23,6 +23,8 @@
 
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <windows.h>
 #include <wchar.h>
@@ -64,10 +66,22 @@ static inline int cyanrip_stat(const char *filename_utf8, cyanrip_stat_t* statbu
     return ret;
 }
 
+static inline int cyanrip_open(const char *filename_utf8, int flags, int mode)
+{
+    wchar_t *filename_w;
+    int ret;
+    if (utf8towchar(filename_utf8, &filename_w))
+        return -1;
+    ret = _wopen(filename_w, flags | _O_BINARY, mode);
+    av_free(filename_w);
+    return ret;
+}
+
 #define mkdir(path, mode) win32_mkdir(path)
 #else
 typedef struct stat cyanrip_stat_t;
 #define cyanrip_stat stat
+#define cyanrip_open open
 #endif
 
 #if defined(__MACH__)
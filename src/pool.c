@@ -0,0 +1,152 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+
+#include "pool.h"
+
+typedef struct CRPoolJob {
+    CRPoolJobFn fn;
+    void *arg;
+    struct CRPoolJob *next;
+} CRPoolJob;
+
+struct CRPool {
+    pthread_t *threads;
+    int nb_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CRPoolJob *first;
+    CRPoolJob *last;
+    int quit;
+};
+
+static void *pool_worker(void *arg)
+{
+    CRPool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        while (!pool->first && !pool->quit)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        CRPoolJob *job = pool->first;
+        if (!job)
+            break; /* Quitting, and nothing left to do */
+
+        pool->first = job->next;
+        if (!pool->first)
+            pool->last = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+        job->fn(job->arg);
+        av_free(job);
+        pthread_mutex_lock(&pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+CRPool *cr_pool_create(int nb_threads)
+{
+    CRPool *pool = av_mallocz(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    if (nb_threads <= 0)
+        nb_threads = av_cpu_count();
+
+    pool->threads = av_calloc(nb_threads, sizeof(*pool->threads));
+    if (!pool->threads) {
+        av_free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < nb_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool))
+            break;
+        pool->nb_threads++;
+    }
+
+    if (!pool->nb_threads) {
+        cr_pool_free(&pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int cr_pool_threads(CRPool *pool)
+{
+    return pool->nb_threads;
+}
+
+int cr_pool_submit(CRPool *pool, CRPoolJobFn fn, void *arg)
+{
+    CRPoolJob *job = av_mallocz(sizeof(*job));
+    if (!job)
+        return AVERROR(ENOMEM);
+
+    job->fn = fn;
+    job->arg = arg;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->last)
+        pool->last->next = job;
+    else
+        pool->first = job;
+    pool->last = job;
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void cr_pool_free(CRPool **pool)
+{
+    CRPool *s = *pool;
+    if (!s)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->nb_threads; i++)
+        pthread_join(s->threads[i], NULL);
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+
+    av_free(s->threads);
+    av_freep(pool);
+}
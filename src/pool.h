@@ -0,0 +1,34 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+/* Simple pool of worker threads, running jobs in submission order */
+typedef struct CRPool CRPool;
+
+typedef void (*CRPoolJobFn)(void *arg);
+
+/* nb_threads <= 0 means one per CPU */
+CRPool *cr_pool_create(int nb_threads);
+int cr_pool_threads(CRPool *pool);
+
+/* Never blocks, the job owns arg */
+int cr_pool_submit(CRPool *pool, CRPoolJobFn fn, void *arg);
+
+/* Finishes all queued jobs before returning */
+void cr_pool_free(CRPool **pool);
@@ -270,20 +270,6 @@ static inline uint8_t bcd_to_bin(uint8_t x){
     return 10*((x & 0xF0) >> 4) + (x & 0x0F);
 }
 
-// CRC-16/GSM with length 10
-static inline unsigned crc_subq(const uint8_t* subq_buf)
-{
-    int length = 10;
-    const unsigned crc_poly = 0x1021;
-    unsigned r = 0x0000;
-    while (length--) {
-        r ^= *subq_buf++ << 8;
-        for (int i = 0; i < 8; i++)
-            r = r & 0x8000 ? (r << 1) ^ crc_poly : r << 1;
-    }
-    return ~r & 0xFFFF;
-}
-
 // MMC-3 Table 38 - Formatted Q sub-channel response data
 static void decode_subq(subq_t *subq, const uint8_t *src) {
     subq->control       = (src[0] & 0xF0) >> 4;
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <cdio/cdio.h>
 
 lsn_t cyanrip_get_track_pregap_lsn(CdIo_t *p_cdio, track_t track_number);
@@ -25,3 +26,17 @@ lsn_t cyanrip_get_track_pregap_lsn(CdIo_t *p_cdio, track_t track_number);
 static inline lba_t cyanrip_get_track_pregap_lba(CdIo_t *p_cdio, track_t track_number) {
     return cdio_lsn_to_lba(cyanrip_get_track_pregap_lsn(p_cdio, track_number));
 }
+
+// CRC-16/GSM with length 10
+static inline unsigned crc_subq(const uint8_t* subq_buf)
+{
+    int length = 10;
+    const unsigned crc_poly = 0x1021;
+    unsigned r = 0x0000;
+    while (length--) {
+        r ^= *subq_buf++ << 8;
+        for (int i = 0; i < 8; i++)
+            r = r & 0x8000 ? (r << 1) ^ crc_poly : r << 1;
+    }
+    return ~r & 0xFFFF;
+}
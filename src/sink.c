@@ -0,0 +1,223 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <libavutil/bprint.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+
+#include "os_compat.h"
+#include "sink.h"
+
+#define SINK_AVIO_BUF (64 << 10)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct CRSink {
+    int fd;
+    int close_fd;
+    pthread_mutex_t lock;
+    uint32_t next_id;
+    int err;
+};
+
+typedef struct CRSinkStream {
+    CRSink *sink;
+    uint32_t id;
+} CRSinkStream;
+
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size) {
+        ssize_t ret = write(fd, data, size);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        data += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+/* Records are written whole, streams never interleave within one */
+static int write_record(CRSink *s, const char tag[4], uint32_t id,
+                        const uint8_t *data, int size)
+{
+    uint8_t hdr[12];
+    memcpy(hdr, tag, 4);
+    AV_WB32(hdr + 4, id);
+    AV_WB32(hdr + 8, size);
+
+    pthread_mutex_lock(&s->lock);
+    if (!s->err)
+        s->err = write_all(s->fd, hdr, sizeof(hdr));
+    if (!s->err && size)
+        s->err = write_all(s->fd, data, size);
+    int ret = s->err;
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+int cr_sink_open(CRSink **s, const char *path)
+{
+    CRSink *sink = av_mallocz(sizeof(*sink));
+    if (!sink)
+        return AVERROR(ENOMEM);
+
+    if (!strcmp(path, "-")) {
+        sink->fd = STDOUT_FILENO;
+#ifdef _WIN32
+        _setmode(sink->fd, _O_BINARY);
+#endif
+    } else {
+        /* Named pipes wait here until there's a reader */
+        sink->fd = cyanrip_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+        if (sink->fd < 0) {
+            int ret = AVERROR(errno);
+            av_free(sink);
+            return ret;
+        }
+        sink->close_fd = 1;
+    }
+
+    pthread_mutex_init(&sink->lock, NULL);
+    sink->next_id = 1;
+
+    uint8_t version[4];
+    AV_WB32(version, CR_SINK_VERSION);
+
+    int ret = write_record(sink, "CRIP", 0, version, sizeof(version));
+    if (ret < 0) {
+        cr_sink_close(&sink);
+        return ret;
+    }
+
+    *s = sink;
+
+    return 0;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+static int avio_write_cb(void *opaque, uint8_t *buf, int size)
+#else
+static int avio_write_cb(void *opaque, const uint8_t *buf, int size)
+#endif
+{
+    CRSinkStream *st = opaque;
+    int ret = write_record(st->sink, "DATA", st->id, buf, size);
+    return ret < 0 ? ret : size;
+}
+
+int cr_sink_avio_open(CRSink *s, AVIOContext **pb, int track,
+                      const char *format, const char *name)
+{
+    int ret;
+    AVBPrint bp;
+    uint8_t *buf = NULL;
+
+    CRSinkStream *st = av_mallocz(sizeof(*st));
+    if (!st)
+        return AVERROR(ENOMEM);
+
+    st->sink = s;
+    pthread_mutex_lock(&s->lock);
+    st->id = s->next_id++;
+    pthread_mutex_unlock(&s->lock);
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "track=%i\nformat=%s\nname=%s\n", track, format, name);
+    if (!av_bprint_is_complete(&bp)) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    ret = write_record(s, "OPEN", st->id, (const uint8_t *)bp.str, bp.len);
+    if (ret < 0)
+        goto fail;
+
+    buf = av_malloc(SINK_AVIO_BUF);
+    if (!buf) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    /* Not seekable, so muxers write something which can be streamed */
+    *pb = avio_alloc_context(buf, SINK_AVIO_BUF, 1, st, NULL, avio_write_cb, NULL);
+    if (!*pb) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    av_bprint_finalize(&bp, NULL);
+
+    return 0;
+
+fail:
+    av_bprint_finalize(&bp, NULL);
+    av_free(buf);
+    av_free(st);
+    return ret;
+}
+
+int cr_sink_avio_close(AVIOContext **pb, int status)
+{
+    if (!*pb)
+        return 0;
+
+    avio_flush(*pb);
+
+    CRSinkStream *st = (*pb)->opaque;
+    int ret = (*pb)->error;
+
+    uint8_t res[4];
+    AV_WB32(res, ret < 0 ? ret : status);
+    int err = write_record(st->sink, "DONE", st->id, res, sizeof(res));
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    av_free(st);
+
+    return ret < 0 ? ret : err;
+}
+
+int cr_sink_close(CRSink **s)
+{
+    CRSink *sink = *s;
+    if (!sink)
+        return 0;
+
+    int ret = write_record(sink, "END ", 0, NULL, 0);
+
+    if (sink->close_fd && close(sink->fd) && !ret)
+        ret = AVERROR(errno);
+
+    pthread_mutex_destroy(&sink->lock);
+    av_freep(s);
+
+    return ret;
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavformat/avio.h>
+
+/* Streams outputs into a single pipe, stdout or file, instead of one file
+ * each. Everything is sent as records of a 4 byte tag, a 4 byte stream ID
+ * and a 4 byte payload size (both big-endian), followed by the payload:
+ *   "CRIP" ID 0, the format version, as 4 bytes
+ *   "OPEN" a new stream, "key=value" lines with its track, format and name
+ *   "DATA" the next bytes of a stream's container
+ *   "DONE" a stream's end, with its status as 4 bytes, 0 if it's complete
+ *   "END " ID 0, nothing comes after it
+ * Writes block while the reader is behind, which holds up encoding, and with
+ * it ripping. */
+typedef struct CRSink CRSink;
+
+#define CR_SINK_VERSION 1
+
+/* "-" is stdout */
+int cr_sink_open(CRSink **s, const char *path);
+
+/* name is what the file would be called */
+int cr_sink_avio_open(CRSink *s, AVIOContext **pb, int track,
+                      const char *format, const char *name);
+int cr_sink_avio_close(AVIOContext **pb, int status);
+
+int cr_sink_close(CRSink **s);
@@ -0,0 +1,414 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <pthread.h>
+
+#include <libavutil/sha.h>
+#include <libavutil/mem.h>
+
+#include "treehash.h"
+#include "checksums.h"
+#include "cyanrip_log.h"
+#include "writer.h"
+#include "flac_tags.h"
+#include "manifest.h"
+
+struct CRIPTreeHash {
+    CRPool *pool;
+
+    uint8_t *cur;
+    int cur_size;
+
+    int nb_leaves;
+    int nb_leaves_alloc;
+    uint8_t (*leaves)[CRIP_TREE_HASH_SIZE];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+    int err;
+};
+
+typedef struct CRIPTreeJob {
+    CRIPTreeHash *s;
+    int idx;
+    uint8_t *data;
+    int size;
+} CRIPTreeJob;
+
+static int sha256_node(const uint8_t *prefix, int prefix_size,
+                       const uint8_t *a, int a_size,
+                       const uint8_t *b, int b_size,
+                       uint8_t out[CRIP_TREE_HASH_SIZE])
+{
+    struct AVSHA *sha = av_sha_alloc();
+    if (!sha)
+        return AVERROR(ENOMEM);
+
+    av_sha_init(sha, 256);
+    av_sha_update(sha, prefix, prefix_size);
+    av_sha_update(sha, a, a_size);
+    if (b)
+        av_sha_update(sha, b, b_size);
+    av_sha_final(sha, out);
+    av_free(sha);
+
+    return 0;
+}
+
+static void tree_leaf_job(void *arg)
+{
+    CRIPTreeJob *job = arg;
+    CRIPTreeHash *s = job->s;
+    const uint8_t prefix = 0x00;
+
+    int err = sha256_node(&prefix, 1, job->data, job->size, NULL, 0,
+                          s->leaves[job->idx]);
+
+    pthread_mutex_lock(&s->lock);
+    if (err < 0)
+        s->err = err;
+    s->pending--;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    av_free(job->data);
+    av_free(job);
+}
+
+static void tree_wait(CRIPTreeHash *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->pending)
+        pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int tree_submit_leaf(CRIPTreeHash *s)
+{
+    if (s->nb_leaves == s->nb_leaves_alloc) {
+        /* Can't move leaves while they're being written */
+        tree_wait(s);
+        void *tmp = av_realloc_array(s->leaves, s->nb_leaves_alloc + 16,
+                                     sizeof(*s->leaves));
+        if (!tmp)
+            return AVERROR(ENOMEM);
+        s->leaves = tmp;
+        s->nb_leaves_alloc += 16;
+    }
+
+    CRIPTreeJob *job = av_mallocz(sizeof(*job));
+    if (!job)
+        return AVERROR(ENOMEM);
+
+    job->s = s;
+    job->idx = s->nb_leaves++;
+    job->data = s->cur;
+    job->size = s->cur_size;
+
+    s->cur = NULL;
+    s->cur_size = 0;
+
+    pthread_mutex_lock(&s->lock);
+    s->pending++;
+    pthread_mutex_unlock(&s->lock);
+
+    int err = cr_pool_submit(s->pool, tree_leaf_job, job);
+    if (err < 0) {
+        pthread_mutex_lock(&s->lock);
+        s->pending--;
+        pthread_mutex_unlock(&s->lock);
+        av_free(job->data);
+        av_free(job);
+    }
+
+    return err;
+}
+
+CRIPTreeHash *crip_tree_alloc(CRPool *pool, int64_t total_bytes)
+{
+    CRIPTreeHash *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->pool = pool;
+    s->nb_leaves_alloc = FFMAX((total_bytes + CRIP_TREE_LEAF_SIZE - 1) / CRIP_TREE_LEAF_SIZE, 1);
+    s->leaves = av_calloc(s->nb_leaves_alloc, sizeof(*s->leaves));
+    if (!s->leaves) {
+        av_free(s);
+        return NULL;
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    return s;
+}
+
+int crip_tree_update(CRIPTreeHash *s, const uint8_t *data, int bytes)
+{
+    int err;
+
+    while (bytes) {
+        if (!s->cur) {
+            s->cur = av_malloc(CRIP_TREE_LEAF_SIZE);
+            if (!s->cur)
+                return AVERROR(ENOMEM);
+        }
+
+        int len = FFMIN(CRIP_TREE_LEAF_SIZE - s->cur_size, bytes);
+        memcpy(&s->cur[s->cur_size], data, len);
+        s->cur_size += len;
+        data  += len;
+        bytes -= len;
+
+        if (s->cur_size == CRIP_TREE_LEAF_SIZE) {
+            if ((err = tree_submit_leaf(s)) < 0)
+                return err;
+        }
+    }
+
+    return 0;
+}
+
+int crip_tree_final(CRIPTreeHash *s, uint8_t root[CRIP_TREE_HASH_SIZE],
+                    uint8_t (**leaves)[CRIP_TREE_HASH_SIZE])
+{
+    int err = 0;
+
+    if (s->cur_size)
+        err = tree_submit_leaf(s);
+
+    tree_wait(s);
+
+    if (!err)
+        err = s->err;
+    if (err < 0)
+        return err;
+
+    crip_tree_root((const uint8_t (*)[CRIP_TREE_HASH_SIZE])s->leaves, s->nb_leaves, root);
+
+    *leaves = s->leaves;
+    s->leaves = NULL;
+
+    return s->nb_leaves;
+}
+
+void crip_tree_free(CRIPTreeHash **s)
+{
+    CRIPTreeHash *ctx = *s;
+    if (!ctx)
+        return;
+
+    tree_wait(ctx);
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    av_free(ctx->cur);
+    av_free(ctx->leaves);
+    av_freep(s);
+}
+
+void crip_tree_root(const uint8_t (*nodes)[CRIP_TREE_HASH_SIZE], int nb,
+                    uint8_t root[CRIP_TREE_HASH_SIZE])
+{
+    const uint8_t prefix = 0x01;
+    uint8_t left[CRIP_TREE_HASH_SIZE], right[CRIP_TREE_HASH_SIZE];
+
+    if (!nb) {
+        sha256_node(NULL, 0, NULL, 0, NULL, 0, root);
+        return;
+    } else if (nb == 1) {
+        memcpy(root, nodes[0], CRIP_TREE_HASH_SIZE);
+        return;
+    }
+
+    /* Split at the largest power of two smaller than nb */
+    int split = 1;
+    while ((split << 1) < nb)
+        split <<= 1;
+
+    crip_tree_root(nodes, split, left);
+    crip_tree_root(nodes + split, nb - split, right);
+
+    sha256_node(&prefix, 1, left, sizeof(left), right, sizeof(right), root);
+}
+
+static int tree_enabled(cyanrip_ctx *ctx)
+{
+    for (int i = 0; i < ctx->settings.checksums_num; i++)
+        if (ctx->settings.checksums[i] == CRIP_CHECKSUM_SHA256_TREE)
+            return 1;
+    return 0;
+}
+
+int crip_tree_disc_meta(cyanrip_ctx *ctx)
+{
+    char str[2*CRIP_TREE_HASH_SIZE + 1];
+    uint8_t (*roots)[CRIP_TREE_HASH_SIZE];
+    int nb_roots = 0;
+
+    if (!tree_enabled(ctx))
+        return 0;
+
+    roots = av_calloc(ctx->nb_tracks, sizeof(*roots));
+    if (!roots)
+        return AVERROR(ENOMEM);
+
+    /* Only meaningful if every audio track was hashed */
+    for (int i = 0; i < ctx->nb_tracks; i++) {
+        cyanrip_track *t = &ctx->tracks[i];
+        if (t->track_is_data)
+            continue;
+        if (!t->tree_leaves) {
+            av_free(roots);
+            return 0;
+        }
+        memcpy(roots[nb_roots++], t->checksums[CRIP_CHECKSUM_SHA256_TREE],
+               CRIP_TREE_HASH_SIZE);
+    }
+
+    crip_tree_root((const uint8_t (*)[CRIP_TREE_HASH_SIZE])roots, nb_roots,
+                   ctx->tree_root);
+    ctx->tree_root_computed = 1;
+    av_free(roots);
+
+    for (int i = 0; i < CRIP_TREE_HASH_SIZE; i++)
+        snprintf(&str[i*2], 3, "%02x", ctx->tree_root[i]);
+
+    for (int i = 0; i < ctx->nb_tracks; i++)
+        av_dict_set(&ctx->tracks[i].meta, "PCM_SHA256_TREE_DISC", str, 0);
+
+    return 0;
+}
+
+int crip_tree_write(cyanrip_ctx *ctx)
+{
+    if (!ctx->tree_root_computed)
+        return 0;
+
+    for (int f = 0; f < ctx->settings.outputs_num; f++) {
+        CRWriter *w;
+        char *path = crip_get_path(ctx, CRIP_PATH_TREE, 1,
+                                   &crip_fmt_info[ctx->settings.outputs[f]],
+                                   NULL);
+        int err = cr_writer_open(&w, path, 0, ctx->settings.writer_flags);
+        if (err < 0) {
+            cyanrip_log(ctx, 0, "Couldn't open path \"%s\" for writing: %s!\n",
+                        path, av_err2str(err));
+            av_free(path);
+            return err;
+        }
+
+        cr_writer_printf(w, "; cyanrip %s PCM SHA-256 tree, RFC 6962 node hashing, %i frames per leaf\n",
+                         PROJECT_VERSION_STRING, CRIP_TREE_LEAF_FRAMES);
+
+        cr_writer_printf(w, "disc ");
+        for (int i = 0; i < CRIP_TREE_HASH_SIZE; i++)
+            cr_writer_printf(w, "%02x", ctx->tree_root[i]);
+        cr_writer_printf(w, "\n");
+
+        for (int i = 0; i < ctx->nb_tracks; i++) {
+            cyanrip_track *t = &ctx->tracks[i];
+            if (!t->tree_leaves)
+                continue;
+
+            cr_writer_printf(w, "track %i root ", t->number);
+            for (int j = 0; j < CRIP_TREE_HASH_SIZE; j++)
+                cr_writer_printf(w, "%02x", t->checksums[CRIP_CHECKSUM_SHA256_TREE][j]);
+            cr_writer_printf(w, "\n");
+
+            for (int l = 0; l < t->nb_tree_leaves; l++) {
+                cr_writer_printf(w, "track %i leaf %i ", t->number, l);
+                for (int j = 0; j < CRIP_TREE_HASH_SIZE; j++)
+                    cr_writer_printf(w, "%02x", t->tree_leaves[l][j]);
+                cr_writer_printf(w, "\n");
+            }
+        }
+
+        err = cr_writer_close(&w);
+        if (err < 0) {
+            cyanrip_log(ctx, 0, "Error writing %s: %s!\n", path, av_err2str(err));
+            av_free(path);
+            return err;
+        }
+        av_free(path);
+    }
+
+    return 0;
+}
+
+static int append_tags(cyanrip_ctx *ctx, const cyanrip_out_fmt *cfmt,
+                       cyanrip_track *t)
+{
+    AVDictionary *tags = NULL;
+    const AVDictionaryEntry *e;
+
+    if ((e = av_dict_get(t->meta, "PCM_SHA256_TREE", NULL, 0)))
+        av_dict_set(&tags, e->key, e->value, 0);
+    if ((e = av_dict_get(t->meta, "PCM_SHA256_TREE_DISC", NULL, 0)))
+        av_dict_set(&tags, e->key, e->value, 0);
+
+    char *path = crip_get_path(ctx, CRIP_PATH_TRACK, 0, cfmt, t);
+    int ret = path ? cr_flac_append_tags(path, tags) : AVERROR(ENOMEM);
+    if (ret < 0)
+        cyanrip_log(ctx, 0, "Error adding tags to %s: %s!\n", path, av_err2str(ret));
+    else
+        cr_manifest_patched(ctx->pool, path);
+
+    av_dict_free(&tags);
+    av_free(path);
+
+    return ret;
+}
+
+int crip_tree_append_tags(cyanrip_ctx *ctx)
+{
+    int ret = 0;
+
+    /* With ReplayGain, outputs are only finished once they're known */
+    if (!tree_enabled(ctx) || ctx->settings.enable_replaygain)
+        return 0;
+
+    /* Deferred outputs are encoded with them */
+    for (int f = 0; f < ctx->nb_live_outputs; f++) {
+        const cyanrip_out_fmt *cfmt = &crip_fmt_info[ctx->settings.outputs[f]];
+
+        if (cfmt->codec == AV_CODEC_ID_NONE)
+            continue;
+
+        if (ctx->sink || cfmt->codec != AV_CODEC_ID_FLAC) {
+            cyanrip_log(ctx, 0, "Tags can't be added to %s %s once written, "
+                        "SHA-256 tree hashes are only logged for them.\n",
+                        cfmt->name, ctx->sink ? "streams" : "files");
+            continue;
+        }
+
+        for (int i = 0; i < ctx->nb_tracks; i++) {
+            cyanrip_track *t = &ctx->tracks[i];
+            if (!t->tree_leaves)
+                continue;
+
+            int err = append_tags(ctx, cfmt, t);
+            ret = err < 0 ? err : ret;
+        }
+    }
+
+    return ret;
+}
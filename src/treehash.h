@@ -0,0 +1,54 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "cyanrip_main.h"
+#include "pool.h"
+
+/* Chunked SHA-256 Merkle tree (RFC 6962 hashing) over groups of frames */
+#define CRIP_TREE_LEAF_FRAMES 75
+#define CRIP_TREE_LEAF_SIZE   (CRIP_TREE_LEAF_FRAMES*CDIO_CD_FRAMESIZE_RAW)
+#define CRIP_TREE_HASH_SIZE   32
+
+typedef struct CRIPTreeHash CRIPTreeHash;
+
+/* Leaves are hashed on the pool, total_bytes is only a hint */
+CRIPTreeHash *crip_tree_alloc(CRPool *pool, int64_t total_bytes);
+int crip_tree_update(CRIPTreeHash *s, const uint8_t *data, int bytes);
+
+/* Waits for all leaves, returns their number, leaves are owned by the caller */
+int crip_tree_final(CRIPTreeHash *s, uint8_t root[CRIP_TREE_HASH_SIZE],
+                    uint8_t (**leaves)[CRIP_TREE_HASH_SIZE]);
+void crip_tree_free(CRIPTreeHash **s);
+
+/* Computes a root from nodes, which are leaf or subtree hashes */
+void crip_tree_root(const uint8_t (*nodes)[CRIP_TREE_HASH_SIZE], int nb,
+                    uint8_t root[CRIP_TREE_HASH_SIZE]);
+
+/* Computes the disc root from the track roots, and tags all tracks */
+int crip_tree_disc_meta(cyanrip_ctx *ctx);
+
+/* Writes all leaves into a file in each output folder */
+int crip_tree_write(cyanrip_ctx *ctx);
+
+/* Outputs written before their tree hashes were known, without ReplayGain,
+ * get them added to their tags if they're FLAC, must all be closed */
+int crip_tree_append_tags(cyanrip_ctx *ctx);
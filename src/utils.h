@@ -25,6 +25,7 @@
 #include <libavutil/rational.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/dict.h>
+#include <libavutil/avstring.h>
 
 /* Sliding window */
 #define MAX_ROLLING_WIN_ENTRIES 1024 * 16
@@ -42,6 +43,14 @@ int64_t cr_sliding_win(CRSlidingWinCtx *ctx, int64_t num, int64_t pts,
 
 char *cr_ffmpeg_file_path(const char *path);
 
+static inline int crip_is_integer(const char *src)
+{
+    for (int i = 0; i < strlen(src); i++)
+        if (!av_isdigit(src[i]))
+            return 0;
+    return 1;
+}
+
 static inline const char *dict_get(AVDictionary *dict, const char *key)
 {
     AVDictionaryEntry *e = av_dict_get(dict, key, NULL, 0);
@@ -0,0 +1,174 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <libavutil/crc.h>
+
+#include "verify.h"
+
+struct CRVerify {
+    AVCodecContext *dec;
+    AVFrame *frame;
+    const AVCRC *crc_tab;
+
+    enum AVSampleFormat sample_fmt;
+    int nb_planes;
+    int plane_sample_size; /* Bytes per sample in each plane */
+
+    uint32_t crc_in[AV_NUM_DATA_POINTERS];
+    uint32_t crc_out[AV_NUM_DATA_POINTERS];
+    int64_t samples_in;
+    int64_t samples_out;
+    int status;
+};
+
+int cr_verify_create(CRVerify **s, const AVCodecContext *enc)
+{
+    int ret;
+    AVCodecParameters *par = NULL;
+    const AVCodec *codec = avcodec_find_decoder(enc->codec_id);
+    if (!codec)
+        return AVERROR_DECODER_NOT_FOUND;
+
+    CRVerify *v = av_mallocz(sizeof(*v));
+    if (!v)
+        return AVERROR(ENOMEM);
+
+    v->sample_fmt = enc->sample_fmt;
+    v->crc_tab = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    v->plane_sample_size = av_get_bytes_per_sample(enc->sample_fmt);
+    if (av_sample_fmt_is_planar(enc->sample_fmt)) {
+        v->nb_planes = enc->ch_layout.nb_channels;
+    } else {
+        v->nb_planes = 1;
+        v->plane_sample_size *= enc->ch_layout.nb_channels;
+    }
+
+    if (v->nb_planes > AV_NUM_DATA_POINTERS) {
+        ret = AVERROR(ENOSYS);
+        goto fail;
+    }
+
+    /* Same parameters, and headers, as the muxer gets */
+    par = avcodec_parameters_alloc();
+    v->frame = av_frame_alloc();
+    v->dec = avcodec_alloc_context3(codec);
+    if (!par || !v->frame || !v->dec) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    if ((ret = avcodec_parameters_from_context(par, enc)) < 0 ||
+        (ret = avcodec_parameters_to_context(v->dec, par)) < 0)
+        goto fail;
+
+    v->dec->pkt_timebase = enc->time_base;
+
+    if ((ret = avcodec_open2(v->dec, codec, NULL)) < 0)
+        goto fail;
+
+    avcodec_parameters_free(&par);
+    *s = v;
+
+    return 0;
+
+fail:
+    avcodec_parameters_free(&par);
+    cr_verify_free(&v);
+    return ret;
+}
+
+static void update_crcs(CRVerify *s, uint32_t *crc, const AVFrame *frame)
+{
+    for (int i = 0; i < s->nb_planes; i++)
+        crc[i] = av_crc(s->crc_tab, crc[i], frame->extended_data[i],
+                        frame->nb_samples*s->plane_sample_size);
+}
+
+void cr_verify_input(CRVerify *s, const AVFrame *frame)
+{
+    update_crcs(s, s->crc_in, frame);
+    s->samples_in += frame->nb_samples;
+}
+
+static void receive_frames(CRVerify *s)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_frame(s->dec, s->frame)) >= 0) {
+        /* A different layout would never match */
+        if (s->frame->format != s->sample_fmt) {
+            av_frame_unref(s->frame);
+            s->status = AVERROR(ENOSYS);
+            return;
+        }
+
+        update_crcs(s, s->crc_out, s->frame);
+        s->samples_out += s->frame->nb_samples;
+        av_frame_unref(s->frame);
+    }
+
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        s->status = ret;
+}
+
+void cr_verify_packet(CRVerify *s, const AVPacket *pkt)
+{
+    /* Side data only, e.g. FLAC's final STREAMINFO */
+    if (s->status < 0 || !pkt->size)
+        return;
+
+    int ret = avcodec_send_packet(s->dec, pkt);
+    if (ret < 0) {
+        s->status = ret;
+        return;
+    }
+
+    receive_frames(s);
+}
+
+int cr_verify_finish(CRVerify *s)
+{
+    if (s->status >= 0) {
+        int ret = avcodec_send_packet(s->dec, NULL);
+        if (ret < 0)
+            s->status = ret;
+        else
+            receive_frames(s);
+    }
+
+    if (s->status < 0)
+        return s->status;
+
+    if (s->samples_in != s->samples_out ||
+        memcmp(s->crc_in, s->crc_out, s->nb_planes*sizeof(*s->crc_in)))
+        return AVERROR_INVALIDDATA;
+
+    return 0;
+}
+
+void cr_verify_free(CRVerify **s)
+{
+    if (!*s)
+        return;
+
+    avcodec_free_context(&(*s)->dec);
+    av_frame_free(&(*s)->frame);
+    av_freep(s);
+}
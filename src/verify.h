@@ -0,0 +1,39 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavcodec/avcodec.h>
+
+/* Decodes an encoder's packets back as they come out, and compares them to
+ * the frames it was given, through a CRC per plane */
+typedef struct CRVerify CRVerify;
+
+/* Fails if the codec can't be decoded */
+int cr_verify_create(CRVerify **s, const AVCodecContext *enc);
+
+/* Frames in the order the encoder gets them */
+void cr_verify_input(CRVerify *s, const AVFrame *frame);
+/* Packets in the order they're muxed */
+void cr_verify_packet(CRVerify *s, const AVPacket *pkt);
+
+/* 0 if everything decoded back to what was encoded, AVERROR_INVALIDDATA if
+ * it didn't, any other error if decoding failed */
+int cr_verify_finish(CRVerify *s);
+
+void cr_verify_free(CRVerify **s);
@@ -0,0 +1,638 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_DIRECT and fallocate() */
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <libavutil/bprint.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "../config.h"
+#include "os_compat.h"
+#include "writer.h"
+#include "manifest.h"
+
+#if HAVE_LIBURING
+#include <pthread.h>
+#include <liburing.h>
+#endif
+
+#define WRITER_ALIGN     4096
+#define WRITER_MIN_BLOCK (64 << 10)
+#define WRITER_MAX_BLOCK (1 << 20)
+
+/* The writer does the buffering, lavf hands it everything as it comes */
+#define WRITER_AVIO_BUF  4096
+
+/* Asynchronous writers fill one block while the rest are written out */
+#define WRITER_ASYNC_BLOCKS 4
+
+/* Most fsyncs in flight at once when syncing closed files */
+#define WRITER_SYNC_BATCH 64
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct CRWriter {
+    int fd;
+    int direct_fd; /* Same file, opened with O_DIRECT, -1 if unused */
+
+    uint8_t *block_alloc;
+    uint8_t *blocks[WRITER_ASYNC_BLOCKS];
+    int nb_blocks;
+    int cur;
+    uint8_t *block; /* The one being filled */
+    int block_size;
+    int64_t block_pos; /* Where in the file the block goes */
+    int block_len;
+
+    int64_t pos;
+    int64_t size; /* Furthest anything was written to */
+    int err;
+
+    /* Hashed as it's written, handed to the manifest once closed */
+    char *path;
+    CRFileHash *hash;
+
+#if HAVE_LIBURING
+    struct io_uring *ring;
+    int in_flight;
+    int pending[WRITER_ASYNC_BLOCKS]; /* Writes from each block in flight */
+    int64_t queued[WRITER_ASYNC_BLOCKS]; /* Bytes to be written from each */
+    int64_t written[WRITER_ASYNC_BLOCKS];
+    int64_t queued_end; /* Furthest any write in flight reaches */
+#endif
+};
+
+/* Filesystems which don't support this just grow the file as it's written */
+static void preallocate(CRWriter *w, int64_t size)
+{
+#if HAVE_FALLOCATE
+    /* Keeps the file's size as is, so there's never zeroes at its end */
+    fallocate(w->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif HAVE_POSIX_FALLOCATE
+    posix_fallocate(w->fd, 0, size);
+#endif
+}
+
+int cr_writer_open(CRWriter **w, const char *path, int64_t size_hint, int flags)
+{
+    int ret;
+    CRWriter *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return AVERROR(ENOMEM);
+
+    s->direct_fd = -1;
+    s->fd = cyanrip_open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (s->fd < 0) {
+        ret = AVERROR(errno);
+        av_free(s);
+        return ret;
+    }
+
+#ifdef O_DIRECT
+    /* Filesystems which can't do it fail to open, those go through the cache */
+    if (flags & CR_WRITER_DIRECT)
+        s->direct_fd = cyanrip_open(path, O_WRONLY | O_DIRECT | O_BINARY, 0666);
+#endif
+
+    if (flags & CR_WRITER_HASH) {
+        s->path = av_strdup(path);
+        s->hash = cr_file_hash_alloc();
+        if (!s->path || !s->hash) {
+            cr_writer_close(&s);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    s->nb_blocks = 1;
+
+#if HAVE_LIBURING
+    /* Kernels without io_uring, or which have it disabled, write synchronously.
+     * Files with no size known upfront are small, and not worth a ring. */
+    if ((flags & CR_WRITER_ASYNC) && size_hint > 0) {
+        s->ring = av_mallocz(sizeof(*s->ring));
+        if (s->ring && io_uring_queue_init(2*WRITER_ASYNC_BLOCKS + 1, s->ring, 0) < 0)
+            av_freep(&s->ring);
+        if (s->ring)
+            s->nb_blocks = WRITER_ASYNC_BLOCKS;
+    }
+#endif
+
+    s->block_size = av_clip64(FFALIGN(size_hint, WRITER_ALIGN),
+                              WRITER_MIN_BLOCK, WRITER_MAX_BLOCK);
+    s->block_alloc = av_malloc(s->nb_blocks*s->block_size + WRITER_ALIGN);
+    if (!s->block_alloc) {
+        cr_writer_close(&s);
+        return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < s->nb_blocks; i++)
+        s->blocks[i] = (uint8_t *)FFALIGN((uintptr_t)s->block_alloc, WRITER_ALIGN) +
+                       i*s->block_size;
+    s->block = s->blocks[0];
+
+    if (size_hint > 0)
+        preallocate(s, size_hint);
+
+    *w = s;
+
+    return 0;
+}
+
+static int write_at(int fd, const uint8_t *data, size_t size, int64_t offset)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return AVERROR(errno);
+
+    while (size) {
+        ssize_t ret = write(fd, data, size);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        data += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+#if HAVE_LIBURING
+static int reap_write(CRWriter *w)
+{
+    int ret;
+    struct io_uring_cqe *cqe;
+
+    while ((ret = io_uring_wait_cqe(w->ring, &cqe)) == -EINTR);
+    if (ret < 0) {
+        /* Nothing more is coming out of the ring */
+        w->in_flight = 0;
+        return w->err = AVERROR(-ret);
+    }
+
+    intptr_t idx = (intptr_t)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(w->ring, cqe);
+    w->in_flight--;
+
+    if (res < 0)
+        ret = AVERROR(-res);
+    else
+        w->written[idx] += res;
+
+    /* Short writes only happen once the disk's full */
+    if (!--w->pending[idx] && !ret &&
+        w->written[idx] != w->queued[idx])
+        ret = AVERROR(ENOSPC);
+
+    if (ret < 0 && !w->err)
+        w->err = ret;
+
+    return ret;
+}
+
+static int drain_writes(CRWriter *w)
+{
+    while (w->in_flight)
+        reap_write(w);
+    w->queued_end = 0;
+    return w->err;
+}
+
+static int queue_op(CRWriter *w, int fd, intptr_t idx, int64_t offset, unsigned len)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(w->ring);
+    if (!sqe)
+        return AVERROR(EAGAIN);
+
+    io_uring_prep_write(sqe, fd, w->blocks[idx] + (offset - w->block_pos),
+                        len, offset);
+    w->pending[idx]++;
+    w->queued[idx] += len;
+
+    io_uring_sqe_set_data(sqe, (void *)idx);
+    w->in_flight++;
+
+    return 0;
+}
+
+static int queue_block(CRWriter *w, int direct)
+{
+    int ret = 0;
+    int idx = w->cur;
+
+    /* Writes in flight can land in any order, so nothing may overlap them */
+    if (w->block_pos < w->queued_end && (ret = drain_writes(w)) < 0)
+        return ret;
+
+    w->pending[idx] = 0;
+    w->queued[idx] = w->written[idx] = 0;
+
+    if (direct)
+        ret = queue_op(w, w->direct_fd, idx, w->block_pos, direct);
+    if (!ret && w->block_len > direct)
+        ret = queue_op(w, w->fd, idx, w->block_pos + direct, w->block_len - direct);
+    if (!ret && (ret = io_uring_submit(w->ring)) >= 0)
+        ret = 0;
+    if (ret < 0)
+        return ret;
+
+    w->queued_end = FFMAX(w->queued_end, w->block_pos + w->block_len);
+
+    /* Fill the next block meanwhile, if it's been written out */
+    w->cur = (w->cur + 1) % w->nb_blocks;
+    while (w->pending[w->cur] && !w->err)
+        reap_write(w);
+    w->block = w->blocks[w->cur];
+
+    return w->err;
+}
+#endif
+
+static int flush_block(CRWriter *w)
+{
+    int ret = 0;
+    int direct = 0;
+
+    if (w->err)
+        return w->err;
+
+    /* Aligned blocks go around the cache, any leftover goes through it */
+    if (w->direct_fd >= 0 && !(w->block_pos % WRITER_ALIGN))
+        direct = w->block_len & ~(WRITER_ALIGN - 1);
+
+#if HAVE_LIBURING
+    if (w->ring && w->block_len) {
+        ret = queue_block(w, direct);
+    } else
+#endif
+    {
+        if (direct)
+            ret = write_at(w->direct_fd, w->block, direct, w->block_pos);
+        if (!ret && w->block_len > direct)
+            ret = write_at(w->fd, w->block + direct, w->block_len - direct,
+                           w->block_pos + direct);
+    }
+
+    w->block_pos = w->pos;
+    w->block_len = 0;
+
+    return w->err = ret;
+}
+
+int cr_writer_write(CRWriter *w, const uint8_t *data, int size)
+{
+    int ret;
+
+    if (w->hash && size > 0)
+        cr_file_hash_update(w->hash, w->pos, data, size);
+
+    while (size > 0) {
+        /* Anything but the block's contents or what comes right after
+         * them starts a new block */
+        if (w->pos < w->block_pos || w->pos > w->block_pos + w->block_len ||
+            w->pos == w->block_pos + w->block_size) {
+            if ((ret = flush_block(w)) < 0)
+                return ret;
+        }
+
+        int off = w->pos - w->block_pos;
+        int len = FFMIN(size, w->block_size - off);
+
+        memcpy(w->block + off, data, len);
+        w->block_len = FFMAX(w->block_len, off + len);
+
+        w->pos += len;
+        w->size = FFMAX(w->size, w->pos);
+        data += len;
+        size -= len;
+    }
+
+    return w->err;
+}
+
+int cr_writer_vprintf(CRWriter *w, const char *fmt, va_list args)
+{
+    int ret;
+    AVBPrint bp;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_vbprintf(&bp, fmt, args);
+
+    if (!av_bprint_is_complete(&bp))
+        ret = AVERROR(ENOMEM);
+    else
+        ret = cr_writer_write(w, bp.str, bp.len);
+
+    av_bprint_finalize(&bp, NULL);
+
+    return ret;
+}
+
+int cr_writer_printf(CRWriter *w, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int ret = cr_writer_vprintf(w, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int64_t cr_writer_seek(CRWriter *w, int64_t offset, int whence)
+{
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += w->pos;
+        break;
+    case SEEK_END:
+        offset += w->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    return w->pos = offset;
+}
+
+int64_t cr_writer_size(CRWriter *w)
+{
+    return w->size;
+}
+
+int cr_writer_read(CRWriter *w, uint8_t *dst, int size, int64_t offset)
+{
+    int ret = flush_block(w);
+#if HAVE_LIBURING
+    if (w->ring && ret >= 0)
+        ret = drain_writes(w);
+#endif
+    if (ret < 0)
+        return ret;
+
+    if (lseek(w->fd, offset, SEEK_SET) < 0)
+        return AVERROR(errno);
+
+    int total = 0;
+    while (total < size) {
+        ssize_t len = read(w->fd, dst + total, size - total);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        } else if (!len) {
+            break;
+        }
+        total += len;
+    }
+
+    return total;
+}
+
+#if HAVE_LIBURING
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *sync_fds;
+static int nb_sync_fds;
+static int sync_error; /* From batches synced when queued, until reported */
+
+static int sync_batch(struct io_uring *ring, const int *fds, int nb)
+{
+    int ret = 0, err, queued = 0;
+    struct io_uring_cqe *cqe;
+
+    for (; queued < nb; queued++)
+        io_uring_prep_fsync(io_uring_get_sqe(ring), fds[queued], 0);
+
+    if ((err = io_uring_submit(ring)) < 0)
+        return AVERROR(-err);
+
+    while (queued) {
+        while ((err = io_uring_wait_cqe(ring, &cqe)) == -EINTR);
+        if (err < 0)
+            return AVERROR(-err);
+        if (cqe->res < 0 && !ret)
+            ret = AVERROR(-cqe->res);
+        io_uring_cqe_seen(ring, cqe);
+        queued--;
+    }
+
+    return ret;
+}
+
+/* Syncs, closes and frees the list */
+static int sync_files(int *fds, int nb)
+{
+    int ret = 0;
+
+    struct io_uring ring;
+    if (io_uring_queue_init(FFMIN(nb, WRITER_SYNC_BATCH), &ring, 0) < 0) {
+        for (int i = 0; i < nb; i++)
+            if (fsync(fds[i]) && !ret)
+                ret = AVERROR(errno);
+    } else {
+        for (int i = 0; i < nb; i += WRITER_SYNC_BATCH) {
+            int err = sync_batch(&ring, fds + i, FFMIN(nb - i, WRITER_SYNC_BATCH));
+            ret = ret < 0 ? ret : err;
+        }
+        io_uring_queue_exit(&ring);
+    }
+
+    for (int i = 0; i < nb; i++)
+        if (close(fds[i]) && !ret)
+            ret = AVERROR(errno);
+    av_free(fds);
+
+    return ret;
+}
+
+/* A full batch is synced right away, by whoever filled it, so the number of
+ * files held open stays bounded however many outputs there are */
+static int queue_sync(int fd)
+{
+    int *full = NULL, nb = 0;
+
+    pthread_mutex_lock(&sync_lock);
+    int *fds = av_realloc_array(sync_fds, nb_sync_fds + 1, sizeof(*sync_fds));
+    if (fds) {
+        sync_fds = fds;
+        sync_fds[nb_sync_fds++] = fd;
+        if (nb_sync_fds >= WRITER_SYNC_BATCH) {
+            full = sync_fds;
+            nb = nb_sync_fds;
+            sync_fds = NULL;
+            nb_sync_fds = 0;
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+
+    if (full) {
+        int err = sync_files(full, nb);
+        pthread_mutex_lock(&sync_lock);
+        sync_error = sync_error < 0 ? sync_error : err;
+        pthread_mutex_unlock(&sync_lock);
+    }
+
+    return fds ? 0 : AVERROR(ENOMEM);
+}
+#endif
+
+int cr_writer_sync(void)
+{
+    int ret = 0;
+#if HAVE_LIBURING
+    pthread_mutex_lock(&sync_lock);
+    int *fds = sync_fds, nb = nb_sync_fds;
+    sync_fds = NULL;
+    nb_sync_fds = 0;
+    ret = sync_error;
+    sync_error = 0;
+    pthread_mutex_unlock(&sync_lock);
+
+    if (nb) {
+        int err = sync_files(fds, nb);
+        ret = ret < 0 ? ret : err;
+    }
+#endif
+    return ret;
+}
+
+int cr_writer_close(CRWriter **w)
+{
+    CRWriter *s = *w;
+    if (!s)
+        return 0;
+
+    int ret = s->block_alloc ? flush_block(s) : 0;
+
+#if HAVE_LIBURING
+    if (s->ring) {
+        int err = drain_writes(s);
+        ret = ret < 0 ? ret : err;
+    }
+#endif
+
+    /* Let go of whatever was allocated but not written to */
+    if (ftruncate(s->fd, s->size) && !ret)
+        ret = AVERROR(errno);
+
+    /* Read back while it's still cached, on the thread that wrote it */
+    if (s->hash && s->block_alloc && !ret)
+        ret = cr_file_hash_finish(s->hash, s->fd);
+
+    if (s->direct_fd >= 0)
+        close(s->direct_fd);
+
+#if HAVE_LIBURING
+    /* Synced along with other closed files, in batches */
+    if (s->ring) {
+        io_uring_queue_exit(s->ring);
+        av_free(s->ring);
+        if (!ret && !queue_sync(s->fd))
+            s->fd = -1;
+    }
+#endif
+
+    if (s->fd >= 0 && close(s->fd) && !ret)
+        ret = AVERROR(errno);
+
+    /* Only if it was opened */
+    if (s->hash && s->block_alloc && !ret)
+        ret = cr_manifest_add(s->path, &s->hash);
+    cr_file_hash_free(&s->hash);
+    av_free(s->path);
+
+    av_free(s->block_alloc);
+    av_freep(w);
+
+    return ret;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+static int avio_write_cb(void *opaque, uint8_t *buf, int size)
+#else
+static int avio_write_cb(void *opaque, const uint8_t *buf, int size)
+#endif
+{
+    int ret = cr_writer_write(opaque, buf, size);
+    return ret < 0 ? ret : size;
+}
+
+static int64_t avio_seek_cb(void *opaque, int64_t offset, int whence)
+{
+    if (whence == AVSEEK_SIZE)
+        return cr_writer_size(opaque);
+    return cr_writer_seek(opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+int cr_writer_avio_open(AVIOContext **pb, const char *path, int64_t size_hint, int flags)
+{
+    CRWriter *w;
+    int ret = cr_writer_open(&w, path, size_hint, flags);
+    if (ret < 0)
+        return ret;
+
+    uint8_t *buf = av_malloc(WRITER_AVIO_BUF);
+    if (!buf)
+        goto fail;
+
+    *pb = avio_alloc_context(buf, WRITER_AVIO_BUF, 1, w, NULL,
+                             avio_write_cb, avio_seek_cb);
+    if (!*pb) {
+        av_free(buf);
+        goto fail;
+    }
+
+    (*pb)->direct = 1;
+
+    return 0;
+
+fail:
+    cr_writer_close(&w);
+    return AVERROR(ENOMEM);
+}
+
+int cr_writer_avio_close(AVIOContext **pb)
+{
+    if (!*pb)
+        return 0;
+
+    avio_flush(*pb);
+
+    CRWriter *w = (*pb)->opaque;
+    int ret = (*pb)->error;
+    int err = cr_writer_close(&w);
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    return ret < 0 ? ret : err;
+}
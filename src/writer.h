@@ -0,0 +1,57 @@
+/*
+ * This file is part of cyanrip.
+ *
+ * cyanrip is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cyanrip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cyanrip; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <libavformat/avio.h>
+
+/* Output file written in large blocks, with its expected size allocated
+ * upfront and whatever wasn't used cut off once closed */
+typedef struct CRWriter CRWriter;
+
+enum CRWriterFlags {
+    CR_WRITER_DIRECT = 1 << 0, /* Bypass the page cache, where supported */
+    CR_WRITER_ASYNC  = 1 << 1, /* Write through io_uring, where supported */
+    CR_WRITER_HASH   = 1 << 2, /* SHA-256 what's written, for the manifest */
+};
+
+/* size_hint may be 0 if there's no telling */
+int cr_writer_open(CRWriter **w, const char *path, int64_t size_hint, int flags);
+int cr_writer_write(CRWriter *w, const uint8_t *data, int size);
+int cr_writer_printf(CRWriter *w, const char *fmt, ...);
+int cr_writer_vprintf(CRWriter *w, const char *fmt, va_list args);
+int64_t cr_writer_seek(CRWriter *w, int64_t offset, int whence);
+int64_t cr_writer_size(CRWriter *w);
+
+/* Reads back what's been written so far */
+int cr_writer_read(CRWriter *w, uint8_t *dst, int size, int64_t offset);
+
+/* Returns any error which came up writing out what was left */
+int cr_writer_close(CRWriter **w);
+
+/* Waits for all closed asynchronous writers to reach the disk, with their
+ * fsyncs all in flight at once rather than one after another as they close.
+ * Closed files are also synced as they fill up a batch of 64, and
+ * any error from those is returned here. */
+int cr_writer_sync(void);
+
+/* For lavf, the writer's closed along with the context */
+int cr_writer_avio_open(AVIOContext **pb, const char *path, int64_t size_hint, int flags);
+int cr_writer_avio_close(AVIOContext **pb);